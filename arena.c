@@ -0,0 +1,192 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/vmalloc.h>
+#include "module.h"
+#include "arena.h"
+
+/*
+ * Log structured storage of the short values: each value is placed right after the previous
+ * one in the last segment, so a write is a pointer bump and the values written together
+ * are read together. A free only marks the block: segments that become sparse are compacted
+ * by moving their live values to the end of the last segment and updating the nodes, then
+ * they are freed as a whole. Everything runs with the mutex of the dictionary locked.
+ */
+
+//Blocks start at this alignment
+#define ARENA_ALIGN sizeof(unsigned long)
+
+static struct arena_segment* arena_segment_alloc(struct arena *arena)
+{
+    struct arena_segment *segment;
+
+    segment = (struct arena_segment*)kmalloc(sizeof(struct arena_segment), GFP_KERNEL);
+    if (segment == NULL)
+        return NULL;
+    //A huge page if there is one ready, without trying hard: vmalloc is fine too
+    segment->page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY, ARENA_SEGMENT_ORDER);
+    if (segment->page != NULL)
+    {
+        segment->base = (char*)page_address(segment->page);
+    } else {
+        segment->base = (char*)vmalloc(ARENA_SEGMENT_SIZE);
+        if (segment->base == NULL)
+        {
+            kfree(segment);
+            return NULL;
+        }
+    }
+    segment->arena = arena;
+    segment->used = 0;
+    segment->live = 0;
+    list_add_tail(&segment->list, &arena->segments);
+    arena->segment_count++;
+    printd("Arena segment %d allocated%s.\n", (int)arena->segment_count, segment->page != NULL ? " in a huge page" : "");
+    return segment;
+}
+static void arena_segment_free(struct arena_segment *segment)
+{
+    list_del(&segment->list);
+    segment->arena->segment_count--;
+    if (segment->page != NULL)
+    {
+        __free_pages(segment->page, ARENA_SEGMENT_ORDER);
+    } else {
+        vfree(segment->base);
+    }
+    kfree(segment);
+}
+#define arena_last(arena) list_last_entry(&(arena)->segments, struct arena_segment, list)
+#define arena_sparse(segment) ((segment)->live < ARENA_SPARSE && (segment) != arena_last((segment)->arena))
+
+//Marks the block as free, without freeing its segment
+static void arena_block_release(struct arena_block *block)
+{
+    struct arena_segment *segment = block->segment;
+    bool sparse = arena_sparse(segment);
+
+    block->owner = NULL;
+    segment->live -= block->length;
+    segment->arena->live -= block->length;
+    if (!sparse && arena_sparse(segment))
+    {
+        segment->arena->compact = true;
+    }
+}
+
+void arena_init(struct arena *arena)
+{
+    INIT_LIST_HEAD(&arena->segments);
+    arena->segment_count = 0;
+    arena->live = 0;
+    arena->compact = false;
+}
+
+char* arena_alloc(struct arena *arena, struct node *owner, size_t length)
+{
+    struct arena_segment *segment = list_empty(&arena->segments) ? NULL : arena_last(arena);
+    struct arena_block *block;
+    size_t size = ALIGN(sizeof(struct arena_block) + length, ARENA_ALIGN);
+
+    if (segment == NULL || ARENA_SEGMENT_SIZE - segment->used < size)
+    {
+        //The segment that was the last one can now be compacted too
+        if (segment != NULL && segment->live < ARENA_SPARSE)
+        {
+            arena->compact = true;
+        }
+        segment = arena_segment_alloc(arena);
+        if (segment == NULL)
+            return NULL;
+    }
+    block = (struct arena_block*)&segment->base[segment->used];
+    block->segment = segment;
+    block->owner = owner;
+    block->length = size;
+    segment->used += size;
+    segment->live += size;
+    arena->live += size;
+    return block->data;
+}
+
+void arena_free(const char *data)
+{
+    struct arena_block *block = arena_block_of(data);
+    struct arena_segment *segment = block->segment;
+
+    arena_block_release(block);
+    if (segment->live == 0 && segment != arena_last(segment->arena))
+    {
+        //Nothing left to move
+        arena_segment_free(segment);
+    }
+}
+
+size_t arena_compact(struct arena *arena)
+{
+    struct arena_segment *segment, *tmp, *last;
+    struct arena_block *block;
+    size_t offset, moved = 0;
+    char *data;
+
+    arena->compact = false;
+    if (list_empty(&arena->segments))
+        return 0;
+    //The values are moved after the current last segment: the segments added meanwhile are never compacted
+    last = arena_last(arena);
+    list_for_each_entry_safe(segment, tmp, &arena->segments, list)
+    {
+        if (segment == last)
+            break;
+        if (segment->live >= ARENA_SPARSE)
+            continue;
+        for (offset = 0; offset < segment->used && segment->live > 0; offset += block->length)
+        {
+            block = (struct arena_block*)&segment->base[offset];
+            if (block->owner == NULL)
+                continue;
+            data = arena_alloc(arena, block->owner, block->length - sizeof(struct arena_block));
+            if (data == NULL)
+            {
+                //Out of memory: the rest is left for the next compaction
+                arena->compact = true;
+                return moved;
+            }
+            memcpy(data, block->data, block->length - sizeof(struct arena_block));
+            block->owner->value = data;
+            moved += block->length;
+            arena_block_release(block);
+        }
+        arena_segment_free(segment);
+        cond_resched();
+    }
+    printd("Arena compacted: %zu bytes moved, %zu segments left.\n", moved, arena->segment_count);
+    return moved;
+}
+
+void arena_move(struct arena *dest, struct arena *src)
+{
+    struct arena_segment *segment;
+
+    arena_init(dest);
+    list_splice_init(&src->segments, &dest->segments);
+    list_for_each_entry(segment, &dest->segments, list)
+    {
+        segment->arena = dest;
+    }
+    dest->segment_count = src->segment_count;
+    dest->live = src->live;
+    arena_init(src);
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_segment *segment, *tmp;
+
+    list_for_each_entry_safe(segment, tmp, &arena->segments, list)
+    {
+        arena_segment_free(segment);
+    }
+    arena->live = 0;
+    arena->compact = false;
+}
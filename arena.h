@@ -0,0 +1,78 @@
+#ifndef _MODULE_ARENA_H
+#define _MODULE_ARENA_H
+
+#include <linux/list.h>
+#include <linux/mm.h>
+
+struct node;
+
+//Segments are 2MB (with 4KB pages): a single huge page of the kernel direct map when one is free
+#define ARENA_SEGMENT_ORDER 9
+#define ARENA_SEGMENT_SIZE (PAGE_SIZE << ARENA_SEGMENT_ORDER)
+//Longer values are left to kvmalloc: the pages they use are never shared with other values
+#define ARENA_MAX_VALUE (PAGE_SIZE - sizeof(struct arena_block))
+//Segments with fewer live bytes than this are compacted
+#define ARENA_SPARSE (ARENA_SEGMENT_SIZE / 4)
+
+/// @brief Large block of memory the values are placed in one after the other. Nothing is ever reused:
+/// freed values leave holes that only the compaction gives back
+struct arena_segment {
+    struct list_head list;
+    struct arena *arena;
+    char *base;
+    struct page *page;      //Compound page of ARENA_SEGMENT_ORDER behind base, NULL if base was vmalloc'd
+    size_t used;            //Bytes given out, the next block starts here
+    size_t live;            //Bytes of the blocks not freed yet
+};
+
+/// @brief Header of a value inside a segment
+struct arena_block {
+    struct arena_segment *segment;
+    struct node *owner;     //Node whose value is the data of the block, NULL once freed
+    size_t length;          //Bytes of the block, header included
+    char data[];
+};
+
+/// @brief Segments of a dictionary, protected by its mutex
+struct arena {
+    struct list_head segments;  //The last one is where new values go
+    size_t segment_count;
+    size_t live;                //Bytes of all the blocks not freed yet
+    bool compact;               //Some segment other than the last one is sparse
+};
+
+//Block holding the data of a value
+#define arena_block_of(data) ((struct arena_block*)((data) - offsetof(struct arena_block, data)))
+
+/// @brief Initializes an arena without segments
+/// @param arena the arena
+void arena_init(struct arena *arena);
+
+/// @brief Places a value at the end of the last segment, starting a new segment if it doesn't fit
+/// @param arena the arena
+/// @param owner the node the value belongs to, its value pointer is updated if the value is moved
+/// @param length bytes of the value, at most ARENA_MAX_VALUE
+/// @return the memory of the value, NULL if a new segment couldn't be allocated
+char* arena_alloc(struct arena *arena, struct node *owner, size_t length);
+
+/// @brief Frees a value returned by arena_alloc. A segment left empty is freed at once, one left sparse
+/// sets arena->compact
+/// @param data the value
+void arena_free(const char *data);
+
+/// @brief Moves the live values of the sparse segments to the end of the last one and frees them.
+/// No one can be reading the values without the lock of the arena
+/// @param arena the arena
+/// @return the bytes moved
+size_t arena_compact(struct arena *arena);
+
+/// @brief Gives all the segments of an arena to another, empty, one
+/// @param dest the empty arena
+/// @param src the arena that is left without segments
+void arena_move(struct arena *dest, struct arena *src);
+
+/// @brief Frees all the segments of an arena, whatever is still inside them
+/// @param arena the arena
+void arena_destroy(struct arena *arena);
+
+#endif
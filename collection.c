@@ -0,0 +1,386 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rbtree.h>
+#include "module.h"
+#include "value.h"
+#include "collection.h"
+
+/*
+ * Lists are doubly linked lists of items: pushes and pops at both ends are O(1).
+ * Sets and hashes are red-black trees ordered by the bytes of the members (the fields
+ * of hashes): adds, removes and lookups are O(log n). Nothing is ever parsed: the text
+ * form is only built when the value is read as a whole (a plain read, a dump, a snapshot).
+ * Everything runs with the mutex of the dictionary locked.
+ */
+
+unsigned int collection_op_type(unsigned int op)
+{
+    switch (op)
+    {
+        case DICTIONARY_LIST_PUSH_HEAD:
+        case DICTIONARY_LIST_PUSH_TAIL:
+        case DICTIONARY_LIST_POP_HEAD:
+        case DICTIONARY_LIST_POP_TAIL:
+            return DICTIONARY_TYPE_LIST;
+        case DICTIONARY_SET_ADD:
+        case DICTIONARY_SET_REMOVE:
+        case DICTIONARY_SET_CONTAINS:
+            return DICTIONARY_TYPE_SET;
+        case DICTIONARY_HASH_SET:
+        case DICTIONARY_HASH_GET:
+        case DICTIONARY_HASH_DELETE:
+            return DICTIONARY_TYPE_HASH;
+    }
+    return 0;
+}
+
+//Bytes of the text form of an item: "element\n" or "<field> value\n"
+static size_t item_text_length(const struct value_collection *collection, const struct collection_item *item)
+{
+    if (collection->type == DICTIONARY_TYPE_HASH)
+        return item->length + item->value_length + 4;
+    return item->length + 1;
+}
+//Adds (or removes, if sign is -1) the item to the counters of the value
+static void item_account(pnode node, const struct collection_item *item, int sign)
+{
+    struct value_collection *collection = node_collection(node);
+    size_t text = item_text_length(collection, item);
+    size_t stored = sizeof(struct collection_item) + item->length + item->value_length;
+
+    if (sign > 0)
+    {
+        node->value_length += text;
+        node->stored_length += stored;
+        collection->count++;
+    } else {
+        node->value_length -= text;
+        node->stored_length -= stored;
+        collection->count--;
+    }
+}
+static struct collection_item* item_alloc(const char *data, size_t length, const char *value, size_t value_length)
+{
+    struct collection_item *item;
+
+    item = (struct collection_item*)kvmalloc(sizeof(struct collection_item) + length + value_length, GFP_KERNEL);
+    if (item == NULL)
+        return NULL;
+    item->length = length;
+    item->value_length = value_length;
+    memcpy(item->data, data, length);
+    if (value_length > 0)
+    {
+        memcpy(&item->data[length], value, value_length);
+    }
+    return item;
+}
+//Copies the element, or the value of a field, to a new '\0' terminated buffer
+static int item_result(struct dictionary_typed_op *op, const char *data, size_t length)
+{
+    op->result = (char*)kvmalloc(length + 1, GFP_KERNEL);
+    if (op->result == NULL)
+        return -ENOMEM;
+    memcpy(op->result, data, length);
+    op->result[length] = '\0';
+    op->result_length = length;
+    return 0;
+}
+
+static struct collection_item* collection_first(struct value_collection *collection)
+{
+    struct rb_node *rb;
+
+    if (collection->type == DICTIONARY_TYPE_LIST)
+        return list_first_entry_or_null(&collection->items, struct collection_item, list);
+    rb = rb_first(&collection->tree);
+    return rb != NULL ? rb_entry(rb, struct collection_item, tree) : NULL;
+}
+static struct collection_item* collection_next(struct value_collection *collection, struct collection_item *item)
+{
+    struct rb_node *rb;
+
+    if (collection->type == DICTIONARY_TYPE_LIST)
+        return list_is_last(&item->list, &collection->items) ? NULL : list_next_entry(item, list);
+    rb = rb_next(&item->tree);
+    return rb != NULL ? rb_entry(rb, struct collection_item, tree) : NULL;
+}
+//Visits the items in the order of the text form
+#define collection_for_each(collection, item) \
+    for (item = collection_first(collection); item != NULL; item = collection_next(collection, item))
+
+//Orders the members by their bytes, a shorter member comes before the longer ones it's the start of
+static int item_compare(const char *member, size_t length, const struct collection_item *item)
+{
+    int res;
+
+    res = memcmp(member, item->data, min(length, item->length));
+    if (res != 0)
+        return res;
+    if (length == item->length)
+        return 0;
+    return length < item->length ? -1 : 1;
+}
+//Searches the member in the tree. If it's missing, *link and *parent tell where it has to be linked
+static struct collection_item* tree_find(struct value_collection *collection, const char *member, size_t length,
+    struct rb_node ***link, struct rb_node **parent)
+{
+    struct rb_node **curr = &collection->tree.rb_node, *last = NULL;
+    struct collection_item *item;
+    int res;
+
+    while (*curr != NULL)
+    {
+        item = rb_entry(*curr, struct collection_item, tree);
+        res = item_compare(member, length, item);
+        if (res == 0)
+            return item;
+        last = *curr;
+        curr = res < 0 ? &(*curr)->rb_left : &(*curr)->rb_right;
+    }
+    if (link != NULL)
+    {
+        *link = curr;
+        *parent = last;
+    }
+    return NULL;
+}
+//Links a new item where tree_find said
+static void tree_link(pnode node, struct collection_item *item, struct rb_node **link, struct rb_node *parent)
+{
+    rb_link_node(&item->tree, parent, link);
+    rb_insert_color(&item->tree, &node_collection(node)->tree);
+    item_account(node, item, 1);
+}
+
+int collection_init(pnode node, unsigned int type)
+{
+    struct value_collection *collection;
+
+    collection = (struct value_collection*)kzalloc(sizeof(struct value_collection), GFP_KERNEL);
+    if (collection == NULL)
+        return -ENOMEM;
+    collection->type = type;
+    if (type == DICTIONARY_TYPE_LIST)
+    {
+        INIT_LIST_HEAD(&collection->items);
+    } else {
+        collection->tree = RB_ROOT;
+    }
+    node->value = (char*)collection;
+    node->value_length = 0;
+    node->stored_length = sizeof(struct value_collection);
+    node->digest = VALUE_DIGEST_SEED;
+    node->flags |= NODE_TYPED;
+    return 0;
+}
+
+int collection_copy(pnode dest, pnode src)
+{
+    struct value_collection *from = node_collection(src);
+    struct collection_item *item, *copy;
+    struct rb_node **link, *parent;
+    int res;
+
+    res = collection_init(dest, from->type);
+    if (res != 0)
+        return res;
+    collection_for_each(from, item)
+    {
+        copy = item_alloc(item->data, item->length, &item->data[item->length], item->value_length);
+        if (copy == NULL)
+        {
+            value_free(dest);
+            return -ENOMEM;
+        }
+        if (from->type == DICTIONARY_TYPE_LIST)
+        {
+            list_add_tail(&copy->list, &node_collection(dest)->items);
+            item_account(dest, copy, 1);
+        } else {
+            tree_find(node_collection(dest), copy->data, copy->length, &link, &parent);
+            tree_link(dest, copy, link, parent);
+        }
+    }
+    dest->digest = src->digest;
+    node_collection(dest)->digest_stale = from->digest_stale;
+    return 0;
+}
+
+//Pushes and pops of lists
+static long list_apply(pnode node, struct dictionary_typed_op *op)
+{
+    struct value_collection *collection = node_collection(node);
+    struct collection_item *item;
+    int res;
+
+    switch (op->op)
+    {
+        case DICTIONARY_LIST_PUSH_HEAD:
+        case DICTIONARY_LIST_PUSH_TAIL:
+            item = item_alloc(op->member, op->member_length, NULL, 0);
+            if (item == NULL)
+                return -ENOMEM;
+            if (op->op == DICTIONARY_LIST_PUSH_HEAD)
+            {
+                list_add(&item->list, &collection->items);
+                collection->digest_stale = true;
+            } else {
+                list_add_tail(&item->list, &collection->items);
+                //Like an append: only the new line is hashed
+                node->digest = value_digest(node->digest, item->data, item->length);
+                node->digest = value_digest(node->digest, "\n", 1);
+            }
+            item_account(node, item, 1);
+            return (long)collection->count;
+        case DICTIONARY_LIST_POP_HEAD:
+        case DICTIONARY_LIST_POP_TAIL:
+            if (list_empty(&collection->items))
+                return -ENOENT;
+            item = op->op == DICTIONARY_LIST_POP_HEAD ?
+                list_first_entry(&collection->items, struct collection_item, list) :
+                list_last_entry(&collection->items, struct collection_item, list);
+            res = item_result(op, item->data, item->length);
+            if (res != 0)
+                return res;
+            list_del(&item->list);
+            item_account(node, item, -1);
+            kvfree(item);
+            collection->digest_stale = true;
+            return 1;
+    }
+    return -EINVAL;
+}
+//Members of sets and fields of hashes
+static long tree_apply(pnode node, struct dictionary_typed_op *op)
+{
+    struct value_collection *collection = node_collection(node);
+    struct collection_item *item, *replacement;
+    struct rb_node **link, *parent;
+
+    item = tree_find(collection, op->member, op->member_length, &link, &parent);
+    switch (op->op)
+    {
+        case DICTIONARY_SET_CONTAINS:
+            return item != NULL;
+        case DICTIONARY_HASH_GET:
+            if (item == NULL)
+                return 0;
+            return item_result(op, &item->data[item->length], item->value_length) == 0 ? 1 : -ENOMEM;
+        case DICTIONARY_SET_ADD:
+        case DICTIONARY_HASH_SET:
+            if (item != NULL && op->op == DICTIONARY_SET_ADD)
+                return 0;
+            replacement = item_alloc(op->member, op->member_length, op->value,
+                op->op == DICTIONARY_HASH_SET ? op->value_length : 0);
+            if (replacement == NULL)
+                return -ENOMEM;
+            collection->digest_stale = true;
+            if (item == NULL)
+            {
+                tree_link(node, replacement, link, parent);
+                return 1;
+            }
+            //The field takes the new value in the same place of the tree
+            rb_replace_node(&item->tree, &replacement->tree, &collection->tree);
+            item_account(node, item, -1);
+            item_account(node, replacement, 1);
+            kvfree(item);
+            return 0;
+        case DICTIONARY_SET_REMOVE:
+        case DICTIONARY_HASH_DELETE:
+            if (item == NULL)
+                return 0;
+            rb_erase(&item->tree, &collection->tree);
+            item_account(node, item, -1);
+            kvfree(item);
+            collection->digest_stale = true;
+            return 1;
+    }
+    return -EINVAL;
+}
+
+long collection_apply(pnode node, struct dictionary_typed_op *op)
+{
+    struct value_collection *collection = node_collection(node);
+
+    if (op->op == DICTIONARY_TYPED_COUNT)
+        return (long)collection->count;
+    if (collection_op_type(op->op) != collection->type)
+        return -EMEDIUMTYPE;
+    if (collection->type == DICTIONARY_TYPE_LIST)
+        return list_apply(node, op);
+    return tree_apply(node, op);
+}
+
+void collection_free(pnode node)
+{
+    struct value_collection *collection = node_collection(node);
+    struct collection_item *item, *tmp;
+
+    if (collection == NULL)
+        return;
+    if (collection->type == DICTIONARY_TYPE_LIST)
+    {
+        list_for_each_entry_safe(item, tmp, &collection->items, list)
+        {
+            kvfree(item);
+        }
+    } else {
+        rbtree_postorder_for_each_entry_safe(item, tmp, &collection->tree, tree)
+        {
+            kvfree(item);
+        }
+    }
+    kfree(collection);
+}
+
+void collection_render(pnode node, char *dest)
+{
+    struct value_collection *collection = node_collection(node);
+    struct collection_item *item;
+
+    collection_for_each(collection, item)
+    {
+        if (collection->type == DICTIONARY_TYPE_HASH)
+        {
+            *dest++ = '<';
+            memcpy(dest, item->data, item->length);
+            dest += item->length;
+            *dest++ = '>';
+            *dest++ = ' ';
+            memcpy(dest, &item->data[item->length], item->value_length);
+            dest += item->value_length;
+        } else {
+            memcpy(dest, item->data, item->length);
+            dest += item->length;
+        }
+        *dest++ = '\n';
+    }
+}
+
+void collection_digest(pnode node)
+{
+    struct value_collection *collection = node_collection(node);
+    struct collection_item *item;
+    u32 digest = VALUE_DIGEST_SEED;
+
+    if (!collection->digest_stale)
+        return;
+    //Same bytes as collection_render, without building the text
+    collection_for_each(collection, item)
+    {
+        if (collection->type == DICTIONARY_TYPE_HASH)
+        {
+            digest = value_digest(digest, "<", 1);
+            digest = value_digest(digest, item->data, item->length);
+            digest = value_digest(digest, "> ", 2);
+            digest = value_digest(digest, &item->data[item->length], item->value_length);
+        } else {
+            digest = value_digest(digest, item->data, item->length);
+        }
+        digest = value_digest(digest, "\n", 1);
+    }
+    node->digest = digest;
+    collection->digest_stale = false;
+}
@@ -0,0 +1,77 @@
+#ifndef _MODULE_COLLECTION_H
+#define _MODULE_COLLECTION_H
+
+#include <linux/rbtree.h>
+#include "dictionary.h"
+
+/// @brief Element of a typed value: an item of a list, a member of a set or a field of a hash followed by its value
+struct collection_item {
+    union {
+        struct list_head list;  //Lists: position inside the list
+        struct rb_node tree;    //Sets and hashes: position inside the tree, ordered by the bytes of the member
+    };
+    size_t length;              //Bytes of the element, or of the field
+    size_t value_length;        //Hashes only: bytes of the value, stored after the field
+    char data[];
+};
+
+/// @brief Typed value, node->value points to it when NODE_TYPED is set.
+/// node->value_length is the length of its text form, node->stored_length the bytes it uses
+struct value_collection {
+    unsigned int type;          //One of DICTIONARY_TYPE_*
+    size_t count;               //Elements
+    bool digest_stale;          //node->digest must be computed again before it's used
+    union {
+        struct list_head items; //Lists
+        struct rb_root tree;    //Sets and hashes
+    };
+};
+
+//Typed value of a node with NODE_TYPED
+#define node_collection(node) ((struct value_collection*)(node)->value)
+
+//Operations that only read the value
+#define collection_op_reads(op) ((op) == DICTIONARY_SET_CONTAINS || (op) == DICTIONARY_HASH_GET || (op) == DICTIONARY_TYPED_COUNT)
+//Operations that can add an element
+#define collection_op_grows(op) ((op) == DICTIONARY_LIST_PUSH_HEAD || (op) == DICTIONARY_LIST_PUSH_TAIL || \
+    (op) == DICTIONARY_SET_ADD || (op) == DICTIONARY_HASH_SET)
+//Bytes the element added by an operation can use
+#define collection_op_memory(op) (sizeof(struct collection_item) + (op)->member_length + (op)->value_length)
+
+/// @brief Gives the type of value an operation works on
+/// @param op one of the operations of DICTIONARY_IOC_TYPED
+/// @return one of DICTIONARY_TYPE_*, 0 for DICTIONARY_TYPED_COUNT that works on all of them
+unsigned int collection_op_type(unsigned int op);
+
+/// @brief Turns a node without value into an empty typed value
+/// @param node the node, its value must be empty
+/// @param type one of DICTIONARY_TYPE_*
+/// @return zero for success, -ENOMEM otherwise
+int collection_init(pnode node, unsigned int type);
+
+/// @brief Gives a node without value a copy of the typed value of another node
+/// @param dest the node that receives the copy, its value must be empty
+/// @param src the node to copy, must be typed
+/// @return zero for success, -ENOMEM otherwise (dest is left without value)
+int collection_copy(pnode dest, pnode src);
+
+/// @brief Executes an operation on the typed value of a node, updating its lengths
+/// @param node the node, its type must be the one of the operation
+/// @param op the operation, on success result is set for the pops and DICTIONARY_HASH_GET
+/// @return the result of the operation (see DICTIONARY_IOC_TYPED), below zero for errors (the value is left as it was)
+long collection_apply(pnode node, struct dictionary_typed_op *op);
+
+/// @brief Frees all the elements of a typed value and the value itself
+/// @param node the node, must be typed
+void collection_free(pnode node);
+
+/// @brief Writes the text form of a typed value: a line for each element of lists and sets, "<field> value" lines for hashes
+/// @param node the node, must be typed
+/// @param dest buffer of at least node->value_length bytes
+void collection_render(pnode node, char *dest);
+
+/// @brief Brings node->digest up to date with the text form of the value, if an operation left it stale
+/// @param node the node, must be typed
+void collection_digest(pnode node);
+
+#endif
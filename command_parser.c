@@ -1,4 +1,8 @@
+#include <linux/ctype.h>
+#include <linux/uio.h>
+#include <asm/unaligned.h>
 #include "module.h"
+#include "collection.h"
 
 //Prototypes used and explicitated later
 
@@ -6,8 +10,137 @@ struct indices_t
 {
     size_t key_start, key_length, value_start, value_length;
 };
-static bool parse_key_and_value(const char __user*, size_t, struct indices_t*);
-static bool parse_key(const char __user*, size_t, struct indices_t*);
+static bool parse_key_and_value(const char*, size_t, struct indices_t*);
+static bool parse_key(const char*, size_t, struct indices_t*);
+static u64 parse_timeout(const char*, size_t, struct indices_t*, u64);
+static bool parse_number(const char*, size_t, size_t*, u64*);
+
+/**************************************************************************************
+ * 
+ *                Results of the commands, read back from the same file
+ * 
+***************************************************************************************/
+
+void command_results_init(struct command_results *results)
+{
+    memset(results, 0, sizeof(struct command_results));
+    mutex_init(&results->mutex);
+}
+void command_results_free(struct command_results *results)
+{
+    kvfree(results->buffer);
+    results->buffer = NULL;
+    results->length = results->position = results->size = 0;
+    results->overflow = false;
+}
+//Adds data and a '\n' to the results. A '\n' or a backslash of data becomes a backslash followed by 'n' or by
+//another backslash: every result is one line
+static void command_results_add(struct command_results *results, const char *data, size_t length)
+{
+    size_t needed, size, escapes = 0, i;
+    char *buffer, *out;
+
+    if (results == NULL)
+        return;
+    for (i = 0; i < length; ++i)
+    {
+        if (data[i] == '\n' || data[i] == '\\')
+            ++escapes;
+    }
+    mutex_lock(&results->mutex);
+    needed = results->length + length + escapes + 1;
+    if (results->overflow || needed > COMMAND_RESULTS_MAX)
+    {
+        results->overflow = true;
+        mutex_unlock(&results->mutex);
+        return;
+    }
+    if (needed > results->size)
+    {
+        size = max_t(size_t, results->size * 2, max_t(size_t, needed, 256));
+        size = min_t(size_t, size, COMMAND_RESULTS_MAX);
+        buffer = (char*)kvmalloc(size, GFP_KERNEL);
+        if (buffer == NULL)
+        {
+            results->overflow = true;
+            mutex_unlock(&results->mutex);
+            return;
+        }
+        if (results->buffer != NULL)
+        {
+            memcpy(buffer, results->buffer, results->length);
+            kvfree(results->buffer);
+        }
+        results->buffer = buffer;
+        results->size = size;
+    }
+    out = &results->buffer[results->length];
+    if (escapes == 0)
+    {
+        memcpy(out, data, length);
+        out += length;
+    } else {
+        for (i = 0; i < length; ++i)
+        {
+            if (data[i] == '\n' || data[i] == '\\')
+            {
+                *out++ = '\\';
+                *out++ = data[i] == '\n' ? 'n' : '\\';
+            } else {
+                *out++ = data[i];
+            }
+        }
+    }
+    *out = '\n';
+    results->length = needed;
+    mutex_unlock(&results->mutex);
+}
+static __printf(2, 3) void command_results_printf(struct command_results *results, const char *fmt, ...)
+{
+    char line[32];
+    va_list args;
+    int length;
+
+    if (results == NULL)
+        return;
+    va_start(args, fmt);
+    length = vscnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    command_results_add(results, line, (size_t)length);
+}
+ssize_t command_results_read(struct command_results *results, char __user *buffer, size_t length, unsigned int flags)
+{
+    ssize_t res;
+
+    if (flags & DICTIONARY_NONBLOCK)
+    {
+        if (!mutex_trylock(&results->mutex))
+            return -EAGAIN;
+    } else {
+        mutex_lock(&results->mutex);
+    }
+    if (results->length == 0 && !results->overflow)
+    {
+        res = -ENODATA;
+    } else if (results->position == results->length) {
+        //Everything was read: the end of the results, or an error if some of them were dropped.
+        //The next commands start a new buffer
+        res = results->overflow ? -EOVERFLOW : 0;
+        results->length = results->position = 0;
+        results->overflow = false;
+    } else {
+        length = min(length, results->length - results->position);
+        if (copy_to_user(buffer, &results->buffer[results->position], length) != 0)
+        {
+            res = -EFAULT;
+        } else {
+            results->position += length;
+            res = (ssize_t)length;
+        }
+    }
+    mutex_unlock(&results->mutex);
+    return res;
+}
 
 /**************************************************************************************
  * 
@@ -16,7 +149,7 @@ static bool parse_key(const char __user*, size_t, struct indices_t*);
  * 
 ***************************************************************************************/
 
-static int function_write(pdictionary dict, const char* __user keyAndValue, size_t length, uint)
+static int function_write(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
 {
     struct indices_t indices;
 
@@ -24,17 +157,15 @@ static int function_write(pdictionary dict, const char* __user keyAndValue, size
     {
         return (-1);//Bad format
     }
-    printd("Executing write with params \"%s\"\n\tfirst %d of \"%s\"\n\tfirst %d of \"%s\"\n", 
-        keyAndValue, 
-        (int)(indices.key_length),  
-        &keyAndValue[indices.key_start], 
-        (int)(indices.value_length),
-        &keyAndValue[indices.value_start]);
+    printd("Executing write with params \"%.*s\"\n\tkey \"%.*s\"\n\tvalue \"%.*s\"\n", 
+        (int)length, keyAndValue, 
+        (int)(indices.key_length), &keyAndValue[indices.key_start], 
+        (int)(indices.value_length), &keyAndValue[indices.value_start]);
     return dictionary_write(dict, 
         &keyAndValue[indices.key_start], indices.key_length, 
-        &keyAndValue[indices.value_start], indices.value_length);
+        &keyAndValue[indices.value_start], indices.value_length, options->flags);
 }
-static int function_append(pdictionary dict, const char __user* keyAndValue, size_t length, uint)
+static int function_append(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
 {
     struct indices_t indices;
 
@@ -42,27 +173,232 @@ static int function_append(pdictionary dict, const char __user* keyAndValue, siz
     {
         return (-1);//Bad format
     }
-    printd("Executing append with params \"%s\"\n first %d of \"%s\"\n first %d of \"%s\"\n", 
-        keyAndValue, 
-        (int)(indices.key_length),  
-        &keyAndValue[indices.key_start], 
-        (int)(indices.value_length),
-        &keyAndValue[indices.value_start]);
+    printd("Executing append with params \"%.*s\"\n key \"%.*s\"\n value \"%.*s\"\n", 
+        (int)length, keyAndValue, 
+        (int)(indices.key_length), &keyAndValue[indices.key_start], 
+        (int)(indices.value_length), &keyAndValue[indices.value_start]);
     return dictionary_append(dict, 
         &keyAndValue[indices.key_start], indices.key_length, 
-        &keyAndValue[indices.value_start], indices.value_length);
+        &keyAndValue[indices.value_start], indices.value_length, options->flags);
+}
+static int function_set_range(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    struct indices_t indices;
+    size_t index;
+    u64 offset;
+
+    if (!parse_key_and_value(keyAndValue, length, &indices))
+    {
+        return -EINVAL;//Bad format
+    }
+    index = indices.value_start;
+    if (!parse_number(keyAndValue, length, &index, &offset))
+    {
+        return -EINVAL;
+    }
+    //The bytes start after the spaces that follow the offset
+    index = command_scan_spaces(keyAndValue, index, length);
+    return dictionary_write_range(dict, 
+        &keyAndValue[indices.key_start], indices.key_length, (size_t)offset,
+        &keyAndValue[index], length - index, options->flags);
 }
-static int function_print(pdictionary dict, const char __user* keyAndValue, size_t length, uint timeout)
+static int function_print(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
 {
     struct indices_t indices;
+    u64 timeout_us;
+    char *value;
+    size_t value_length;
+    int res;
 
     if (!parse_key(keyAndValue, length, &indices))
     {
         return -EINVAL;//Bad format
     }
-    return dictionary_print_key(dict, &keyAndValue[indices.key_start], indices.key_length, timeout);
+    timeout_us = parse_timeout(keyAndValue, length, &indices, options->timeout_us);
+    res = dictionary_copy_value(dict, &keyAndValue[indices.key_start], indices.key_length, timeout_us, options->flags, 
+        NULL, &value, &value_length);
+    if (res == 0)
+    {
+        command_results_add(options->results, value, value_length);
+        kvfree(value);
+    }
+    return res;
 }
-static int function_delete(pdictionary dict, const char __user *keyAndValue, size_t length, uint)
+static int function_get_if_changed(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    struct dictionary_condition condition = { .match = DICTIONARY_IF_DIGEST };
+    struct indices_t indices;
+    char digits[9] = { 0 }, *value, *line;
+    size_t count = 0, value_length;
+    int res;
+
+    if (!parse_key_and_value(keyAndValue, length, &indices))
+    {
+        return -EINVAL;//Bad format
+    }
+    //The digest the caller has: up to 8 hex digits
+    while (count < indices.value_length && count < sizeof(digits) - 1 && isxdigit(keyAndValue[indices.value_start + count]))
+    {
+        digits[count] = keyAndValue[indices.value_start + count];
+        ++count;
+    }
+    if (count == 0 || kstrtou32(digits, 16, &condition.digest) != 0)
+    {
+        return -EINVAL;
+    }
+    res = dictionary_copy_value(dict, &keyAndValue[indices.key_start], indices.key_length, options->timeout_us, options->flags, 
+        &condition, &value, &value_length);
+    if (res != 0)
+        return res;
+    if (value == NULL)
+    {
+        //Unchanged: the digest alone
+        command_results_printf(options->results, "%08x", condition.digest);
+        return 0;
+    }
+    //Changed: the new digest and the value on the same line
+    line = (char*)kvmalloc(value_length + 9, GFP_KERNEL);
+    if (line == NULL)
+    {
+        kvfree(value);
+        return -ENOMEM;
+    }
+    scnprintf(line, 10, "%08x ", condition.digest);
+    memcpy(&line[9], value, value_length);
+    command_results_add(options->results, line, value_length + 9);
+    kvfree(line);
+    kvfree(value);
+    return 0;
+}
+static int function_get_range(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    struct indices_t indices;
+    struct iov_iter iter;
+    struct kvec kvec;
+    size_t index;
+    u64 offset, count;
+    loff_t position;
+    ssize_t res;
+
+    if (!parse_key_and_value(keyAndValue, length, &indices))
+    {
+        return -EINVAL;//Bad format
+    }
+    index = indices.value_start;
+    if (!parse_number(keyAndValue, length, &index, &offset) || !parse_number(keyAndValue, length, &index, &count) ||
+        count == 0 || offset > LLONG_MAX)
+    {
+        return -EINVAL;
+    }
+    //A line of results can't be longer than the results themselves
+    count = min_t(u64, count, COMMAND_RESULTS_MAX - 1);
+    kvec.iov_base = kvmalloc(count, GFP_KERNEL);
+    if (kvec.iov_base == NULL)
+        return -ENOMEM;
+    kvec.iov_len = count;
+    iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, count);
+    position = (loff_t)offset;
+    //Only the bytes of the range are copied out of the value
+    res = dictionary_read_iter(dict, &keyAndValue[indices.key_start], indices.key_length, &iter, 
+        options->timeout_us, options->flags, &position);
+    if (res >= 0)
+    {
+        //A range past the end of the value is an empty line
+        command_results_add(options->results, kvec.iov_base, (size_t)res);
+    }
+    kvfree(kvec.iov_base);
+    return res < 0 ? (int)res : 0;
+}
+//Executes an operation on a list, set or hash value and adds its result line: the element or value read, or a number
+static int typed_command(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options, 
+    unsigned int operation)
+{
+    struct dictionary_typed_op op = { .op = operation };
+    struct indices_t indices, field;
+    bool parsed;
+    long res;
+
+    if (operation == DICTIONARY_LIST_POP_HEAD || operation == DICTIONARY_LIST_POP_TAIL || operation == DICTIONARY_TYPED_COUNT)
+    {
+        parsed = parse_key(keyAndValue, length, &indices);
+    } else {
+        parsed = parse_key_and_value(keyAndValue, length, &indices) && indices.value_length > 0;
+        op.member = &keyAndValue[indices.value_start];
+        op.member_length = indices.value_length;
+    }
+    if (parsed && collection_op_type(operation) == DICTIONARY_TYPE_HASH)
+    {
+        //The field is inside <> like the key, only DICTIONARY_HASH_SET has a value after it
+        parsed = operation == DICTIONARY_HASH_SET ? 
+            parse_key_and_value(op.member, op.member_length, &field) : parse_key(op.member, op.member_length, &field);
+        op.value = &op.member[field.value_start];
+        op.value_length = field.value_length;
+        op.member += field.key_start;
+        op.member_length = field.key_length;
+    }
+    if (!parsed)
+    {
+        return -EINVAL;//Bad format
+    }
+    res = dictionary_typed(dict, &keyAndValue[indices.key_start], indices.key_length, &op, options->flags);
+    if (res < 0)
+        return (int)res;
+    if (operation == DICTIONARY_LIST_POP_HEAD || operation == DICTIONARY_LIST_POP_TAIL || operation == DICTIONARY_HASH_GET)
+    {
+        if (op.result == NULL)
+            return -ENOENT;//Missing field
+        command_results_add(options->results, op.result, op.result_length);
+        kvfree(op.result);
+        return 0;
+    }
+    command_results_printf(options->results, "%ld", res);
+    return 0;
+}
+static int function_list_push_tail(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_LIST_PUSH_TAIL);
+}
+static int function_list_push_head(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_LIST_PUSH_HEAD);
+}
+static int function_list_pop_head(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_LIST_POP_HEAD);
+}
+static int function_list_pop_tail(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_LIST_POP_TAIL);
+}
+static int function_set_add(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_SET_ADD);
+}
+static int function_set_remove(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_SET_REMOVE);
+}
+static int function_set_contains(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_SET_CONTAINS);
+}
+static int function_hash_set(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_HASH_SET);
+}
+static int function_hash_get(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_HASH_GET);
+}
+static int function_hash_delete(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_HASH_DELETE);
+}
+static int function_typed_count(pdictionary dict, const char* keyAndValue, size_t length, const struct command_options* options)
+{
+    return typed_command(dict, keyAndValue, length, options, DICTIONARY_TYPED_COUNT);
+}
+static int function_delete(pdictionary dict, const char *keyAndValue, size_t length, const struct command_options* options)
 {
     struct indices_t indices;
 
@@ -70,9 +406,9 @@ static int function_delete(pdictionary dict, const char __user *keyAndValue, siz
     {
         return (-1);//Bad format
     }
-    return dictionary_delete_key(dict, &keyAndValue[indices.key_start], indices.key_length);
+    return dictionary_delete_key(dict, &keyAndValue[indices.key_start], indices.key_length, options->flags);
 }
-static int function_delete_all(pdictionary dict, const char*, size_t, uint)
+static int function_delete_all(pdictionary dict, const char*, size_t, const struct command_options*)
 {
     int res;
 
@@ -80,41 +416,31 @@ static int function_delete_all(pdictionary dict, const char*, size_t, uint)
     res = dictionary_free(dict);
     return res;
 }
-static int function_count(pdictionary dict, const char __user*, size_t, uint)
+static int function_count(pdictionary dict, const char*, size_t, const struct command_options* options)
 {
-    int count;
-
-    count = (int)dictionary_count(dict);
-    printk(KERN_INFO "Keys in dictionary: %d\n", count);
-    if (count == 0)
-        return 1;
+    command_results_printf(options->results, "%zu", dictionary_count(dict));
     return 0;
 }
-static int function_is_empty(pdictionary dict, const char __user*, size_t, uint)
+static int function_is_empty(pdictionary dict, const char*, size_t, const struct command_options* options)
 {
-    if (dictionary_empty(dict))
-    {
-        printk(KERN_INFO "Dictionary is empty.\n");
-    } else {
-        printk(KERN_INFO "Dictionary is not empty.\n");
-    }
+    command_results_printf(options->results, "%d", dictionary_empty(dict) ? 1 : 0);
     return 0;
 }
-static int function_lock(pdictionary dict, const char __user*, size_t, uint)
+static int function_lock(pdictionary dict, const char*, size_t, const struct command_options*)
 {
     if (dictionary_is_locked(dict))
     {
-        printk(KERN_ALERT "Dictionary is already locked, we will wait until it unlocks...\n");
+        printd("Dictionary is already locked, we will wait until it unlocks...\n");
     }
     if (dictionary_lock(dict))
     {
         printd("Dictionary is now locked.\n");
         return 0;
     }
-    printk(KERN_ERR "Dictionary couldn't be locked!\n");
+    printd("Dictionary couldn't be locked!\n");
     return 1;
 }
-static int function_unlock(pdictionary dict, const char __user*, size_t, uint)
+static int function_unlock(pdictionary dict, const char*, size_t, const struct command_options*)
 {
     if (dictionary_is_locked(dict))
     {
@@ -125,14 +451,9 @@ static int function_unlock(pdictionary dict, const char __user*, size_t, uint)
     }
     return 0;
 }
-static int function_is_locked(pdictionary dict, const char __user*, size_t, uint)
+static int function_is_locked(pdictionary dict, const char*, size_t, const struct command_options* options)
 {
-    if (dictionary_is_locked(dict))
-    {
-        printd("Dictionary is locked.\n");
-    } else {
-        printd("Dictionary is not locked.\n");
-    }
+    command_results_printf(options->results, "%d", dictionary_is_locked(dict) ? 1 : 0);
     return 0;
 }
  
@@ -144,23 +465,73 @@ static int function_is_locked(pdictionary dict, const char __user*, size_t, uint
 
 //Basic object declarations
 
-typedef int(*command_function)(pdictionary, const char __user *, size_t, uint);
+typedef int(*command_function)(pdictionary, const char *, size_t, const struct command_options*);
 #define skip_spaces(command, i, length) \
-    while (i < length && (command[i] == ' ' || command[i] == '\t') && command[i] != '\0') \
-    { \
-        ++i; \
-    } \
+    i = command_scan_spaces(command, i, length); \
     if (i >= length) \
         return
 
-//Actual functions
+/*
+ * The scans read a word at a time. A byte of the word is zero when adding 0x7f to its low
+ * 7 bits doesn't carry into the high bit and the high bit was clear already.
+ * Bytes never borrow from each other, so the mask is exact for every byte of the word.
+ */
+#define SCAN_WORD sizeof(unsigned long)
+#define word_zero_bytes(word) (~((((word) & REPEAT_BYTE(0x7f)) + REPEAT_BYTE(0x7f)) | (word) | REPEAT_BYTE(0x7f)))
+#define word_bytes_equal(word, c) word_zero_bytes((word) ^ REPEAT_BYTE((u8)(c)))
+
+size_t command_scan(const char *str, size_t index, size_t length, char delimiter)
+{
+    unsigned long word;
+
+    //Byte by byte up to the first aligned word
+    for ( ; index < length && !IS_ALIGNED((unsigned long)&str[index], SCAN_WORD); ++index)
+    {
+        if (str[index] == delimiter || str[index] == '\0')
+            return index;
+    }
+    for ( ; length - index >= SCAN_WORD; index += SCAN_WORD)
+    {
+        word = *(const unsigned long*)&str[index];
+        if ((word_zero_bytes(word) | word_bytes_equal(word, delimiter)) != 0)
+            break;
+    }
+    //The word with the match, or the bytes after the last whole word
+    for ( ; index < length && str[index] != delimiter && str[index] != '\0'; ++index)
+    {
+        //Do nothing
+    }
+    return index;
+}
 
-static ssize_t next_command_start(const char __user *commands, size_t length, ssize_t curr_index)
+size_t command_scan_spaces(const char *str, size_t index, size_t length)
 {
-    for ( ; curr_index < (ssize_t)length && commands[curr_index] != COMMAND_SEPARATOR && commands[curr_index] != '\0'; ++curr_index)
+    unsigned long word;
+
+    for ( ; index < length && !IS_ALIGNED((unsigned long)&str[index], SCAN_WORD); ++index)
+    {
+        if (str[index] != ' ' && str[index] != '\t')
+            return index;
+    }
+    for ( ; length - index >= SCAN_WORD; index += SCAN_WORD)
+    {
+        word = *(const unsigned long*)&str[index];
+        //Stops at the first word that isn't all blanks
+        if ((word_bytes_equal(word, ' ') | word_bytes_equal(word, '\t')) != REPEAT_BYTE(0x80))
+            break;
+    }
+    for ( ; index < length && (str[index] == ' ' || str[index] == '\t'); ++index)
     {
         //Do nothing
     }
+    return index;
+}
+
+//Actual functions
+
+static ssize_t next_command_start(const char *commands, size_t length, ssize_t curr_index)
+{
+    curr_index = (ssize_t)command_scan(commands, (size_t)curr_index, length, COMMAND_SEPARATOR);
     if ((size_t)curr_index < length)
     {
         //We hit the separator
@@ -169,29 +540,28 @@ static ssize_t next_command_start(const char __user *commands, size_t length, ss
     return (-1);
 }
 
-static bool parse_key_and_value(const char __user *str, size_t length, struct indices_t* indices)
+static bool parse_key_and_value(const char *str, size_t length, struct indices_t* indices)
 {
     size_t index = 1;
 
-    printd("Parsing key and value of \"%s\" (%d)\n", str, (int)length);
+    printd("Parsing key and value of \"%.*s\" (%d)\n", (int)length, str, (int)length);
     memset(indices, 0, sizeof(struct indices_t));
     //search for key
-    if (str[0] != '<' || length == 0)
+    if (length == 0 || str[0] != '<')
     {
-        printk(KERN_ALERT "Bad first character or length == 0\n");
+        printd("Bad first character or length == 0\n");
         return false;
     }
     indices->key_start = 1;
-    while (index < length && str[index] != '\0' && str[index] != '>')
-    {
-        ++index;
-    }
+    index = command_scan(str, index, length, '>');
     if (index >= length || str[index] == '\0')
     {
-        printk(KERN_ALERT "Closing '>' of key not found\n");
+        printd("Closing '>' of key not found\n");
         return false;
     }
     indices->key_length = index - 1;
+    if (indices->key_length == 0)
+        return false;//Empty keys can't be created, a length of zero would be taken for a string
     ++index;
 
     //search for value (starts with first non space character after the key)
@@ -200,7 +570,23 @@ static bool parse_key_and_value(const char __user *str, size_t length, struct in
     indices->value_length = length - index;
     return true;
 }
-static bool parse_key(const char __user *str, size_t length, struct indices_t* indices)
+//Reads a decimal number from *index, after the spaces, and moves *index after it
+static bool parse_number(const char *str, size_t length, size_t *index, u64 *number)
+{
+    char digits[21] = { 0 };
+    size_t count = 0, i;
+
+    i = command_scan_spaces(str, *index, length);
+    while (i < length && count < sizeof(digits) - 1 && str[i] >= '0' && str[i] <= '9')
+    {
+        digits[count++] = str[i++];
+    }
+    if (count == 0 || kstrtou64(digits, 10, number) != 0)
+        return false;
+    *index = i;
+    return true;
+}
+static bool parse_key(const char *str, size_t length, struct indices_t* indices)
 {
     size_t index = 1;
 
@@ -210,20 +596,37 @@ static bool parse_key(const char __user *str, size_t length, struct indices_t* i
     if (str[0] == '<')
     {
         indices->key_start = index++;
-        while (index < length && str[index] != '\0' && str[index] != '>')
-        {
-            ++index;
-        }
+        index = command_scan(str, index, length, '>');
         if (index == length)
             return false;
         indices->key_length = index - 1;
     } else {
+        //The commands are not NUL terminated: the key ends with them
         indices->key_start = 0;
-        index = strlen(str);
-        indices->key_length = min(length, index);
+        indices->key_length = strnlen(str, length);
     }
-    
-    return true;
+    //Empty keys can't be created, a length of zero would be taken for a string
+    return indices->key_length > 0;
+}
+//Reads the optional timeout written after a key inside <>: "-r <KEY_HERE> 500" (msecs) or "-r <KEY_HERE> 250us"
+static u64 parse_timeout(const char *str, size_t length, struct indices_t* indices, u64 default_timeout)
+{
+    char digits[21] = { 0 };
+    size_t index, count = 0;
+    u64 timeout;
+
+    if (indices->key_start == 0)
+        return default_timeout;//The key is not inside <>, it takes the whole command
+    index = command_scan_spaces(str, indices->key_start + indices->key_length + 1, length);//+1 to skip the closing '>'
+    while (index < length && count < sizeof(digits) - 1 && str[index] >= '0' && str[index] <= '9')
+    {
+        digits[count++] = str[index++];
+    }
+    if (count == 0 || kstrtou64(digits, 10, &timeout) != 0)
+        return default_timeout;
+    if (index + 1 < length && str[index] == 'u' && str[index + 1] == 's')
+        return timeout;
+    return timeout * USEC_PER_MSEC;
 }
   
 static void print_commands_format(void)
@@ -243,26 +646,68 @@ static void print_commands_format(void)
         COMMAND_WRITE);
     printk(                                   
         "# Append to key \"-%c <KEY_HERE> VALUE_HERE\"\n"                    
-        "   # If the key is not present it is created but does not wake\n"   
-        "     tasks in the waitqueue\n"                                      
+        "   # If the key is not present it is created and wakes the\n"       
+        "     tasks that are waiting for it\n"                               
         "   # Same format as Write\n"                                        
         "   # Wrtinig an empty string to a key doeas nothing\n"              
+        "# Write range \"-%c <KEY_HERE> OFFSET VALUE_HERE\"\n"
+        "   # Overwrites the value from byte OFFSET, the bytes past the end\n"
+        "     are appended. OFFSET can't be past the end of the value\n"
         "# Delete key \"-%c KEY_HERE\"\n"                                    
         "   # The key is interpreted since the first non space character\n" 
         "# Delete all keys \"-%c\"\n"                                        
         "   # No parameters to this command\n", 
         COMMAND_APPEND, 
+        COMMAND_SET_RANGE, 
         COMMAND_DELETE, 
         COMMAND_DELETE_ALL);
     printk(                                                               
         "# Print key \"-%c KEY_HERE\" or \"-%c KEY_HERE\"\n"                 
         "   # Prints the key, if present. If not waits until its created\n"  
+        "   # \"-%c <KEY_HERE> MSECS\" waits at most MSECS for the key,\n"     
+        "     \"-%c <KEY_HERE> USECSus\" at most USECS microseconds\n"         
+        "   # With O_NONBLOCK missing keys fail immediately\n"               
+        "# Print key if changed \"-%c <KEY_HERE> DIGEST\"\n"
+        "   # DIGEST is the 8 hex digits CRC32 of the value the caller has:\n"
+        "     the result is the digest alone if the value is the same,\n"
+        "     the new digest, a space and the value otherwise\n"
+        "# Print range \"-%c <KEY_HERE> OFFSET LENGTH\"\n"
+        "   # Prints at most LENGTH bytes of the value, from byte OFFSET\n"
         "# Count keys \"-%c\"\n"                                             
         "# Is empty? \"-%c\"\n", 
         COMMAND_PRINT, 
         COMMAND_READ, 
+        COMMAND_READ, 
+        COMMAND_READ, 
+        COMMAND_GET_IF_CHANGED, 
+        COMMAND_GET_RANGE, 
         COMMAND_COUNT, 
         COMMAND_EMPTY);
+    printk(
+        "# Lists: push to the tail \"-%c <KEY_HERE> VALUE_HERE\", to the head \"-%c <KEY_HERE> VALUE_HERE\"\n"
+        "   # The result is the number of elements after the push\n"
+        "  pop from the head \"-%c KEY_HERE\", from the tail \"-%c KEY_HERE\"\n"
+        "   # The result is the element, popping the last one deletes the key\n"
+        "# Sets: add \"-%c <KEY_HERE> MEMBER\", remove \"-%c <KEY_HERE> MEMBER\",\n"
+        "  contains \"-%c <KEY_HERE> MEMBER\"\n"
+        "   # The result is 1 if the member was added, removed or found, 0 otherwise\n"
+        "# Hashes: set \"-%c <KEY_HERE> <FIELD> VALUE_HERE\", get \"-%c <KEY_HERE> <FIELD>\",\n"
+        "  delete \"-%c <KEY_HERE> <FIELD>\"\n"
+        "   # Set gives 1 for a new field, 0 for a replaced value, delete 1 or 0\n"
+        "# Elements of a list, set or hash \"-%c KEY_HERE\"\n"
+        "   # Reading a typed key as a whole gives a line for each element,\n"
+        "     \"<FIELD> VALUE\" lines for hashes. Writing it replaces it\n",
+        COMMAND_LIST_PUSH_TAIL,
+        COMMAND_LIST_PUSH_HEAD,
+        COMMAND_LIST_POP_HEAD,
+        COMMAND_LIST_POP_TAIL,
+        COMMAND_SET_ADD,
+        COMMAND_SET_REMOVE,
+        COMMAND_SET_CONTAINS,
+        COMMAND_HASH_SET,
+        COMMAND_HASH_GET,
+        COMMAND_HASH_DELETE,
+        COMMAND_TYPED_COUNT);
     printk(                                                                  
         "# Lock \"-%c\"\n"                                                   
         "   # Locks the dictionary, no call will be able to\n"               
@@ -277,7 +722,9 @@ static void print_commands_format(void)
         COMMAND_INFO);
 }
 
-static bool execute_single_command(pdictionary dict, const char __user *command, size_t length, uint timeout, int* command_out)
+//Executes one command. reports is set for the commands that add their own result line
+static bool execute_single_command(pdictionary dict, const char *command, size_t length, const struct command_options *options, int* command_out, 
+    bool *reports)
 {
     size_t i = 0;
     bool need_for_parameters = false;
@@ -302,9 +749,79 @@ static bool execute_single_command(pdictionary dict, const char __user *command,
             f = function_append;
             need_for_parameters = true;
             break;
+        case COMMAND_SET_RANGE:
+            f = function_set_range;
+            need_for_parameters = true;
+            break;
         case COMMAND_READ:
         case COMMAND_PRINT:
             f = function_print;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_GET_IF_CHANGED:
+            f = function_get_if_changed;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_GET_RANGE:
+            f = function_get_range;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_LIST_PUSH_TAIL:
+            f = function_list_push_tail;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_LIST_PUSH_HEAD:
+            f = function_list_push_head;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_LIST_POP_HEAD:
+            f = function_list_pop_head;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_LIST_POP_TAIL:
+            f = function_list_pop_tail;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_SET_ADD:
+            f = function_set_add;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_SET_REMOVE:
+            f = function_set_remove;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_SET_CONTAINS:
+            f = function_set_contains;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_HASH_SET:
+            f = function_hash_set;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_HASH_GET:
+            f = function_hash_get;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_HASH_DELETE:
+            f = function_hash_delete;
+            *reports = true;
+            need_for_parameters = true;
+            break;
+        case COMMAND_TYPED_COUNT:
+            f = function_typed_count;
+            *reports = true;
             need_for_parameters = true;
             break;
         case COMMAND_DELETE:
@@ -316,9 +833,11 @@ static bool execute_single_command(pdictionary dict, const char __user *command,
             break;
         case COMMAND_COUNT:
             f = function_count;
+            *reports = true;
             break;
         case COMMAND_EMPTY:
             f = function_is_empty;
+            *reports = true;
             break;
         case COMMAND_LOCK:
             f = function_lock;
@@ -328,15 +847,20 @@ static bool execute_single_command(pdictionary dict, const char __user *command,
             break;
         case COMMAND_IS_LOCKED:
             f = function_is_locked;
+            *reports = true;
             break;
         case COMMAND_INFO:
             print_commands_format();
+            if (command_out)
+            {
+                *command_out = 0;
+            }
             return true;
         default: 
-            printk(KERN_ERR 
-                "Unrecognized command character '%c', from: \"%s\"\n"
+            printd(
+                "Unrecognized command character '%c', from: \"%.*s\"\n"
                 "If you need info about the command format send command -%c.\n", 
-                command[i], command,
+                command[i], (int)length, command,
                 COMMAND_INFO);
             return false;
     }
@@ -345,7 +869,7 @@ static bool execute_single_command(pdictionary dict, const char __user *command,
         ++i;
         skip_spaces(command, i, length) false;
     }
-    function_output = f(dict, &command[i], length - i, timeout);
+    function_output = f(dict, &command[i], length - i, options);
     
     // Keep the output of the function if requested
     if (command_out)
@@ -355,33 +879,47 @@ static bool execute_single_command(pdictionary dict, const char __user *command,
 
     if (function_output != 0)
     {
-        printk(KERN_ERR "Command reported error %d while executing\n", function_output);
-        switch (function_output)
-        {
-            case -EFAULT:
-                printk(KERN_ERR "Detected error: EFAULT.\n");
-                break;
-            case -EINVAL:
-                printk(KERN_ERR "Detected error: EINVAL.\n");
-                break;
-            case -EAGAIN:
-                printk(KERN_ERR "Detected error: EAGAIN.\n");
-                break;
-        }
-        
+        printd("Command reported error %d while executing\n", function_output);
         return false;
     }
     return true;
 }
+//Executes one command and adds its result line: the output of the command, "OK" or "ERR" and the code
+static bool execute_and_report(pdictionary dict, const char *command, size_t length, const struct command_options *options, int* command_out)
+{
+    int output = -EINVAL;//Left as it is by the bad formats
+    bool reports = false, done;
+
+    done = execute_single_command(dict, command, length, options, &output, &reports);
+    if (!done && output == -EAGAIN && (options->flags & DICTIONARY_NONBLOCK))
+    {
+        //Not executed at all: the caller sends it again, and its line comes then
+    } else if (!done)
+    {
+        command_results_printf(options->results, "ERR %d", output);
+    } else if (!reports) {
+        command_results_add(options->results, "OK", 2);
+    }
+    if (command_out)
+    {
+        *command_out = output;
+    }
+    return done;
+}
 
-int parse_command(pdictionary dict, const char __user *commands, size_t length, uint timeout, bool allow_multi)
+int parse_command(pdictionary dict, const char *commands, size_t length, const struct command_options *options, bool allow_multi, 
+    size_t *consumed)
 {
     ssize_t command_start = 0, command_end = 0;
     int command_out = 0, command_count = 0;
 
-    if (commands == NULL || length == 0)
+    if (consumed != NULL)
+    {
+        *consumed = length;
+    }
+    if (commands == NULL || length == 0 || options == NULL)
         return -EINVAL;
-    printd("parse command of \"%s\" (%d)", commands, (int)length);
+    printd("parse command of \"%.*s\" (%d)", (int)length, commands, (int)length);
 
     //
     //  Only one command allowed: we return the operation return value
@@ -392,7 +930,7 @@ int parse_command(pdictionary dict, const char __user *commands, size_t length,
         if (command_end < 0)
         {
             //Last command
-            printd("Only command: \"%s\" (%d)\n", &commands[command_start], (int)(length - command_start));
+            printd("Only command: \"%.*s\"\n", (int)(length - command_start), &commands[command_start]);
             
             command_end = length;
         }
@@ -402,7 +940,7 @@ int parse_command(pdictionary dict, const char __user *commands, size_t length,
             printd("%d characters after the command will be ignored.\n", (int)(length - command_end));
         }
 
-        execute_single_command(dict, &commands[command_start], command_end - command_start, timeout, &command_out);
+        execute_and_report(dict, &commands[command_start], command_end - command_start, options, &command_out);
         return command_out; // Return
     }
     
@@ -415,8 +953,8 @@ int parse_command(pdictionary dict, const char __user *commands, size_t length,
         if (command_end < 0)
         {
             //Last command
-            printd("Last command: \"%s\" (%d)\n", &commands[command_start], (int)(length - command_start));
-            if (execute_single_command(dict, &commands[command_start], length - command_start, timeout, &command_out))
+            printd("Last command: \"%.*s\"\n", (int)(length - command_start), &commands[command_start]);
+            if (execute_and_report(dict, &commands[command_start], length - command_start, options, &command_out))
             {
                 // Command succeded: update the count
                 ++command_count;
@@ -425,9 +963,9 @@ int parse_command(pdictionary dict, const char __user *commands, size_t length,
                 break;
             }
         } else {
-            printd("Command: \"%s\" (%d)\n of many", &commands[command_start], (int)(command_end - command_start));
+            printd("Command: \"%.*s\" of many\n", (int)(command_end - command_start), &commands[command_start]);
             //There are other commands next
-            if (execute_single_command(dict, &commands[command_start], command_end - command_start, timeout, &command_out))
+            if (execute_and_report(dict, &commands[command_start], command_end - command_start, options, &command_out))
             {
                 // Command succeded: update the count
                 ++command_count;
@@ -439,5 +977,96 @@ int parse_command(pdictionary dict, const char __user *commands, size_t length,
         command_start = command_end + 1;//+1 to skip the COMMAND_SEPARATOR character
     }
     while (command_end < length);
+    if (command_out == -EAGAIN && (options->flags & DICTIONARY_NONBLOCK) && consumed != NULL)
+    {
+        //The commands from the one that would wait on were not executed: they can be sent again
+        *consumed = (size_t)command_start;
+    }
+    if (command_count == 0 && command_out == -EAGAIN)
+    {
+        //Non blocking and nothing executed: the whole write can be retried
+        return -EAGAIN;
+    }
+    return command_count;
+}
+
+int parse_binary_commands(pdictionary dict, const char *records, size_t length, const struct command_options *options, 
+    size_t *consumed)
+{
+    const struct dictionary_wire_record *record;
+    const char *key;
+    size_t index = 0, key_length, value_length;
+    int res = 0, command_count = 0;
+
+    if (consumed != NULL)
+    {
+        *consumed = 0;
+    }
+    if (records == NULL || options == NULL)
+        return -EINVAL;
+    if (length > 0 && (u8)records[0] == DICTIONARY_WIRE_MAGIC)
+    {
+        //The magic byte only selects the format
+        index++;
+    }
+    while (index < length)
+    {
+        if (consumed != NULL)
+        {
+            *consumed = index;
+        }
+        //Nothing is scanned: one check for the header, one for the key and the value together
+        if (length - index < sizeof(struct dictionary_wire_record))
+        {
+            res = -EINVAL;
+            break;
+        }
+        record = (const struct dictionary_wire_record*)&records[index];
+        key_length = get_unaligned_le32(&record->key_length);
+        value_length = get_unaligned_le32(&record->value_length);
+        index += sizeof(struct dictionary_wire_record);
+        if (key_length == 0 || key_length + value_length > length - index)
+        {
+            res = -EINVAL;
+            break;
+        }
+        key = &records[index];
+        switch (record->opcode)
+        {
+            case DICTIONARY_WIRE_SET:
+                res = dictionary_write(dict, key, key_length, &key[key_length], value_length, options->flags);
+                break;
+            case DICTIONARY_WIRE_APPEND:
+                res = dictionary_append(dict, key, key_length, &key[key_length], value_length, options->flags);
+                break;
+            case DICTIONARY_WIRE_DELETE:
+                res = value_length != 0 ? -EINVAL : dictionary_delete_key(dict, key, key_length, options->flags);
+                break;
+            default:
+                res = -EINVAL;
+                break;
+        }
+        if (res == 1 && value_length == 0 && record->opcode != DICTIONARY_WIRE_APPEND)
+        {
+            //The key to delete is already missing: that is what the record asks, a batch sent again must not stop on it
+            res = 0;
+        }
+        if (res != 0)
+        {
+            printd("Binary record %d failed with code %d.\n", command_count, res);
+            break;
+        }
+        index += key_length + value_length;
+        ++command_count;
+    }
+    if (consumed != NULL && res == 0)
+    {
+        *consumed = index;
+    }
+    if (command_count == 0 && res < 0)
+    {
+        //Malformed batch or non blocking and nothing executed
+        return res;
+    }
     return command_count;
 }
\ No newline at end of file
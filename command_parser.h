@@ -8,12 +8,27 @@
 
 #define COMMAND_WRITE 'w'
 #define COMMAND_APPEND 'a'
+#define COMMAND_SET_RANGE 's'
 
 #define COMMAND_DELETE 'd'
 #define COMMAND_DELETE_ALL 'f'
 
 #define COMMAND_READ 'r'
 #define COMMAND_PRINT 'p'
+#define COMMAND_GET_IF_CHANGED 'g'
+#define COMMAND_GET_RANGE 'o'
+
+#define COMMAND_LIST_PUSH_TAIL 'q'
+#define COMMAND_LIST_PUSH_HEAD 'Q'
+#define COMMAND_LIST_POP_HEAD 'y'
+#define COMMAND_LIST_POP_TAIL 'Y'
+#define COMMAND_SET_ADD 'm'
+#define COMMAND_SET_REMOVE 'M'
+#define COMMAND_SET_CONTAINS 'k'
+#define COMMAND_HASH_SET 'H'
+#define COMMAND_HASH_GET 'G'
+#define COMMAND_HASH_DELETE 'D'
+#define COMMAND_TYPED_COUNT 'n'
 
 #define COMMAND_COUNT 'c'
 #define COMMAND_EMPTY 'e'
@@ -22,14 +37,79 @@
 #define COMMAND_UNLOCK 'u'
 #define COMMAND_IS_LOCKED 'i'
 
+#define COMMAND_RESULTS_MAX (1 << 20) //Bytes of results a file keeps before dropping the new ones
+
+/// @brief Result lines of the text commands sent through a file, waiting to be read
+struct command_results {
+    struct mutex mutex; //Protects the fields below
+    char *buffer;
+    size_t length;      //Bytes of results
+    size_t position;    //Bytes already read
+    size_t size;        //Bytes allocated
+    bool overflow;      //COMMAND_RESULTS_MAX was reached: the lines are dropped and the read after the last one fails
+};
+
+/// @brief Options shared by all the commands of a write
+struct command_options {
+    u64 timeout_us;     //usecs reads will wait for keys that have not been created yet, if 0 they wait until killed
+    unsigned int flags; //DICTIONARY_NONBLOCK to never wait for missing keys
+    struct command_results *results; //Where each command puts its result line, NULL to drop them
+};
+
+/// @brief Prepares an empty result buffer
+/// @param results The results to initialize
+void command_results_init(struct command_results *results);
+
+/// @brief Frees the result lines that were not read
+/// @param results The results to free
+void command_results_free(struct command_results *results);
+
+/// @brief Reads the result lines of the commands executed so far
+/// @param results The results of the file
+/// @param buffer User space buffer
+/// @param length Size of buffer
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex
+/// @returns bytes read, 0 once all the lines have been read (the buffer is then emptied), -EOVERFLOW instead of 0
+/// if lines were dropped because COMMAND_RESULTS_MAX was reached, -ENODATA if there are no results at all,
+/// below zero for other errors
+ssize_t command_results_read(struct command_results *results, char __user *buffer, size_t length, unsigned int flags);
+
+/// @brief Finds the first delimiter or '\0' of a string, reading a word at a time
+/// @param str The string to scan
+/// @param index Where the scan starts
+/// @param length Length of the string
+/// @param delimiter The character to search
+/// @returns the index of the delimiter or of the '\0', length if neither is found
+size_t command_scan(const char *str, size_t index, size_t length, char delimiter);
+
+/// @brief Skips the spaces and tabs of a string, reading a word at a time
+/// @param str The string to scan
+/// @param index Where the scan starts
+/// @param length Length of the string
+/// @returns the index of the first other character, length if there is none
+size_t command_scan_spaces(const char *str, size_t index, size_t length);
+
 /// @brief Parses a list of commands and executes them
 /// @param dict Pointer to the dictionary object 
 /// @param commands The string containing the commands
 /// @param length Length of the string containing the commands
-/// @param timeout msecs reads will wait for keys that have not been created yet
+/// @param options timeout and flags of the commands
 /// @param allow_multiple_commands Allow or not multiple commands to be executed
+/// @param consumed Set to the bytes of the commands that don't have to be sent again: all of them, unless a
+/// DICTIONARY_NONBLOCK command failed with -EAGAIN, then the ones before it (separators included). Can be NULL
 /// @returns number of commands executed if allow_multple_commands is true, 
 /// below zero for errors zero for success of the first and only command where allow_multiple_commands is false
-int parse_command(pdictionary dict, const char __user *commands, size_t length, uint timeout, bool allow_multiple_commands);
+int parse_command(pdictionary dict, const char *commands, size_t length, const struct command_options *options, bool allow_multiple_commands, 
+    size_t *consumed);
+
+/// @brief Executes a batch of binary records (see struct dictionary_wire_record), stops at the first failure
+/// @param dict Pointer to the dictionary object
+/// @param records Kernel buffer with the records, optionally preceded by DICTIONARY_WIRE_MAGIC
+/// @param length Length of the buffer
+/// @param options timeout and flags of the commands
+/// @param consumed Set to the bytes of the records executed (and of the magic byte), length if all of them were. Can be NULL
+/// @returns number of records executed, below zero if the batch is malformed or nothing could be executed
+int parse_binary_commands(pdictionary dict, const char *records, size_t length, const struct command_options *options, 
+    size_t *consumed);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/lz4.h>
+#include <linux/moduleparam.h>
+#include "module.h"
+#include "compression.h"
+#include "value.h"
+
+//Compresses a plain node
+void compression_compress_node(void **workspace, pnode node)
+{
+    char *compressed, *exact;
+    int size, bound;
+    bool hc;
+
+    if (compress_threshold == 0 || node->value == NULL || (node->flags & (NODE_COMPRESSED | NODE_CHUNKED | NODE_SHARED | NODE_TYPED)) ||
+        node->value_length < compress_threshold || node->value_length > LZ4_MAX_INPUT_SIZE)
+    {
+        //Nothing to do: the node stays plain
+        return;
+    }
+    if (*workspace == NULL)
+    {
+        //Big enough for both LZ4 and LZ4HC
+        *workspace = kvmalloc(LZ4HC_MEM_COMPRESS, GFP_KERNEL);
+        if (*workspace == NULL)
+            return;
+    }
+    bound = LZ4_compressBound(node->value_length);
+    compressed = (char*)kvmalloc(bound, GFP_USER);
+    if (compressed == NULL)
+        return;
+    //The param can be written from sysfs at any time: its string is read under the param lock
+    kernel_param_lock(THIS_MODULE);
+    hc = strcmp(compress_algorithm, COMPRESSION_LZ4HC) == 0;
+    kernel_param_unlock(THIS_MODULE);
+    if (hc)
+    {
+        size = LZ4_compress_HC(node->value, compressed, (int)node->value_length, bound, LZ4HC_DEFAULT_CLEVEL, *workspace);
+    } else {
+        size = LZ4_compress_default(node->value, compressed, (int)node->value_length, bound, *workspace);
+    }
+    if (size <= 0 || (size_t)size >= node->value_length)
+    {
+        //Compression failed or the value does not compress: keeping it plain is cheaper to read
+        kvfree(compressed);
+        return;
+    }
+    //Give back the part of the buffer that was not used
+    exact = (char*)kvmalloc(size, GFP_USER);
+    if (exact != NULL)
+    {
+        memcpy(exact, compressed, size);
+        kvfree(compressed);
+        compressed = exact;
+    }
+    value_buffer_free(node);
+    node->value = compressed;
+    node->stored_length = (size_t)size;
+    node->flags |= NODE_COMPRESSED;
+}
+
+//Decompresses a node to a buffer
+int compression_expand(pnode node, char *dest)
+{
+    if (LZ4_decompress_safe(node->value, dest, (int)node->stored_length, (int)node->value_length) != (int)node->value_length)
+        return -EIO;
+    return 0;
+}
+
+//Decompresses a node in place
+int compression_decompress_node(pnode node)
+{
+    char *plain;
+
+    if (!(node->flags & NODE_COMPRESSED))
+        return 0;
+    plain = (char*)kvmalloc(node->value_length + 1, GFP_USER);
+    if (plain == NULL)
+        return -ENOMEM;
+    if (compression_expand(node, plain) != 0)
+    {
+        kvfree(plain);
+        return -EIO;
+    }
+    plain[node->value_length] = '\0';
+    kvfree(node->value);
+    node->value = plain;
+    node->stored_length = node->value_length + 1;
+    node->flags &= ~NODE_COMPRESSED;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _MODULE_COMPRESSION_H
+#define _MODULE_COMPRESSION_H
+
+#include "dictionary.h"
+
+//Values of the compress_algorithm param
+#define COMPRESSION_LZ4   "lz4"
+#define COMPRESSION_LZ4HC "lz4hc"
+
+/// @brief Compresses the value of a plain, not chunked, node if it is at least compress_threshold bytes long
+/// and compression saves memory. If anything fails the node is left plain
+/// @param workspace pointer to the workspace of the compressor, allocated when first needed. 
+/// Whoever owns it must serialize the calls and free it with kvfree()
+/// @param node the node to compress
+void compression_compress_node(void **workspace, pnode node);
+
+/// @brief Turns a compressed node back into a plain one, does nothing on plain nodes
+/// @param node the node to decompress
+/// @return zero for success, non zero otherwise (the node is left unchanged)
+int compression_decompress_node(pnode node);
+
+/// @brief Decompresses the value of a compressed node to a buffer
+/// @param node the node, must be compressed
+/// @param dest buffer of at least node->value_length bytes
+/// @return zero for success, non zero otherwise
+int compression_expand(pnode node, char *dest);
+
+#endif
@@ -0,0 +1,240 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include "module.h"
+#include "dedup.h"
+#include "value.h"
+
+/*
+ * Values and key prefixes are content addressed: a table of the dictionary maps the hash of
+ * the bytes to the single copy that the nodes point to. Everything runs with the mutex of the
+ * dictionary locked, so plain counters are enough for the references.
+ * Shared bytes are charged to the memory of the dictionary once, the nodes pointing to them
+ * charge only what they keep private.
+ */
+
+#define DEDUP_SEED 0x44445550 //"DDUP"
+#define DEDUP_BUCKETS (1u << DEDUP_ORDER)
+
+#define shared_bytes_memory(length) (sizeof(struct shared_bytes) + (length) + 1)
+
+//Allocates the table the first time it's needed
+static bool dedup_table(struct hlist_head **table)
+{
+    size_t i;
+
+    if (*table != NULL)
+        return true;
+    *table = (struct hlist_head*)kvmalloc_array(DEDUP_BUCKETS, sizeof(struct hlist_head), GFP_KERNEL);
+    if (*table == NULL)
+        return false;
+    for (i = 0; i < DEDUP_BUCKETS; ++i)
+    {
+        INIT_HLIST_HEAD(&(*table)[i]);
+    }
+    return true;
+}
+
+//Returns the shared copy of data, creating it with no references if it's missing
+static struct shared_bytes *dedup_get(pdictionary dict, struct hlist_head *table, const char *data, size_t length, bool *created)
+{
+    struct shared_bytes *shared;
+    struct hlist_head *bucket;
+    u32 hash;
+
+    hash = jhash(data, length, DEDUP_SEED);
+    bucket = &table[hash & (DEDUP_BUCKETS - 1)];
+    *created = false;
+    hlist_for_each_entry(shared, bucket, hash_list)
+    {
+        if (shared->hash == hash && shared->length == length && memcmp(shared->data, data, length) == 0)
+            return shared;
+    }
+    shared = (struct shared_bytes*)kvmalloc(shared_bytes_memory(length), GFP_KERNEL);
+    if (shared == NULL)
+        return NULL;
+    shared->hash = hash;
+    shared->refs = 0;
+    shared->length = length;
+    memcpy(shared->data, data, length);
+    shared->data[length] = '\0';
+    hlist_add_head(&shared->hash_list, bucket);
+    dict->memory_used += shared_bytes_memory(length);
+    *created = true;
+    return shared;
+}
+
+//Drops a reference, freeing the shared bytes with the last one. Returns true if they were freed
+static bool dedup_put(pdictionary dict, struct shared_bytes *shared)
+{
+    if (--shared->refs != 0)
+        return false;
+    hlist_del(&shared->hash_list);
+    dict->memory_used -= shared_bytes_memory(shared->length);
+    kvfree(shared);
+    return true;
+}
+
+void dedup_share_value(pdictionary dict, pnode node)
+{
+    struct shared_bytes *shared;
+    bool created;
+
+    if (!dedup || (node->flags & ~NODE_ARENA) != 0 || node->value == NULL || node->value_length == 0)
+        return;
+    if (!dedup_table(&dict->shared_values))
+        return;
+    shared = dedup_get(dict, dict->shared_values, node->value, node->value_length, &created);
+    if (shared == NULL)
+        return;
+    if (created)
+    {
+        dict->stats.shared_values++;
+        dict->stats.shared_stored += shared->length;
+    }
+    shared->refs++;
+    dict->stats.shared_original += shared->length;
+    value_buffer_free(node);
+    node->value = shared->data;
+    node->stored_length = 0;
+    node->flags |= NODE_SHARED;
+}
+
+struct shared_bytes *dedup_detach_value(pnode node)
+{
+    struct shared_bytes *shared;
+
+    if (!(node->flags & NODE_SHARED))
+        return NULL;
+    shared = node_shared_value(node);
+    node->value = NULL;
+    node->value_length = 0;
+    node->flags &= ~NODE_SHARED;
+    return shared;
+}
+
+void dedup_attach_value(pnode node, struct shared_bytes *shared)
+{
+    if (shared == NULL)
+        return;
+    node->value = shared->data;
+    node->value_length = shared->length;
+    node->stored_length = 0;
+    node->flags |= NODE_SHARED;
+}
+
+void dedup_put_value(pdictionary dict, struct shared_bytes *shared)
+{
+    size_t length;
+
+    if (shared == NULL)
+        return;
+    length = shared->length;
+    dict->stats.shared_original -= length;
+    if (dedup_put(dict, shared))
+    {
+        dict->stats.shared_values--;
+        dict->stats.shared_stored -= length;
+    }
+}
+
+int dedup_unshare_value(pdictionary dict, pnode node)
+{
+    struct shared_bytes *shared;
+    char *copy;
+
+    if (!(node->flags & NODE_SHARED))
+        return 0;
+    shared = node_shared_value(node);
+    copy = (char*)kvmalloc(shared->length + 1, GFP_KERNEL);
+    if (copy == NULL)
+        return -ENOMEM;
+    memcpy(copy, shared->data, shared->length + 1);
+    dedup_detach_value(node);
+    node->value = copy;
+    node->value_length = shared->length;
+    node->stored_length = shared->length + 1;
+    dedup_put_value(dict, shared);
+    return 0;
+}
+
+//Length of the prefix of a key: up to its last separator
+static size_t dedup_prefix_split(const char *key, size_t length)
+{
+    while (length > 0 && memchr(DEDUP_SEPARATORS, key[length - 1], sizeof(DEDUP_SEPARATORS) - 1) == NULL)
+    {
+        --length;
+    }
+    return length;
+}
+
+void dedup_intern_key(pdictionary dict, pnode node)
+{
+    struct shared_bytes *prefix;
+    size_t split;
+    char *suffix;
+    bool created;
+
+    if (!dedup || node->prefix != NULL)
+        return;
+    split = dedup_prefix_split(node->key, node->key_length);
+    if (split < DEDUP_PREFIX_MIN || !dedup_table(&dict->shared_prefixes))
+        return;
+    suffix = (char*)kmalloc(node->key_length - split + 1, GFP_KERNEL);
+    if (suffix == NULL)
+        return;
+    prefix = dedup_get(dict, dict->shared_prefixes, node->key, split, &created);
+    if (prefix == NULL)
+    {
+        kfree(suffix);
+        return;
+    }
+    if (created)
+    {
+        dict->stats.shared_prefixes++;
+        dict->stats.prefix_stored += split;
+    }
+    prefix->refs++;
+    dict->stats.prefix_original += split;
+    memcpy(suffix, &node->key[split], node->key_length - split);
+    suffix[node->key_length - split] = '\0';
+    kfree(node->key);
+    node->key = suffix;
+    node->prefix = prefix;
+}
+
+void dedup_release(pdictionary dict, pnode node)
+{
+    size_t length;
+
+    dedup_put_value(dict, dedup_detach_value(node));
+    if (node->prefix != NULL)
+    {
+        length = node->prefix->length;
+        dict->stats.prefix_original -= length;
+        if (dedup_put(dict, node->prefix))
+        {
+            dict->stats.shared_prefixes--;
+            dict->stats.prefix_stored -= length;
+        }
+        node->prefix = NULL;
+    }
+}
+
+void dedup_free_table(struct hlist_head *table)
+{
+    struct shared_bytes *shared;
+    struct hlist_node *tmp;
+    size_t i;
+
+    if (table == NULL)
+        return;
+    for (i = 0; i < DEDUP_BUCKETS; ++i)
+    {
+        hlist_for_each_entry_safe(shared, tmp, &table[i], hash_list)
+        {
+            kvfree(shared);
+        }
+    }
+    kvfree(table);
+}
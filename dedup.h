@@ -0,0 +1,72 @@
+#ifndef _MODULE_DEDUP_H
+#define _MODULE_DEDUP_H
+
+#include "dictionary.h"
+
+/// @brief Bytes stored once for many nodes: a value or the start of some keys.
+/// Refcounted by the nodes, protected by the mutex of the dictionary
+struct shared_bytes {
+    struct hlist_node hash_list;
+    u32 hash;
+    unsigned int refs;  //Nodes pointing to it
+    size_t length;
+    char data[];        //length bytes and a '\0'
+};
+
+//Buckets of each table: 2^DEDUP_ORDER
+#define DEDUP_ORDER 12
+//Prefixes shorter than this cost more than they save
+#define DEDUP_PREFIX_MIN 8
+//Characters that end the prefix of a key: "user:42:name" has prefix "user:42:"
+#define DEDUP_SEPARATORS ":/."
+
+//Shared value of a node with NODE_SHARED
+#define node_shared_value(node) ((struct shared_bytes*)((node)->value - offsetof(struct shared_bytes, data)))
+//Length and bytes of the shared start of the key of a node
+#define node_prefix_length(node) ((node)->prefix != NULL ? (node)->prefix->length : 0)
+#define node_prefix(node) ((node)->prefix != NULL ? (node)->prefix->data : "")
+
+/// @brief Points a plain value to the shared copy of the same bytes, creating it if needed.
+/// Does nothing if the dedup param is off or the node is compressed or chunked. Call with the mutex locked
+/// @param dict the dictionary of the node
+/// @param node the node, its private value is freed
+void dedup_share_value(pdictionary dict, pnode node);
+
+/// @brief Gives a node a private copy of its shared value, so that it can be modified. Call with the mutex locked
+/// @param dict the dictionary of the node
+/// @param node the node, nothing is done if its value is not shared
+/// @return zero for success, -ENOMEM if the copy couldn't be allocated (the node is left unchanged)
+int dedup_unshare_value(pdictionary dict, pnode node);
+
+/// @brief Takes the shared value away from a node, leaving it empty, so that a new value can be set
+/// @param node the node
+/// @return the shared value, to give to dedup_put_value or back to dedup_attach_value. NULL if the value was not shared
+struct shared_bytes *dedup_detach_value(pnode node);
+
+/// @brief Gives back to a node the value taken by dedup_detach_value
+/// @param node the node
+/// @param shared what dedup_detach_value returned, can be NULL
+void dedup_attach_value(pnode node, struct shared_bytes *shared);
+
+/// @brief Drops the reference of a node detached from a shared value. Call with the mutex locked
+/// @param dict the dictionary of the node
+/// @param shared what dedup_detach_value returned, can be NULL
+void dedup_put_value(pdictionary dict, struct shared_bytes *shared);
+
+/// @brief Moves the start of the key of a node, up to its last DEDUP_SEPARATORS character, to a shared prefix.
+/// Does nothing if the dedup param is off or the prefix is shorter than DEDUP_PREFIX_MIN. Call with the mutex locked
+/// @param dict the dictionary of the node
+/// @param node the node, its key must be whole
+void dedup_intern_key(pdictionary dict, pnode node);
+
+/// @brief Drops the shared value and the shared prefix of a node that is being deleted. Call with the mutex locked
+/// @param dict the dictionary of the node
+/// @param node the node, its key still needs to be freed
+void dedup_release(pdictionary dict, pnode node);
+
+/// @brief Frees a table and all the shared bytes in it, without updating any dictionary.
+/// Used on the tables taken away by dictionary_free, whose nodes don't release their references
+/// @param table the table, can be NULL
+void dedup_free_table(struct hlist_head *table);
+
+#endif
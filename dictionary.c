@@ -1,26 +1,83 @@
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
 #include "module.h"
+#include "value.h"
+#include "filter.h"
+#include "dedup.h"
+#include "collection.h"
+#include "replica.h"
+#include "hotkeys.h"
+#include "wal.h"
+
+//Cache the nodes of all the dictionaries are allocated from
+static struct kmem_cache *node_cache = NULL;
+//Queue that frees the nodes taken away by dictionary_free
+static struct workqueue_struct *free_queue = NULL;
+
+/// @brief Everything dictionary_free takes away from a dictionary, freed later without its mutex
+struct dictionary_garbage {
+    struct work_struct work;
+    struct list_head nodes;
+    struct arena arena;
+    struct hlist_head *shared_values;
+    struct hlist_head *shared_prefixes;
+    void *compress_workspace;
+    struct list_head tombstones;
+};
+
+/// @brief Append queued by a task waiting for the mutex, applied by the first task that takes it (see dictionary_append)
+struct dictionary_append_request {
+    struct llist_node link;     //Inside the appends of the dictionary
+    const char *key;
+    size_t key_length;
+    const char *str;            //Kernel memory: another task may copy it
+    size_t str_len;
+    struct wal_entry *entry;    //Record of the append, queued or freed by the task that applies it
+    int res;                    //Result of the append, once done
+    u64 lsn;                    //Record of the append in the write-ahead log, once done
+    bool done;                  //Applied, protected by the mutex
+};
+
+//Arena the values of the dictionary are placed in, NULL if they are kvmalloc'd
+#define dictionary_arena(dict) (use_arena ? &(dict)->arena : NULL)
+
 //Useful functions 
 static bool key_check(pnode node, const char *key, size_t key_length)
 {
-    if (strlen(node->key) != key_length)
+    size_t prefix_length = node_prefix_length(node);
+
+    if (node->key_length != key_length)
         return false;
-    return strncmp(node->key, key, key_length) == 0;
+    if (prefix_length != 0 && memcmp(node->prefix->data, key, prefix_length) != 0)
+        return false;
+    return memcmp(node->key, &key[prefix_length], key_length - prefix_length) == 0;
 }
 static struct list_head* dictionary_find_node(pdictionary dict, 
     const char* key, size_t key_length, struct node ** node_obj)
 {
     struct list_head *pos, *q;
+    u32 hash;
     
     if (key_length == 0)
     {
         key_length = strlen(key);
     }
+    hash = filter_hash(key, key_length);
+    if (!filter_may_contain(dict, hash))
+    {
+        //Surely missing: no need to walk the list
+        *node_obj = NULL;
+        return (struct list_head*)NULL;
+    }
     list_for_each_safe(pos, q, &dict->key_value_list)
     {
         *node_obj = list_entry(pos, struct node, list);
-        if (key_check(*node_obj, key, key_length))
+        if ((*node_obj)->key_hash == hash && (*node_obj)->retired == 0 && key_check(*node_obj, key, key_length))
         {
             return pos;
         }
@@ -31,20 +88,32 @@ static struct list_head* dictionary_find_node(pdictionary dict,
 #endif
     return (struct list_head*)NULL;
 }
+//Answers the searches of keys the filter knows are missing without taking the mutex
+static bool dictionary_surely_missing(pdictionary dict, const char* key, size_t key_length)
+{
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    if (filter_may_contain(dict, filter_hash(key, key_length)))
+        return false;
+    atomic64_inc(&dict->filtered_misses);
+    return true;
+}
 static pnode create_node_and_insert(pdictionary dict, const char* key, size_t key_length)
 {
     pnode new_node;
-    size_t ret;
 
     //Create the new element
-    new_node = (pnode)kzalloc(sizeof(struct node), GFP_USER);
+    new_node = (pnode)kmem_cache_zalloc(node_cache, GFP_USER);
     if (new_node == NULL)
     {
         //Failed to allocate node
         return NULL;
     }
-    //No need to call memset(new_node, 0, sizeof(struct node)) since we allocated with kzalloc
+    //No need to call memset(new_node, 0, sizeof(struct node)) since we allocated with kmem_cache_zalloc
     INIT_LIST_HEAD(&new_node->list);
+    INIT_LIST_HEAD(&new_node->chunks);
     if (key_length == 0)
     {
         key_length = strlen(key);
@@ -53,140 +122,413 @@ static pnode create_node_and_insert(pdictionary dict, const char* key, size_t ke
     if (new_node->key == NULL)
     {
         //An error occured
-        kfree(new_node);
+        kmem_cache_free(node_cache, new_node);
         return NULL;
     }
-    ret = copy_from_user(new_node->key, key, key_length);
-    if (ret != 0)
-    {
-        //An error occured: copy_from_user failed
-        if (ret != key_length || memcpy(new_node->key, key, key_length) != new_node->key)
-        {
-            kfree(new_node->key);
-            kfree(new_node);
-            return NULL;
-        } 
-        //A possible cause is that key was not a user space string
-        //Error was fixed with memcpy
-    }
+    //Keys are kernel memory: the search compared them already
+    memcpy(new_node->key, key, key_length);
+    new_node->key_length = key_length;
+    new_node->key_hash = filter_hash(new_node->key, key_length);
+    new_node->digest = VALUE_DIGEST_SEED;
+    new_node->created = dict->sequence;
     list_add(&new_node->list, &dict->key_value_list);
+    list_add_tail(&new_node->changes, &dict->changes);
+    filter_add(dict, new_node->key_hash);
+    dedup_intern_key(dict, new_node);
     return new_node;
 }
-static void delete_dict_entry(struct list_head* entry, pnode node_ptr)
+static void delete_dict_entry(pdictionary dict, struct list_head* entry, pnode node_ptr)
 {
-    printd("Deleting item of key <%s> and value \"%s\"\n", node_ptr->key, node_ptr->value);
+    printd("Deleting item of key <%s%s> and value of %zu bytes\n", node_prefix(node_ptr), node_ptr->key, node_ptr->value_length);
+    if (node_ptr->retired == 0)
+    {
+        //Retired nodes left the filter when they were retired
+        filter_remove(dict, node_ptr->key_hash);
+    }
+    list_del(&node_ptr->changes);
+    dedup_release(dict, node_ptr);
     kfree(node_ptr->key);
-    kfree(node_ptr->value);
+    value_free(node_ptr);
     list_del(entry);
-    kfree(node_ptr);
+    kmem_cache_free(node_cache, node_ptr);
 }
 
-static int update_node(pnode node, const char __user *str, size_t length)
+static int update_node(pdictionary dict, pnode node, const char __user *str, size_t length, bool user)
 {
+    struct shared_bytes *shared;
     int res;
 
-    /*
-    if (node->value == NULL)
-    {
-        node->value = kmalloc(length, GFP_USER);
-    } else {
-        node->value = krealloc(node->value, length, GFP_USER)
-    }
-    */
     if (node == NULL)
         return 1;
-    //if node->value is NULL krealloc behaves the same as kmalloc(length + 1, GFP_USER)    
-    node->value = (char*)krealloc(node->value, length + 1, GFP_USER);
-    if (node->value == NULL)
-        return 1;
-    memset(node->value, 0, ksize(node->value));//The allocated block could be greater than what was requested
-    res = copy_from_user(node->value, str, length);
+    //A shared value is left to the other nodes, and given back if the new one can't be set
+    shared = dedup_detach_value(node);
+    res = value_set(&dict->compress_workspace, dictionary_arena(dict), node, str, length, user);
     if (res != 0)
     {
-        if (res < length)
-        {
-            //copy_from_user failed
-            kfree(node->value);
-            node->value = NULL;
-            return res;
-        }
-        //This might be cause because str was not a user space string (could be a literal for example)
-        if (memcpy(node->value, str, length) == node->value)
+        dedup_attach_value(node, shared);
+        return res;
+    }
+    dedup_put_value(dict, shared);
+    dedup_share_value(dict, node);
+    return 0;
+}
+static int append_node(pdictionary dict, pnode node, const char __user *str, size_t length, bool user)
+{
+    int res;
+
+    //Values that grow are not shared again
+    res = dedup_unshare_value(dict, node);
+    if (res != 0)
+        return res;
+    return value_append(&dict->compress_workspace, dictionary_arena(dict), node, str, length, user);
+}
+static int write_range_node(pdictionary dict, pnode node, size_t offset, const char __user *str, size_t length, bool user)
+{
+    int res;
+
+    //Values changed in place are not shared again
+    res = dedup_unshare_value(dict, node);
+    if (res != 0)
+        return res;
+    return value_write_range(&dict->compress_workspace, dictionary_arena(dict), node, offset, str, length, user);
+}
+//Bytes charged to the dictionary for a node, shared prefixes and values are charged once by dedup.c
+static size_t node_memory(pnode node)
+{
+    return sizeof(struct node) + node->key_length - node_prefix_length(node) + 1 + node->stored_length;
+}
+//Adds the node to the memory and compression counters of the dictionary, call with the mutex locked
+static void node_charge(pdictionary dict, pnode node)
+{
+    dict->memory_used += node_memory(node);
+    if (node->flags & NODE_COMPRESSED)
+    {
+        dict->stats.compressed_values++;
+        dict->stats.compressed_original += node->value_length;
+        dict->stats.compressed_stored += node->stored_length;
+    }
+}
+//Removes the node from the memory and compression counters of the dictionary, call with the mutex locked
+static void node_uncharge(pdictionary dict, pnode node)
+{
+    dict->memory_used -= node_memory(node);
+    if (node->flags & NODE_COMPRESSED)
+    {
+        dict->stats.compressed_values--;
+        dict->stats.compressed_original -= node->value_length;
+        dict->stats.compressed_stored -= node->stored_length;
+    }
+}
+//Checks if the dictionary can grow of needed bytes after freed bytes are released
+static bool memory_available(pdictionary dict, size_t needed, size_t freed)
+{
+    if (dict->memory_limit == 0 || needed <= freed)
+        return true;
+    return dict->memory_used + (needed - freed) <= dict->memory_limit;
+}
+//Stamps the node with the sequence number of the change that is being made, call with the mutex locked
+static void node_changed(pdictionary dict, pnode node)
+{
+    node->created = dict->sequence;
+    list_move_tail(&node->changes, &dict->changes);
+    replica_invalidate(dict, node->key_hash);
+}
+//Remembers that the key of the node is being deleted, call with the mutex locked
+static void add_tombstone(pdictionary dict, pnode node)
+{
+    struct dictionary_tombstone *tombstone;
+    size_t prefix_length = node_prefix_length(node);
+
+    tombstone = (struct dictionary_tombstone*)kmalloc(sizeof(struct dictionary_tombstone) + node->key_length, GFP_KERNEL);
+    if (tombstone == NULL)
+    {
+        //The deltas from before this delete will hold all the keys
+        dict->delta_floor = dict->sequence;
+        return;
+    }
+    tombstone->generation = dict->sequence;
+    tombstone->key_length = node->key_length;
+    memcpy(tombstone->key, node_prefix(node), prefix_length);
+    memcpy(&tombstone->key[prefix_length], node->key, node->key_length - prefix_length);
+    list_add_tail(&tombstone->list, &dict->tombstones);
+    if (++dict->tombstone_count > DICTIONARY_MAX_TOMBSTONES)
+    {
+        //The deltas from before the oldest delete can't list it anymore
+        tombstone = list_first_entry(&dict->tombstones, struct dictionary_tombstone, list);
+        dict->delta_floor = tombstone->generation;
+        list_del(&tombstone->list);
+        kfree(tombstone);
+        dict->tombstone_count--;
+    }
+}
+static void free_tombstones(struct list_head *tombstones)
+{
+    struct dictionary_tombstone *tombstone, *tmp;
+
+    list_for_each_entry_safe(tombstone, tmp, tombstones, list)
+    {
+        kfree(tombstone);
+    }
+    INIT_LIST_HEAD(tombstones);
+}
+//Checks if the node is the version of its key seen at sequence
+#define node_visible(node, seq) ((node)->created <= (seq) && ((node)->retired == 0 || (node)->retired > (seq)))
+//Checks if an open view sees the live node, call with the mutex locked
+static bool node_in_view(pdictionary dict, pnode node)
+{
+    //Views are opened in order: the newest one sees everything the others see
+    return !list_empty(&dict->views) &&
+        node->created <= list_last_entry(&dict->views, struct dictionary_view, list)->sequence;
+}
+//Hides the node from the searches, keeping it for the open views. Call with the mutex locked
+static void retire_node(pdictionary dict, pnode node)
+{
+    node->retired = dict->sequence;
+    filter_remove(dict, node->key_hash);
+    replica_invalidate(dict, node->key_hash);
+    list_move_tail(&node->changes, &dict->versions);
+    dict->stats.versions++;
+}
+//Deletes the node, or only retires it if an open view sees it. Call with the mutex locked
+static void remove_node(pdictionary dict, struct list_head *entry, pnode node)
+{
+    if (node_in_view(dict, node))
+    {
+        retire_node(dict, node);
+        return;
+    }
+    replica_invalidate(dict, node->key_hash);
+    node_uncharge(dict, node);
+    delete_dict_entry(dict, entry, node);
+}
+//Frees the retired nodes no open view sees anymore, call with the mutex locked
+static void reclaim_versions(pdictionary dict)
+{
+    struct dictionary_view *view;
+    pnode node, tmp;
+    bool seen;
+
+    list_for_each_entry_safe(node, tmp, &dict->versions, changes)
+    {
+        seen = false;
+        list_for_each_entry(view, &dict->views, list)
         {
-            //The error was fixed
-            res = 0;
+            if (node_visible(node, view->sequence))
+            {
+                seen = true;
+                break;
+            }
         }
+        if (seen)
+            continue;
+        dict->stats.versions--;
+        node_uncharge(dict, node);
+        delete_dict_entry(dict, &node->list, node);
     }
-    return res;
 }
-static int append_node(pnode node, const char __user *str, size_t length)
+//Gives the key a new node with the value str (written over the current value from offset, if offset is not -1) 
+//and retires the old node, that an open view sees. user tells if str is user memory. Call with the mutex locked
+static int new_version(pdictionary dict, const char* key, size_t key_length, pnode *node_ptr, 
+    const char __user *str, size_t length, loff_t offset, bool user)
 {
+    pnode old = *node_ptr, node;
+    const char *value;
     int res;
-    size_t old_strlen;
-    void* new_offSet;
 
-    old_strlen = strlen(node->value);
-#if 0
-    printd("appennd_node on \"%s\": adding \"%s\" (%d) to \"%s\" (%d)\n", node->key, str, (int)length, node->value, (int)old_strlen);
-#endif
-    node->value = (char*)krealloc(node->value, old_strlen + length + 1, GFP_USER);
-    if (node->value == NULL || ksize(node->value) < old_strlen + length + 1)
-        return 1;
-    new_offSet = &node->value[old_strlen];
-    //Initialize new part to '\0'
-    memset(new_offSet, 0, length + 1);
-    res = copy_from_user(new_offSet, str, length);
-    if (res != 0)
+    node = create_node_and_insert(dict, key, key_length);
+    if (node == NULL)
+        return -ENOMEM;
+    if (offset >= 0)
     {
-        if (res < length)
+        value = node_value_get(old);
+        res = value != NULL ? update_node(dict, node, value, old->value_length, false) : -ENOMEM;
+        node_value_put(old, value);
+        if (res == 0)
         {
-            //copy_from user failed
-            kfree(node->value);
-            node->value = NULL;
-            return res;
+            res = write_range_node(dict, node, offset, str, length, user);
         }
-        //This might be cause because str was not a user space string (could be a literal for example)
-        if (memcpy(new_offSet, str, length) == new_offSet)
+    } else {
+        res = update_node(dict, node, str, length, user);
+    }
+    if (res != 0)
+    {
+        delete_dict_entry(dict, &node->list, node);
+        return res;
+    }
+    retire_node(dict, old);
+    node_charge(dict, node);
+    *node_ptr = node;
+    return 0;
+}
+static void free_watch(pwatch watch)
+{
+    if (watch->eventfd != NULL)
+    {
+        eventfd_ctx_put(watch->eventfd);
+    }
+    kfree(watch->key);
+    kfree(watch);
+}
+//Moves the watch to its watcher and notifies it, call with the mutex locked
+static void complete_watch(pdictionary dict, pwatch watch)
+{
+    struct dictionary_watcher *watcher = watch->watcher;
+
+    list_del(&watch->list);
+    if (watcher == NULL)
+    {
+        //A task sleeping inside dictionary_find_or_wait: dictionary_wake_waiting will wake it
+        WRITE_ONCE(watch->done, true);
+        return;
+    }
+    watcher->registered--;
+    spin_lock(&watcher->lock);
+    list_add_tail(&watch->list, &watcher->ready);
+    spin_unlock(&watcher->lock);
+    if (watch->eventfd != NULL)
+    {
+        eventfd_signal(watch->eventfd);
+    }
+    wake_up_interruptible_poll(&watcher->poll_queue, EPOLLIN | EPOLLRDNORM);
+}
+//Completes the watches waiting for the key of a node that was just created, call with the mutex locked
+static void dictionary_complete_watches(pdictionary dict, pnode node)
+{
+    pwatch watch, tmp;
+
+    list_for_each_entry_safe(watch, tmp, &dict->watch_list, list)
+    {
+        if (key_check(node, watch->key, watch->key_length))
         {
-            //The error was fixed: memcpy succeded in copying str to the node
-            res = 0;
+            complete_watch(dict, watch);
         }
     }
-    return res;
 }
-static bool dictionary_wait_for_key_callback(pdictionary dict, const char* key, size_t key_length, pnode *node_ptr)
+#define dictionary_wake_waiting(dict) wake_up_all(&dict->queue)
+//Searches the node of key and, if it's missing, waits until it is created or the timeout expires.
+//Call with the mutex locked: on success the mutex is still locked, otherwise it has been unlocked
+static int dictionary_find_or_wait(pdictionary dict, const char* key, size_t key_length, 
+    u64 timeout_us, unsigned int flags, pnode *node_ptr)
 {
-    bool res;
+    struct dictionary_watch waiter;
+    ktime_t deadline = 0, remaining;
+    int res;
 
-    res = dictionary_lock(dict);
-    //If dictionary_lock fails we can't even search on the dictionary, false is returned
-    if (res)
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    if (timeout_us != 0)
+    {
+        //The deadline is fixed once: wake ups for keys deleted again do not extend it
+        deadline = ktime_add_us(ktime_get(), timeout_us);
+    }
+    while (dictionary_find_node(dict, key, key_length, node_ptr) == NULL)
     {
-        res = dictionary_find_node(dict, key, key_length, node_ptr) != NULL;
-        if (!res)
+        //Key not created, wait here
+        dict->stats.misses++;
+        if (flags & DICTIONARY_NONBLOCK)
+        {
+            //The caller does not want to wait for the key
+            dictionary_unlock(dict);
+            return -EAGAIN;
+        }
+        printd("Key not found in dictionary at the moment.\nTask will be set to INTERRUPTIBLE and put in a waitqueue.\n");
+        //The task waits like a watch without watcher: the writer that creates the key marks it as done,
+        //so a wake up never needs to search the dictionary to know if the key is there
+        memset(&waiter, 0, sizeof(struct dictionary_watch));
+        waiter.key = (char*)key;
+        waiter.key_length = key_length;
+        list_add_tail(&waiter.list, &dict->watch_list);
+        dictionary_unlock(dict);
+
+        if (timeout_us != 0)
+        {
+            //hrtimer based wait: precise also for timeouts shorter than a jiffy
+            remaining = ktime_sub(deadline, ktime_get());
+            res = ktime_to_ns(remaining) > 0 ? 
+                wait_event_interruptible_hrtimeout(dict->queue, READ_ONCE(waiter.done), remaining) : -ETIME;
+        } else {
+            //We will wait until the task is killed, no time limit
+            res = wait_event_interruptible(dict->queue, READ_ONCE(waiter.done));
+        }
+
+        //The waiter lives on this stack: it must leave the list even if a signal is pending
+        mutex_lock(&dict->mutex);
+        if (!waiter.done)
         {
-            //Node not found, no further need to operate on the dictionary
+            list_del(&waiter.list);
             dictionary_unlock(dict);
+            if (res == -ETIME)
+            {
+                printd("Timeout of %llu usecs passed without the key being generated.\nTask will be killed\n", timeout_us);
+            } else {
+                printd("An error happened.\nTask was probably killed\n");
+            }
+            return -EAGAIN;
         }
-        // else {
-            //The node we were waiting for has just been created.
-            //To avoid race-conditions the dictionary is not unlocked, since the node has just been loaded too.
-            //The Task that is waiting will later free the mutex when has finished operations
-        //}
+        //The key was created: one search finds it, unless it has already been deleted again
     }
-    return res;
+    return 0;
 }
-#define dictionary_wait_for_key(dict, key, key_lenght, node_ptr) \
-    (wait_event_interruptible(dict->queue, dictionary_wait_for_key_callback(dict, key, key_length, &node_ptr)) == 0)
-#define dictionary_wait_for_key_timeout(dict, key, key_lenght, node_ptr, timeout) \
-    (wait_event_timeout(dict->queue, dictionary_wait_for_key_callback(dict, key, key_length, &node_ptr), HZ * timeout / 1000) > 0)
-#define dictionary_wake_waiting(dict) wake_up_all(&dict->queue)
 /*********************************************/
 /*                                           */
 /*          Header functions body            */
 /*                                           */
 /*********************************************/
 
+//Cache init function: called once before any dictionary is used
+int dictionary_cache_init(void)
+{
+    node_cache = kmem_cache_create("dictionary_node", sizeof(struct node), 0, 0, NULL);
+    if (node_cache == NULL)
+    {
+        return -ENOMEM;
+    }
+    free_queue = alloc_workqueue("dictionary_free", WQ_UNBOUND, 0);
+    if (free_queue == NULL)
+    {
+        kmem_cache_destroy(node_cache);
+        node_cache = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+//Cache destroy function: called once after all the dictionaries have been freed
+void dictionary_cache_destroy(void)
+{
+    //Waits for the nodes still being freed
+    destroy_workqueue(free_queue);
+    free_queue = NULL;
+    kmem_cache_destroy(node_cache);
+    node_cache = NULL;
+}
+
+//Moves the live values of the sparse segments of the arena, queued by dictionary_schedule_compaction
+static void dictionary_compact_work(struct work_struct *work)
+{
+    pdictionary dict = container_of(work, struct dictionary_base, compact_work);
+
+    mutex_lock(&dict->mutex);
+    //The views read the values without the mutex: nothing can move while one is open
+    if (list_empty(&dict->views))
+    {
+        arena_compact(&dict->arena);
+    }
+    //Not dictionary_unlock: a compaction that ran out of memory is not queued again at once
+    mutex_unlock(&dict->mutex);
+}
+
+void dictionary_schedule_compaction(pdictionary dict)
+{
+    //Closing the last view unlocks the mutex again
+    if (list_empty(&dict->views))
+    {
+        queue_work(free_queue, &dict->compact_work);
+    }
+}
+
 //Init functon: the first one to be called
 int dictionary_init(pdictionary dict)
 {
@@ -197,39 +539,106 @@ int dictionary_init(pdictionary dict)
     mutex_init(&dict->mutex);
     init_waitqueue_head(&dict->queue);
     INIT_LIST_HEAD(&dict->key_value_list);
+    INIT_LIST_HEAD(&dict->watch_list);
+    INIT_LIST_HEAD(&dict->namespace_list);
+    dict->memory_used = 0;
+    dict->memory_limit = 0;
+    memset(&dict->stats, 0, sizeof(struct dictionary_stats));
+    dict->compress_workspace = NULL;
+    dict->shared_values = NULL;
+    dict->shared_prefixes = NULL;
+    dict->sequence = 0;
+    INIT_LIST_HEAD(&dict->views);
+    INIT_LIST_HEAD(&dict->versions);
+    INIT_LIST_HEAD(&dict->changes);
+    INIT_LIST_HEAD(&dict->tombstones);
+    init_llist_head(&dict->appends);
+    dict->tombstone_count = 0;
+    dict->delta_floor = 0;
+    arena_init(&dict->arena);
+    INIT_WORK(&dict->compact_work, dictionary_compact_work);
+    filter_init(dict);
+    replica_init(dict);
     return 0;
 }
 
+void dictionary_destroy(pdictionary dict)
+{
+    if (dict == NULL)
+        return;
+    cancel_work_sync(&dict->compact_work);
+    hotkeys_forget(dict);
+    arena_destroy(&dict->arena);
+    filter_destroy(dict);
+    replica_destroy(dict);
+}
+
 //Write function
 int dictionary_write(pdictionary dict, 
     const char* key, size_t key_length,
-    const char* str, size_t str_len)
+    const char* str, size_t str_len, unsigned int flags)
 {
     struct list_head *node_ref;
     struct node* node_ptr;
+    struct wal_entry *entry;
+    u64 lsn = 0;
     int res = 0;
-    bool created_new = false;
+    bool created_new = false, keep_old;
 
     if (dict == NULL)
         return 1;
-    if (!dictionary_lock(dict))
+    hotkeys_record(dict, key, key_length, HOTKEYS_WRITE);
+    if ((str_len == 0 || str == NULL) && dictionary_surely_missing(dict, key, key_length))
     {
+        //Trying to delete a non-existing key
         return 1;
     }
+    //The record is built before the mutex is taken
+    entry = wal_prepare(dict, str_len == 0 || str == NULL ? WAL_DELETE : WAL_SET, key, key_length, 
+        str, str == NULL ? 0 : str_len, 0, flags);
+    if (IS_ERR(entry))
+        return (int)PTR_ERR(entry);
+    if (entry != NULL && str_len != 0 && str != NULL)
+    {
+        //The value is copied from the record, already in kernel memory
+        str = wal_entry_value(entry);
+        flags |= DICTIONARY_KERNEL;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        wal_discard(entry);
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : 1;
+    }
     ////////////////////////////////////////
     //Mutex is locked from now on
+    dict->sequence++;
     node_ref = dictionary_find_node(dict, key, key_length, &node_ptr);
+    //The value an open view sees stays where it is, the new one goes into a new node
+    keep_old = node_ptr != NULL && node_in_view(dict, node_ptr);
     if (str_len == 0 || str == NULL)
     {
         //length of 0 means delete the node if present
         if (node_ptr != NULL)
         {
             //Delete the node here
-            delete_dict_entry(node_ref, node_ptr);
+            add_tombstone(dict, node_ptr);
+            remove_node(dict, node_ref, node_ptr);
+            dict->stats.deletes++;
         } else {
             //Trying to delete a non-existing key
             res = 1;
+            dict->stats.misses++;
         }
+    } else if (!memory_available(dict, 
+        str_len + 1 + (node_ptr == NULL || keep_old ? sizeof(struct node) + key_length + 1 : 0), 
+        node_ptr != NULL && !keep_old ? node_ptr->stored_length : 0))
+    {
+        //The namespace would go over its memory limit
+        res = -ENOSPC;
+    } else if (keep_old)
+    {
+        res = new_version(dict, key, key_length, &node_ptr, str, str_len, -1, !(flags & DICTIONARY_KERNEL));
+        dict->stats.writes++;
     } else {
         if (node_ptr == NULL)
         {
@@ -237,9 +646,36 @@ int dictionary_write(pdictionary dict,
             node_ptr = create_node_and_insert(dict, key, key_length);
             created_new = node_ptr != NULL;
             printd("Creting item of key <%s> and value \"%s\".\n", key, str);
+        } else {
+            node_uncharge(dict, node_ptr);
         }
         //Values are assigned here
-        res = update_node(node_ptr, str, str_len);
+        res = update_node(dict, node_ptr, str, str_len, !(flags & DICTIONARY_KERNEL));
+        if (created_new && res != 0)
+        {
+            //The value couldn't be copied: no key is left without one
+            delete_dict_entry(dict, &node_ptr->list, node_ptr);
+            node_ptr = NULL;
+            created_new = false;
+        }
+        if (node_ptr != NULL)
+        {
+            //A failed write leaves the value as it was: the deltas have nothing to list
+            if (res == 0)
+                node_changed(dict, node_ptr);
+            node_charge(dict, node_ptr);
+        }
+        if (created_new && res == 0)
+        {
+            dictionary_complete_watches(dict, node_ptr);
+        }
+        dict->stats.writes++;
+    }
+    if (res == 0)
+    {
+        lsn = wal_queue(entry);
+    } else {
+        wal_discard(entry);
     }
     //End of the write operations
     ////////////////////////////////////////
@@ -249,249 +685,1040 @@ int dictionary_write(pdictionary dict,
     {
         dictionary_wake_waiting(dict);
     }
+    wal_wait_flags(res, lsn, flags);
     return res;
 }
 
-//Append function
-int dictionary_append(pdictionary dict, 
-    const char* key, size_t key_length,
-    const char* str, size_t str_len)
+//Appends str to the value of key, call with the mutex locked and dict->sequence already incremented.
+//count is the number of appends joined in str, user tells if str is user memory, *created_new is set if the key
+//is created. The record of the append is left to the caller
+static int append_locked(pdictionary dict, const char* key, size_t key_length, const char* str, size_t str_len, 
+    size_t count, bool user, bool *created_new)
 {
-    struct list_head *node_ref;
     struct node* node_ptr;
     int res;
+    bool keep_old;
 
-    if (dict == NULL)
-        return 1;
-    if (str_len == 0 || str == NULL)
+    dictionary_find_node(dict, key, key_length, &node_ptr);
+    //The value an open view sees stays where it is, the longer one goes into a new node
+    keep_old = node_ptr != NULL && node_in_view(dict, node_ptr);
+    if (node_ptr != NULL && (node_ptr->flags & NODE_TYPED))
     {
-        //Bad call
-        return 1;
-    }
-    if (!dictionary_lock(dict))
+        //Lists, sets and hashes change only through dictionary_typed
+        res = -EMEDIUMTYPE;
+    } else if (!memory_available(dict, 
+        str_len + (node_ptr == NULL ? sizeof(struct node) + key_length + 2 : node_ptr->value_length + 1) +
+            (keep_old ? sizeof(struct node) + key_length + 1 : 0), 
+        node_ptr != NULL && !keep_old ? node_ptr->stored_length : 0))
     {
-        return 1;
-    }
-    ////////////////////////////////////////
-    //Mutex is locked from now on
-    node_ref = dictionary_find_node(dict, key, key_length, &node_ptr);
-    if (node_ptr == NULL)
+        //The namespace would go over its memory limit
+        res = -ENOSPC;
+    } else if (keep_old)
+    {
+        res = new_version(dict, key, key_length, &node_ptr, str, str_len, node_ptr->value_length, user);
+        dict->stats.appends += count;
+    } else if (node_ptr == NULL)
     {
         //Node needs to be created
         node_ptr = create_node_and_insert(dict, key, key_length);
-        res = update_node(node_ptr, str, str_len);
+        res = update_node(dict, node_ptr, str, str_len, user);
+        if (res == 0)
+        {
+            *created_new = true;
+            dictionary_complete_watches(dict, node_ptr);
+        } else if (node_ptr != NULL)
+        {
+            //The value couldn't be copied: no key is left without one
+            delete_dict_entry(dict, &node_ptr->list, node_ptr);
+            node_ptr = NULL;
+        }
     } else {
         //Node exists and we append data to it
-        res = append_node(node_ptr, str, str_len);
+        node_uncharge(dict, node_ptr);
+        res = append_node(dict, node_ptr, str, str_len, user);
+        if (res == 0)
+            node_changed(dict, node_ptr);
+    }
+    if (res != -ENOSPC && res != -EMEDIUMTYPE && !keep_old)
+    {
+        if (node_ptr != NULL)
+        {
+            node_charge(dict, node_ptr);
+        }
+        dict->stats.appends += count;
     }
-    //End of the write operations
-    ////////////////////////////////////////
-    //Unlock the mutex here
-    dictionary_unlock(dict);
     return res;
 }
 
-//Read to buffer function
-ssize_t dictionary_read(
-    pdictionary dict, 
-    const char* key, size_t key_length, 
-    char __user *buffer, size_t maxsize, 
-    uint timeout, loff_t *ppos)
-{
-    pnode node_ptr;
-    ssize_t res;
-    size_t value_length;
+//Checks if two queued appends are on the same key
+#define append_same_key(a, b) ((a)->key_length == (b)->key_length && memcmp((a)->key, (b)->key, (a)->key_length) == 0)
 
-    // Check for invalid parameters
-    if (dict == NULL || buffer == NULL || maxsize == 0 || ppos == NULL)
-        return -EINVAL;
+//Applies the appends queued on the dictionary in the order they were queued. A run of appends to the same key is
+//joined: one search, one reallocation and one change for all of them. Call with the mutex locked and the flags
+//of the task that holds it, returns true if a key was created
+static bool dictionary_combine_appends(pdictionary dict, unsigned int flags)
+{
+    struct llist_node *pending;
+    struct dictionary_append_request *first, *last, *request, *next;
+    size_t length, count, offset;
+    char *joined;
+    int res = 0;
+    bool created_new = false, one_by_one;
 
-    // Try to acquire the mutex: if a signal interrupts exit
-    if (!dictionary_lock(dict))
+    pending = llist_reverse_order(llist_del_all(&dict->appends));
+    while (pending != NULL)
     {
-        return -EAGAIN;
-    }
+        first = last = llist_entry(pending, struct dictionary_append_request, link);
+        length = first->str_len;
+        count = 1;
+        while (last->link.next != NULL)
+        {
+            request = llist_entry(last->link.next, struct dictionary_append_request, link);
+            if (!append_same_key(first, request))
+                break;
+            length += request->str_len;
+            last = request;
+            count++;
+        }
+        //The run becomes a list of its own
+        pending = last->link.next;
+        last->link.next = NULL;
 
-    //
-    // Mutex is locked from now on
-    //
-    do {
-        if (dictionary_find_node(dict, key, key_length, &node_ptr) == NULL)
+        //Without memory at once the run is applied one append at a time
+        joined = count > 1 ? (char*)kvmalloc(length, (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL) : NULL;
+        one_by_one = joined == NULL;
+        if (joined != NULL)
         {
-            //Key not created, wait here
-            printd("Key not found in dictionary at the moment.\nTask will be set to UNINTERRUPIBLE and put in a waitqueue.\n");
-            dictionary_unlock(dict);
-            if (timeout != 0)
+            offset = 0;
+            llist_for_each_entry(request, &first->link, link)
             {
-                //We will wait with a timeout
-                if (!dictionary_wait_for_key_timeout(dict, key, key_length, node_ptr, timeout))
-                {
-                    printk(KERN_ALERT "Timeout of %d msecs passed without the key being generated.\nTask will be killed\n", (int)timeout);
-                    return -EAGAIN;
-                }
-            } else {
-                //We will wait until the task is killed, no time limit
-                if (!dictionary_wait_for_key(dict, key, key_length, node_ptr))
-                {
-                    printk(KERN_ALERT "An error happened.\nTask was probably killed\n");
-                    return -EAGAIN;
-                }
+                memcpy(&joined[offset], request->str, request->str_len);
+                offset += request->str_len;
             }
-            //If we are here it means that we have found the element and also we have control over the mutex
+            dict->sequence++;
+            res = append_locked(dict, first->key, first->key_length, joined, length, count, false, &created_new);
+            kvfree(joined);
+            //Appends that fit one at a time are not failed because of the others
+            one_by_one = res == -ENOSPC || res == -ENOMEM;
         }
-    } while (node_ptr == NULL);
-
-    // We know where to read
-    value_length = strlen(node_ptr->value);
-    res = simple_read_from_buffer(buffer, maxsize, ppos, node_ptr->value, value_length);
-
-    // The read failed but it could be caused by output buffer not in user's space
-    if (res == -EFAULT && tests)
-    {
-        // No byte was read
-        // Retry with memcpy: the output buffer could be kernel space (maybe we are testing)
-        value_length = min(value_length, maxsize);
-        if (memcpy(buffer, node_ptr->value, value_length) == buffer)
+        llist_for_each_entry_safe(request, next, &first->link, link)
         {
-            //Error has been fixed: the problem was the testing buffer
-            res = (ssize_t)value_length;
-            *ppos += value_length;
+            if (one_by_one)
+            {
+                dict->sequence++;
+                res = append_locked(dict, request->key, request->key_length, request->str, request->str_len, 1, false, &created_new);
+            }
+            //Every append keeps the record it built: nothing is allocated for the run
+            if (res == 0)
+            {
+                request->lsn = wal_queue(request->entry);
+            } else {
+                wal_discard(request->entry);
+            }
+            request->res = res;
+            //The task of the request reads it once it has the mutex
+            request->done = true;
         }
     }
-    
-    //
-    // End of the read operations: Unlock the mutex here
-    //
-    dictionary_unlock(dict);
-    return res;
+    return created_new;
 }
 
-//Read all keys to buffer function
-ssize_t dictionary_read_all(pdictionary dict, char __user *buffer, size_t maxsize, loff_t *ppos)
+//Append function
+int dictionary_append(pdictionary dict, 
+    const char* key, size_t key_length,
+    const char* str, size_t str_len, unsigned int flags)
 {
-    struct list_head *pos, *q;
-    pnode temp;
-    size_t node_key_size;
-    size_t node_value_size;
-    const char* print_helpers = "<>: \"\"\n";
-    ssize_t index = 0;
+    struct dictionary_append_request request;
+    struct wal_entry *entry;
+    char *copy = NULL;
+    u64 lsn = 0;
+    int res;
+    bool created_new = false;
+
+    if (dict == NULL)
+        return 1;
+    if (str_len == 0 || str == NULL)
+    {
+        //Bad call
+        return 1;
+    }
+    hotkeys_record(dict, key, key_length, HOTKEYS_WRITE);
+    //The record is built before the mutex is taken
+    entry = wal_prepare(dict, WAL_APPEND, key, key_length, str, str_len, 0, flags);
+    if (IS_ERR(entry))
+        return (int)PTR_ERR(entry);
+    if (entry != NULL)
+    {
+        //The value is copied from the record, already in kernel memory
+        str = wal_entry_value(entry);
+        flags |= DICTIONARY_KERNEL;
+    }
+    if (!combine_appends)
+    {
+        if (!dictionary_lock_flags(dict, flags))
+        {
+            wal_discard(entry);
+            return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : 1;
+        }
+        ////////////////////////////////////////
+        //Mutex is locked from now on
+        dict->sequence++;
+        res = append_locked(dict, key, key_length, str, str_len, 1, !(flags & DICTIONARY_KERNEL), &created_new);
+        if (res == 0)
+        {
+            lsn = wal_queue(entry);
+        } else {
+            wal_discard(entry);
+        }
+    } else {
+        if (!(flags & DICTIONARY_KERNEL))
+        {
+            //The combiner may be another task, in another address space: it gets a kernel copy of the value
+            copy = (char*)kvmalloc(str_len, GFP_KERNEL);
+            if (copy == NULL)
+                return -ENOMEM;
+            if (copy_from_user(copy, (const char __user*)str, str_len) != 0)
+            {
+                kvfree(copy);
+                return -EFAULT;
+            }
+            str = copy;
+        }
+        request.key = key;
+        request.key_length = key_length != 0 ? key_length : strlen(key);
+        request.str = str;
+        request.str_len = str_len;
+        request.entry = entry;
+        request.res = 0;
+        request.lsn = 0;
+        request.done = false;
+        if (flags & DICTIONARY_NONBLOCK)
+        {
+            //Queued only once the mutex is taken: a request that can fail must not be seen by a combiner
+            if (!dictionary_lock_flags(dict, flags))
+            {
+                wal_discard(entry);
+                kvfree(copy);
+                return -EAGAIN;
+            }
+            llist_add(&request.link, &dict->appends);
+        } else {
+            //Not interruptible: the request lives on this stack and stays queued until someone applies it
+            llist_add(&request.link, &dict->appends);
+            mutex_lock(&dict->mutex);
+        }
+        ////////////////////////////////////////
+        //Mutex is locked from now on
+        if (!request.done)
+        {
+            //No one applied it meanwhile: this task applies all the queued appends, its own included
+            created_new = dictionary_combine_appends(dict, flags);
+        }
+        res = request.res;
+        lsn = request.lsn;
+    }
+    //End of the write operations
+    ////////////////////////////////////////
+    //Unlock the mutex here
+    dictionary_unlock(dict);
+    //Applied by now, by this task or by the combiner
+    kvfree(copy);
+    if (created_new)
+    {
+        dictionary_wake_waiting(dict);
+    }
+    wal_wait_flags(res, lsn, flags);
+    return res;
+}
+
+//Range write function
+int dictionary_write_range(pdictionary dict, 
+    const char* key, size_t key_length, size_t offset,
+    const char* str, size_t str_len, unsigned int flags)
+{
+    struct node* node_ptr;
+    struct wal_entry *entry;
+    size_t end;
+    u64 lsn = 0;
+    int res;
+    bool created_new = false, keep_old;
 
     if (dict == NULL)
+        return 1;
+    end = offset + str_len;
+    if (str_len == 0 || str == NULL || end < offset)
+    {
+        //Bad call
+        return 1;
+    }
+    hotkeys_record(dict, key, key_length, HOTKEYS_WRITE);
+    //The record is built before the mutex is taken
+    entry = wal_prepare(dict, WAL_RANGE, key, key_length, str, str_len, offset, flags);
+    if (IS_ERR(entry))
+        return (int)PTR_ERR(entry);
+    if (entry != NULL)
+    {
+        //The value is copied from the record, already in kernel memory
+        str = wal_entry_value(entry);
+        flags |= DICTIONARY_KERNEL;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        wal_discard(entry);
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : 1;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    dictionary_find_node(dict, key, key_length, &node_ptr);
+    if (offset > (node_ptr != NULL ? node_ptr->value_length : 0))
+    {
+        //The range would leave a hole in the value
+        dictionary_unlock(dict);
+        wal_discard(entry);
+        return -EINVAL;
+    }
+    dict->sequence++;
+    //The value an open view sees stays where it is, the changed one goes into a new node
+    keep_old = node_ptr != NULL && node_in_view(dict, node_ptr);
+    if (node_ptr != NULL && (node_ptr->flags & NODE_TYPED))
+    {
+        //Lists, sets and hashes change only through dictionary_typed
+        res = -EMEDIUMTYPE;
+    } else if (!memory_available(dict, 
+        (node_ptr == NULL ? sizeof(struct node) + key_length + 2 + end : max(end, node_ptr->value_length) + 1) +
+            (keep_old ? sizeof(struct node) + key_length + 1 : 0), 
+        node_ptr != NULL && !keep_old ? node_ptr->stored_length : 0))
+    {
+        //The namespace would go over its memory limit
+        res = -ENOSPC;
+    } else if (keep_old)
+    {
+        res = new_version(dict, key, key_length, &node_ptr, str, str_len, offset, !(flags & DICTIONARY_KERNEL));
+        dict->stats.writes++;
+    } else if (node_ptr == NULL)
+    {
+        //Writing from the start of a missing key is a plain write
+        node_ptr = create_node_and_insert(dict, key, key_length);
+        res = update_node(dict, node_ptr, str, str_len, !(flags & DICTIONARY_KERNEL));
+        if (res == 0)
+        {
+            created_new = true;
+            dictionary_complete_watches(dict, node_ptr);
+        } else if (node_ptr != NULL)
+        {
+            //The value couldn't be copied: no key is left without one
+            delete_dict_entry(dict, &node_ptr->list, node_ptr);
+            node_ptr = NULL;
+        }
+    } else {
+        //Only the bytes of the range are written
+        node_uncharge(dict, node_ptr);
+        res = write_range_node(dict, node_ptr, offset, str, str_len, !(flags & DICTIONARY_KERNEL));
+        if (res == 0)
+            node_changed(dict, node_ptr);
+    }
+    if (res != -ENOSPC && res != -EMEDIUMTYPE && !keep_old)
+    {
+        if (node_ptr != NULL)
+        {
+            node_charge(dict, node_ptr);
+        }
+        dict->stats.writes++;
+    }
+    if (res == 0)
+    {
+        lsn = wal_queue(entry);
+    } else {
+        wal_discard(entry);
+    }
+    //End of the write operations
+    ////////////////////////////////////////
+    //Unlock the mutex here
+    dictionary_unlock(dict);
+    if (created_new)
+    {
+        dictionary_wake_waiting(dict);
+    }
+    wal_wait_flags(res, lsn, flags);
+    return res;
+}
+
+//Changes the typed value of the key: creates it if node is NULL, gives it a new version if an open view sees it.
+//Call with the mutex locked
+static long typed_change(pdictionary dict, const char *key, size_t key_length, pnode node, 
+    struct dictionary_typed_op *op, bool *created_new)
+{
+    pnode old = node;
+    long res;
+
+    if (node == NULL || node_in_view(dict, node))
+    {
+        node = create_node_and_insert(dict, key, key_length);
+        if (node == NULL)
+            return -ENOMEM;
+        res = old != NULL ? collection_copy(node, old) : collection_init(node, collection_op_type(op->op));
+        if (res == 0)
+        {
+            res = collection_apply(node, op);
+        }
+        if (res < 0)
+        {
+            delete_dict_entry(dict, &node->list, node);
+            return res;
+        }
+        if (old != NULL)
+        {
+            retire_node(dict, old);
+        } else {
+            *created_new = true;
+        }
+    } else {
+        node_uncharge(dict, node);
+        res = collection_apply(node, op);
+    }
+    node_charge(dict, node);
+    if (node_collection(node)->count == 0)
+    {
+        //Like an empty string, an empty list, set or hash deletes the key
+        add_tombstone(dict, node);
+        remove_node(dict, &node->list, node);
+        dict->stats.deletes++;
+        return res;
+    }
+    if (res >= 0)
+    {
+        node_changed(dict, node);
+    }
+    if (*created_new)
     {
-        printk(KERN_ERR "dictionary_read_all: dictionary was NULL!\n");
+        dictionary_complete_watches(dict, node);
+    }
+    return res;
+}
+
+//Typed value function
+long dictionary_typed(pdictionary dict, const char *key, size_t key_length, struct dictionary_typed_op *op, unsigned int flags)
+{
+    pnode node_ptr;
+    unsigned int type;
+    long res;
+    bool created_new = false;
+
+    if (dict == NULL || key == NULL || op == NULL || op->op == 0 || op->op > DICTIONARY_TYPED_COUNT)
         return -EINVAL;
+    op->result = NULL;
+    op->result_length = 0;
+    type = collection_op_type(op->op);
+    if (type != 0 && op->op != DICTIONARY_LIST_POP_HEAD && op->op != DICTIONARY_LIST_POP_TAIL && op->member == NULL)
+        return -EINVAL;
+    hotkeys_record(dict, key, key_length, collection_op_reads(op->op) ? HOTKEYS_READ : HOTKEYS_WRITE);
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -EINTR;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    dictionary_find_node(dict, key, key_length, &node_ptr);
+    if (node_ptr != NULL && (!(node_ptr->flags & NODE_TYPED) || (type != 0 && node_collection(node_ptr)->type != type)))
+    {
+        //The key holds another type of value
+        res = -EMEDIUMTYPE;
+    } else if (collection_op_reads(op->op) || (node_ptr == NULL && !collection_op_grows(op->op)))
+    {
+        //Nothing changes: reads, and pops or removes on a missing key
+        if (node_ptr != NULL)
+        {
+            res = collection_apply(node_ptr, op);
+        } else {
+            res = op->op == DICTIONARY_LIST_POP_HEAD || op->op == DICTIONARY_LIST_POP_TAIL ? -ENOENT : 0;
+            dict->stats.misses++;
+        }
+        dict->stats.reads++;
+    } else {
+        dict->sequence++;
+        if (collection_op_grows(op->op) && !memory_available(dict, collection_op_memory(op) + 
+            (node_ptr == NULL ? sizeof(struct node) + key_length + 1 + sizeof(struct value_collection) : 0) +
+            (node_ptr != NULL && node_in_view(dict, node_ptr) ? node_memory(node_ptr) : 0), 0))
+        {
+            //The namespace would go over its memory limit
+            res = -ENOSPC;
+        } else {
+            res = typed_change(dict, key, key_length, node_ptr, op, &created_new);
+            dict->stats.writes++;
+        }
+    }
+    //End of the operation
+    ////////////////////////////////////////
+    //Unlock the mutex here
+    dictionary_unlock(dict);
+    if (created_new)
+    {
+        dictionary_wake_waiting(dict);
     }
-    if (buffer == NULL)
+    return res;
+}
+
+//Start of the reads of a key: counts the access and searches the copy of the value on the NUMA node of the task.
+//Returns the copy, to read without the mutex and give back with replica_put, NULL to read the dictionary,
+//ERR_PTR(-EAGAIN) if the read is non blocking and the key is surely missing
+static struct replica_entry* read_start(pdictionary dict, const char *key, size_t key_length, unsigned int flags)
+{
+    hotkeys_record(dict, key, key_length, HOTKEYS_READ);
+    if ((flags & DICTIONARY_NONBLOCK) && dictionary_surely_missing(dict, key, key_length))
     {
-        printk(KERN_ERR "dictionary_read_all: output buffer was NULL!\n");
+        //Non blocking reads don't wait for missing keys
+        return ERR_PTR(-EAGAIN);
+    }
+    return replica_get(dict, key, key_length);
+}
+
+//Read to buffer function
+ssize_t dictionary_read(
+    pdictionary dict, 
+    const char* key, size_t key_length, 
+    char __user *buffer, size_t maxsize, 
+    u64 timeout_us, unsigned int flags, loff_t *ppos)
+{
+    pnode node_ptr;
+    struct replica_entry *entry;
+    ssize_t res;
+
+    // Check for invalid parameters
+    if (dict == NULL || buffer == NULL || maxsize == 0 || ppos == NULL)
         return -EINVAL;
+
+    entry = read_start(dict, key, key_length, flags);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    if (entry != NULL)
+    {
+        res = replica_read(entry, buffer, maxsize, ppos, !(flags & DICTIONARY_KERNEL));
+        replica_put(entry);
+        return res;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return -EAGAIN;
+    }
+
+    //
+    // Mutex is locked from now on
+    //
+    res = dictionary_find_or_wait(dict, key, key_length, timeout_us, flags, &node_ptr);
+    if (res != 0)
+    {
+        //The mutex has already been unlocked
+        return res;
     }
+
+    // We know where to read
+    dict->stats.reads++;
+    res = value_read(node_ptr, buffer, maxsize, ppos, !(flags & DICTIONARY_KERNEL));
+    replica_fill(dict, key, key_length, node_ptr, flags);
     
-    if (!dictionary_lock(dict))
+    //
+    // End of the read operations: Unlock the mutex here
+    //
+    dictionary_unlock(dict);
+    return res;
+}
+
+//Checks if the value of the node is the one the caller has, and gives the caller its version and digest
+static bool node_matches(pnode node, struct dictionary_condition *condition)
+{
+    bool matches;
+
+    if (node->flags & NODE_TYPED)
     {
-        printk(KERN_ERR "dictionary_read_all: Couldn't unlock the mutex!\n");
+        //Typed values hash their text form only when someone asks
+        collection_digest(node);
+    }
+    matches = ((condition->match & DICTIONARY_IF_VERSION) && condition->version == node->created) ||
+        ((condition->match & DICTIONARY_IF_DIGEST) && condition->digest == node->digest);
+    condition->version = node->created;
+    condition->digest = node->digest;
+    return matches;
+}
+
+//Conditional read to buffer function
+ssize_t dictionary_read_if_changed(pdictionary dict, 
+    const char *key, size_t key_length, 
+    char __user *buffer, size_t maxsize, u64 timeout_us, unsigned int flags, loff_t *ppos,
+    struct dictionary_condition *condition)
+{
+    pnode node_ptr;
+    ssize_t res;
+
+    if (dict == NULL || key == NULL || buffer == NULL || maxsize == 0 || ppos == NULL || condition == NULL)
+        return -EINVAL;
+    hotkeys_record(dict, key, key_length, HOTKEYS_READ);
+    if ((flags & DICTIONARY_NONBLOCK) && dictionary_surely_missing(dict, key, key_length))
+    {
+        //Non blocking reads don't wait for missing keys
         return -EAGAIN;
     }
-    list_for_each_safe(pos, q, &dict->key_value_list)
+    if (!dictionary_lock_flags(dict, flags))
     {
-        temp = list_entry(pos, struct node, list);
-        if (temp == NULL)
-        {
-            printk(KERN_ALERT "NULL value inside list detected\n");  
-            continue;
-        }
-        node_key_size = strlen(temp->key);
-        node_value_size = strlen(temp->value);
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    res = dictionary_find_or_wait(dict, key, key_length, timeout_us, flags, &node_ptr);
+    if (res != 0)
+    {
+        //The mutex has already been unlocked
+        return res;
+    }
+    dict->stats.reads++;
+    //An unchanged value costs the comparison only
+    res = node_matches(node_ptr, condition) ? 0 : value_read(node_ptr, buffer, maxsize, ppos, !(flags & DICTIONARY_KERNEL));
+    //End of the read operations
+    ////////////////////////////////////////
+    dictionary_unlock(dict);
+    return res;
+}
+
+//Read to iov_iter function
+ssize_t dictionary_read_iter(pdictionary dict, 
+    const char *key, size_t key_length, 
+    struct iov_iter *to, u64 timeout_us, unsigned int flags, loff_t *ppos)
+{
+    pnode node_ptr;
+    struct replica_entry *entry;
+    ssize_t res;
+
+    if (dict == NULL || key == NULL || to == NULL || ppos == NULL)
+        return -EINVAL;
+    entry = read_start(dict, key, key_length, flags);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    if (entry != NULL)
+    {
+        res = replica_read_iter(entry, to, ppos);
+        replica_put(entry);
+        return res;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    res = dictionary_find_or_wait(dict, key, key_length, timeout_us, flags, &node_ptr);
+    if (res != 0)
+    {
+        //The mutex has already been unlocked
+        return res;
+    }
+    dict->stats.reads++;
+    res = value_read_iter(node_ptr, to, ppos);
+    replica_fill(dict, key, key_length, node_ptr, flags);
+    //End of the read operations
+    ////////////////////////////////////////
+    dictionary_unlock(dict);
+    return res;
+}
+
+//Read to pipe function
+ssize_t dictionary_splice_read(pdictionary dict, 
+    const char *key, size_t key_length, 
+    struct pipe_inode_info *pipe, size_t len, u64 timeout_us, unsigned int flags, loff_t *ppos)
+{
+    pnode node_ptr;
+    ssize_t res;
+
+    if (dict == NULL || key == NULL || pipe == NULL || ppos == NULL)
+        return -EINVAL;
+    hotkeys_record(dict, key, key_length, HOTKEYS_READ);
+    if ((flags & DICTIONARY_NONBLOCK) && dictionary_surely_missing(dict, key, key_length))
+    {
+        //Non blocking reads don't wait for missing keys
+        return -EAGAIN;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    res = dictionary_find_or_wait(dict, key, key_length, timeout_us, flags, &node_ptr);
+    if (res != 0)
+    {
+        //The mutex has already been unlocked
+        return res;
+    }
+    dict->stats.reads++;
+    res = value_splice(node_ptr, pipe, len, ppos);
+    //End of the read operations
+    ////////////////////////////////////////
+    dictionary_unlock(dict);
+    return res;
+}
+
+//Read all keys to buffer function
+ssize_t dictionary_read_all(pdictionary dict, char __user *buffer, size_t maxsize, unsigned int flags, loff_t *ppos)
+{
+    struct dictionary_view view;
+    pnode temp;
+    size_t node_key_size;
+    size_t node_value_size;
+    loff_t value_pos;
+    const char* print_helpers = "<>: \"\"\n";
+    ssize_t index = 0;
+
+    if (dict == NULL || buffer == NULL)
+        return -EINVAL;
+    
+    //The pairs are copied from a view: writers only wait for the mutex while the view moves to the next node
+    if (dictionary_view_open(dict, &view, flags) != 0)
+    {
+        return -EAGAIN;
+    }
+    while (!IS_ERR_OR_NULL(temp = dictionary_view_next(dict, &view, flags)))
+    {
+        node_key_size = temp->key_length;
+        node_value_size = temp->value_length;
         if (node_key_size + node_value_size+index >= maxsize)
         {
-            printk(KERN_ALERT "Reaached buffer limit but more could be printed.\n");
+            printd("dictionary_read_all: reached buffer limit but more could be printed.\n");
             break;
         }
         
         if (copy_to_user(&buffer[index], print_helpers, 1) != 0)
         {
-            printk(KERN_ERR "Couldn't copy char '<' to output buffer\n");
+            temp = ERR_PTR(-EFAULT);
             break;
         }
         index++;
 
-        if (copy_to_user(&buffer[index], temp->key, node_key_size) != 0)
+        if (copy_to_user(&buffer[index], node_prefix(temp), node_prefix_length(temp)) != 0 ||
+            copy_to_user(&buffer[index + node_prefix_length(temp)], temp->key, node_key_size - node_prefix_length(temp)) != 0)
         {
-            printk(KERN_ERR "Couldn't copy key  \"%s\" (%d) to output buffer\n", temp->key, (int)node_key_size);
+            temp = ERR_PTR(-EFAULT);
             break;
         }
         index += node_key_size;
             
         if (copy_to_user(&buffer[index], print_helpers + 1, 4) != 0)
         {
+            temp = ERR_PTR(-EFAULT);
             break;
         }
         index += 4;
 
-        if (copy_to_user(&buffer[index], temp->value, node_value_size) != 0)
+        value_pos = 0;
+        if (value_read(temp, &buffer[index], node_value_size, &value_pos, true) != (ssize_t)node_value_size)
         {
-            printk(KERN_ERR "Couldn't copy value \"%s\" (%d) to output buffer\n", temp->value, (int)node_value_size);
+            temp = ERR_PTR(-EFAULT);
             break;
         }
         index += node_value_size;
 
         if (copy_to_user(&buffer[index], print_helpers + 5, 2) != 0)
         {
+            temp = ERR_PTR(-EFAULT);
+            break;
+        }
+        index += 2;
+    }    
+    dictionary_view_close(dict, &view);
+    if (IS_ERR(temp))
+    {
+        //The keys after the ones copied were never seen, or the output buffer is not writable
+        return PTR_ERR(temp);
+    }
+    (*ppos) += index;
+    return index;
+}
+
+//View open function
+int dictionary_view_open(pdictionary dict, struct dictionary_view *view, unsigned int flags)
+{
+    if (dict == NULL || view == NULL)
+        return -EINVAL;
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return -EAGAIN;
+    }
+    view->sequence = dict->sequence;
+    view->cursor = NULL;
+    list_add_tail(&view->list, &dict->views);
+    dictionary_unlock(dict);
+    return 0;
+}
+
+//View step function
+pnode dictionary_view_next(pdictionary dict, struct dictionary_view *view, unsigned int flags)
+{
+    struct list_head *pos;
+    pnode node = NULL;
+
+    if (dict == NULL || view == NULL)
+        return NULL;
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        //Not the end of the view: the caller must not take what it has as all of it
+        return ERR_PTR((flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -EINTR);
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    //The cursor is seen by the view, so it can't have left the list. 
+    //New nodes are added at the head: they are all behind it
+    pos = view->cursor != NULL ? view->cursor->list.next : dict->key_value_list.next;
+    for ( ; pos != &dict->key_value_list; pos = pos->next)
+    {
+        node = list_entry(pos, struct node, list);
+        if (node_visible(node, view->sequence))
+        {
+            view->cursor = node;
+            break;
+        }
+        node = NULL;
+    }
+    dictionary_unlock(dict);
+    return node;
+}
+
+//View close function
+void dictionary_view_close(pdictionary dict, struct dictionary_view *view)
+{
+    if (dict == NULL || view == NULL)
+        return;
+    //Not interruptible: a view left in the list would point to the stack of a task that is gone
+    mutex_lock(&dict->mutex);
+    list_del(&view->list);
+    reclaim_versions(dict);
+    dictionary_unlock(dict);
+}
+
+//Print key function
+int dictionary_copy_value(pdictionary dict, const char* key, size_t key_length, u64 timeout_us, unsigned int flags,
+    struct dictionary_condition *condition, char **value, size_t *value_length)
+{
+    pnode node_ptr;
+    struct replica_entry *entry;
+    int res = 0;
+
+    if (dict == NULL || value == NULL || value_length == NULL)
+        return -EINVAL;
+    entry = read_start(dict, key, key_length, flags);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    if (entry != NULL)
+    {
+        res = replica_copy(entry, condition, value, value_length);
+        replica_put(entry);
+        return res;
+    }
+    if (!dictionary_lock_flags(dict, flags))
+    {
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    res = dictionary_find_or_wait(dict, key, key_length, timeout_us, flags, &node_ptr);
+    if (res != 0)
+    {
+        //The mutex has already been unlocked
+        return res;
+    }
+    
+    dict->stats.reads++;
+    if (condition != NULL && node_matches(node_ptr, condition))
+    {
+        //The caller already has the value
+        *value = NULL;
+        *value_length = 0;
+    } else if ((*value = (char*)kvmalloc(node_ptr->value_length + 1, GFP_KERNEL)) == NULL)
+    {
+        res = -ENOMEM;
+    } else {
+        res = value_copy(node_ptr, *value);
+        if (res != 0)
+        {
+            kvfree(*value);
+            *value = NULL;
+        } else {
+            (*value)[node_ptr->value_length] = '\0';
+            *value_length = node_ptr->value_length;
+        }
+    }
+    replica_fill(dict, key, key_length, node_ptr, flags);
+    //End of the read operations
+    ////////////////////////////////////////
+    //Unlock the mutex here
+    dictionary_unlock(dict);
+    return res;
+}
+
+//Writes the <Key>: "Value" line of a node into out and returns its size. If out is NULL the line is only measured
+static ssize_t delta_node_line(pnode node, char *out)
+{
+    size_t prefix_length;
+
+    if (out != NULL)
+    {
+        prefix_length = node_prefix_length(node);
+        out[0] = '<';
+        memcpy(&out[1], node_prefix(node), prefix_length);
+        memcpy(&out[1 + prefix_length], node->key, node->key_length - prefix_length);
+        memcpy(&out[1 + node->key_length], ">: \"", 4);
+        if (value_copy(node, &out[5 + node->key_length]) != 0)
+            return -EIO;
+        memcpy(&out[5 + node->key_length + node->value_length], "\"\n", 2);
+    }
+    return (ssize_t)(node->key_length + node->value_length + 7);
+}
+
+//Writes the lines of a delta into out, from the node at node_pos and the tombstone at tombstone_pos 
+//to the ends of their lists. If out is NULL the lines are only measured. Call with the mutex locked
+static ssize_t delta_lines(pdictionary dict, struct list_head *node_pos, struct list_head *tombstone_pos, char *out)
+{
+    struct dictionary_tombstone *tombstone;
+    pnode node;
+    size_t index = 0;
+    ssize_t line;
+
+    while (node_pos != &dict->changes || tombstone_pos != &dict->tombstones)
+    {
+        node = node_pos != &dict->changes ? list_entry(node_pos, struct node, changes) : NULL;
+        tombstone = tombstone_pos != &dict->tombstones ? list_entry(tombstone_pos, struct dictionary_tombstone, list) : NULL;
+        //Both lists are sorted: merged, the changes come out in the order they were made
+        if (node != NULL && (tombstone == NULL || node->created < tombstone->generation))
+        {
+            line = delta_node_line(node, out != NULL ? &out[index] : NULL);
+            if (line < 0)
+                return line;
+            index += (size_t)line;
+            node_pos = node_pos->next;
+        } else {
+            if (out != NULL)
+            {
+                memcpy(&out[index], "-<", 2);
+                memcpy(&out[index + 2], tombstone->key, tombstone->key_length);
+                memcpy(&out[index + 2 + tombstone->key_length], ">\n", 2);
+            }
+            index += tombstone->key_length + 4;
+            tombstone_pos = tombstone_pos->next;
+        }
+    }
+    return (ssize_t)index;
+}
+
+//Lists every key, for a delta that can't list the changes. Like snapshot_save it goes through a view:
+//the values are measured and copied without holding the mutex
+static ssize_t delta_all(pdictionary dict, char **buffer, u64 *generation, unsigned int flags)
+{
+    struct dictionary_view view;
+    pnode node;
+    char header[32];
+    size_t header_length, size, index;
+    ssize_t line;
+    char *output;
+
+    if (dictionary_view_open(dict, &view, flags) != 0)
+    {
+        return -EAGAIN;
+    }
+    header_length = scnprintf(header, sizeof(header), "#%llu all\n", view.sequence);
+    size = header_length;
+    while (!IS_ERR_OR_NULL(node = dictionary_view_next(dict, &view, flags)))
+    {
+        size += (size_t)delta_node_line(node, NULL);
+    }
+    if (IS_ERR(node))
+    {
+        dictionary_view_close(dict, &view);
+        return PTR_ERR(node);
+    }
+    output = (char*)kvmalloc(size, (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (output == NULL)
+    {
+        dictionary_view_close(dict, &view);
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    }
+    memcpy(output, header, header_length);
+    index = header_length;
+    dictionary_view_rewind(&view);
+    while (!IS_ERR_OR_NULL(node = dictionary_view_next(dict, &view, flags)))
+    {
+        line = delta_node_line(node, &output[index]);
+        if (line < 0)
+        {
+            node = ERR_PTR(line);
             break;
         }
-        index += 2;
-    }    
-    dictionary_unlock(dict);
-    (*ppos) += index;
-    return index;
+        index += (size_t)line;
+    }
+    dictionary_view_close(dict, &view);
+    if (IS_ERR(node))
+    {
+        //A delta missing some of the keys would be taken for all of them
+        kvfree(output);
+        return PTR_ERR(node);
+    }
+    *buffer = output;
+    *generation = view.sequence;
+    return (ssize_t)size;
 }
 
-//Print key function
-int dictionary_print_key(pdictionary dict, const char* key, size_t key_length, uint timeout)
+//Delta function
+ssize_t dictionary_read_delta(pdictionary dict, u64 since, char **buffer, u64 *generation, unsigned int flags)
 {
-    pnode node_ptr;
-    int res = 0;
+    struct list_head *node_pos, *tombstone_pos;
+    char header[32];
+    size_t header_length;
+    ssize_t size;
+    char *output;
 
-    if (dict == NULL)
+    if (dict == NULL || buffer == NULL || generation == NULL)
         return -EINVAL;
-    if (!dictionary_lock(dict))
+    if (!dictionary_lock_flags(dict, flags))
     {
         return -EAGAIN;
     }
     ////////////////////////////////////////
     //Mutex is locked from now on
-    do {
-        if (dictionary_find_node(dict, key, key_length, &node_ptr) == NULL)
+    if (since == 0 || since < dict->delta_floor || since > dict->sequence)
+    {
+        //Every key is listed: it can be a lot of values, they are not copied under the mutex
+        dictionary_unlock(dict);
+        return delta_all(dict, buffer, generation, flags);
+    }
+    header_length = scnprintf(header, sizeof(header), "#%llu\n", dict->sequence);
+    //Only the ends of the lists, changed after since, are walked
+    node_pos = &dict->changes;
+    while (node_pos->prev != &dict->changes && list_entry(node_pos->prev, struct node, changes)->created > since)
+    {
+        node_pos = node_pos->prev;
+    }
+    tombstone_pos = &dict->tombstones;
+    while (tombstone_pos->prev != &dict->tombstones && 
+        list_entry(tombstone_pos->prev, struct dictionary_tombstone, list)->generation > since)
+    {
+        tombstone_pos = tombstone_pos->prev;
+    }
+    size = delta_lines(dict, node_pos, tombstone_pos, NULL);
+    output = (char*)kvmalloc(header_length + size, (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (output == NULL)
+    {
+        size = (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    } else {
+        memcpy(output, header, header_length);
+        size = delta_lines(dict, node_pos, tombstone_pos, &output[header_length]);
+        if (size < 0)
         {
-            //Key not created, wait here
-            printd("Key not found in dictionary at the moment.\nTask will be set to UNINTERRUPIBLE and put in a waitqueue.\n");
-            dictionary_unlock(dict);
-            if (timeout != 0)
-            {
-                //We will wait with a timeout
-                if (!dictionary_wait_for_key_timeout(dict, key, key_length, node_ptr, timeout))
-                {
-                    printk(KERN_ALERT "Timeout of %d msecs passed without the key being generated.\nTask will be killed\n", (int)timeout);
-                    return -EAGAIN;
-                }
-            } else {
-                //We will wait until the task is killed, no time limit
-                if (!dictionary_wait_for_key(dict, key, key_length, node_ptr))
-                {
-                    printk(KERN_ALERT "An error happened.\nTask was probably killed\n");
-                    return -EAGAIN; //An error happened: can't continue. Mutex should already be unlocked
-                }
-            }
-            //If we are here it means that we have found the element and also we have control over the mutex
+            kvfree(output);
+        } else {
+            size += header_length;
+            *buffer = output;
         }
-    } while (node_ptr == NULL);
-    
-    printk(KERN_INFO "<%s>: \"%s\"\n", node_ptr->key, node_ptr->value);
+    }
+    *generation = dict->sequence;
     //End of the read operations
     ////////////////////////////////////////
-    //Unlock the mutex here
     dictionary_unlock(dict);
-    return res;
+    return size;
 }
 
 //Print all keys function
@@ -499,6 +1726,7 @@ int dictionary_print_all(pdictionary dict)
 {
     struct list_head *pos, *q;
     pnode temp;
+    const char* value;
 
     if (dict == NULL)
     {
@@ -514,10 +1742,11 @@ int dictionary_print_all(pdictionary dict)
     list_for_each_safe(pos, q, &dict->key_value_list)
     {
         temp = list_entry(pos, struct node, list);
-        if (temp != NULL)
+        if (temp != NULL && temp->retired == 0 && (value = node_value_get(temp)) != NULL)
         {
-            printk(KERN_INFO "\t<%s>: \"%s\"\n", temp->key, temp->value);
-            printk(KERN_DEBUG "\t<%s>: \"%s\"\n", temp->key, temp->value);
+            printk(KERN_INFO "\t<%s%s>: \"%s\"\n", node_prefix(temp), temp->key, value);
+            printk(KERN_DEBUG "\t<%s%s>: \"%s\"\n", node_prefix(temp), temp->key, value);
+            node_value_put(temp, value);
         }
     }
     
@@ -525,34 +1754,120 @@ int dictionary_print_all(pdictionary dict)
     return 0;
 }
 
+//Frees the nodes taken away from a dictionary
+static void dictionary_garbage_free(struct dictionary_garbage *garbage)
+{
+    pnode node, tmp;
+
+    list_for_each_entry_safe(node, tmp, &garbage->nodes, list)
+    {
+        list_del(&node->list);
+        dictionary_free_node(node);
+        cond_resched();
+    }
+    //The nodes are gone, but arena_free never frees the last segment
+    arena_destroy(&garbage->arena);
+    dedup_free_table(garbage->shared_values);
+    dedup_free_table(garbage->shared_prefixes);
+    kvfree(garbage->compress_workspace);
+    free_tombstones(&garbage->tombstones);
+}
+static void dictionary_garbage_work(struct work_struct *work)
+{
+    struct dictionary_garbage *garbage = container_of(work, struct dictionary_garbage, work);
+
+    dictionary_garbage_free(garbage);
+    kfree(garbage);
+}
+
 //Free function
 int dictionary_free(pdictionary dict)
 {
-    struct list_head *pos, *q;
-    pnode temp;
+    struct dictionary_garbage *garbage, local;
+    struct wal_entry *entry;
+    pnode node, tmp;
 
     if (dict == NULL)
         return -EINVAL;
+    //A clear that is not in the log would come back when it's replayed
+    entry = wal_prepare(dict, WAL_CLEAR, NULL, 0, NULL, 0, 0, DICTIONARY_KERNEL);
+    if (IS_ERR(entry))
+        return (int)PTR_ERR(entry);
+    //Allocated before the mutex. If it fails the nodes are freed by this task, still without the mutex
+    garbage = (struct dictionary_garbage*)kmalloc(sizeof(struct dictionary_garbage), GFP_KERNEL);
     if (!dictionary_lock(dict))
     {
+        wal_discard(entry);
+        kfree(garbage);
         return -EAGAIN;
     }
-    
-    list_for_each_safe(pos, q, &dict->key_value_list)
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    dict->sequence++;
+    //The deletes are not listed one by one: the deltas from before get all the keys
+    dict->delta_floor = dict->sequence;
+    dict->tombstone_count = 0;
+    replica_clear(dict);
+    wal_queue(entry);
+    if (!list_empty(&dict->views))
     {
-        temp = list_entry(pos, struct node, list);
-        //Delete every entry
-        delete_dict_entry(pos, temp);
+        //The open views still see the nodes: they are retired one by one and freed when the views are closed
+        list_for_each_entry_safe(node, tmp, &dict->key_value_list, list)
+        {
+            if (node->retired == 0)
+            {
+                remove_node(dict, &node->list, node);
+            }
+        }
+        free_tombstones(&dict->tombstones);
+        dictionary_unlock(dict);
+        kfree(garbage);
+        return 0;
     }
-
+    //The dictionary gets an empty list at once: no node is touched here
+    if (garbage == NULL)
+    {
+        garbage = &local;
+    }
+    INIT_LIST_HEAD(&garbage->nodes);
+    INIT_LIST_HEAD(&garbage->tombstones);
+    list_splice_init(&dict->key_value_list, &garbage->nodes);
+    list_splice_init(&dict->tombstones, &garbage->tombstones);
+    INIT_LIST_HEAD(&dict->changes);
+    //The segments go with the nodes: their values are freed without the mutex
+    arena_move(&garbage->arena, &dict->arena);
+    garbage->shared_values = dict->shared_values;
+    garbage->shared_prefixes = dict->shared_prefixes;
+    garbage->compress_workspace = dict->compress_workspace;
+    dict->shared_values = NULL;
+    dict->shared_prefixes = NULL;
+    dict->compress_workspace = NULL;
+    //Also the counters that saturated
+    filter_clear(dict);
+    dict->memory_used = 0;
+    dict->stats.compressed_values = 0;
+    dict->stats.compressed_original = 0;
+    dict->stats.compressed_stored = 0;
+    dict->stats.shared_values = dict->stats.shared_original = dict->stats.shared_stored = 0;
+    dict->stats.shared_prefixes = dict->stats.prefix_original = dict->stats.prefix_stored = 0;
+    //End of the write operations
+    ////////////////////////////////////////
     dictionary_unlock(dict);
+
+    if (garbage == &local)
+    {
+        dictionary_garbage_free(garbage);
+    } else {
+        INIT_WORK(&garbage->work, dictionary_garbage_work);
+        queue_work(free_queue, &garbage->work);
+    }
     return 0;
 }
 
 // Count function
 size_t dictionary_count(pdictionary dict)
 {
-    struct list_head *pos;
+    pnode node;
     size_t count = 0;
 
     if (dict == NULL)
@@ -562,15 +1877,451 @@ size_t dictionary_count(pdictionary dict)
         return 0;
     }
     
-    list_for_each(pos, &dict->key_value_list)
+    list_for_each_entry(node, &dict->key_value_list, list)
     {
-        ++count;
+        //Old versions kept for the views are not keys
+        if (node->retired == 0)
+            ++count;
     }
 
     dictionary_unlock(dict);
     return count;
 }
 
+// Bulk node allocation function
+int dictionary_alloc_nodes(pnode *nodes, size_t count)
+{
+    size_t i;
+
+    if (nodes == NULL || count == 0)
+        return -EINVAL;
+    if (kmem_cache_alloc_bulk(node_cache, GFP_USER, count, (void**)nodes) == 0)
+    {
+        return -ENOMEM;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        memset(nodes[i], 0, sizeof(struct node));
+        INIT_LIST_HEAD(&nodes[i]->list);
+        INIT_LIST_HEAD(&nodes[i]->chunks);
+        INIT_LIST_HEAD(&nodes[i]->changes);
+    }
+    return 0;
+}
+
+// Free function for nodes that are not inside a dictionary
+void dictionary_free_node(pnode node)
+{
+    if (node == NULL)
+        return;
+    kfree(node->key);
+    //Shared values and prefixes belong to the tables of the dictionary, freed with them
+    dedup_detach_value(node);
+    value_free(node);
+    kmem_cache_free(node_cache, node);
+}
+
+//Frees the nodes whose key comes again later in the list: the last one wins, as it would with a write for each.
+//Sets the key_hash of the nodes that are left
+static int bulk_drop_duplicates(struct list_head *nodes)
+{
+    struct list_head *buckets;
+    pnode node, tmp, other;
+    size_t count = 0, size = 1, i;
+    bool found;
+
+    list_for_each_entry(node, nodes, list)
+    {
+        ++count;
+    }
+    while (size < count)
+    {
+        size <<= 1;
+    }
+    buckets = (struct list_head*)kvmalloc_array(size, sizeof(struct list_head), GFP_KERNEL);
+    if (buckets == NULL)
+        return -ENOMEM;
+    for (i = 0; i < size; ++i)
+    {
+        INIT_LIST_HEAD(&buckets[i]);
+    }
+    //The nodes are not in the dictionary yet: their changes link them to the buckets meanwhile
+    list_for_each_entry_safe(node, tmp, nodes, list)
+    {
+        node->key_hash = filter_hash(node->key, node->key_length);
+        found = false;
+        list_for_each_entry(other, &buckets[node->key_hash & (size - 1)], changes)
+        {
+            if (other->key_hash == node->key_hash && other->key_length == node->key_length && 
+                memcmp(other->key, node->key, node->key_length) == 0)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (found)
+        {
+            list_del(&other->changes);
+            list_del(&other->list);
+            dictionary_free_node(other);
+        }
+        list_add(&node->changes, &buckets[node->key_hash & (size - 1)]);
+    }
+    list_for_each_entry(node, nodes, list)
+    {
+        INIT_LIST_HEAD(&node->changes);
+    }
+    kvfree(buckets);
+    return 0;
+}
+
+//Frees the records of the write-ahead log built for a bulk insert that failed
+static void discard_records(struct list_head *records)
+{
+    struct wal_entry *entry, *next;
+
+    list_for_each_entry_safe(entry, next, records, list)
+    {
+        wal_discard(entry);
+    }
+}
+
+// Bulk insert function
+int dictionary_bulk_insert(pdictionary dict, struct list_head *nodes)
+{
+    struct list_head *pos, *old_ref;
+    pnode node_ptr, old_ptr;
+    size_t memory = 0, freed = 0, count = 0;
+    struct dictionary_stats compressed;
+    struct wal_entry *entry, *next;
+    LIST_HEAD(records);
+    const char *value;
+
+    if (dict == NULL || nodes == NULL)
+        return -EINVAL;
+    if (list_empty(nodes))
+        return 0;
+    //A key twice in the list would be two live nodes
+    if (bulk_drop_duplicates(nodes) != 0)
+        return -ENOMEM;
+    //Sizes are computed before taking the mutex
+    memset(&compressed, 0, sizeof(struct dictionary_stats));
+    list_for_each(pos, nodes)
+    {
+        node_ptr = list_entry(pos, struct node, list);
+        memory += node_memory(node_ptr);
+        if (node_ptr->flags & NODE_COMPRESSED)
+        {
+            compressed.compressed_values++;
+            compressed.compressed_original += node_ptr->value_length;
+            compressed.compressed_stored += node_ptr->stored_length;
+        }
+        ++count;
+    }
+    //The loaded keys are in the write-ahead log too: a snapshot taken before is not needed to replay it.
+    //Typed values are not logged, like the changes of dictionary_typed. The records are built here, before the mutex
+    list_for_each(pos, nodes)
+    {
+        node_ptr = list_entry(pos, struct node, list);
+        value = wal_enabled() && !(node_ptr->flags & NODE_TYPED) ? node_value_get(node_ptr) : NULL;
+        if (value == NULL)
+            continue;
+        entry = wal_prepare(dict, WAL_SET, node_ptr->key, node_ptr->key_length, value, node_ptr->value_length, 0, 
+            DICTIONARY_KERNEL);
+        node_value_put(node_ptr, value);
+        if (IS_ERR(entry))
+        {
+            discard_records(&records);
+            return (int)PTR_ERR(entry);
+        }
+        if (entry != NULL)
+        {
+            list_add_tail(&entry->list, &records);
+        }
+    }
+    if (!dictionary_lock(dict))
+    {
+        discard_records(&records);
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    if (!list_empty(&dict->key_value_list))
+    {
+        //The keys that are replaced give their memory back, unless an open view keeps them
+        list_for_each(pos, nodes)
+        {
+            node_ptr = list_entry(pos, struct node, list);
+            dictionary_find_node(dict, node_ptr->key, node_ptr->key_length, &old_ptr);
+            if (old_ptr != NULL && !node_in_view(dict, old_ptr))
+                freed += node_memory(old_ptr);
+        }
+    }
+    if (!memory_available(dict, memory, freed))
+    {
+        dictionary_unlock(dict);
+        discard_records(&records);
+        return -ENOSPC;
+    }
+    dict->sequence++;
+    if (!list_empty(&dict->key_value_list))
+    {
+        //Keys already present are replaced by the loaded ones.
+        //On an empty dictionary (the warm restart case) no search is needed at all
+        list_for_each(pos, nodes)
+        {
+            node_ptr = list_entry(pos, struct node, list);
+            old_ref = dictionary_find_node(dict, node_ptr->key, node_ptr->key_length, &old_ptr);
+            if (old_ptr != NULL)
+            {
+                remove_node(dict, old_ref, old_ptr);
+            }
+        }
+    }
+    if (!list_empty(&dict->watch_list))
+    {
+        list_for_each(pos, nodes)
+        {
+            dictionary_complete_watches(dict, list_entry(pos, struct node, list));
+        }
+    }
+    list_for_each(pos, nodes)
+    {
+        node_ptr = list_entry(pos, struct node, list);
+        node_ptr->created = dict->sequence;
+        list_add_tail(&node_ptr->changes, &dict->changes);
+        filter_add(dict, node_ptr->key_hash);
+        //What dedup saves is charged once by dedup.c, not by the node
+        memory -= node_memory(node_ptr);
+        dedup_intern_key(dict, node_ptr);
+        dedup_share_value(dict, node_ptr);
+        memory += node_memory(node_ptr);
+    }
+    list_splice_init(nodes, &dict->key_value_list);
+    list_for_each_entry_safe(entry, next, &records, list)
+    {
+        wal_queue(entry);
+    }
+    dict->memory_used += memory;
+    dict->stats.writes += count;
+    dict->stats.compressed_values += compressed.compressed_values;
+    dict->stats.compressed_original += compressed.compressed_original;
+    dict->stats.compressed_stored += compressed.compressed_stored;
+    //End of the write operations
+    ////////////////////////////////////////
+    dictionary_unlock(dict);
+    //One wake up for all the keys that were loaded
+    dictionary_wake_waiting(dict);
+    return 0;
+}
+
+// Watcher init function
+void dictionary_watcher_init(struct dictionary_watcher *watcher)
+{
+    spin_lock_init(&watcher->lock);
+    INIT_LIST_HEAD(&watcher->ready);
+    init_waitqueue_head(&watcher->poll_queue);
+    watcher->registered = 0;
+}
+
+// Watch function
+int dictionary_watch(pdictionary dict, struct dictionary_watcher *watcher, 
+    const char* key, size_t key_length, u64 cookie, int eventfd)
+{
+    pwatch watch;
+    pnode node_ptr;
+    int res;
+
+    if (dict == NULL || watcher == NULL || key == NULL || key_length == 0)
+        return -EINVAL;
+    watch = (pwatch)kzalloc(sizeof(struct dictionary_watch), GFP_KERNEL);
+    if (watch == NULL)
+        return -ENOMEM;
+    watch->key = kmemdup(key, key_length, GFP_KERNEL);
+    if (watch->key == NULL)
+    {
+        kfree(watch);
+        return -ENOMEM;
+    }
+    watch->key_length = key_length;
+    watch->cookie = cookie;
+    watch->watcher = watcher;
+    if (eventfd >= 0)
+    {
+        watch->eventfd = eventfd_ctx_fdget(eventfd);
+        if (IS_ERR(watch->eventfd))
+        {
+            res = PTR_ERR(watch->eventfd);
+            watch->eventfd = NULL;
+            free_watch(watch);
+            return res;
+        }
+    }
+
+    if (!dictionary_lock(dict))
+    {
+        free_watch(watch);
+        return -EAGAIN;
+    }
+    ////////////////////////////////////////
+    //Mutex is locked from now on
+    if (watcher->registered >= DICTIONARY_MAX_WATCHES)
+    {
+        dictionary_unlock(dict);
+        free_watch(watch);
+        return -ENOSPC;
+    }
+    list_add_tail(&watch->list, &dict->watch_list);
+    watcher->registered++;
+    if (dictionary_find_node(dict, key, key_length, &node_ptr) != NULL)
+    {
+        //The key is already there: no need to wait
+        complete_watch(dict, watch);
+    }
+    //End of the write operations
+    ////////////////////////////////////////
+    dictionary_unlock(dict);
+    return 0;
+}
+
+// Watch pop function
+int dictionary_watch_pop(struct dictionary_watcher *watcher, u64 *cookie)
+{
+    pwatch watch;
+
+    spin_lock(&watcher->lock);
+    watch = list_first_entry_or_null(&watcher->ready, struct dictionary_watch, list);
+    if (watch != NULL)
+    {
+        list_del(&watch->list);
+    }
+    spin_unlock(&watcher->lock);
+    if (watch == NULL)
+        return -EAGAIN;
+    *cookie = watch->cookie;
+    free_watch(watch);
+    return 0;
+}
+
+// Watch ready function
+bool dictionary_watch_ready(struct dictionary_watcher *watcher)
+{
+    bool res;
+
+    spin_lock(&watcher->lock);
+    res = !list_empty(&watcher->ready);
+    spin_unlock(&watcher->lock);
+    return res;
+}
+
+// Unwatch function
+void dictionary_unwatch_all(pdictionary dict, struct dictionary_watcher *watcher)
+{
+    pwatch watch, tmp;
+    LIST_HEAD(ready);
+
+    if (dict != NULL && watcher->registered > 0)
+    {
+        //Can't be interrupted: the watches must not outlive the file
+        mutex_lock(&dict->mutex);
+        list_for_each_entry_safe(watch, tmp, &dict->watch_list, list)
+        {
+            if (watch->watcher == watcher)
+            {
+                list_del(&watch->list);
+                free_watch(watch);
+            }
+        }
+        watcher->registered = 0;
+        dictionary_unlock(dict);
+    }
+    spin_lock(&watcher->lock);
+    list_splice_init(&watcher->ready, &ready);
+    spin_unlock(&watcher->lock);
+    list_for_each_entry_safe(watch, tmp, &ready, list)
+    {
+        free_watch(watch);
+    }
+}
+
+// Stats function
+int dictionary_get_stats(pdictionary dict, struct dictionary_stats_arg *stats)
+{
+    pnode node;
+    int i;
+
+    if (dict == NULL || stats == NULL)
+        return -EINVAL;
+    if (!dictionary_lock(dict))
+    {
+        return -EAGAIN;
+    }
+
+    memset(stats, 0, sizeof(struct dictionary_stats_arg));
+    list_for_each_entry(node, &dict->key_value_list, list)
+    {
+        if (node->retired == 0)
+            stats->keys++;
+    }
+    stats->memory_used = dict->memory_used;
+    stats->memory_limit = dict->memory_limit;
+    stats->reads = dict->stats.reads;
+    stats->writes = dict->stats.writes;
+    stats->appends = dict->stats.appends;
+    stats->deletes = dict->stats.deletes;
+    stats->misses = dict->stats.misses + atomic64_read(&dict->filtered_misses);
+    stats->compressed_values = dict->stats.compressed_values;
+    stats->compressed_original = dict->stats.compressed_original;
+    stats->compressed_stored = dict->stats.compressed_stored;
+    stats->shared_values = dict->stats.shared_values;
+    stats->shared_original = dict->stats.shared_original;
+    stats->shared_stored = dict->stats.shared_stored;
+    stats->shared_prefixes = dict->stats.shared_prefixes;
+    stats->prefix_original = dict->stats.prefix_original;
+    stats->prefix_stored = dict->stats.prefix_stored;
+    stats->versions = dict->stats.versions;
+    stats->generation = dict->sequence;
+    stats->arena_segments = dict->arena.segment_count;
+    stats->arena_live = dict->arena.live;
+    replica_stats(dict, stats);
+    for (i = 0; i < DICTIONARY_MAX_NUMA_NODES; ++i)
+    {
+        //The reads served by the copies never take the mutex
+        stats->reads += stats->replica_hits[i];
+    }
+
+    dictionary_unlock(dict);
+    return 0;
+}
+
+// Memory limit function
+int dictionary_set_memory_limit(pdictionary dict, size_t limit)
+{
+    if (dict == NULL)
+        return -EINVAL;
+    if (!dictionary_lock(dict))
+    {
+        return -EAGAIN;
+    }
+    dict->memory_limit = limit;
+    dictionary_unlock(dict);
+    return 0;
+}
+
+bool dictionary_lock_flags(pdictionary dict, unsigned int flags)
+{
+    if (!(flags & DICTIONARY_NONBLOCK))
+        return dictionary_lock(dict);
+    if (!mutex_trylock(&dict->mutex))
+    {
+        //Non blocking callers (io_uring, O_NONBLOCK) are never put to sleep here
+        printd("Dictionary busy: the non blocking operation will not wait for the mutex.\n");
+        return false;
+    }
+    printd("\tDictionary locked.\n");
+    return true;
+}
+
 bool dictionary_lock(pdictionary dict)
 {
     if (mutex_lock_interruptible(&dict->mutex) != 0)
@@ -4,50 +4,222 @@
 #include <linux/mutex.h>
 #include <linux/list.h>
 #include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/llist.h>
+#include "dictionary_ioctl.h"
+#include "arena.h"
+
+struct eventfd_ctx;
+struct iov_iter;
+struct pipe_inode_info;
+struct shared_bytes;
+struct replica;
 
 /// @brief Node of the list: has key, value and a struct list_head object
 typedef struct node {
     struct list_head list;
-    char* key;
+    char* key;              //The key, or the part after prefix when the start of the key is shared
+    size_t key_length;      //Keys can hold any byte, so their length is not given by '\0'
+    struct shared_bytes *prefix; //Start of the key shared with other nodes, NULL if key holds all of it
     char* value;
+    size_t value_length;    //Length of the plain value
+    size_t stored_length;   //Bytes allocated for the value: the compressed size, the chunk pages or value_length + 1
+    unsigned int flags;
+    u32 key_hash;           //filter_hash of the whole key
+    u32 digest;             //CRC32 of the plain value, extended by each append
+    struct list_head chunks;//Pages holding the value when NODE_CHUNKED is set
+    u64 created;            //Sequence number of the change that wrote the value
+    u64 retired;            //Sequence number of the change that replaced or deleted it, 0 while the node is live
+    struct list_head changes;//Inside the changes of the dictionary while live, inside its versions once retired
 } *pnode;
 
-/// @brief Dictionary class: has list of nodes and a mutex to protect them
+//Flags of the nodes
+#define NODE_COMPRESSED 0x1 //value holds the LZ4 compressed value_length bytes, without '\0'
+#define NODE_CHUNKED    0x2 //value is NULL, the value is split in the struct value_chunk pages of chunks
+#define NODE_SHARED     0x4 //value is the data of a struct shared_bytes other nodes can point to, see dedup.h
+#define NODE_TYPED      0x8 //value is a struct value_collection: a list, a set or a hash, see collection.h
+#define NODE_ARENA      0x10//value is the data of a block of the arena of the dictionary, see arena.h
+
+/// @brief Receives the watches of an open file once their keys are created
+struct dictionary_watcher {
+    spinlock_t lock;                //Protects ready
+    struct list_head ready;         //Completed watches, not yet popped
+    wait_queue_head_t poll_queue;   //Woken when a watch completes
+    size_t registered;              //Watches still waiting, protected by the mutex of the dictionary
+};
+
+/// @brief A key a file or a sleeping task wants to be notified about, stays in the dictionary until the key is created
+typedef struct dictionary_watch {
+    struct list_head list;
+    char* key;
+    size_t key_length;
+    u64 cookie;
+    struct eventfd_ctx *eventfd;
+    struct dictionary_watcher *watcher; //NULL for a task sleeping on the queue of the dictionary
+    bool done;                          //Set when the key is created, for tasks without watcher
+} *pwatch;
+
+/// @brief Version and digest of the value a reader already has: conditional reads skip the values that match
+struct dictionary_condition {
+    unsigned int match; //DICTIONARY_IF_* flags, what is compared
+    u64 version;        //Sequence number of the change that wrote the value (node->created)
+    u32 digest;         //CRC32 of the value (node->digest)
+};
+
+/// @brief Operation on a typed value: a list, a set or a hash
+struct dictionary_typed_op {
+    unsigned int op;        //DICTIONARY_LIST_*, DICTIONARY_SET_*, DICTIONARY_HASH_* or DICTIONARY_TYPED_COUNT
+    const char *member;     //Element of lists, member of sets, field of hashes
+    size_t member_length;
+    const char *value;      //Value of DICTIONARY_HASH_SET
+    size_t value_length;
+    char *result;           //Element popped or value of DICTIONARY_HASH_GET: kvmalloc'd, the caller kvfrees it
+    size_t result_length;
+};
+
+//Max number of watches a file can have waiting at the same time
+#define DICTIONARY_MAX_WATCHES 65536
+
+//Flags of the operations that can wait for missing keys
+#define DICTIONARY_NONBLOCK 0x1 //Fail with -EAGAIN instead of waiting
+#define DICTIONARY_SYNC     0x2 //Writes only: return once the change is in the write-ahead log on disk, see wal.h
+#define DICTIONARY_KERNEL   0x4 //The value written, or the buffer of a read, is kernel memory. Without it user space is used
+
+/// @brief Counters of the operations executed on a dictionary, protected by its mutex
+struct dictionary_stats {
+    size_t reads;
+    size_t writes;
+    size_t appends;
+    size_t deletes;
+    size_t misses;
+    size_t compressed_values;   //Values stored compressed
+    size_t compressed_original; //Plain size of the values stored compressed
+    size_t compressed_stored;   //Bytes used by the values stored compressed
+    size_t shared_values;       //Distinct values stored once for many nodes
+    size_t shared_original;     //Bytes of the values of all the nodes that point to a shared value
+    size_t shared_stored;       //Bytes of the shared values
+    size_t shared_prefixes;     //Distinct key prefixes
+    size_t prefix_original;     //Bytes of the prefixes of all the keys that point to one
+    size_t prefix_stored;       //Bytes of the shared prefixes
+    size_t versions;            //Retired nodes kept for the open views
+};
+
+/// @brief Key deleted from a dictionary, kept so that the deltas can report it
+struct dictionary_tombstone {
+    struct list_head list;
+    u64 generation;     //Sequence number of the delete
+    size_t key_length;
+    char key[];
+};
+
+//Max number of tombstones a dictionary keeps, the older ones are dropped
+#define DICTIONARY_MAX_TOMBSTONES 4096
+
+/// @brief Point in time view of a dictionary: the nodes it sees are neither modified nor freed while it's open,
+/// writers give the keys new nodes instead
+struct dictionary_view {
+    struct list_head list;  //Inside the views of the dictionary, oldest first
+    u64 sequence;           //Last change the view sees
+    pnode cursor;           //Last node returned by dictionary_view_next, NULL before the first
+};
+
+/// @brief Dictionary class: has list of nodes and a mutex to protect them.
+/// Every namespace is a separate dictionary
 typedef struct dictionary_base
 {
     wait_queue_head_t queue;
     struct mutex mutex;
     struct list_head key_value_list;
+    struct list_head watch_list;
+    struct list_head namespace_list;
+    char name[DICTIONARY_NAME_MAX];
+    size_t memory_used;
+    size_t memory_limit;
+    struct dictionary_stats stats;
+    void *compress_workspace;   //Workspace of the compressor, protected by the mutex
+    u8 *filter;                 //Counting Bloom filter of the keys, read without the mutex (see filter.h)
+    atomic64_t filtered_misses; //Misses answered by the filter alone, without the mutex
+    struct hlist_head *shared_values;   //Hash table of the shared values, protected by the mutex
+    struct hlist_head *shared_prefixes; //Hash table of the shared key prefixes, protected by the mutex
+    u64 sequence;               //Sequence number of the last change, protected by the mutex
+    struct list_head views;     //Open views, oldest first
+    struct list_head versions;  //Retired nodes some open view can still see, oldest first
+    struct list_head changes;   //Live nodes, from the least to the most recently changed
+    struct list_head tombstones;//Deleted keys, oldest first
+    size_t tombstone_count;
+    u64 delta_floor;            //Deltas since an older sequence number can't list all the deletes
+    struct arena arena;         //Segments of the short values, with the use_arena param
+    struct work_struct compact_work; //Compacts the arena when some of its segments are sparse
+    struct llist_head appends;  //Appends waiting for the mutex, with the combine_appends param (see dictionary_append)
+    struct replica **replicas;  //Copies of the values read lately, one replica per NUMA node, with the numa_replicas param
 } dictionary_wrapper, *pdictionary;
 
+/// @brief Creates the cache the nodes are allocated from, call before any other function
+/// @return zero for success, non zero otherwise
+int dictionary_cache_init(void);
+
+/// @brief Destroys the cache the nodes are allocated from, call after all dictionaries are freed
+void dictionary_cache_destroy(void);
+
 /// @brief Initiates the dictionary instance, inits its mutex
 /// @param dict pointer to the dictionary_base object to initiate
 /// @return zero for success, non zero otherwise
 int dictionary_init(pdictionary dict);
 
+/// @brief Frees what the dictionary keeps after dictionary_free, call when nothing can use it anymore
+/// @param dict pointer to the dictionary_base object
+void dictionary_destroy(pdictionary dict);
+
 /// @brief Writes str to the specified key
 /// @param dict pointer to the dictionary_base object
-/// @param key assumed not NULL, the key we want to write to
+/// @param key assumed not NULL, the key we want to write to, kernel memory
 /// @param key_length the length of the key
-/// @param str the value we want to assign to the key
+/// @param str the value we want to assign to the key, user memory unless flags has DICTIONARY_KERNEL
 /// @param str_len the length of the value (could contain \0, so we cannot call strlen() on it)
-/// @return zero for success, non zero otherwise
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex,
+/// DICTIONARY_SYNC to wait for the write-ahead log, DICTIONARY_KERNEL if str is kernel memory
+/// @return zero for success, -ENOSPC if the dictionary would exceed its memory limit, -EIO if the change
+/// couldn't be logged, -EFAULT if str couldn't be copied, non zero otherwise
 int dictionary_write(pdictionary dict, 
     const char* key, size_t key_length,
-    const char* value, size_t str_len);
+    const char* value, size_t str_len, unsigned int flags);
 
-#define dictionary_delete_key(dict, key, key_length) dictionary_write(dict, key, key_length, NULL, 0)
+#define dictionary_delete_key(dict, key, key_length, flags) dictionary_write(dict, key, key_length, NULL, 0, flags)
 
-/// @brief Appends str to the specified key, if the key is not present is created
+/// @brief Appends str to the specified key, if the key is not present is created.
+/// With the combine_appends param the append is queued and the first task that takes the mutex applies all the
+/// queued ones, joining those to the same key: each append is applied whole, in the order it was queued,
+/// before the call returns. Appends joined together are a single change: views and deltas never see half of them
 /// @param dict pointer to the dictionary_base object
-/// @param key assumed not NULL, the key we want to write to
+/// @param key assumed not NULL, the key we want to write to, kernel memory
 /// @param key_length the length of the key
-/// @param str the value we want to append to the key
+/// @param str the value we want to append to the key, user memory unless flags has DICTIONARY_KERNEL
 /// @param str_len the length of the value (could contain \0, so we cannot call strlen() on it)
-/// @return zero for success, non zero otherwise
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex. Without it and with
+/// combine_appends the wait for the mutex can't be interrupted. DICTIONARY_SYNC to wait for the write-ahead log,
+/// DICTIONARY_KERNEL if str is kernel memory
+/// @return zero for success, -ENOSPC if the dictionary would exceed its memory limit, -EIO if the change
+/// couldn't be logged, -EFAULT if str couldn't be copied, non zero otherwise
 int dictionary_append(pdictionary dict, 
     const char* key, size_t key_length,
-    const char* value, size_t str_len);
+    const char* value, size_t str_len, unsigned int flags);
+
+/// @brief Writes str over the value of key from offset, without copying the rest of the value.
+/// The bytes past the end of the value are appended, a missing key is created only if offset is zero
+/// @param dict pointer to the dictionary_base object
+/// @param key assumed not NULL, the key we want to write to, kernel memory
+/// @param key_length the length of the key
+/// @param offset the first byte of the value to overwrite, at most the length of the value
+/// @param str the bytes to write, user memory unless flags has DICTIONARY_KERNEL
+/// @param str_len the number of bytes to write
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex,
+/// DICTIONARY_SYNC to wait for the write-ahead log, DICTIONARY_KERNEL if str is kernel memory
+/// @return zero for success, -EINVAL if offset is past the end of the value, 
+/// -ENOSPC if the dictionary would exceed its memory limit, -EIO if the change couldn't be logged, non zero otherwise
+int dictionary_write_range(pdictionary dict, 
+    const char* key, size_t key_length, size_t offset,
+    const char* str, size_t str_len, unsigned int flags);
 
 /// @brief Reads the content of key and puts it into buffer
 /// @param dict pointer to the dictionary_base object
@@ -55,35 +227,139 @@ int dictionary_append(pdictionary dict,
 /// @param key_length the length of the key
 /// @param buffer the buffer where the stored data will be copied
 /// @param maxsize the max length of the buffer that we can receive
-/// @param timeout max amount of msecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param timeout_us max amount of usecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for a missing key or for the mutex,
+/// DICTIONARY_KERNEL if buffer is kernel memory
 /// @param ppos passed from the Misc device file read method
 /// @return number of bytes read, below zero for errors
 ssize_t dictionary_read(pdictionary dict, 
     const char *key, size_t key_length, 
-    char __user* buffer, size_t maxsize, uint timeout, loff_t *ppos);
+    char __user* buffer, size_t maxsize, u64 timeout_us, unsigned int flags, loff_t *ppos);
 
-/// @brief Reads all the key-value pairs
+/// @brief Reads the content of key like dictionary_read, unless the caller already has it
+/// @param dict pointer to the dictionary_base object
+/// @param key assumed not NULL, the key we want to read
+/// @param key_length the length of the key
+/// @param buffer the buffer where the stored data will be copied
+/// @param maxsize the max length of the buffer that we can receive
+/// @param timeout_us max amount of usecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for a missing key or for the mutex,
+/// DICTIONARY_KERNEL if buffer is kernel memory
+/// @param ppos offset inside the value, incremented by the bytes read
+/// @param condition what the caller has, replaced by the version and the digest of the value
+/// @return number of bytes read, 0 if the value matches the condition (values are never empty), below zero for errors
+ssize_t dictionary_read_if_changed(pdictionary dict, 
+    const char *key, size_t key_length, 
+    char __user* buffer, size_t maxsize, u64 timeout_us, unsigned int flags, loff_t *ppos,
+    struct dictionary_condition *condition);
+
+/// @brief Reads the content of key, from *ppos, into an iov_iter
+/// @param dict pointer to the dictionary_base object
+/// @param key assumed not NULL, the key we want to read
+/// @param key_length the length of the key
+/// @param to where the value is copied, user or kernel memory
+/// @param timeout_us max amount of usecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for a missing key or for the mutex
+/// @param ppos offset inside the value, incremented by the bytes read
+/// @return number of bytes read, below zero for errors
+ssize_t dictionary_read_iter(pdictionary dict, 
+    const char *key, size_t key_length, 
+    struct iov_iter *to, u64 timeout_us, unsigned int flags, loff_t *ppos);
+
+/// @brief Moves the content of key, from *ppos, into a pipe. The pages of chunked values are given
+/// to the pipe by reference, without copying them
+/// @param dict pointer to the dictionary_base object
+/// @param key assumed not NULL, the key we want to read
+/// @param key_length the length of the key
+/// @param pipe the pipe to fill
+/// @param len max number of bytes to move
+/// @param timeout_us max amount of usecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for a missing key or for the mutex
+/// @param ppos offset inside the value, incremented by the bytes moved
+/// @return number of bytes moved, below zero for errors
+ssize_t dictionary_splice_read(pdictionary dict, 
+    const char *key, size_t key_length, 
+    struct pipe_inode_info *pipe, size_t len, u64 timeout_us, unsigned int flags, loff_t *ppos);
+
+/// @brief Reads all the key-value pairs, as they were when the call started: writers are not stopped meanwhile
 /// @param dict The dictionary we want to read
 /// @param buffer the buffer where the stored data will be copied
 /// @param maxsize the max length of the buffer that we can receive
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex
 /// @param ppos passed from the Misc device file read method
 /// @return total number of bytes read, below zero for errors
-ssize_t dictionary_read_all(pdictionary dict, char __user *buffer, size_t maxsize, loff_t *ppos);
+ssize_t dictionary_read_all(pdictionary dict, char __user *buffer, size_t maxsize, unsigned int flags, loff_t *ppos);
 
-/// @brief Reads the content of key and puts it into buffer
+/// @brief Copies the whole value of key into a new buffer
 /// @param dict pointer to the dictionary_base object
-/// @param key assumed not NULL, the key we want to write to
+/// @param key assumed not NULL, the key we want to read
 /// @param key_length the length of the key
-/// @param timeout max amount of msecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param timeout_us max amount of usecs to wait for the creation. If 0, the task will wait until it's killed
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for a missing key or for the mutex
+/// @param condition NULL to always copy the value, otherwise see dictionary_read_if_changed. 
+/// If the value matches nothing is copied and value is set to NULL
+/// @param value where the kvmalloc'd copy is put, the caller kvfrees it
+/// @param value_length where the length of the value is put
+/// @return zero for success, non zero otherwise
+int dictionary_copy_value(pdictionary dict, const char* key, size_t key_length, u64 timeout_us, unsigned int flags,
+    struct dictionary_condition *condition, char **value, size_t *value_length);
+
+/// @brief Executes an operation on the typed value of key, creating it when something is added.
+/// A list, set or hash left without elements deletes the key, like an empty write
+/// @param dict pointer to the dictionary_base object
+/// @param key assumed not NULL, the key of the typed value
+/// @param key_length the length of the key
+/// @param op the operation, member and value in kernel memory. result is set by the pops and DICTIONARY_HASH_GET
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex
+/// @return the result of the operation (see DICTIONARY_IOC_TYPED), -EMEDIUMTYPE if key holds another type of value,
+/// -ENOENT for pops of missing keys, -ENOSPC if the dictionary would exceed its memory limit, below zero for other errors
+long dictionary_typed(pdictionary dict, const char *key, size_t key_length, struct dictionary_typed_op *op, unsigned int flags);
+
+/// @brief Opens a view of the dictionary as it is now. Writers are not stopped: the nodes the view sees are
+/// kept as they are until it's closed
+/// @param dict pointer to the dictionary_base object
+/// @param view the view to open, stays inside the dictionary until dictionary_view_close
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex
 /// @return zero for success, non zero otherwise
-int dictionary_print_key(pdictionary dict, const char* key, size_t key_length, uint timeout);
+int dictionary_view_open(pdictionary dict, struct dictionary_view *view, unsigned int flags);
+
+/// @brief Moves the view to its next node, holding the mutex only for the step
+/// @param dict pointer to the dictionary_base object
+/// @param view the open view
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex
+/// @return the node, that can be read without the mutex while the view is open. NULL after the last one,
+/// ERR_PTR(-EINTR) if the wait for the mutex was interrupted, ERR_PTR(-EAGAIN) if the mutex was taken
+/// with DICTIONARY_NONBLOCK (the view stays where it was)
+pnode dictionary_view_next(pdictionary dict, struct dictionary_view *view, unsigned int flags);
+
+/// @brief Starts the nodes of the view again from the first one
+/// @param view the open view
+#define dictionary_view_rewind(view) ((view)->cursor = NULL)
+
+/// @brief Closes the view and frees the old versions no other view can see. The wait for the mutex can't be interrupted,
+/// and it's the only one of a non blocking reader: writers hold the mutex for a single change
+/// @param dict pointer to the dictionary_base object
+/// @param view the view to close
+void dictionary_view_close(pdictionary dict, struct dictionary_view *view);
+
+/// @brief Lists the changes made after a sequence number: the keys written since then as
+/// <Key>: "Value" lines and the keys deleted as -<Key> lines, in the order they changed. The first line is
+/// #<sequence number of the last change>, followed by " all" when the changes can't be listed
+/// (the tombstones are gone or since is unknown) and the output holds every key instead
+/// @param dict pointer to the dictionary_base object
+/// @param since sequence number the caller is up to date with, 0 for all the keys
+/// @param buffer where the pointer to the output is written, free it with kvfree()
+/// @param generation where the sequence number to pass as since the next time is written
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex or for memory
+/// @return size of the output, below zero for errors
+ssize_t dictionary_read_delta(pdictionary dict, u64 since, char **buffer, u64 *generation, unsigned int flags);
 
 /// @brief Reads all the key-value pairs
 /// @param dict The dictionary we want to read
 /// @return zero for success
 int dictionary_print_all(pdictionary dict);
 
-/// @brief De allocates all the keys, frees the mutex
+/// @brief De allocates all the keys: the list is emptied under the mutex and the nodes are freed on a workqueue
 /// @param dict pointer to the dictionary_base object
 /// @return zero for success, non zero otherwise
 int dictionary_free(pdictionary dict);
@@ -98,18 +374,95 @@ size_t dictionary_count(pdictionary dict);
 /// @return true if empty or for error, false otherwise
 #define dictionary_empty(dict) (dictionary_count(dict) == 0)
 
+/// @brief Allocates many empty nodes at once, that can be filled and later given to dictionary_bulk_insert
+/// @param nodes array where the pointers to the nodes are written
+/// @param count number of nodes to allocate
+/// @return zero for success, non zero otherwise
+int dictionary_alloc_nodes(pnode *nodes, size_t count);
+
+/// @brief Frees a node that is not part of a dictionary, with its key and value
+/// @param node the node to free, can be NULL
+void dictionary_free_node(pnode node);
+
+/// @brief Moves a list of filled nodes (keys and values are kernel memory) into the dictionary
+/// holding the mutex once and waking the waiting tasks once. Keys already present are replaced,
+/// a key found twice in the list keeps the value of its last node
+/// @param dict pointer to the dictionary_base object
+/// @param nodes list of nodes, it is empty when the function succeeds
+/// @return zero for success, -ENOSPC if the dictionary would exceed its memory limit, non zero otherwise
+int dictionary_bulk_insert(pdictionary dict, struct list_head *nodes);
+
+/// @brief Initiates the object that receives the completed watches of a file
+/// @param watcher the object to initiate
+void dictionary_watcher_init(struct dictionary_watcher *watcher);
+
+/// @brief Registers a watch: when key is created the watch is moved to the watcher, 
+/// its poll_queue is woken and the eventfd (if any) is signaled. If the key exists it completes immediately
+/// @param dict pointer to the dictionary_base object
+/// @param watcher receives the watch once completed
+/// @param key the key to watch, kernel memory
+/// @param key_length the length of the key
+/// @param cookie value returned by dictionary_watch_pop
+/// @param eventfd file descriptor of an eventfd to signal, below zero for none
+/// @return zero for success, non zero otherwise
+int dictionary_watch(pdictionary dict, struct dictionary_watcher *watcher, 
+    const char* key, size_t key_length, u64 cookie, int eventfd);
+
+/// @brief Takes a completed watch out of the watcher
+/// @param watcher the watcher
+/// @param cookie where the cookie of the watch is written
+/// @return zero for success, -EAGAIN if no watch has completed
+int dictionary_watch_pop(struct dictionary_watcher *watcher, u64 *cookie);
+
+/// @brief Checks if a watch has completed
+/// @param watcher the watcher
+/// @return true if dictionary_watch_pop would succeed
+bool dictionary_watch_ready(struct dictionary_watcher *watcher);
+
+/// @brief Cancels all the watches of the watcher registered on the dictionary and frees the completed ones
+/// @param dict the dictionary the watches were registered on
+/// @param watcher the watcher
+void dictionary_unwatch_all(pdictionary dict, struct dictionary_watcher *watcher);
+
+/// @brief Copies the counters of the dictionary
+/// @param dict pointer to the dictionary_base object
+/// @param stats where the counters will be copied
+/// @return zero for success, non zero otherwise
+int dictionary_get_stats(pdictionary dict, struct dictionary_stats_arg *stats);
+
+/// @brief Sets the max amount of bytes the keys and values of the dictionary can use
+/// @param dict pointer to the dictionary_base object
+/// @param limit the max amount of bytes, 0 for no limit
+/// @return zero for success, non zero otherwise
+int dictionary_set_memory_limit(pdictionary dict, size_t limit);
+
 /// @brief Locks the dictionary mutex, if it's already locked waits until it becomes avaible
 /// @param dict pointer to dictionary object
 /// @return true, awaits for completition
 bool dictionary_lock(pdictionary dict);
 
+/// @brief Locks the dictionary mutex. With DICTIONARY_NONBLOCK it never sleeps: if the mutex is taken it fails at once
+/// @param dict pointer to dictionary object
+/// @param flags DICTIONARY_NONBLOCK to only try to lock
+/// @return true if the mutex was locked, false otherwise
+bool dictionary_lock_flags(pdictionary dict, unsigned int flags);
+
 /// @brief Checks if the dictionary is currently locked
 /// @param dict pointer to dictionary object
 /// @return true if locked, false otherwise
 #define dictionary_is_locked(dict) mutex_is_locked(&dict->mutex)
 
-/// @brief Unlocks dictionary's mutex
+/// @brief Queues the compaction of the arena of the dictionary, unless a view is open. Call with the mutex locked
+/// @param dict pointer to the dictionary_base object
+void dictionary_schedule_compaction(pdictionary dict);
+
+/// @brief Unlocks dictionary's mutex, queueing the compaction of the arena if it needs one
 /// @param dict pointer to dictionary object
-#define dictionary_unlock(dict) do { mutex_unlock(&dict->mutex); printd("\tDictionary unlocked.\n"); } while (0)
+#define dictionary_unlock(dict) do { \
+        if (unlikely(dict->arena.compact)) \
+            dictionary_schedule_compaction(dict); \
+        mutex_unlock(&dict->mutex); \
+        printd("\tDictionary unlocked.\n"); \
+    } while (0)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,224 @@
+#ifndef _DICTIONARY_IOCTL_H
+#define _DICTIONARY_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+//Shared between the module and the programs that use the device file
+
+#define DICTIONARY_IOC_MAGIC 'D'
+
+//Max length of a namespace name, including the terminating '\0'
+#define DICTIONARY_NAME_MAX 32
+
+//Name of the namespace every file is attached to when opened
+#define DICTIONARY_DEFAULT_NAMESPACE "default"
+
+//Flags of struct dictionary_namespace_arg
+#define DICTIONARY_NAMESPACE_CREATE 0x1 //Create the namespace if it does not exist
+
+/// @brief Argument of DICTIONARY_IOC_SELECT_NAMESPACE
+struct dictionary_namespace_arg {
+    char name[DICTIONARY_NAME_MAX];
+    __u32 flags;
+};
+
+//NUMA nodes DICTIONARY_IOC_GET_STATS reports one by one, the others are added to the last one
+#define DICTIONARY_MAX_NUMA_NODES 8
+
+/// @brief Output of DICTIONARY_IOC_GET_STATS
+struct dictionary_stats_arg {
+    __u64 keys;
+    __u64 memory_used;
+    __u64 memory_limit;
+    __u64 reads;
+    __u64 writes;
+    __u64 appends;
+    __u64 deletes;
+    __u64 misses;
+    __u64 compressed_values;
+    __u64 compressed_original;
+    __u64 compressed_stored;
+    __u64 shared_values;    //Distinct values stored once, with the dedup param
+    __u64 shared_original;  //Bytes the values pointing to them would use if they were private
+    __u64 shared_stored;
+    __u64 shared_prefixes;  //Distinct key prefixes stored once, with the dedup param
+    __u64 prefix_original;
+    __u64 prefix_stored;
+    __u64 versions;         //Old versions of the keys kept for the open point in time views
+    __u64 generation;       //Sequence number of the last change, see DICTIONARY_READ_DELTA
+    __u64 arena_segments;   //Segments of ARENA_SEGMENT_SIZE bytes holding the short values, with the use_arena param
+    __u64 arena_live;       //Bytes of the values inside them, headers included
+    __u64 replica_hits[DICTIONARY_MAX_NUMA_NODES];  //Reads served by the copy on the NUMA node of the reader, with the numa_replicas param
+    __u64 replica_misses[DICTIONARY_MAX_NUMA_NODES];//Reads that found no copy on their NUMA node and locked the namespace
+};
+
+//Modes of DICTIONARY_IOC_SET_READ_MODE
+#define DICTIONARY_READ_TEXT     0 //A read returns all the pairs as text, the default
+#define DICTIONARY_READ_SNAPSHOT 1 //Reads stream a binary snapshot of the namespace
+#define DICTIONARY_READ_VALUE    2 //Reads return the value of the key chosen with DICTIONARY_IOC_SELECT_KEY, from the file offset.
+                                   //Also the only mode that supports splice() and sendfile()
+#define DICTIONARY_READ_DELTA    3 //Reads return the keys changed after the generation of the file (DICTIONARY_IOC_SET_GENERATION),
+                                   //which then moves to the last change returned
+
+//Modes of DICTIONARY_IOC_SET_WRITE_MODE
+#define DICTIONARY_WRITE_COMMANDS  0 //Writes are parsed as text commands, the default
+#define DICTIONARY_WRITE_BULK_LOAD 1 //Writes are a binary snapshot to load into the namespace
+#define DICTIONARY_WRITE_BINARY    2 //Writes are length prefixed command records
+//Longest write of text commands, the longer ones are refused with -E2BIG.
+//A binary write executes the records in its first DICTIONARY_MAX_WRITE bytes at most
+#define DICTIONARY_MAX_WRITE (1u << 28)
+
+/*
+ * Binary command format (all integers are little endian):
+ * struct dictionary_wire_record followed by key_length bytes of key and
+ * value_length bytes of value, repeated until the end of the write.
+ * Keys and values can hold any byte, records can't span two writes.
+ * A write starting with DICTIONARY_WIRE_MAGIC is binary also in
+ * DICTIONARY_WRITE_COMMANDS mode: the text commands never start with it.
+ */
+#define DICTIONARY_WIRE_MAGIC  0xD1
+#define DICTIONARY_WIRE_SET    1 //Creates or replaces the key, an empty value deletes it like -w
+#define DICTIONARY_WIRE_APPEND 2
+#define DICTIONARY_WIRE_DELETE 3 //value_length must be 0
+
+struct dictionary_wire_record {
+    __u8 opcode;        //One of DICTIONARY_WIRE_*
+    __u8 reserved[3];
+    __le32 key_length;
+    __le32 value_length;
+};
+
+/*
+ * Binary snapshot format (all integers are little endian):
+ * struct dictionary_snapshot_header, then header.count times
+ * struct dictionary_snapshot_record followed by key_length bytes of key
+ * and value_length bytes of value. Keys and values are not '\0' terminated.
+ */
+#define DICTIONARY_SNAPSHOT_MAGIC   0x504E5344 //"DSNP"
+#define DICTIONARY_SNAPSHOT_VERSION 1
+//Longest key and value of a record: a bulk load refuses the longer ones with -EINVAL
+#define DICTIONARY_SNAPSHOT_MAX_KEY   (1u << 16)
+#define DICTIONARY_SNAPSHOT_MAX_VALUE (1u << 28)
+
+struct dictionary_snapshot_header {
+    __le32 magic;
+    __le32 version;
+    __le64 count;
+};
+
+struct dictionary_snapshot_record {
+    __le32 key_length;
+    __le32 value_length;
+};
+
+//Types of the typed values
+#define DICTIONARY_TYPE_LIST 1 //Elements in order, pushed and popped at both ends
+#define DICTIONARY_TYPE_SET  2 //Distinct members
+#define DICTIONARY_TYPE_HASH 3 //Fields, each with its value
+
+//Operations of DICTIONARY_IOC_TYPED and the result they return
+#define DICTIONARY_LIST_PUSH_HEAD 1  //Elements of the list after the push
+#define DICTIONARY_LIST_PUSH_TAIL 2
+#define DICTIONARY_LIST_POP_HEAD  3  //Bytes of the element, copied to value. ENOENT if the list is missing
+#define DICTIONARY_LIST_POP_TAIL  4
+#define DICTIONARY_SET_ADD        5  //1 if the member was added, 0 if it was there already
+#define DICTIONARY_SET_REMOVE     6  //1 if the member was removed, 0 if it was missing
+#define DICTIONARY_SET_CONTAINS   7  //1 if the member is there, 0 otherwise
+#define DICTIONARY_HASH_SET       8  //1 if the field was added, 0 if its value was replaced
+#define DICTIONARY_HASH_GET       9  //Bytes of the value of the field, copied to value. ENOENT if the field is missing
+#define DICTIONARY_HASH_DELETE    10 //1 if the field was removed, 0 if it was missing
+#define DICTIONARY_TYPED_COUNT    11 //Elements of a value of any type, 0 for missing keys
+
+/// @brief Argument of DICTIONARY_IOC_TYPED
+struct dictionary_typed_arg {
+    __u64 key;          //User space pointer to the key
+    __u64 member;       //User space pointer to the element, member or field
+    __u64 value;        //User space pointer to the value of DICTIONARY_HASH_SET, or to the buffer of the pops and DICTIONARY_HASH_GET
+    __u32 key_length;
+    __u32 member_length;
+    __u32 value_length; //Length of the value, or size of the buffer
+    __u32 op;           //One of the operations above
+};
+
+/// @brief Argument of DICTIONARY_IOC_WATCH
+struct dictionary_watch_arg {
+    __u64 key;          //User space pointer to the key
+    __u32 key_length;
+    __s32 eventfd;      //eventfd signaled when the key is created, -1 for none
+    __u64 cookie;       //Returned by DICTIONARY_IOC_WATCH_POP when the key is created
+};
+
+/// @brief Argument of DICTIONARY_IOC_GET and DICTIONARY_IOC_SET
+struct dictionary_kv_arg {
+    __u64 key;          //User space pointer to the key
+    __u64 value;        //User space pointer to the value (SET) or to the buffer that receives it (GET)
+    __u32 key_length;
+    __u32 value_length; //Length of the value (SET, 0 deletes the key) or size of the buffer (GET)
+    __u64 offset;       //GET and SET_RANGE only: first byte of the value to read or to overwrite
+};
+
+/*
+ * io_uring passthrough: an IORING_OP_URING_CMD on the device file with cmd_op set to
+ * DICTIONARY_IOC_GET, DICTIONARY_IOC_SET or DICTIONARY_IOC_SET_RANGE executes the same operation as the ioctl.
+ * The first 8 bytes of the command area of the SQE hold the user space pointer to
+ * the struct dictionary_kv_arg. The CQE result is the result of the ioctl.
+ * Submitted inline the operation never sleeps: if the namespace is busy or the key
+ * is missing io_uring gets EAGAIN and retries from a worker, where it can wait.
+ */
+
+/// @brief Argument of DICTIONARY_IOC_SELECT_KEY
+struct dictionary_key_arg {
+    __u64 key;          //User space pointer to the key
+    __u32 key_length;
+    __u32 flags;        //Must be zero
+};
+
+//Flags of struct dictionary_get_if_arg
+#define DICTIONARY_IF_VERSION 0x1 //The value is not read if its version is version
+#define DICTIONARY_IF_DIGEST  0x2 //The value is not read if its digest is digest
+
+/// @brief Argument of DICTIONARY_IOC_GET_IF_CHANGED
+struct dictionary_get_if_arg {
+    struct dictionary_kv_arg kv;    //Same as DICTIONARY_IOC_GET
+    __u64 version;      //In: version of the value the caller has. Out: version of the value
+    __u32 digest;       //In: digest of the value the caller has. Out: digest of the value, a CRC32 (crc32_le seeded with ~0)
+    __u32 match;        //DICTIONARY_IF_* flags, what is compared
+};
+
+//Attaches the file to another namespace: every later read/write of the file operates on it
+#define DICTIONARY_IOC_SELECT_NAMESPACE _IOW(DICTIONARY_IOC_MAGIC, 1, struct dictionary_namespace_arg)
+//Sets the max amount of bytes keys and values of the current namespace can use, 0 for no limit
+#define DICTIONARY_IOC_SET_MEMORY_LIMIT _IOW(DICTIONARY_IOC_MAGIC, 2, __u64)
+//Reads the counters of the current namespace
+#define DICTIONARY_IOC_GET_STATS _IOR(DICTIONARY_IOC_MAGIC, 3, struct dictionary_stats_arg)
+//Selects what a read of the file returns, one of DICTIONARY_READ_*
+#define DICTIONARY_IOC_SET_READ_MODE _IOW(DICTIONARY_IOC_MAGIC, 4, __u32)
+//Selects how a write of the file is interpreted, one of DICTIONARY_WRITE_*
+#define DICTIONARY_IOC_SET_WRITE_MODE _IOW(DICTIONARY_IOC_MAGIC, 5, __u32)
+//Inserts into the namespace all the keys bulk loaded so far (also done when the file is closed)
+#define DICTIONARY_IOC_BULK_COMMIT _IO(DICTIONARY_IOC_MAGIC, 6)
+//Asks to be notified (poll readiness and the optional eventfd) when a key is created, without waiting
+#define DICTIONARY_IOC_WATCH _IOW(DICTIONARY_IOC_MAGIC, 7, struct dictionary_watch_arg)
+//Reads the cookie of a watch whose key was created, fails with EAGAIN if there is none
+#define DICTIONARY_IOC_WATCH_POP _IOR(DICTIONARY_IOC_MAGIC, 8, __u64)
+//Sets the msecs reads of the file wait for missing keys, 0 to wait until killed
+#define DICTIONARY_IOC_SET_TIMEOUT _IOW(DICTIONARY_IOC_MAGIC, 9, __u32)
+//Same as DICTIONARY_IOC_SET_TIMEOUT, in usecs
+#define DICTIONARY_IOC_SET_TIMEOUT_US _IOW(DICTIONARY_IOC_MAGIC, 10, __u64)
+//Chooses the key read in DICTIONARY_READ_VALUE mode and moves the file offset back to 0
+#define DICTIONARY_IOC_SELECT_KEY _IOW(DICTIONARY_IOC_MAGIC, 11, struct dictionary_key_arg)
+//Reads a value into a buffer, returns the number of bytes read
+#define DICTIONARY_IOC_GET _IOW(DICTIONARY_IOC_MAGIC, 12, struct dictionary_kv_arg)
+//Writes (or deletes, with an empty value) a value
+#define DICTIONARY_IOC_SET _IOW(DICTIONARY_IOC_MAGIC, 13, struct dictionary_kv_arg)
+//Sets the generation the reads in DICTIONARY_READ_DELTA mode start from, 0 for all the keys
+#define DICTIONARY_IOC_SET_GENERATION _IOW(DICTIONARY_IOC_MAGIC, 14, __u64)
+//Same as DICTIONARY_IOC_GET, but returns 0 without reading if the value matches what the caller has
+#define DICTIONARY_IOC_GET_IF_CHANGED _IOWR(DICTIONARY_IOC_MAGIC, 15, struct dictionary_get_if_arg)
+//Overwrites the value from offset without copying the rest of it, the bytes past the end are appended
+#define DICTIONARY_IOC_SET_RANGE _IOW(DICTIONARY_IOC_MAGIC, 16, struct dictionary_kv_arg)
+//Executes an operation on a list, set or hash value, returns its result. EMEDIUMTYPE if the key holds another type of value
+#define DICTIONARY_IOC_TYPED _IOW(DICTIONARY_IOC_MAGIC, 17, struct dictionary_typed_arg)
+
+#endif
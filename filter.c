@@ -0,0 +1,103 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include "module.h"
+#include "filter.h"
+
+/*
+ * Counting Bloom filter: each key increments FILTER_HASHES byte counters, chosen by double hashing
+ * of the low and the high bits of its hash.
+ * Writers update the counters with the mutex locked, readers only load them: a zero counter
+ * means no key hashing to it is in the dictionary, so the search can be skipped.
+ * Counters that saturate stay at FILTER_STICKY until the filter is cleared, that can only
+ * cause false positives.
+ */
+
+#define FILTER_SEED 0x44494354 //"DICT"
+
+u32 filter_hash(const char *key, size_t key_length)
+{
+    return jhash(key, key_length, FILTER_SEED);
+}
+
+//Fills the counter indexes of a key
+static void filter_indexes(u32 hash, u32 *indexes)
+{
+    u32 step;
+    int i;
+
+    step = (hash >> FILTER_ORDER) | 1;//Odd: every index is different from the one before
+    for (i = 0; i < FILTER_HASHES; ++i)
+    {
+        indexes[i] = (hash + i * step) & (FILTER_SIZE - 1);
+    }
+}
+
+void filter_init(pdictionary dict)
+{
+    dict->filter = (u8*)kvzalloc(FILTER_SIZE, GFP_KERNEL);
+    atomic64_set(&dict->filtered_misses, 0);
+}
+
+void filter_destroy(pdictionary dict)
+{
+    kvfree(dict->filter);
+    dict->filter = NULL;
+}
+
+void filter_add(pdictionary dict, u32 hash)
+{
+    u32 indexes[FILTER_HASHES];
+    int i;
+
+    if (dict->filter == NULL)
+        return;
+    filter_indexes(hash, indexes);
+    for (i = 0; i < FILTER_HASHES; ++i)
+    {
+        if (dict->filter[indexes[i]] != FILTER_STICKY)
+        {
+            WRITE_ONCE(dict->filter[indexes[i]], dict->filter[indexes[i]] + 1);
+        }
+    }
+}
+
+void filter_remove(pdictionary dict, u32 hash)
+{
+    u32 indexes[FILTER_HASHES];
+    int i;
+
+    if (dict->filter == NULL)
+        return;
+    filter_indexes(hash, indexes);
+    for (i = 0; i < FILTER_HASHES; ++i)
+    {
+        if (dict->filter[indexes[i]] != FILTER_STICKY && dict->filter[indexes[i]] != 0)
+        {
+            WRITE_ONCE(dict->filter[indexes[i]], dict->filter[indexes[i]] - 1);
+        }
+    }
+}
+
+void filter_clear(pdictionary dict)
+{
+    if (dict->filter == NULL)
+        return;
+    memset(dict->filter, 0, FILTER_SIZE);
+}
+
+bool filter_may_contain(pdictionary dict, u32 hash)
+{
+    u32 indexes[FILTER_HASHES];
+    int i;
+
+    if (dict->filter == NULL)
+        return true;
+    filter_indexes(hash, indexes);
+    for (i = 0; i < FILTER_HASHES; ++i)
+    {
+        if (READ_ONCE(dict->filter[indexes[i]]) == 0)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef _MODULE_FILTER_H
+#define _MODULE_FILTER_H
+
+#include "dictionary.h"
+
+//Counters of the filter of each namespace: 2^FILTER_ORDER bytes
+#define FILTER_ORDER  14
+#define FILTER_SIZE   (1u << FILTER_ORDER)
+//Counters each key increments
+#define FILTER_HASHES 3
+//A counter that reaches this value is never decremented again
+#define FILTER_STICKY 0xff
+
+/// @brief Allocates the counting Bloom filter of a dictionary. If it fails the dictionary works without it
+/// @param dict the dictionary
+void filter_init(pdictionary dict);
+
+/// @brief Frees the filter, call when nothing can use the dictionary anymore
+/// @param dict the dictionary
+void filter_destroy(pdictionary dict);
+
+/// @brief Hashes a key, the nodes keep the hash of their key in key_hash
+/// @param key the key
+/// @param key_length the length of the key
+/// @return the hash the filter functions take
+u32 filter_hash(const char *key, size_t key_length);
+
+/// @brief Adds a key to the filter, call with the mutex locked
+/// @param dict the dictionary
+/// @param hash the filter_hash of the key
+void filter_add(pdictionary dict, u32 hash);
+
+/// @brief Removes a key added before from the filter, call with the mutex locked
+/// @param dict the dictionary
+/// @param hash the filter_hash of the key
+void filter_remove(pdictionary dict, u32 hash);
+
+/// @brief Empties the filter, call with the mutex locked
+/// @param dict the dictionary
+void filter_clear(pdictionary dict);
+
+/// @brief Checks if a key could be in the dictionary. Doesn't need the mutex: without it the answer
+/// is true for the moment the counters were read
+/// @param dict the dictionary
+/// @param hash the filter_hash of the key
+/// @return false if the key is surely missing, true if it may be present
+bool filter_may_contain(pdictionary dict, u32 hash);
+
+#endif
@@ -0,0 +1,309 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "module.h"
+#include "filter.h"
+#include "hotkeys.h"
+
+/*
+ * Hot keys tracker: every CPU samples one access in hot_keys_sample and counts it in a Count-Min sketch of
+ * its own, then keeps the HOTKEYS_TOP keys with the highest estimates. Nothing is shared between CPUs
+ * on the path of the accesses: the lock of each CPU is only contended by the readers of the debugfs file,
+ * that add up the estimates of all the CPUs for the keys any of them tracks.
+ */
+
+/// @brief Key listed by the debugfs file: the name of the namespace is copied while the CPU that tracks it is locked,
+/// the namespace can be destroyed once it's unlocked
+struct hotkeys_candidate {
+    struct hotkeys_entry entry;
+    char name[DICTIONARY_NAME_MAX];
+};
+
+//Seeds of the rows of the sketch
+static const u32 hotkeys_seeds[HOTKEYS_DEPTH] = { 0x0, 0x9e3779b9, 0x7f4a7c15, 0x85ebca6b };
+
+static struct hotkeys_cpu __percpu *hotkeys = NULL;
+static struct dentry *hotkeys_dir = NULL;
+
+//The same key in two namespaces is two keys
+#define hotkeys_hash(dict, key, key_length) (filter_hash(key, key_length) ^ hash_ptr(dict, 32))
+#define hotkeys_counter(cpu, kind, row, hash) (&(cpu)->sketch[kind][row][hash_32((hash) ^ hotkeys_seeds[row], HOTKEYS_BITS)])
+
+//Estimate of the sampled accesses of a key counted by a CPU, call with its lock taken
+static u32 hotkeys_estimate(struct hotkeys_cpu *cpu, unsigned int kind, u32 hash)
+{
+    u32 estimate = U32_MAX;
+    int row;
+
+    for (row = 0; row < HOTKEYS_DEPTH; ++row)
+    {
+        estimate = min(estimate, *hotkeys_counter(cpu, kind, row, hash));
+    }
+    return estimate;
+}
+
+//Puts the key among the top ones of the CPU if its estimate beats the lowest of them, call with the lock taken
+static void hotkeys_top_update(struct hotkeys_entry *top, pdictionary dict, u32 hash,
+    const char *key, size_t key_length, u32 estimate)
+{
+    struct hotkeys_entry *lowest = &top[0];
+    int i;
+
+    for (i = 0; i < HOTKEYS_TOP; ++i)
+    {
+        if (top[i].dict == dict && top[i].hash == hash)
+        {
+            top[i].count = estimate;
+            return;
+        }
+        if (top[i].count < lowest->count)
+        {
+            lowest = &top[i];
+        }
+    }
+    //Free slots count zero: they are filled first
+    if (estimate <= lowest->count)
+        return;
+    lowest->dict = dict;
+    lowest->hash = hash;
+    lowest->count = estimate;
+    lowest->key_length = key_length;
+    memcpy(lowest->key, key, min_t(size_t, key_length, HOTKEYS_KEY_MAX));
+}
+
+void hotkeys_record(pdictionary dict, const char *key, size_t key_length, unsigned int kind)
+{
+    struct hotkeys_cpu *cpu;
+    unsigned int period = READ_ONCE(hot_keys_sample);
+    u32 hash, *counter;
+    int row;
+
+    if (period == 0 || hotkeys == NULL)
+        return;
+    cpu = get_cpu_ptr(hotkeys);
+    if (++cpu->tick < period)
+    {
+        //Not sampled: the cost of the tracker is this increment
+        put_cpu_ptr(hotkeys);
+        return;
+    }
+    cpu->tick = 0;
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    hash = hotkeys_hash(dict, key, key_length);
+    spin_lock(&cpu->lock);
+    for (row = 0; row < HOTKEYS_DEPTH; ++row)
+    {
+        counter = hotkeys_counter(cpu, kind, row, hash);
+        if (*counter != U32_MAX)
+        {
+            (*counter)++;
+        }
+    }
+    hotkeys_top_update(cpu->top[kind], dict, hash, key, key_length, hotkeys_estimate(cpu, kind, hash));
+    spin_unlock(&cpu->lock);
+    put_cpu_ptr(hotkeys);
+}
+
+void hotkeys_forget(pdictionary dict)
+{
+    struct hotkeys_cpu *cpu;
+    int c, kind, i;
+
+    if (hotkeys == NULL)
+        return;
+    for_each_possible_cpu(c)
+    {
+        cpu = per_cpu_ptr(hotkeys, c);
+        spin_lock(&cpu->lock);
+        for (kind = 0; kind < HOTKEYS_KINDS; ++kind)
+        {
+            for (i = 0; i < HOTKEYS_TOP; ++i)
+            {
+                if (cpu->top[kind][i].dict == dict)
+                {
+                    memset(&cpu->top[kind][i], 0, sizeof(struct hotkeys_entry));
+                }
+            }
+        }
+        spin_unlock(&cpu->lock);
+    }
+}
+
+void hotkeys_reset(void)
+{
+    struct hotkeys_cpu *cpu;
+    int i;
+
+    if (hotkeys == NULL)
+        return;
+    for_each_possible_cpu(i)
+    {
+        cpu = per_cpu_ptr(hotkeys, i);
+        spin_lock(&cpu->lock);
+        cpu->tick = 0;
+        memset(cpu->sketch, 0, sizeof(cpu->sketch));
+        memset(cpu->top, 0, sizeof(cpu->top));
+        spin_unlock(&cpu->lock);
+    }
+}
+
+//Sampled accesses of a key counted by all the CPUs
+static u64 hotkeys_total(unsigned int kind, u32 hash)
+{
+    struct hotkeys_cpu *cpu;
+    u64 total = 0;
+    int c;
+
+    for_each_possible_cpu(c)
+    {
+        cpu = per_cpu_ptr(hotkeys, c);
+        spin_lock(&cpu->lock);
+        total += hotkeys_estimate(cpu, kind, hash);
+        spin_unlock(&cpu->lock);
+    }
+    return total;
+}
+
+u64 hotkeys_accesses(pdictionary dict, const char *key, size_t key_length, unsigned int kind)
+{
+    if (hotkeys == NULL)
+        return 0;
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    return hotkeys_total(kind, hotkeys_hash(dict, key, key_length));
+}
+
+//Sorts the candidates from the most accessed one
+static int hotkeys_compare(const void *a, const void *b)
+{
+    const struct hotkeys_candidate *x = (const struct hotkeys_candidate*)a, *y = (const struct hotkeys_candidate*)b;
+
+    if (x->entry.count != y->entry.count)
+        return x->entry.count < y->entry.count ? 1 : -1;
+    return 0;
+}
+
+//Prints the top keys of a kind of access, merging the ones of all the CPUs
+static void hotkeys_show_kind(struct seq_file *file, unsigned int kind, struct hotkeys_candidate *candidates,
+    unsigned int period)
+{
+    struct hotkeys_cpu *cpu;
+    size_t count = 0, i, j;
+    int c;
+
+    //The keys any CPU tracks, once each
+    for_each_possible_cpu(c)
+    {
+        cpu = per_cpu_ptr(hotkeys, c);
+        spin_lock(&cpu->lock);
+        for (i = 0; i < HOTKEYS_TOP; ++i)
+        {
+            if (cpu->top[kind][i].dict == NULL)
+                continue;
+            for (j = 0; j < count; ++j)
+            {
+                if (candidates[j].entry.dict == cpu->top[kind][i].dict && candidates[j].entry.hash == cpu->top[kind][i].hash)
+                    break;
+            }
+            if (j == count)
+            {
+                //hotkeys_forget takes this lock before the namespace is freed: it's still there
+                candidates[count].entry = cpu->top[kind][i];
+                strscpy(candidates[count].name, cpu->top[kind][i].dict->name, DICTIONARY_NAME_MAX);
+                count++;
+            }
+        }
+        spin_unlock(&cpu->lock);
+    }
+    //Their accesses on every CPU, also the ones where they are not among the top ones
+    for (j = 0; j < count; ++j)
+    {
+        candidates[j].entry.count = (u32)min_t(u64, hotkeys_total(kind, candidates[j].entry.hash), U32_MAX);
+    }
+    sort(candidates, count, sizeof(struct hotkeys_candidate), hotkeys_compare, NULL);
+
+    seq_printf(file, "# %s, one access in %u sampled\n", kind == HOTKEYS_READ ? "reads" : "writes", period);
+    for (j = 0; j < count && j < HOTKEYS_TOP; ++j)
+    {
+        seq_printf(file, "%llu\t%s\t%*pE%s\n", (u64)candidates[j].entry.count * period, candidates[j].name,
+            (int)min_t(size_t, candidates[j].entry.key_length, HOTKEYS_KEY_MAX), candidates[j].entry.key,
+            candidates[j].entry.key_length > HOTKEYS_KEY_MAX ? "..." : "");
+    }
+}
+
+static int hotkeys_show(struct seq_file *file, void *data)
+{
+    struct hotkeys_candidate *candidates;
+    unsigned int period = READ_ONCE(hot_keys_sample);
+
+    if (period == 0)
+    {
+        seq_puts(file, "# Disabled: set the hot_keys_sample param to track the keys\n");
+        return 0;
+    }
+    candidates = (struct hotkeys_candidate*)kvmalloc_array(num_possible_cpus() * HOTKEYS_TOP,
+        sizeof(struct hotkeys_candidate), GFP_KERNEL);
+    if (candidates == NULL)
+        return -ENOMEM;
+    hotkeys_show_kind(file, HOTKEYS_READ, candidates, period);
+    hotkeys_show_kind(file, HOTKEYS_WRITE, candidates, period);
+    kvfree(candidates);
+    return 0;
+}
+
+static int hotkeys_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hotkeys_show, NULL);
+}
+
+//Any write resets the counters
+static ssize_t hotkeys_write(struct file *file, const char __user *buffer, size_t length, loff_t *ppos)
+{
+    hotkeys_reset();
+    return (ssize_t)length;
+}
+
+static const struct file_operations hotkeys_fops = {
+    .owner =    THIS_MODULE,
+    .open =     hotkeys_open,
+    .read =     seq_read,
+    .write =    hotkeys_write,
+    .llseek =   seq_lseek,
+    .release =  single_release
+};
+
+void hotkeys_init(void)
+{
+    int i;
+
+    hotkeys = alloc_percpu(struct hotkeys_cpu);
+    if (hotkeys == NULL)
+    {
+        printk(KERN_WARNING "dictionary: the hot keys tracker could not be allocated.\n");
+        return;
+    }
+    for_each_possible_cpu(i)
+    {
+        spin_lock_init(&per_cpu_ptr(hotkeys, i)->lock);
+    }
+    //Without debugfs the keys are still counted, no one can read them
+    hotkeys_dir = debugfs_create_dir("dictionary", NULL);
+    debugfs_create_file("hot_keys", 0600, hotkeys_dir, NULL, &hotkeys_fops);
+}
+
+void hotkeys_destroy(void)
+{
+    debugfs_remove_recursive(hotkeys_dir);
+    hotkeys_dir = NULL;
+    free_percpu(hotkeys);
+    hotkeys = NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef _MODULE_HOTKEYS_H
+#define _MODULE_HOTKEYS_H
+
+#include <linux/spinlock.h>
+#include "dictionary.h"
+
+//Rows of the Count-Min sketch, each with its own hash of the key
+#define HOTKEYS_DEPTH 4
+//Counters of each row: 2^HOTKEYS_BITS
+#define HOTKEYS_BITS  9
+#define HOTKEYS_WIDTH (1u << HOTKEYS_BITS)
+//Keys each CPU tracks for each kind of access
+#define HOTKEYS_TOP   16
+//Bytes of the key kept by the tracker, longer keys are shown truncated
+#define HOTKEYS_KEY_MAX 48
+
+//Kinds of access
+#define HOTKEYS_READ  0
+#define HOTKEYS_WRITE 1
+#define HOTKEYS_KINDS 2
+
+/// @brief Key among the most accessed ones seen by a CPU
+struct hotkeys_entry {
+    pdictionary dict;           //Namespace of the key, NULL for a free slot
+    u32 hash;                   //Hash of the namespace and the key
+    u32 count;                  //Estimate of the sampled accesses, in the sketch of the CPU
+    size_t key_length;          //Length of the whole key
+    char key[HOTKEYS_KEY_MAX];  //Start of the key
+};
+
+/// @brief Sampled accesses counted by one CPU. Only that CPU updates it, lock is taken by the others to read it
+struct hotkeys_cpu {
+    spinlock_t lock;
+    unsigned int tick;          //Accesses since the last sampled one
+    u32 sketch[HOTKEYS_KINDS][HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+    struct hotkeys_entry top[HOTKEYS_KINDS][HOTKEYS_TOP];
+};
+
+/// @brief Allocates the per CPU counters and creates dictionary/hot_keys in debugfs.
+/// If it fails the module works without tracking the keys
+void hotkeys_init(void);
+
+/// @brief Removes the debugfs file and frees the counters, call before the namespaces are freed
+void hotkeys_destroy(void);
+
+/// @brief Counts an access to a key, one every hot_keys_sample accesses of the CPU. Doesn't need the mutex
+/// @param dict the namespace of the key
+/// @param key the key, kernel memory
+/// @param key_length the length of the key, zero if it's a string
+/// @param kind HOTKEYS_READ or HOTKEYS_WRITE
+void hotkeys_record(pdictionary dict, const char *key, size_t key_length, unsigned int kind);
+
+/// @brief Estimates how many accesses of a kind to a key were sampled, on all the CPUs.
+/// Count-Min sketches never underestimate: other keys can only add to the result
+/// @param dict the namespace of the key
+/// @param key the key
+/// @param key_length the length of the key, zero if it's a string
+/// @param kind HOTKEYS_READ or HOTKEYS_WRITE
+/// @return the sampled accesses, multiply by hot_keys_sample for all of them
+u64 hotkeys_accesses(pdictionary dict, const char *key, size_t key_length, unsigned int kind);
+
+/// @brief Drops the keys of a dictionary from the top ones, call before it's freed: the debugfs file reads its name
+/// @param dict the dictionary
+void hotkeys_forget(pdictionary dict);
+
+/// @brief Forgets all the accesses counted so far
+void hotkeys_reset(void);
+
+#endif
@@ -1,167 +1,1056 @@
-#include <linux/module.h>
-#include <linux/moduleparam.h>
-#include <linux/fs.h>
-#include <linux/init.h>
-#include <linux/miscdevice.h>
-#include <linux/poll.h>
-#include <linux/slab.h>
-#include "module.h"
-
-MODULE_AUTHOR("Riccardo Ciucci <riccardo@richie314.it>");
-MODULE_DESCRIPTION("Implementation of static dictionary controlled by a device file");
-MODULE_LICENSE("GPL");
-MODULE_VERSION("1.0");
-
-//Module params
-
-// Prints a lot of unnecessary data if true
-bool debug = false;
-
-// Executes a bunch of tests when the module is loaded
-bool tests = false;
-
-// Allow or not multiple read/writes on the dictionary
-static bool multi_command = true;
-
-// Max timeout that read/print will wait for keys, if 0 they will wait until killed
-static uint timeout = 0;
-
-//Device filename, when loaded
-#define DEVICE_FILE_NAME "dictionary"
-
-//The dictionary the module operates upon
-static dictionary_wrapper dictionary;
-
-static int misc_device_open(struct inode *inode, struct file *file)
-{
-    printd("misc device (" DEVICE_FILE_NAME ") file opened.\n");
-    return 0;
-}
-
-static int misc_device_close(struct inode *inode, struct file *file)
-{
-    printd("misc device (" DEVICE_FILE_NAME ") file closed.\n");
-    return 0;
-}
-
-static ssize_t misc_device_read(struct file *file, char __user *buffer, size_t len, loff_t *ppos)
-{
-    ssize_t res;
-    
-    if (buffer == NULL || len == 0 || ppos == NULL)
-    {
-        printk(KERN_ERR "misc_device_read failed because of bad output buffer.\n");
-        return -EINVAL;
-    }
-    if (*ppos > 0)
-    {
-        return 0;
-    }
-    res = dictionary_read_all(&dictionary, buffer, len, ppos);
-    if (res < 0)
-    {
-        printk(KERN_ERR "dictionary_read_all failed.\n");
-        return res;
-    }
-    printd("Bytes read: %d\n", (int)res);
-    return res;
-}
-
-static ssize_t misc_device_write(struct file *file, const char __user *buffer, size_t count, loff_t *ppos)
-{
-    int res;
-    
-    if (buffer == NULL || count == 0)
-    {
-        printk(KERN_ERR "misc_device_write failed because of NULL input.\n");
-        return -EINVAL;
-    } 
-    
-    res = parse_command(&dictionary, buffer, count, timeout, multi_command);
-
-    if (res == 0)
-    {
-        if (multi_command)
-        {
-            printk(KERN_ERR "All commands failed!\n");
-        }
-        return -EFAULT;
-    }
-    if (res < 0)
-    {
-        printk(KERN_ERR "Internal error of code %d.\n", res);
-        return res;
-    }
-    printk(KERN_DEBUG "Executed %d commands.\n", res);
-    return count;
-}
-
-static struct file_operations dictionary_fops = {
-    .owner =        THIS_MODULE,
-    .read =         misc_device_read,
-    .open =         misc_device_open,
-    .release =      misc_device_close,
-    .write =        misc_device_write,
-    .llseek         = no_llseek
-};
-
-static struct miscdevice dictionary_device = {
-    MISC_DYNAMIC_MINOR, DEVICE_FILE_NAME, &dictionary_fops
-};
-
-static __init int dictionary_module_init(void)
-{
-    int res;
-
-    res = misc_register(&dictionary_device);
-    printd("Misc Register returned %d\n", res);
-
-    res = dictionary_init(&dictionary);
-    if (res != 0)
-    {
-        printk(KERN_ALERT "dictionary_init failed! (code: %d)\n", res);
-        return 0;
-    }
-
-    printd("Debug activated.\n");
-    if (timeout != 0)
-    {
-        printk(KERN_INFO "Default timeout set to %d msecs.\n", (int)timeout);
-    } else {
-        printk(KERN_INFO "No timeout set. Reads will wait for missing keys indefinitely (or until they are killed).\n");
-    }
-    if (tests)
-    {
-        res = test_dictionary(&dictionary, timeout);
-        if (res == 0)
-        {
-            printk(KERN_INFO "test_dictionary: all tests succeded!\n");
-        } else {
-            printk(KERN_ALERT "test_dictionary: %d tests failed\n", res);
-        }
-    }
-    printk(KERN_INFO "dictionary: write \"-h\" to the device file to see the list of commands.\n");
-    return 0;
-}
-
-static __exit void dictionary_module_exit(void)
-{
-    int res;
-
-    res = dictionary_free(&dictionary);
-    if (res != 0)
-    {
-        printk(KERN_ALERT 
-            "dictionary_free failed with exit code of %d.\n"
-            "This could mean that the mutex was locked and it was impossible to unlock!\n", res);
-    }
-    misc_deregister(&dictionary_device);
-    printd("Module " DEVICE_FILE_NAME " removed.\n");
-}
-
-module_init(dictionary_module_init);
-module_exit(dictionary_module_exit);
-module_param(debug, bool, 0);
-module_param(tests, bool, 0);
-module_param(timeout, uint, 0);
-module_param(multi_command, bool, 0);
\ No newline at end of file
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/err.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/io_uring/cmd.h>
+#include "module.h"
+#include "namespace.h"
+#include "hotkeys.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "compression.h"
+
+MODULE_AUTHOR("Riccardo Ciucci <riccardo@richie314.it>");
+MODULE_DESCRIPTION("Implementation of static dictionary controlled by a device file");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("1.0");
+
+//Module params
+
+// Prints a lot of unnecessary data if true
+bool debug = false;
+
+// Executes a bunch of tests when the module is loaded
+bool tests = false;
+
+// Commands of the parser benchmark run when the module is loaded, if 0 it's not run
+static uint benchmark = 0;
+
+// Allow or not multiple read/writes on the dictionary
+static bool multi_command = true;
+
+// Max timeout that read/print will wait for keys, if 0 they will wait until killed
+static uint timeout = 0;
+
+// Max bytes keys and values of a new namespace can use, if 0 there is no limit
+static ulong namespace_memory_limit = 0;
+
+// Values of at least this many bytes are stored compressed, if 0 compression is disabled. Can be changed at runtime
+uint compress_threshold = 0;
+
+// Identical values and the common prefixes of the keys are stored once. Can be changed at runtime, for the new writes
+bool dedup = false;
+
+// Short values are placed one after the other in 2MB arena segments, compacted in background. Can be changed at runtime
+bool use_arena = false;
+
+// Each NUMA node keeps copies of the short values read lately, read without the mutex. Set at load time
+bool numa_replicas = false;
+
+// Appends waiting for the mutex are applied together by the task that takes it. Can be changed at runtime
+bool combine_appends = true;
+
+// One access to the keys every this many on each CPU is counted by the hot keys tracker, if 0 nothing is counted.
+// Can be changed at runtime
+uint hot_keys_sample = 0;
+
+// Changes are logged to this file and replayed from it when the module is loaded, if empty there is no log. Set at load time
+char wal_path[256] = "";
+
+// The writer thread of the log writes and syncs the queued records at least every this many msecs. Can be changed at runtime
+uint wal_flush_ms = 10;
+
+// ... or as soon as this many bytes of records are queued. Can be changed at runtime
+uint wal_batch = 65536;
+
+// Compressor used for the values: "lz4" (faster) or "lz4hc" (smaller). Can be changed at runtime
+char compress_algorithm[8] = COMPRESSION_LZ4;
+
+//Device filename, when loaded
+#define DEVICE_FILE_NAME "dictionary"
+
+/// @brief State of an open file of the device, kept in file->private_data
+struct dictionary_file {
+    struct mutex mutex;         //Protects the fields below
+    pdictionary dict;           //The namespace the file operates upon
+    u32 read_mode;              //One of DICTIONARY_READ_*
+    u32 write_mode;             //One of DICTIONARY_WRITE_*
+    u64 timeout_us;             //usecs reads wait for missing keys
+    char *snapshot;             //Snapshot or delta being streamed by reads
+    size_t snapshot_size;
+    u64 generation;             //Last change the reads in DICTIONARY_READ_DELTA mode have returned
+    struct snapshot_loader *loader; //Bulk load in progress
+    char *key;                  //Key read in DICTIONARY_READ_VALUE mode
+    size_t key_length;
+    struct dictionary_watcher watcher; //Watches completed for this file
+    struct command_results results; //Result lines of the text commands, returned by the next reads
+};
+
+#define file_dictionary(file) (((struct dictionary_file*)(file)->private_data)->dict)
+
+static int misc_device_open(struct inode *inode, struct file *file)
+{
+    struct dictionary_file *state;
+
+    state = (struct dictionary_file*)kzalloc(sizeof(struct dictionary_file), GFP_KERNEL);
+    if (state == NULL)
+    {
+        return -ENOMEM;
+    }
+    mutex_init(&state->mutex);
+    state->dict = namespace_default();
+    state->read_mode = DICTIONARY_READ_TEXT;
+    state->write_mode = DICTIONARY_WRITE_COMMANDS;
+    state->timeout_us = (u64)timeout * USEC_PER_MSEC;
+    dictionary_watcher_init(&state->watcher);
+    command_results_init(&state->results);
+    file->private_data = state;
+    //Non blocking operations never sleep: io_uring can issue them inline
+    file->f_mode |= FMODE_NOWAIT;
+    printd("misc device (" DEVICE_FILE_NAME ") file opened.\n");
+    return 0;
+}
+
+//Inserts the keys bulk loaded so far and stops the bulk load, call with state->mutex locked
+static int misc_device_end_bulk_load(struct dictionary_file *state)
+{
+    int res;
+
+    if (state->loader == NULL)
+        return 0;
+    res = snapshot_loader_commit(state->loader, state->dict);
+    snapshot_loader_free(state->loader);
+    state->loader = NULL;
+    return res;
+}
+
+static int misc_device_close(struct inode *inode, struct file *file)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    int res;
+
+    res = misc_device_end_bulk_load(state);
+    if (res != 0)
+    {
+        printk(KERN_ERR "Bulk load into namespace \"%s\" failed with code %d.\n", state->dict->name, res);
+    }
+    dictionary_unwatch_all(state->dict, &state->watcher);
+    kvfree(state->snapshot);
+    kfree(state->key);
+    command_results_free(&state->results);
+    kfree(state);
+    file->private_data = NULL;
+    printd("misc device (" DEVICE_FILE_NAME ") file closed.\n");
+    return 0;
+}
+
+//Flags of the dictionary operations started through a file
+#define misc_device_flags(file, nowait) (((((file)->f_flags & O_NONBLOCK) || (nowait)) ? DICTIONARY_NONBLOCK : 0) | \
+    (((file)->f_flags & O_DSYNC) ? DICTIONARY_SYNC : 0))
+
+//Locks the state of the file, non blocking operations only try to
+static bool misc_device_lock(struct dictionary_file *state, unsigned int flags)
+{
+    if (flags & DICTIONARY_NONBLOCK)
+        return mutex_trylock(&state->mutex);
+    mutex_lock(&state->mutex);
+    return true;
+}
+
+//Streams a binary snapshot or a delta, taken when the first read happens
+static ssize_t misc_device_read_snapshot(struct dictionary_file *state, char __user *buffer, size_t len, loff_t *ppos, unsigned int flags)
+{
+    ssize_t res;
+
+    if (!misc_device_lock(state, flags))
+        return -EAGAIN;
+    if (*ppos == 0 || state->snapshot == NULL)
+    {
+        kvfree(state->snapshot);
+        state->snapshot = NULL;
+        if (state->read_mode == DICTIONARY_READ_DELTA)
+        {
+            //The next delta starts where this one ends
+            res = dictionary_read_delta(state->dict, state->generation, &state->snapshot, &state->generation, flags);
+        } else {
+            res = snapshot_save(state->dict, &state->snapshot, flags);
+        }
+        if (res < 0)
+        {
+            mutex_unlock(&state->mutex);
+            return res;
+        }
+        state->snapshot_size = (size_t)res;
+        *ppos = 0;
+    }
+    res = simple_read_from_buffer(buffer, len, ppos, state->snapshot, state->snapshot_size);
+    mutex_unlock(&state->mutex);
+    return res;
+}
+
+//What a read of the selected key needs, copied out of the state of the file
+struct misc_device_key {
+    pdictionary dict;
+    char *key;
+    size_t key_length;
+    u64 timeout_us;
+};
+
+//Copies the selected key, so the read can wait for it without holding state->mutex. 
+//The copy of the key must be freed with kfree()
+static int misc_device_select(struct dictionary_file *state, unsigned int flags, struct misc_device_key *selected)
+{
+    int res = 0;
+
+    if (!misc_device_lock(state, flags))
+        return -EAGAIN;
+    if (state->key == NULL)
+    {
+        //DICTIONARY_IOC_SELECT_KEY was never sent
+        res = -EINVAL;
+    } else {
+        selected->dict = state->dict;
+        selected->key_length = state->key_length;
+        selected->timeout_us = state->timeout_us;
+        selected->key = (char*)kmemdup(state->key, state->key_length, 
+            (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+        if (selected->key == NULL)
+            res = (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    }
+    mutex_unlock(&state->mutex);
+    return res;
+}
+
+//Reads the value of the selected key, from the file offset
+static ssize_t misc_device_read_value(struct dictionary_file *state, char __user *buffer, size_t len, loff_t *ppos, unsigned int flags)
+{
+    struct misc_device_key selected;
+    ssize_t res;
+
+    res = misc_device_select(state, flags, &selected);
+    if (res != 0)
+        return res;
+    res = dictionary_read(selected.dict, selected.key, selected.key_length, buffer, len, 
+        selected.timeout_us, flags, ppos);
+    kfree(selected.key);
+    return res;
+}
+
+//Read in the current read mode of the file
+static ssize_t misc_device_read_flags(struct file *file, char __user *buffer, size_t len, loff_t *ppos, unsigned int flags)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    ssize_t res;
+    
+    if (buffer == NULL || len == 0 || ppos == NULL)
+    {
+        printd("misc_device_read failed because of bad output buffer.\n");
+        return -EINVAL;
+    }
+    if (state->read_mode == DICTIONARY_READ_SNAPSHOT || state->read_mode == DICTIONARY_READ_DELTA)
+    {
+        return misc_device_read_snapshot(state, buffer, len, ppos, flags);
+    }
+    if (state->read_mode == DICTIONARY_READ_VALUE)
+    {
+        return misc_device_read_value(state, buffer, len, ppos, flags);
+    }
+    //The results of the commands written through this file come first
+    res = command_results_read(&state->results, buffer, len, flags);
+    if (res != -ENODATA)
+    {
+        return res;
+    }
+    if (*ppos > 0)
+    {
+        return 0;
+    }
+    res = dictionary_read_all(file_dictionary(file), buffer, len, flags, ppos);
+    if (res < 0)
+    {
+        printd("dictionary_read_all failed.\n");
+        return res;
+    }
+    printd("Bytes read: %d\n", (int)res);
+    return res;
+}
+
+static ssize_t misc_device_read(struct file *file, char __user *buffer, size_t len, loff_t *ppos)
+{
+    return misc_device_read_flags(file, buffer, len, ppos, misc_device_flags(file, false));
+}
+
+//User buffer and length of the segment of a user backed iov_iter that comes next
+static void __user *misc_device_segment(const struct iov_iter *iter, size_t *length)
+{
+    //A ubuf iter is a single segment of count bytes
+    *length = iter_is_ubuf(iter) ? iov_iter_count(iter) : min(iov_iter_count(iter), iter_iov_len(iter));
+    return iter_iov_addr(iter);
+}
+
+static ssize_t misc_device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file = iocb->ki_filp;
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    unsigned int flags = misc_device_flags(file, iocb->ki_flags & IOCB_NOWAIT);
+    struct misc_device_key selected;
+    char __user *buffer;
+    size_t length;
+    ssize_t res = 0, total = 0;
+
+    if (state->read_mode == DICTIONARY_READ_VALUE)
+    {
+        //The value is copied straight into the iter, whatever memory backs it
+        res = misc_device_select(state, flags, &selected);
+        if (res != 0)
+            return res;
+        res = dictionary_read_iter(selected.dict, selected.key, selected.key_length, to, 
+            selected.timeout_us, flags, &iocb->ki_pos);
+        kfree(selected.key);
+        return res;
+    }
+    //The other modes close a view and read into one user buffer at a time: they can't be served without
+    //sleeping, io_uring tries them again from a worker
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+    if (!user_backed_iter(to))
+        return -EINVAL;
+    while (iov_iter_count(to) > 0)
+    {
+        buffer = (char __user*)misc_device_segment(to, &length);
+        res = misc_device_read_flags(file, buffer, length, &iocb->ki_pos, flags);
+        if (res <= 0)
+            break;
+        iov_iter_advance(to, res);
+        total += res;
+        if ((size_t)res < length)
+            break;
+    }
+    return total > 0 ? total : res;
+}
+
+//Moves the value of the selected key into a pipe: chunked values are not copied at all
+static ssize_t misc_device_splice_read(struct file *file, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    unsigned int dictionary_flags = misc_device_flags(file, flags & SPLICE_F_NONBLOCK);
+    struct misc_device_key selected;
+    ssize_t res;
+
+    if (state->read_mode != DICTIONARY_READ_VALUE)
+        return -EINVAL;
+    res = misc_device_select(state, dictionary_flags, &selected);
+    if (res != 0)
+        return res;
+    res = dictionary_splice_read(selected.dict, selected.key, selected.key_length, pipe, len, 
+        selected.timeout_us, dictionary_flags, ppos);
+    kfree(selected.key);
+    return res;
+}
+
+//Parses a piece of a binary snapshot
+static ssize_t misc_device_write_bulk_load(struct dictionary_file *state, const char __user *buffer, size_t count, unsigned int flags)
+{
+    ssize_t res;
+
+    if (!misc_device_lock(state, flags))
+        return -EAGAIN;
+    if (state->loader == NULL)
+    {
+        state->loader = snapshot_loader_create();
+        if (state->loader == NULL)
+        {
+            mutex_unlock(&state->mutex);
+            return -ENOMEM;
+        }
+    }
+    res = snapshot_loader_write(state->loader, buffer, count, true);
+    mutex_unlock(&state->mutex);
+    return res;
+}
+
+//Executes the commands of a write, or a segment of misc_device_write_iter. Text commands are split on '|' only 
+//if multiple is true. *consumed grows by the bytes that don't have to be sent again, 1 is returned if the commands 
+//after them were not executed
+static int misc_device_execute(struct file *file, const char *commands, size_t length, unsigned int flags, bool binary, 
+    bool multiple, int *executed, size_t *consumed)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    struct command_options options;
+    size_t done = length;
+    int res;
+
+    if (length == 0)
+        return 0;
+    options.timeout_us = state->timeout_us;
+    //The commands have been copied: their values are kernel memory
+    options.flags = flags | DICTIONARY_KERNEL;
+    options.results = &state->results;
+    if (binary)
+    {
+        res = parse_binary_commands(file_dictionary(file), commands, length, &options, &done);
+    } else if (multiple)
+    {
+        res = parse_command(file_dictionary(file), commands, length, &options, true, &done);
+    } else {
+        //A single command returns its own result: zero when it was executed
+        res = parse_command(file_dictionary(file), commands, length, &options, false, &done);
+        res = res == 0 ? 1 : (res > 0 ? 0 : res);
+    }
+    if (res <= 0)
+        return res == 0 ? -EFAULT : res;
+    *executed += res;
+    *consumed += done;
+    return done < length ? 1 : 0;
+}
+
+//Binary records are chosen by the write mode or by the first byte of the write
+static bool misc_device_is_binary(struct dictionary_file *state, const char __user *buffer, size_t count)
+{
+    u8 first;
+
+    if (state->write_mode == DICTIONARY_WRITE_BINARY)
+        return true;
+    return count > 0 && get_user(first, (const u8 __user*)buffer) == 0 && first == DICTIONARY_WIRE_MAGIC;
+}
+
+//Copies the records once, then parses them without touching user memory again
+static ssize_t misc_device_write_binary(struct file *file, const char __user *buffer, size_t count, unsigned int flags)
+{
+    char *records;
+    size_t consumed = 0;
+    int res, executed = 0;
+
+    //Records can't be split between writes: the ones past the limit are left to the next write
+    count = min_t(size_t, count, DICTIONARY_MAX_WRITE);
+    records = (char*)kvmalloc(count, GFP_KERNEL);
+    if (records == NULL)
+        return -ENOMEM;
+    if (copy_from_user(records, buffer, count) != 0)
+    {
+        kvfree(records);
+        return -EFAULT;
+    }
+    res = misc_device_execute(file, records, count, flags, true, true, &executed, &consumed);
+    kvfree(records);
+    if (executed == 0)
+    {
+        printd("All commands failed!\n");
+        return res;
+    }
+    printd("Executed %d commands.\n", executed);
+    //Only the records executed: the one that failed and the ones after it can be sent again
+    return consumed;
+}
+
+static ssize_t misc_device_write(struct file *file, const char __user *buffer, size_t count, loff_t *ppos)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    struct command_options options;
+    char *commands;
+    size_t consumed;
+    int res;
+    
+    if (buffer == NULL || count == 0)
+    {
+        printd("misc_device_write failed because of NULL input.\n");
+        return -EINVAL;
+    } 
+    if (state->write_mode == DICTIONARY_WRITE_BULK_LOAD)
+    {
+        return misc_device_write_bulk_load(state, buffer, count, misc_device_flags(file, false));
+    }
+    if (misc_device_is_binary(state, buffer, count))
+    {
+        return misc_device_write_binary(file, buffer, count, misc_device_flags(file, false));
+    }
+    
+    if (count > DICTIONARY_MAX_WRITE)
+    {
+        return -E2BIG;
+    }
+    //The parser works on kernel memory: the commands are copied once
+    commands = (char*)kvmalloc(count, (file->f_flags & O_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (commands == NULL)
+    {
+        return (file->f_flags & O_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    }
+    if (copy_from_user(commands, buffer, count) != 0)
+    {
+        kvfree(commands);
+        return -EFAULT;
+    }
+    options.timeout_us = state->timeout_us;
+    options.flags = misc_device_flags(file, false) | DICTIONARY_KERNEL;
+    options.results = &state->results;
+    res = parse_command(file_dictionary(file), commands, count, &options, multi_command, &consumed);
+    kvfree(commands);
+
+    if (res == 0)
+    {
+        if (multi_command)
+        {
+            printd("All commands failed!\n");
+        }
+        return -EFAULT;
+    }
+    if (res < 0)
+    {
+        printd("Internal error of code %d.\n", res);
+        return res;
+    }
+    printd("Executed %d commands.\n", res);
+    //Less than count if a non blocking command stopped the ones after it
+    return consumed;
+}
+
+//Scatter-gather write: each segment is a single command, so its value can start with '-' and hold '|'
+static ssize_t misc_device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    unsigned int flags = misc_device_flags(file, iocb->ki_flags & IOCB_NOWAIT);
+    size_t count = iov_iter_count(from), length, index = 0, consumed = 0;
+    const char __user *segment;
+    char *commands;
+    int res = 0, executed = 0;
+    ssize_t loaded;
+    bool binary = false;
+
+    if (count == 0)
+        return 0;
+    if (state->write_mode == DICTIONARY_WRITE_BULK_LOAD)
+    {
+        //Snapshots can be split anywhere: each segment is just the next piece
+        if (!user_backed_iter(from))
+            return -EINVAL;
+        while (iov_iter_count(from) > 0)
+        {
+            segment = (const char __user*)misc_device_segment(from, &length);
+            loaded = misc_device_write_bulk_load(state, segment, length, flags);
+            if (loaded < 0)
+                return loaded;
+            iov_iter_advance(from, length);
+        }
+        return count;
+    }
+
+    if (user_backed_iter(from))
+    {
+        binary = misc_device_is_binary(state, (const char __user*)misc_device_segment(from, &length), length);
+    }
+    if (count > DICTIONARY_MAX_WRITE)
+    {
+        if (!binary)
+            return -E2BIG;
+        //Records can't be split between writes: the ones past the limit are left to the next write
+        count = DICTIONARY_MAX_WRITE;
+    }
+
+    //The parser works on kernel memory: every segment is copied once, and never by user space
+    commands = (char*)kvmalloc(count, (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (commands == NULL)
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    if (!user_backed_iter(from) || binary)
+    {
+        //Kernel memory (splice, io_uring registered buffers): no segments to follow, it's a normal write.
+        //Binary records carry their own lengths, so segments mean nothing to them either
+        if (!copy_from_iter_full(commands, count, from))
+        {
+            res = -EFAULT;
+        } else {
+            binary = binary || state->write_mode == DICTIONARY_WRITE_BINARY || (u8)commands[0] == DICTIONARY_WIRE_MAGIC;
+            res = misc_device_execute(file, commands, count, flags, binary, multi_command, &executed, &consumed);
+        }
+        index = count;
+    }
+    while (res == 0 && index < count)
+    {
+        misc_device_segment(from, &length);
+        if (length == 0)
+        {
+            //Moves past the empty segment
+            iov_iter_advance(from, 0);
+            continue;
+        }
+        if (copy_from_iter(&commands[index], length, from) != length)
+        {
+            res = -EFAULT;
+            break;
+        }
+        res = misc_device_execute(file, &commands[index], length, flags, false, false, &executed, &consumed);
+        index += length;
+        if (!multi_command)
+        {
+            //Like a write: what follows the first command is ignored
+            break;
+        }
+    }
+    kvfree(commands);
+    if (executed == 0)
+    {
+        printd("All commands failed!\n");
+        return res;
+    }
+    printd("Executed %d commands.\n", executed);
+    //The commands before the failed one were executed
+    return res == 0 ? (ssize_t)count : (ssize_t)consumed;
+}
+
+//A file is readable when one of its watches has completed
+static __poll_t misc_device_poll(struct file *file, poll_table *wait)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &state->watcher.poll_queue, wait);
+    if (dictionary_watch_ready(&state->watcher))
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+//Registers a watch on a key of the current namespace
+static long misc_device_watch(struct dictionary_file *state, const struct dictionary_watch_arg *watch_arg)
+{
+    char *key;
+    long res;
+
+    if (watch_arg->key_length == 0)
+        return -EINVAL;
+    key = (char*)memdup_user(u64_to_user_ptr(watch_arg->key), watch_arg->key_length);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
+    res = dictionary_watch(state->dict, &state->watcher, key, watch_arg->key_length, watch_arg->cookie, watch_arg->eventfd);
+    kfree(key);
+    return res;
+}
+
+//Binary read of a value, shared by the ioctls and io_uring. With a condition the value is read only if it doesn't match
+static long misc_device_get(struct file *file, const struct dictionary_kv_arg *kv_arg, unsigned int flags, 
+    struct dictionary_condition *condition)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    loff_t pos = (loff_t)kv_arg->offset;
+    char *key;
+    long res;
+
+    if (kv_arg->key_length == 0 || kv_arg->value_length == 0 || pos < 0)
+        return -EINVAL;
+    key = (char*)memdup_user(u64_to_user_ptr(kv_arg->key), kv_arg->key_length);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
+    //The result must fit the int of an io_uring completion
+    if (condition != NULL)
+    {
+        res = dictionary_read_if_changed(state->dict, key, kv_arg->key_length, u64_to_user_ptr(kv_arg->value), 
+            min_t(size_t, kv_arg->value_length, INT_MAX), state->timeout_us, flags, &pos, condition);
+    } else {
+        res = dictionary_read(state->dict, key, kv_arg->key_length, u64_to_user_ptr(kv_arg->value), 
+            min_t(size_t, kv_arg->value_length, INT_MAX), state->timeout_us, flags, &pos);
+    }
+    kfree(key);
+    return res;
+}
+
+//Binary write of a value, or of the range from kv_arg->offset, shared by the ioctls and io_uring
+static long misc_device_set(struct file *file, const struct dictionary_kv_arg *kv_arg, unsigned int flags, bool range)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    char *key;
+    long res;
+
+    if (kv_arg->key_length == 0 || (range && (kv_arg->value_length == 0 || kv_arg->offset > SIZE_MAX)))
+        return -EINVAL;
+    key = (char*)memdup_user(u64_to_user_ptr(kv_arg->key), kv_arg->key_length);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
+    //The value is copied only once, by the dictionary
+    if (range)
+    {
+        res = dictionary_write_range(state->dict, key, kv_arg->key_length, (size_t)kv_arg->offset, 
+            u64_to_user_ptr(kv_arg->value), kv_arg->value_length, flags);
+    } else {
+        res = dictionary_write(state->dict, key, kv_arg->key_length, 
+            u64_to_user_ptr(kv_arg->value), kv_arg->value_length, flags);
+    }
+    kfree(key);
+    if (res > 0)
+    {
+        //Deleting a missing key or an interrupted wait for the mutex
+        return kv_arg->value_length == 0 ? -ENOENT : -EINTR;
+    }
+    return res;
+}
+
+//Operation on a list, set or hash value
+static long misc_device_typed(struct file *file, const struct dictionary_typed_arg *typed_arg)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    struct dictionary_typed_op op = { .op = typed_arg->op };
+    char *key, *member = NULL, *value = NULL;
+    bool output = typed_arg->op == DICTIONARY_LIST_POP_HEAD || typed_arg->op == DICTIONARY_LIST_POP_TAIL || 
+        typed_arg->op == DICTIONARY_HASH_GET;
+    long res;
+
+    if (typed_arg->key_length == 0)
+        return -EINVAL;
+    key = (char*)memdup_user(u64_to_user_ptr(typed_arg->key), typed_arg->key_length);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
+    //The elements are copied to the kernel once, here: the dictionary keeps them without copying again
+    member = typed_arg->member_length > 0 ? 
+        (char*)memdup_user(u64_to_user_ptr(typed_arg->member), typed_arg->member_length) : NULL;
+    value = !output && typed_arg->value_length > 0 ? 
+        (char*)memdup_user(u64_to_user_ptr(typed_arg->value), typed_arg->value_length) : NULL;
+    if (IS_ERR(member) || IS_ERR(value))
+    {
+        res = IS_ERR(member) ? PTR_ERR(member) : PTR_ERR(value);
+    } else {
+        op.member = member != NULL ? member : "";
+        op.member_length = typed_arg->member_length;
+        op.value = value;
+        op.value_length = value != NULL ? typed_arg->value_length : 0;
+        res = dictionary_typed(state->dict, key, typed_arg->key_length, &op, misc_device_flags(file, false));
+    }
+    if (res >= 0 && output)
+    {
+        if (op.result == NULL)
+        {
+            //Missing field
+            res = -ENOENT;
+        } else if (copy_to_user(u64_to_user_ptr(typed_arg->value), op.result, 
+            min_t(size_t, op.result_length, typed_arg->value_length)) != 0)
+        {
+            res = -EFAULT;
+        } else {
+            //The whole length, so that the caller can tell if its buffer was too small
+            res = (long)min_t(size_t, op.result_length, INT_MAX);
+        }
+        kvfree(op.result);
+    }
+    if (!IS_ERR(value))
+    {
+        kfree(value);
+    }
+    if (!IS_ERR(member))
+    {
+        kfree(member);
+    }
+    kfree(key);
+    return res;
+}
+
+//io_uring passthrough of DICTIONARY_IOC_GET, DICTIONARY_IOC_SET and DICTIONARY_IOC_SET_RANGE
+static int misc_device_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+    struct dictionary_kv_arg kv_arg;
+    const __u64 *arg = (const __u64*)io_uring_sqe_cmd(cmd->sqe);
+    unsigned int flags = misc_device_flags(cmd->file, issue_flags & IO_URING_F_NONBLOCK);
+
+    if (copy_from_user(&kv_arg, u64_to_user_ptr(READ_ONCE(*arg)), sizeof(kv_arg)) != 0)
+        return -EFAULT;
+    switch (cmd->cmd_op)
+    {
+        case DICTIONARY_IOC_GET:
+            return (int)misc_device_get(cmd->file, &kv_arg, flags, NULL);
+        case DICTIONARY_IOC_SET:
+        case DICTIONARY_IOC_SET_RANGE:
+            return (int)misc_device_set(cmd->file, &kv_arg, flags, cmd->cmd_op == DICTIONARY_IOC_SET_RANGE);
+    }
+    return -ENOTTY;
+}
+
+static long misc_device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct dictionary_file *state = (struct dictionary_file*)file->private_data;
+    struct dictionary_namespace_arg namespace_arg;
+    struct dictionary_stats_arg stats_arg;
+    struct dictionary_watch_arg watch_arg;
+    struct dictionary_key_arg key_arg;
+    struct dictionary_kv_arg kv_arg;
+    struct dictionary_get_if_arg get_if_arg;
+    struct dictionary_typed_arg typed_arg;
+    struct dictionary_condition condition;
+    pdictionary dict;
+    char *key;
+    __u64 limit, cookie;
+    __u32 mode;
+    int res;
+
+    switch (cmd)
+    {
+        case DICTIONARY_IOC_SELECT_NAMESPACE:
+            if (copy_from_user(&namespace_arg, (void __user*)arg, sizeof(namespace_arg)) != 0)
+                return -EFAULT;
+            namespace_arg.name[DICTIONARY_NAME_MAX - 1] = '\0';
+            dict = namespace_get(namespace_arg.name, (namespace_arg.flags & DICTIONARY_NAMESPACE_CREATE) != 0);
+            if (IS_ERR(dict))
+                return PTR_ERR(dict);
+            mutex_lock(&state->mutex);
+            if (dict != state->dict)
+            {
+                //Watches belong to the namespace they were registered on
+                dictionary_unwatch_all(state->dict, &state->watcher);
+            }
+            state->dict = dict;
+            mutex_unlock(&state->mutex);
+            printd("File moved to namespace \"%s\".\n", dict->name);
+            return 0;
+        case DICTIONARY_IOC_SET_MEMORY_LIMIT:
+            if (copy_from_user(&limit, (void __user*)arg, sizeof(limit)) != 0)
+                return -EFAULT;
+            return dictionary_set_memory_limit(state->dict, (size_t)limit);
+        case DICTIONARY_IOC_GET_STATS:
+            res = dictionary_get_stats(state->dict, &stats_arg);
+            if (res != 0)
+                return res;
+            if (copy_to_user((void __user*)arg, &stats_arg, sizeof(stats_arg)) != 0)
+                return -EFAULT;
+            return 0;
+        case DICTIONARY_IOC_SET_READ_MODE:
+            if (get_user(mode, (__u32 __user*)arg) != 0)
+                return -EFAULT;
+            if (mode != DICTIONARY_READ_TEXT && mode != DICTIONARY_READ_SNAPSHOT && mode != DICTIONARY_READ_VALUE &&
+                mode != DICTIONARY_READ_DELTA)
+                return -EINVAL;
+            mutex_lock(&state->mutex);
+            state->read_mode = mode;
+            kvfree(state->snapshot);
+            state->snapshot = NULL;
+            mutex_unlock(&state->mutex);
+            return 0;
+        case DICTIONARY_IOC_SET_WRITE_MODE:
+            if (get_user(mode, (__u32 __user*)arg) != 0)
+                return -EFAULT;
+            if (mode != DICTIONARY_WRITE_COMMANDS && mode != DICTIONARY_WRITE_BULK_LOAD && mode != DICTIONARY_WRITE_BINARY)
+                return -EINVAL;
+            mutex_lock(&state->mutex);
+            res = 0;
+            if (mode != DICTIONARY_WRITE_BULK_LOAD)
+            {
+                res = misc_device_end_bulk_load(state);
+            }
+            state->write_mode = mode;
+            mutex_unlock(&state->mutex);
+            return res;
+        case DICTIONARY_IOC_BULK_COMMIT:
+            mutex_lock(&state->mutex);
+            res = state->loader != NULL ? snapshot_loader_commit(state->loader, state->dict) : 0;
+            mutex_unlock(&state->mutex);
+            return res;
+        case DICTIONARY_IOC_WATCH:
+            if (copy_from_user(&watch_arg, (void __user*)arg, sizeof(watch_arg)) != 0)
+                return -EFAULT;
+            mutex_lock(&state->mutex);
+            res = misc_device_watch(state, &watch_arg);
+            mutex_unlock(&state->mutex);
+            return res;
+        case DICTIONARY_IOC_WATCH_POP:
+            res = dictionary_watch_pop(&state->watcher, &cookie);
+            if (res != 0)
+                return res;
+            if (put_user(cookie, (__u64 __user*)arg) != 0)
+                return -EFAULT;
+            return 0;
+        case DICTIONARY_IOC_SET_TIMEOUT:
+            if (get_user(mode, (__u32 __user*)arg) != 0)
+                return -EFAULT;
+            mutex_lock(&state->mutex);
+            state->timeout_us = (u64)mode * USEC_PER_MSEC;
+            mutex_unlock(&state->mutex);
+            return 0;
+        case DICTIONARY_IOC_SET_TIMEOUT_US:
+            if (get_user(limit, (__u64 __user*)arg) != 0)
+                return -EFAULT;
+            mutex_lock(&state->mutex);
+            state->timeout_us = limit;
+            mutex_unlock(&state->mutex);
+            return 0;
+        case DICTIONARY_IOC_SET_GENERATION:
+            if (get_user(limit, (__u64 __user*)arg) != 0)
+                return -EFAULT;
+            mutex_lock(&state->mutex);
+            state->generation = limit;
+            kvfree(state->snapshot);
+            state->snapshot = NULL;
+            mutex_unlock(&state->mutex);
+            return 0;
+        case DICTIONARY_IOC_SELECT_KEY:
+            if (copy_from_user(&key_arg, (void __user*)arg, sizeof(key_arg)) != 0)
+                return -EFAULT;
+            if (key_arg.key_length == 0 || key_arg.flags != 0)
+                return -EINVAL;
+            key = (char*)memdup_user(u64_to_user_ptr(key_arg.key), key_arg.key_length);
+            if (IS_ERR(key))
+                return PTR_ERR(key);
+            mutex_lock(&state->mutex);
+            kfree(state->key);
+            state->key = key;
+            state->key_length = key_arg.key_length;
+            file->f_pos = 0;
+            mutex_unlock(&state->mutex);
+            return 0;
+        case DICTIONARY_IOC_GET:
+        case DICTIONARY_IOC_SET:
+        case DICTIONARY_IOC_SET_RANGE:
+            if (copy_from_user(&kv_arg, (void __user*)arg, sizeof(kv_arg)) != 0)
+                return -EFAULT;
+            if (cmd == DICTIONARY_IOC_GET)
+                return misc_device_get(file, &kv_arg, misc_device_flags(file, false), NULL);
+            return misc_device_set(file, &kv_arg, misc_device_flags(file, false), cmd == DICTIONARY_IOC_SET_RANGE);
+        case DICTIONARY_IOC_GET_IF_CHANGED:
+            if (copy_from_user(&get_if_arg, (void __user*)arg, sizeof(get_if_arg)) != 0)
+                return -EFAULT;
+            condition.match = get_if_arg.match;
+            condition.version = get_if_arg.version;
+            condition.digest = get_if_arg.digest;
+            res = (int)misc_device_get(file, &get_if_arg.kv, misc_device_flags(file, false), &condition);
+            if (res < 0)
+                return res;
+            //The caller gets the version and the digest of the value also when it didn't change
+            if (put_user(condition.version, &((struct dictionary_get_if_arg __user*)arg)->version) != 0 ||
+                put_user(condition.digest, &((struct dictionary_get_if_arg __user*)arg)->digest) != 0)
+                return -EFAULT;
+            return res;
+        case DICTIONARY_IOC_TYPED:
+            if (copy_from_user(&typed_arg, (void __user*)arg, sizeof(typed_arg)) != 0)
+                return -EFAULT;
+            return misc_device_typed(file, &typed_arg);
+    }
+    return -ENOTTY;
+}
+
+//Waits until the changes made so far, by any file, are in the write-ahead log on disk
+static int misc_device_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    return wal_sync();
+}
+
+static struct file_operations dictionary_fops = {
+    .owner =        THIS_MODULE,
+    .read =         misc_device_read,
+    .read_iter =    misc_device_read_iter,
+    .splice_read =  misc_device_splice_read,
+    .open =         misc_device_open,
+    .release =      misc_device_close,
+    .write =        misc_device_write,
+    .write_iter =   misc_device_write_iter,
+    .unlocked_ioctl = misc_device_ioctl,
+    .poll =         misc_device_poll,
+    .fsync =        misc_device_fsync,
+    .uring_cmd =    misc_device_uring_cmd,
+    .llseek         = no_llseek
+};
+
+static struct miscdevice dictionary_device = {
+    MISC_DYNAMIC_MINOR, DEVICE_FILE_NAME, &dictionary_fops
+};
+
+static __init int dictionary_module_init(void)
+{
+    int res;
+
+    //The namespaces must exist before the device file can be opened
+    res = dictionary_cache_init();
+    if (res != 0)
+    {
+        printk(KERN_ALERT "dictionary_cache_init failed! (code: %d)\n", res);
+        return res;
+    }
+    res = namespace_init((size_t)namespace_memory_limit);
+    if (res != 0)
+    {
+        printk(KERN_ALERT "namespace_init failed! (code: %d)\n", res);
+        dictionary_cache_destroy();
+        return res;
+    }
+    hotkeys_init();
+    //Replayed before the device file exists: no change can slip in meanwhile
+    res = wal_init();
+    if (res != 0)
+    {
+        printk(KERN_ALERT "wal_init failed! (code: %d)\n", res);
+        hotkeys_destroy();
+        namespace_free_all();
+        dictionary_cache_destroy();
+        return res;
+    }
+
+    res = misc_register(&dictionary_device);
+    printd("Misc Register returned %d\n", res);
+
+    printd("Debug activated.\n");
+    if (timeout != 0)
+    {
+        printk(KERN_INFO "Default timeout set to %d msecs.\n", (int)timeout);
+    } else {
+        printk(KERN_INFO "No timeout set. Reads will wait for missing keys indefinitely (or until they are killed).\n");
+    }
+    kernel_param_lock(THIS_MODULE);
+    if (strcmp(compress_algorithm, COMPRESSION_LZ4) != 0 && strcmp(compress_algorithm, COMPRESSION_LZ4HC) != 0)
+    {
+        printk(KERN_WARNING "Unknown compress_algorithm \"%s\": values will be compressed with " COMPRESSION_LZ4 ".\n", compress_algorithm);
+    }
+    if (compress_threshold != 0)
+    {
+        printk(KERN_INFO "Values of at least %u bytes will be compressed with %s.\n", compress_threshold, compress_algorithm);
+    }
+    kernel_param_unlock(THIS_MODULE);
+    if (tests)
+    {
+        res = test_dictionary(namespace_default(), timeout);
+        if (res == 0)
+        {
+            printk(KERN_INFO "test_dictionary: all tests succeded!\n");
+        } else {
+            printk(KERN_ALERT "test_dictionary: %d tests failed\n", res);
+        }
+    }
+    if (benchmark != 0)
+    {
+        benchmark_parser(benchmark);
+        benchmark_appends(benchmark);
+    }
+    printk(KERN_INFO "dictionary: write \"-h\" to the device file to see the list of commands.\n");
+    return 0;
+}
+
+static __exit void dictionary_module_exit(void)
+{
+    misc_deregister(&dictionary_device);
+    //The last records are written before the namespaces go
+    wal_exit();
+    //The tracker points to the namespaces
+    hotkeys_destroy();
+    namespace_free_all();
+    dictionary_cache_destroy();
+    printd("Module " DEVICE_FILE_NAME " removed.\n");
+}
+
+module_init(dictionary_module_init);
+module_exit(dictionary_module_exit);
+module_param(debug, bool, 0);
+module_param(tests, bool, 0);
+module_param(benchmark, uint, 0);
+module_param(timeout, uint, 0);
+module_param(multi_command, bool, 0);
+module_param(namespace_memory_limit, ulong, 0);
+module_param(compress_threshold, uint, 0644);
+module_param(dedup, bool, 0644);
+module_param(use_arena, bool, 0644);
+module_param(numa_replicas, bool, 0);
+module_param(combine_appends, bool, 0644);
+module_param(hot_keys_sample, uint, 0644);
+module_param_string(wal_path, wal_path, sizeof(wal_path), 0);
+module_param(wal_flush_ms, uint, 0644);
+module_param(wal_batch, uint, 0644);
+module_param_string(compress_algorithm, compress_algorithm, sizeof(compress_algorithm), 0644);
\ No newline at end of file
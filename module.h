@@ -5,6 +5,16 @@
 
 extern bool debug;
 extern bool tests;
+extern uint compress_threshold;
+extern char compress_algorithm[];
+extern bool dedup;
+extern bool use_arena;
+extern bool numa_replicas;
+extern bool combine_appends;
+extern uint hot_keys_sample;
+extern char wal_path[];
+extern uint wal_flush_ms;
+extern uint wal_batch;
 
 #define printd(fmt, ...) if (debug) { printk(KERN_INFO "\t" fmt, ## __VA_ARGS__); }
 
@@ -14,4 +24,15 @@ extern bool tests;
 /// @return the number of tests failed
 int test_dictionary(pdictionary dict, uint timeout);
 
+/// @brief Measures the throughput of the text command parser
+/// @param commands number of commands of the batch to parse
+/// @return 0 on success, below zero if the batch couldn't be allocated
+int benchmark_parser(uint commands);
+
+/// @brief Measures the throughput of the appends to a single key, from 1, 2, 4... threads up to the online CPUs,
+/// with and without combine_appends
+/// @param appends number of appends of each round, split among its threads
+/// @return 0 on success, below zero if the namespace of the benchmark couldn't be created
+int benchmark_appends(uint appends);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include "module.h"
+
+//Max number of namespaces that can exist at the same time
+#define NAMESPACE_MAX_COUNT 64
+
+//The namespace files are attached to when opened, never freed until the module is removed
+static dictionary_wrapper default_namespace;
+
+//List of all the namespaces, protected by namespaces_mutex
+static LIST_HEAD(namespaces);
+static DEFINE_MUTEX(namespaces_mutex);
+static size_t namespaces_count = 0;
+static size_t namespaces_memory_limit = 0;
+
+static pdictionary namespace_find(const char* name)
+{
+    pdictionary dict;
+
+    list_for_each_entry(dict, &namespaces, namespace_list)
+    {
+        if (strncmp(dict->name, name, DICTIONARY_NAME_MAX) == 0)
+        {
+            return dict;
+        }
+    }
+    return NULL;
+}
+
+static void namespace_add(pdictionary dict, const char* name)
+{
+    strscpy(dict->name, name, DICTIONARY_NAME_MAX);
+    dict->memory_limit = namespaces_memory_limit;
+    list_add_tail(&dict->namespace_list, &namespaces);
+    ++namespaces_count;
+}
+
+int namespace_init(size_t memory_limit)
+{
+    int res;
+
+    namespaces_memory_limit = memory_limit;
+    res = dictionary_init(&default_namespace);
+    if (res != 0)
+    {
+        return res;
+    }
+    mutex_lock(&namespaces_mutex);
+    namespace_add(&default_namespace, DICTIONARY_DEFAULT_NAMESPACE);
+    mutex_unlock(&namespaces_mutex);
+    return 0;
+}
+
+pdictionary namespace_default(void)
+{
+    return &default_namespace;
+}
+
+pdictionary namespace_get(const char* name, bool create)
+{
+    pdictionary dict;
+
+    if (name == NULL || strnlen(name, DICTIONARY_NAME_MAX) == 0 || strnlen(name, DICTIONARY_NAME_MAX) == DICTIONARY_NAME_MAX)
+        return ERR_PTR(-EINVAL);
+
+    mutex_lock(&namespaces_mutex);
+    dict = namespace_find(name);
+    if (dict != NULL || !create)
+    {
+        mutex_unlock(&namespaces_mutex);
+        return dict != NULL ? dict : ERR_PTR(-ENOENT);
+    }
+    if (namespaces_count >= NAMESPACE_MAX_COUNT)
+    {
+        mutex_unlock(&namespaces_mutex);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    //The namespace needs to be created
+    dict = (pdictionary)kzalloc(sizeof(dictionary_wrapper), GFP_KERNEL);
+    if (dict == NULL)
+    {
+        mutex_unlock(&namespaces_mutex);
+        return ERR_PTR(-ENOMEM);
+    }
+    dictionary_init(dict);
+    namespace_add(dict, name);
+    mutex_unlock(&namespaces_mutex);
+    printd("Namespace \"%s\" created.\n", dict->name);
+    return dict;
+}
+
+void namespace_free_all(void)
+{
+    pdictionary dict, tmp;
+    int res;
+
+    mutex_lock(&namespaces_mutex);
+    list_for_each_entry_safe(dict, tmp, &namespaces, namespace_list)
+    {
+        res = dictionary_free(dict);
+        if (res != 0)
+        {
+            printk(KERN_ALERT 
+                "dictionary_free of namespace \"%s\" failed with exit code of %d.\n"
+                "This could mean that the mutex was locked and it was impossible to unlock!\n", dict->name, res);
+        }
+        list_del(&dict->namespace_list);
+        dictionary_destroy(dict);
+        if (dict != &default_namespace)
+        {
+            kfree(dict);
+        }
+    }
+    namespaces_count = 0;
+    mutex_unlock(&namespaces_mutex);
+}
@@ -0,0 +1,24 @@
+#ifndef _MODULE_NAMESPACE_H
+#define _MODULE_NAMESPACE_H
+
+#include "dictionary.h"
+
+/// @brief Initiates the list of namespaces and creates the default one
+/// @param memory_limit max bytes each new namespace can use, 0 for no limit
+/// @return zero for success, non zero otherwise
+int namespace_init(size_t memory_limit);
+
+/// @brief Returns the namespace every file starts from
+/// @return pointer to the default dictionary
+pdictionary namespace_default(void);
+
+/// @brief Searches a namespace by name
+/// @param name the name of the namespace, '\0' terminated
+/// @param create if true and the namespace is missing it is created
+/// @return the namespace, an ERR_PTR otherwise (-ENOENT if missing, -ENOSPC if too many namespaces exist)
+pdictionary namespace_get(const char* name, bool create);
+
+/// @brief Frees all the namespaces and their content
+void namespace_free_all(void);
+
+#endif
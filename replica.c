@@ -0,0 +1,289 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/hash.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/rculist.h>
+#include "module.h"
+#include "value.h"
+#include "filter.h"
+#include "collection.h"
+#include "replica.h"
+
+/*
+ * Per NUMA node copies of the short values read lately. A read first searches the replica of the node
+ * it runs on, under RCU and without the mutex: a hit touches only memory of that node. A miss reads the
+ * dictionary as usual and leaves a copy in the replica of its node while the mutex is still locked, so
+ * no write can slip between the read and the copy. Writers drop the copies of the keys they change from
+ * every replica before unlocking the mutex: a read that starts after a write never finds the old value.
+ * The copies are not charged to the memory limit: each replica holds at most REPLICA_BUCKETS * REPLICA_DEPTH.
+ */
+
+//Checks if the copy is the one of key
+static bool replica_entry_is(struct replica_entry *entry, u32 hash, const char *key, size_t key_length)
+{
+    return entry->key_hash == hash && entry->key_length == key_length && memcmp(entry->data, key, key_length) == 0;
+}
+//Takes the copy out of its bucket, readers using it keep it until replica_put. Call with the mutex locked
+static void replica_entry_drop(struct replica *replica, unsigned int bucket, struct replica_entry *entry)
+{
+    hlist_del_rcu(&entry->link);
+    replica->depth[bucket]--;
+    replica_put(entry);
+}
+
+void replica_init(pdictionary dict)
+{
+    int nid;
+
+    dict->replicas = NULL;
+    if (!numa_replicas)
+        return;
+    dict->replicas = (struct replica**)kcalloc(nr_node_ids, sizeof(struct replica*), GFP_KERNEL);
+    if (dict->replicas == NULL)
+        return;
+    for_each_node(nid)
+    {
+        //Nodes without memory get it from the closest one
+        dict->replicas[nid] = (struct replica*)kzalloc_node(sizeof(struct replica), GFP_KERNEL, nid);
+        if (dict->replicas[nid] == NULL)
+        {
+            //Still empty: freeing them is enough
+            for_each_node(nid)
+            {
+                kfree(dict->replicas[nid]);
+            }
+            kfree(dict->replicas);
+            dict->replicas = NULL;
+            return;
+        }
+    }
+}
+
+void replica_destroy(pdictionary dict)
+{
+    int nid;
+
+    if (dict->replicas == NULL)
+        return;
+    replica_clear(dict);
+    for_each_node(nid)
+    {
+        kfree(dict->replicas[nid]);
+    }
+    kfree(dict->replicas);
+    dict->replicas = NULL;
+}
+
+struct replica_entry* replica_get(pdictionary dict, const char *key, size_t key_length)
+{
+    struct replica *replica;
+    struct replica_entry *entry, *found = NULL;
+    u32 hash;
+
+    if (dict->replicas == NULL)
+        return NULL;
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    hash = filter_hash(key, key_length);
+    //A task moved to another node meanwhile only reads a remote copy
+    replica = dict->replicas[numa_node_id()];
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(entry, &replica->buckets[hash_32(hash, REPLICA_BITS)], link)
+    {
+        //A copy being dropped is skipped like a missing one
+        if (replica_entry_is(entry, hash, key, key_length) && refcount_inc_not_zero(&entry->refs))
+        {
+            found = entry;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    atomic64_inc(found != NULL ? &replica->hits : &replica->misses);
+    return found;
+}
+
+void replica_put(struct replica_entry *entry)
+{
+    if (refcount_dec_and_test(&entry->refs))
+    {
+        //Searches that started before the drop can still be looking at it
+        kfree_rcu(entry, rcu);
+    }
+}
+
+ssize_t replica_read(struct replica_entry *entry, char __user *buffer, size_t maxsize, loff_t *ppos, bool user)
+{
+    const char *value = replica_entry_value(entry);
+
+    if (!user)
+        return memory_read_from_buffer((char __force*)buffer, maxsize, ppos, value, entry->value_length);
+    return simple_read_from_buffer(buffer, maxsize, ppos, value, entry->value_length);
+}
+
+ssize_t replica_read_iter(struct replica_entry *entry, struct iov_iter *to, loff_t *ppos)
+{
+    size_t copied;
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (*ppos >= entry->value_length || iov_iter_count(to) == 0)
+        return 0;
+    copied = copy_to_iter(&replica_entry_value(entry)[*ppos], entry->value_length - *ppos, to);
+    if (copied == 0)
+        return -EFAULT;
+    *ppos += copied;
+    return (ssize_t)copied;
+}
+
+int replica_copy(struct replica_entry *entry, struct dictionary_condition *condition, char **value, size_t *value_length)
+{
+    bool matches;
+
+    if (condition != NULL)
+    {
+        //Same comparison as the one of the nodes
+        matches = ((condition->match & DICTIONARY_IF_VERSION) && condition->version == entry->version) ||
+            ((condition->match & DICTIONARY_IF_DIGEST) && condition->digest == entry->digest);
+        condition->version = entry->version;
+        condition->digest = entry->digest;
+        if (matches)
+        {
+            *value = NULL;
+            *value_length = 0;
+            return 0;
+        }
+    }
+    *value = (char*)kvmalloc(entry->value_length + 1, GFP_KERNEL);
+    if (*value == NULL)
+        return -ENOMEM;
+    //The '\0' is copied too
+    memcpy(*value, replica_entry_value(entry), entry->value_length + 1);
+    *value_length = entry->value_length;
+    return 0;
+}
+
+void replica_fill(pdictionary dict, const char *key, size_t key_length, pnode node, unsigned int flags)
+{
+    struct replica *replica;
+    struct replica_entry *entry, *old;
+    struct hlist_node *tmp;
+    const char *value;
+    unsigned int bucket;
+    int nid;
+
+    if (dict->replicas == NULL || node->value_length > REPLICA_MAX_VALUE)
+        return;
+    //Compressed, chunked and typed values need memory to be read: left to the next blocking read
+    if ((flags & DICTIONARY_NONBLOCK) && (node->flags & (NODE_COMPRESSED | NODE_CHUNKED | NODE_TYPED)))
+        return;
+    if (key_length == 0)
+    {
+        key_length = strlen(key);
+    }
+    nid = numa_node_id();
+    replica = dict->replicas[nid];
+    entry = (struct replica_entry*)kmalloc_node(sizeof(struct replica_entry) + key_length + node->value_length + 1,
+        ((flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL) | __GFP_NOWARN, nid);
+    if (entry == NULL)
+        return;
+    value = node_value_get(node);
+    if (value == NULL)
+    {
+        kfree(entry);
+        return;
+    }
+    if (node->flags & NODE_TYPED)
+    {
+        //The copy answers the conditional reads too
+        collection_digest(node);
+    }
+    refcount_set(&entry->refs, 1);
+    entry->key_hash = node->key_hash;
+    entry->key_length = key_length;
+    entry->value_length = node->value_length;
+    entry->version = node->created;
+    entry->digest = node->digest;
+    memcpy(entry->data, key, key_length);
+    memcpy(&entry->data[key_length], value, node->value_length);
+    entry->data[key_length + node->value_length] = '\0';
+    node_value_put(node, value);
+
+    //The copy made by another reader of the node is replaced, the oldest one dropped if the bucket is full
+    bucket = hash_32(entry->key_hash, REPLICA_BITS);
+    hlist_for_each_entry_safe(old, tmp, &replica->buckets[bucket], link)
+    {
+        if (replica_entry_is(old, entry->key_hash, key, key_length) ||
+            (tmp == NULL && replica->depth[bucket] >= REPLICA_DEPTH))
+        {
+            replica_entry_drop(replica, bucket, old);
+        }
+    }
+    hlist_add_head_rcu(&entry->link, &replica->buckets[bucket]);
+    replica->depth[bucket]++;
+}
+
+void replica_invalidate(pdictionary dict, u32 hash)
+{
+    struct replica *replica;
+    struct replica_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int bucket = hash_32(hash, REPLICA_BITS);
+    int nid;
+
+    if (dict->replicas == NULL)
+        return;
+    for_each_node(nid)
+    {
+        replica = dict->replicas[nid];
+        //Other keys of the same hash lose their copies too: the next read makes them again
+        hlist_for_each_entry_safe(entry, tmp, &replica->buckets[bucket], link)
+        {
+            if (entry->key_hash == hash)
+            {
+                replica_entry_drop(replica, bucket, entry);
+            }
+        }
+    }
+}
+
+void replica_clear(pdictionary dict)
+{
+    struct replica *replica;
+    struct replica_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int bucket;
+    int nid;
+
+    if (dict->replicas == NULL)
+        return;
+    for_each_node(nid)
+    {
+        replica = dict->replicas[nid];
+        for (bucket = 0; bucket < REPLICA_BUCKETS; ++bucket)
+        {
+            hlist_for_each_entry_safe(entry, tmp, &replica->buckets[bucket], link)
+            {
+                replica_entry_drop(replica, bucket, entry);
+            }
+        }
+    }
+}
+
+void replica_stats(pdictionary dict, struct dictionary_stats_arg *stats)
+{
+    int nid, slot;
+
+    if (dict->replicas == NULL)
+        return;
+    for_each_node(nid)
+    {
+        slot = min(nid, DICTIONARY_MAX_NUMA_NODES - 1);
+        stats->replica_hits[slot] += atomic64_read(&dict->replicas[nid]->hits);
+        stats->replica_misses[slot] += atomic64_read(&dict->replicas[nid]->misses);
+    }
+}
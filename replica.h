@@ -0,0 +1,115 @@
+#ifndef _MODULE_REPLICA_H
+#define _MODULE_REPLICA_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/cache.h>
+#include "dictionary.h"
+
+struct iov_iter;
+
+//Buckets of the replica of each NUMA node: 2^REPLICA_BITS
+#define REPLICA_BITS 6
+#define REPLICA_BUCKETS (1u << REPLICA_BITS)
+//Copies each bucket keeps, the oldest one is dropped to make room
+#define REPLICA_DEPTH 4
+//Longer values are always read from the dictionary
+#define REPLICA_MAX_VALUE PAGE_SIZE
+
+/// @brief Copy of the value of a key, in the memory of one NUMA node
+struct replica_entry {
+    struct hlist_node link;     //Inside a bucket of the replica
+    struct rcu_head rcu;
+    refcount_t refs;            //One for the bucket and one for each reader using the copy
+    u32 key_hash;               //filter_hash of the key
+    size_t key_length;
+    size_t value_length;
+    u64 version;                //node->created of the node the value was copied from
+    u32 digest;                 //node->digest of the node the value was copied from
+    char data[];                //The key, followed by the value and a '\0'
+};
+
+//Value of a copy
+#define replica_entry_value(entry) (&(entry)->data[(entry)->key_length])
+
+/// @brief Copies of the values read lately on one NUMA node. Searched under RCU without the mutex,
+/// changed only with the mutex of the dictionary locked
+struct replica {
+    struct hlist_head buckets[REPLICA_BUCKETS];
+    unsigned int depth[REPLICA_BUCKETS];
+    atomic64_t hits ____cacheline_aligned;  //Reads served by a copy
+    atomic64_t misses;                      //Reads that found no copy and went to the dictionary
+};
+
+/// @brief Allocates a replica for each NUMA node, each in the memory of its node.
+/// If it fails the dictionary works without replicas
+/// @param dict the dictionary
+void replica_init(pdictionary dict);
+
+/// @brief Frees the replicas and the copies inside them, call when nothing can use the dictionary anymore
+/// @param dict the dictionary
+void replica_destroy(pdictionary dict);
+
+/// @brief Searches the copy of the value of key in the replica of the NUMA node the caller runs on.
+/// Doesn't need the mutex
+/// @param dict the dictionary
+/// @param key the key, kernel memory
+/// @param key_length the length of the key, zero if it's a string
+/// @return the copy, to give back with replica_put. NULL if there is none
+struct replica_entry* replica_get(pdictionary dict, const char *key, size_t key_length);
+
+/// @brief Gives back a copy returned by replica_get
+/// @param entry the copy
+void replica_put(struct replica_entry *entry);
+
+/// @brief Reads a copy like value_read reads a node
+/// @param entry the copy
+/// @param buffer the buffer where the value will be copied, user memory unless user is false
+/// @param maxsize the max length of the buffer
+/// @param ppos offset inside the value, incremented by the bytes read
+/// @param user false if buffer is kernel memory
+/// @return number of bytes read, below zero for errors
+ssize_t replica_read(struct replica_entry *entry, char __user *buffer, size_t maxsize, loff_t *ppos, bool user);
+
+/// @brief Reads a copy like value_read_iter reads a node
+/// @param entry the copy
+/// @param to where the value is copied
+/// @param ppos offset inside the value, incremented by the bytes read
+/// @return number of bytes read, below zero for errors
+ssize_t replica_read_iter(struct replica_entry *entry, struct iov_iter *to, loff_t *ppos);
+
+/// @brief Copies the value of a copy like dictionary_copy_value copies the value of a node
+/// @param entry the copy
+/// @param condition NULL to always copy the value, otherwise see dictionary_read_if_changed
+/// @param value where the kvmalloc'd copy is put, NULL if the value matches the condition
+/// @param value_length where the length of the value is put
+/// @return zero for success, -ENOMEM otherwise
+int replica_copy(struct replica_entry *entry, struct dictionary_condition *condition, char **value, size_t *value_length);
+
+/// @brief Leaves a copy of the value of a node in the replica of the NUMA node the caller runs on,
+/// replacing the old copy of the key. Call with the mutex locked
+/// @param dict the dictionary
+/// @param key the key of the node, kernel memory
+/// @param key_length the length of the key, zero if it's a string
+/// @param node the node, live
+/// @param flags DICTIONARY_NONBLOCK not to wait for memory: only plain values are copied, without sleeping
+void replica_fill(pdictionary dict, const char *key, size_t key_length, pnode node, unsigned int flags);
+
+/// @brief Drops the copies of a key from the replicas of all the NUMA nodes, call with the mutex locked
+/// before the change of the key is visible
+/// @param dict the dictionary
+/// @param hash the filter_hash of the key
+void replica_invalidate(pdictionary dict, u32 hash);
+
+/// @brief Drops all the copies from the replicas of all the NUMA nodes, call with the mutex locked
+/// @param dict the dictionary
+void replica_clear(pdictionary dict);
+
+/// @brief Fills the hits and misses of each NUMA node, the nodes past the last slot are added to it
+/// @param dict the dictionary
+/// @param stats where the counters are written
+void replica_stats(pdictionary dict, struct dictionary_stats_arg *stats);
+
+#endif
@@ -0,0 +1,273 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
+#include "module.h"
+#include "snapshot.h"
+#include "compression.h"
+#include "dedup.h"
+#include "value.h"
+
+//What the loader is waiting for
+#define LOADER_HEADER 0
+#define LOADER_RECORD 1
+#define LOADER_KEY    2
+#define LOADER_VALUE  3
+#define LOADER_FAILED 4
+
+//Saves the pairs of the dictionary
+ssize_t snapshot_save(pdictionary dict, char **buffer, unsigned int flags)
+{
+    struct dictionary_snapshot_header *header;
+    struct dictionary_snapshot_record *record;
+    struct dictionary_view view;
+    pnode node_ptr;
+    size_t size = sizeof(struct dictionary_snapshot_header);
+    size_t count = 0, index, key_length, value_length;
+    char *output;
+
+    if (dict == NULL || buffer == NULL)
+        return -EINVAL;
+    //Both passes go through the same view: the writes that come in between are not part of the snapshot
+    if (dictionary_view_open(dict, &view, flags) != 0)
+    {
+        return -EAGAIN;
+    }
+    while (!IS_ERR_OR_NULL(node_ptr = dictionary_view_next(dict, &view, flags)))
+    {
+        size += sizeof(struct dictionary_snapshot_record) + node_ptr->key_length + node_ptr->value_length;
+        ++count;
+    }
+    if (IS_ERR(node_ptr))
+    {
+        dictionary_view_close(dict, &view);
+        return PTR_ERR(node_ptr);
+    }
+    output = (char*)kvmalloc(size, (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (output == NULL)
+    {
+        dictionary_view_close(dict, &view);
+        return (flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM;
+    }
+
+    header = (struct dictionary_snapshot_header*)output;
+    put_unaligned_le32(DICTIONARY_SNAPSHOT_MAGIC, &header->magic);
+    put_unaligned_le32(DICTIONARY_SNAPSHOT_VERSION, &header->version);
+    put_unaligned_le64(count, &header->count);
+    index = sizeof(struct dictionary_snapshot_header);
+    dictionary_view_rewind(&view);
+    while (!IS_ERR_OR_NULL(node_ptr = dictionary_view_next(dict, &view, flags)))
+    {
+        key_length = node_ptr->key_length;
+        value_length = node_ptr->value_length;
+        record = (struct dictionary_snapshot_record*)&output[index];
+        put_unaligned_le32((u32)key_length, &record->key_length);
+        put_unaligned_le32((u32)value_length, &record->value_length);
+        index += sizeof(struct dictionary_snapshot_record);
+        memcpy(&output[index], node_prefix(node_ptr), node_prefix_length(node_ptr));
+        memcpy(&output[index + node_prefix_length(node_ptr)], node_ptr->key, key_length - node_prefix_length(node_ptr));
+        index += key_length;
+        //Snapshots hold the plain values: compression is a choice of the module that loads them
+        if (value_copy(node_ptr, &output[index]) != 0)
+        {
+            dictionary_view_close(dict, &view);
+            kvfree(output);
+            return -EIO;
+        }
+        index += value_length;
+    }
+    dictionary_view_close(dict, &view);
+    if (IS_ERR(node_ptr))
+    {
+        //A snapshot missing some of the keys would load without errors
+        kvfree(output);
+        return PTR_ERR(node_ptr);
+    }
+
+    *buffer = output;
+    return (ssize_t)size;
+}
+
+struct snapshot_loader* snapshot_loader_create(void)
+{
+    struct snapshot_loader *loader;
+
+    loader = (struct snapshot_loader*)kzalloc(sizeof(struct snapshot_loader), GFP_KERNEL);
+    if (loader == NULL)
+        return NULL;
+    loader->state = LOADER_HEADER;
+    INIT_LIST_HEAD(&loader->nodes);
+    return loader;
+}
+
+//Copies into dest the bytes of the current piece that are available, returns true when the piece is complete
+static bool loader_fill(struct snapshot_loader *loader, void *dest, size_t size, 
+    const char __user *buffer, size_t length, size_t *used, int *res, bool user)
+{
+    size_t chunk = min(size - loader->filled, length);
+
+    if (!user)
+    {
+        memcpy((char*)dest + loader->filled, (const char __force*)buffer, chunk);
+    } else if (copy_from_user((char*)dest + loader->filled, buffer, chunk) != 0)
+    {
+        *res = -EFAULT;
+        return false;
+    }
+    *used = chunk;
+    loader->filled += chunk;
+    if (loader->filled < size)
+        return false;
+    loader->filled = 0;
+    return true;
+}
+
+//Takes a preallocated node, allocating a new batch when needed
+static pnode loader_next_node(struct snapshot_loader *loader)
+{
+    size_t expected, count;
+
+    if (loader->batch_left == 0)
+    {
+        //The header tells how many records are coming: allocate up to a batch of them at once
+        expected = (size_t)get_unaligned_le64(&loader->header.count);
+        count = expected > loader->loaded ? expected - loader->loaded : 1;
+        count = min_t(size_t, count, SNAPSHOT_LOADER_BATCH);
+        if (dictionary_alloc_nodes(loader->batch, count) != 0)
+            return NULL;
+        loader->batch_left = count;
+    }
+    return loader->batch[--loader->batch_left];
+}
+
+//A record header has been received: prepares the node that will hold it
+static int loader_start_record(struct snapshot_loader *loader)
+{
+    size_t key_length = get_unaligned_le32(&loader->record.key_length);
+    size_t value_length = get_unaligned_le32(&loader->record.value_length);
+
+    //Empty keys can't be created and empty values mean a deleted key
+    if (key_length == 0 || value_length == 0)
+        return -EINVAL;
+    //A length no record can have is a corrupted stream, not an allocation to try
+    if (key_length > DICTIONARY_SNAPSHOT_MAX_KEY || value_length > DICTIONARY_SNAPSHOT_MAX_VALUE)
+        return -EINVAL;
+    loader->current = loader_next_node(loader);
+    if (loader->current == NULL)
+        return -ENOMEM;
+    loader->current->key = (char*)kmalloc(key_length + 1, GFP_USER);
+    loader->current->value = (char*)kvmalloc(value_length + 1, GFP_USER);
+    if (loader->current->key == NULL || loader->current->value == NULL)
+    {
+        dictionary_free_node(loader->current);
+        loader->current = NULL;
+        return -ENOMEM;
+    }
+    loader->current->key[key_length] = '\0';
+    loader->current->key_length = key_length;
+    loader->current->value[value_length] = '\0';
+    loader->current->value_length = value_length;
+    loader->current->stored_length = value_length + 1;
+    return 0;
+}
+
+ssize_t snapshot_loader_write(struct snapshot_loader *loader, const char __user *buffer, size_t length, bool user)
+{
+    size_t index = 0, used = 0;
+    int res = 0;
+
+    if (loader == NULL || buffer == NULL)
+        return -EINVAL;
+    while (index < length && res == 0)
+    {
+        used = 0;
+        switch (loader->state)
+        {
+            case LOADER_HEADER:
+                if (!loader_fill(loader, &loader->header, sizeof(loader->header), &buffer[index], length - index, &used, &res, user))
+                    break;
+                if (get_unaligned_le32(&loader->header.magic) != DICTIONARY_SNAPSHOT_MAGIC ||
+                    get_unaligned_le32(&loader->header.version) != DICTIONARY_SNAPSHOT_VERSION)
+                {
+                    printd("Bad snapshot header.\n");
+                    res = -EINVAL;
+                    break;
+                }
+                loader->state = LOADER_RECORD;
+                break;
+            case LOADER_RECORD:
+                if (!loader_fill(loader, &loader->record, sizeof(loader->record), &buffer[index], length - index, &used, &res, user))
+                    break;
+                res = loader_start_record(loader);
+                loader->state = LOADER_KEY;
+                break;
+            case LOADER_KEY:
+                if (!loader_fill(loader, loader->current->key, get_unaligned_le32(&loader->record.key_length), 
+                    &buffer[index], length - index, &used, &res, user))
+                    break;
+                loader->state = LOADER_VALUE;
+                break;
+            case LOADER_VALUE:
+                if (!loader_fill(loader, loader->current->value, get_unaligned_le32(&loader->record.value_length), 
+                    &buffer[index], length - index, &used, &res, user))
+                    break;
+                loader->current->digest = value_digest(VALUE_DIGEST_SEED, loader->current->value, 
+                    loader->current->value_length);
+                //Compressed here, before dictionary_bulk_insert takes the mutex
+                compression_compress_node(&loader->compress_workspace, loader->current);
+                list_add_tail(&loader->current->list, &loader->nodes);
+                loader->current = NULL;
+                loader->loaded++;
+                loader->state = LOADER_RECORD;
+                break;
+            default:
+                res = -EINVAL;
+                break;
+        }
+        index += used;
+    }
+    if (res != 0)
+    {
+        //The stream can't be resynchronized: refuse everything that follows
+        dictionary_free_node(loader->current);
+        loader->current = NULL;
+        loader->state = LOADER_FAILED;
+        return res;
+    }
+    return (ssize_t)length;
+}
+
+int snapshot_loader_commit(struct snapshot_loader *loader, pdictionary dict)
+{
+    if (loader == NULL)
+        return -EINVAL;
+    if (loader->state == LOADER_HEADER && loader->filled == 0)
+        return 0;//Nothing was written
+    //A stream that failed, stops inside a record or misses some of the records would load part of the keys as all of them
+    if (loader->state != LOADER_RECORD || loader->filled != 0 || 
+        loader->loaded != get_unaligned_le64(&loader->header.count))
+    {
+        return -EINVAL;
+    }
+    return dictionary_bulk_insert(dict, &loader->nodes);
+}
+
+void snapshot_loader_free(struct snapshot_loader *loader)
+{
+    pnode node_ptr, tmp;
+
+    if (loader == NULL)
+        return;
+    list_for_each_entry_safe(node_ptr, tmp, &loader->nodes, list)
+    {
+        list_del(&node_ptr->list);
+        dictionary_free_node(node_ptr);
+    }
+    dictionary_free_node(loader->current);
+    while (loader->batch_left > 0)
+    {
+        dictionary_free_node(loader->batch[--loader->batch_left]);
+    }
+    kvfree(loader->compress_workspace);
+    kfree(loader);
+}
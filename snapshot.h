@@ -0,0 +1,54 @@
+#ifndef _MODULE_SNAPSHOT_H
+#define _MODULE_SNAPSHOT_H
+
+#include "dictionary.h"
+
+//Nodes preallocated at once while loading a snapshot
+#define SNAPSHOT_LOADER_BATCH 256
+
+/// @brief State of a bulk load: snapshots can be split across any number of writes
+struct snapshot_loader {
+    struct dictionary_snapshot_header header;
+    struct dictionary_snapshot_record record;
+    int state;
+    size_t filled;              //Bytes received of the piece being parsed
+    pnode current;              //Node of the record being parsed
+    struct list_head nodes;     //Loaded nodes, not yet inside the dictionary
+    size_t loaded;              //Records loaded since the header
+    pnode batch[SNAPSHOT_LOADER_BATCH];
+    size_t batch_left;          //Preallocated nodes still unused inside batch
+    void *compress_workspace;   //Workspace of the compressor, used for the loaded values
+};
+
+/// @brief Serializes all the key-value pairs of the dictionary, as they were when the call started, into a new buffer.
+/// Writers are not stopped while the pairs are copied
+/// @param dict The dictionary to save
+/// @param buffer where the pointer to the buffer is written, free it with kvfree()
+/// @param flags DICTIONARY_NONBLOCK to fail with -EAGAIN instead of waiting for the mutex or for memory
+/// @return size of the buffer, below zero for errors
+ssize_t snapshot_save(pdictionary dict, char **buffer, unsigned int flags);
+
+/// @brief Allocates the state of a new bulk load
+/// @return the loader, NULL if the allocation failed
+struct snapshot_loader* snapshot_loader_create(void);
+
+/// @brief Parses a piece of a snapshot
+/// @param loader the loader created by snapshot_loader_create
+/// @param buffer the bytes of the snapshot
+/// @param length the length of the buffer
+/// @param user true if buffer is user memory, false if it is kernel memory
+/// @return number of bytes consumed, below zero for errors (the loader will refuse every later write)
+ssize_t snapshot_loader_write(struct snapshot_loader *loader, const char __user *buffer, size_t length, bool user);
+
+/// @brief Inserts the records loaded into the dictionary, once all the records the header announced were received
+/// @param loader the loader created by snapshot_loader_create
+/// @param dict the dictionary that receives the keys
+/// @return zero for success, -EINVAL if the snapshot failed, is incomplete or holds more records than announced,
+/// non zero otherwise
+int snapshot_loader_commit(struct snapshot_loader *loader, pdictionary dict);
+
+/// @brief Frees the loader and all the records that were not committed
+/// @param loader the loader created by snapshot_loader_create, can be NULL
+void snapshot_loader_free(struct snapshot_loader *loader);
+
+#endif
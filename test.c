@@ -1,5 +1,21 @@
 #include "module.h"
+#include "namespace.h"
+#include "snapshot.h"
+#include "filter.h"
+#include "value.h"
+#include "replica.h"
+#include "hotkeys.h"
+#include "wal.h"
 #include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/uio.h>
+#include <asm/unaligned.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mman.h>
+#include <linux/uaccess.h>
 #define increment_if_failed(res, expected, count, expr, ...) \
     if (res != expected) \
     { \
@@ -11,7 +27,7 @@
     increment_if_failed(res, expected, count, "dictionary_write(\"%s\", \"%s\", %d) failed with code %d\n", key, value, (int)strlen(value), res)
 #define test_write(dict, key, str, res, count, expected) \
     do { \
-        res = dictionary_write(dict, key, strlen(key), str, strlen(str)); \
+        res = dictionary_write(dict, key, strlen(key), str, strlen(str), DICTIONARY_KERNEL); \
         if (strlen(key) > 0) \
         { \
             failed_write(res, expected, count, key, str); \
@@ -22,7 +38,7 @@
     increment_if_failed(res, expected, count, "dictionary_append(\"%s\", \"%s\", %d) failed with code %d\n", key, value, (int)strlen(value), res)
 #define test_append(dict, key, str, res, count, expected) \
     do { \
-        res = dictionary_append(dict, key, strlen(key), str, strlen(str)); \
+        res = dictionary_append(dict, key, strlen(key), str, strlen(str), DICTIONARY_KERNEL); \
         if (strlen(key) > 0) \
         { \
             failed_append(res, expected, count, key, str); \
@@ -34,7 +50,7 @@
     increment_if_failed(1, 0, count, "dictionary_read(\"%s\") failed! Read \"%s\" (%d) instead of \"%s\" (%d).\n", key, got, got_length, expected, expected_length)
 #define test_read(dict, key, buf, pos, expected, res, count, timeout) \
     do { \
-        res = dictionary_read(dict, key, strlen(key), buf, sizeof(buf) - 1, timeout, &pos); \
+        res = dictionary_read(dict, key, strlen(key), buf, sizeof(buf) - 1, (u64)timeout * USEC_PER_MSEC, DICTIONARY_KERNEL, &pos); \
         if (res != (int)strlen(expected) || strncmp(buf, expected, res) != 0) \
         { \
             failed_read(count, key, expected, buf, (int)strlen(expected), res); \
@@ -48,11 +64,173 @@
         increment_if_failed(res, 0, count, "dictionary_count() failed. Code: %d\n", res); \
     } while(0)
         
+//Appends a binary record to out, returns its size
+static size_t wire_record(char *out, u8 opcode, const char *key, size_t key_length, const char *value, size_t value_length)
+{
+    struct dictionary_wire_record *record = (struct dictionary_wire_record*)out;
+
+    memset(record, 0, sizeof(struct dictionary_wire_record));
+    record->opcode = opcode;
+    put_unaligned_le32((u32)key_length, &record->key_length);
+    put_unaligned_le32((u32)value_length, &record->value_length);
+    memcpy(&out[sizeof(struct dictionary_wire_record)], key, key_length);
+    memcpy(&out[sizeof(struct dictionary_wire_record) + key_length], value, value_length);
+    return sizeof(struct dictionary_wire_record) + key_length + value_length;
+}
+
+//Keys of the replay test: more than twice the buckets of a replay table, so that it grows
+#define WAL_TEST_KEYS 2100
+
+//Appends a record of the write-ahead log of namespace "t" to out, returns its size
+static size_t wal_wire_record(char *out, u8 opcode, const char *key, size_t key_length, const char *value, size_t value_length, u64 offset)
+{
+    struct wal_record *record = (struct wal_record*)out;
+    size_t size;
+
+    memset(record, 0, sizeof(struct wal_record));
+    record->opcode = opcode;
+    record->name_length = 1;
+    put_unaligned_le32((u32)key_length, &record->key_length);
+    put_unaligned_le32((u32)value_length, &record->value_length);
+    put_unaligned_le64(offset, &record->offset);
+    out[sizeof(struct wal_record)] = 't';
+    memcpy(&out[sizeof(struct wal_record) + 1], key, key_length);
+    memcpy(&out[sizeof(struct wal_record) + 1 + key_length], value, value_length);
+    size = wal_record_size(record);
+    put_unaligned_le32(wal_record_crc(record, size), &record->crc);
+    return size;
+}
+
+//A dictionary for the tests alone: it is not a namespace, so no file can reach it and nothing is left registered
+static pdictionary test_dictionary_create(void)
+{
+    pdictionary dict;
+
+    dict = (pdictionary)kzalloc(sizeof(dictionary_wrapper), GFP_KERNEL);
+    if (dict == NULL)
+        return ERR_PTR(-ENOMEM);
+    dictionary_init(dict);
+    return dict;
+}
+//Frees a dictionary of test_dictionary_create and its keys
+static void test_dictionary_destroy(pdictionary dict)
+{
+    if (IS_ERR_OR_NULL(dict))
+        return;
+    dictionary_free(dict);
+    dictionary_destroy(dict);
+    kfree(dict);
+}
+
+//Appends str to key from user memory, as a write of the device does: the page is mapped in the address space
+//of the task loading the module. Returns 0 or the code of the failure, -ENOTSUPP if the task has none
+static int test_user_append(pdictionary dict, const char *key, const char *str, size_t str_len)
+{
+    unsigned long address;
+    int res;
+
+    if (current->mm == NULL)
+        return -ENOTSUPP;
+    address = vm_mmap(NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+    if (IS_ERR_VALUE(address))
+        return (int)address;
+    if (copy_to_user((char __user*)address, str, str_len) != 0)
+    {
+        res = -EFAULT;
+    } else {
+        res = dictionary_append(dict, key, 0, (const char __force*)address, str_len, 0);
+    }
+    vm_munmap(address, PAGE_SIZE);
+    return res;
+}
+
+//Bytes each append of benchmark_append_round adds to the hot key
+#define BENCHMARK_APPEND "0123456789abcdef"
+
+/// @brief Thread of benchmark_append_round
+struct benchmark_appender {
+    pdictionary dict;
+    uint appends;
+    struct completion *start;   //Completed when all the threads are ready
+    struct completion done;
+};
+static int benchmark_append_thread(void *data)
+{
+    struct benchmark_appender *appender = (struct benchmark_appender*)data;
+    uint i;
+
+    wait_for_completion(appender->start);
+    for (i = 0; i < appender->appends; ++i)
+    {
+        dictionary_append(appender->dict, "hot", 3, BENCHMARK_APPEND, sizeof(BENCHMARK_APPEND) - 1, DICTIONARY_KERNEL);
+    }
+    kthread_complete_and_exit(&appender->done, 0);
+}
+//Appends to the key "hot" from threads at the same time, each appends / threads times. Returns the nsecs it took, 0 for errors
+static u64 benchmark_append_round(pdictionary dict, uint threads, uint appends)
+{
+    DECLARE_COMPLETION_ONSTACK(start);
+    struct benchmark_appender *appenders;
+    struct task_struct *task;
+    uint i, started = 0;
+    u64 begin;
+
+    appenders = (struct benchmark_appender*)kcalloc(threads, sizeof(struct benchmark_appender), GFP_KERNEL);
+    if (appenders == NULL)
+        return 0;
+    for (i = 0; i < threads; ++i)
+    {
+        appenders[i].dict = dict;
+        appenders[i].appends = appends / threads;
+        appenders[i].start = &start;
+        init_completion(&appenders[i].done);
+        task = kthread_run(benchmark_append_thread, &appenders[i], "dictionary_append/%u", i);
+        if (IS_ERR(task))
+            break;
+        ++started;
+    }
+    begin = ktime_get_ns();
+    complete_all(&start);
+    for (i = 0; i < started; ++i)
+    {
+        wait_for_completion(&appenders[i].done);
+    }
+    begin = ktime_get_ns() - begin;
+    kfree(appenders);
+    return started == threads ? max_t(u64, begin, 1) : 0;
+}
+
 int test_dictionary(pdictionary dict, uint timeout)
 {
     int res, count = 0;
     char readBuffer[128] = { 0 };
     loff_t pos = 0;
+    pdictionary other, replicas;
+    struct snapshot_loader *loader;
+    char *snapshot;
+    ssize_t size;
+    size_t consumed;
+    struct command_options options = { .timeout_us = (u64)timeout * USEC_PER_MSEC, .flags = DICTIONARY_KERNEL };
+    struct dictionary_watcher watcher;
+    u64 cookie = 0;
+    struct dictionary_stats_arg stats;
+    uint old_threshold;
+    bool old_dedup, old_arena, old_replicas, old_combine;
+    u64 hits, sampled;
+    char *piece;
+    int i;
+    struct kvec kvec;
+    struct iov_iter iter;
+    char wire[128];
+    size_t length, valid;
+    s64 misses;
+    struct command_results results;
+    struct dictionary_view view;
+    pnode node;
+    u64 generation, since;
+    struct dictionary_condition condition;
+    char *value;
+    u32 digest = VALUE_DIGEST_SEED;
 
     //Testing dictionry_write
     printk(KERN_INFO 
@@ -98,12 +276,699 @@ int test_dictionary(pdictionary dict, uint timeout)
         "Tests: executing test on dictionary_count method.\n");
     test_count(dict, 4, res, count);
 
+    //Test non blocking reads and watches
+    printk(KERN_INFO 
+        "-------------------------------------------------\n"
+        "Tests: executing test on non blocking reads and watches.\n");
+    res = (int)dictionary_read(dict, "Chiave 3", 8, readBuffer, sizeof(readBuffer) - 1, 0, DICTIONARY_NONBLOCK | DICTIONARY_KERNEL, &pos);
+    increment_if_failed(res, -EAGAIN, count, "Non blocking dictionary_read of a missing key returned %d\n", res);
+    pos = 0;
+    dictionary_watcher_init(&watcher);
+    res = dictionary_watch(dict, &watcher, "Chiave 3", 8, 3, -1);
+    increment_if_failed(res, 0, count, "dictionary_watch() failed with code %d\n", res);
+    res = dictionary_watch_pop(&watcher, &cookie);
+    increment_if_failed(res, -EAGAIN, count, "dictionary_watch_pop() completed a watch of a missing key\n");
+    test_write(dict, "Chiave 3", "Valore 3", res, count, 0);
+    res = dictionary_watch_pop(&watcher, &cookie);
+    increment_if_failed(res, 0, count, "dictionary_watch_pop() failed with code %d after the key was created\n", res);
+    increment_if_failed((int)cookie, 3, count, "dictionary_watch_pop() returned cookie %d instead of 3\n", (int)cookie);
+    dictionary_unwatch_all(dict, &watcher);
+    //A timeout shorter than a jiffy must expire (and not be rounded to zero, waiting forever)
+    res = (int)dictionary_read(dict, "Chiave 4", 8, readBuffer, sizeof(readBuffer) - 1, 200, DICTIONARY_KERNEL, &pos);
+    increment_if_failed(res, -EAGAIN, count, "dictionary_read of a missing key with 200us timeout returned %d\n", res);
+    pos = 0;
+    test_write(dict, "Chiave 3", "", res, count, 0);
+    //Non blocking operations must not wait for the mutex
+    mutex_lock(&dict->mutex);
+    res = dictionary_write(dict, "Chiave 3", 8, "Valore 3", 8, DICTIONARY_NONBLOCK | DICTIONARY_KERNEL);
+    increment_if_failed(res, -EAGAIN, count, "Non blocking dictionary_write on a locked dictionary returned %d\n", res);
+    res = (int)dictionary_read(dict, "Chiave 1", 8, readBuffer, sizeof(readBuffer) - 1, 0, DICTIONARY_NONBLOCK | DICTIONARY_KERNEL, &pos);
+    increment_if_failed(res, -EAGAIN, count, "Non blocking dictionary_read on a locked dictionary returned %d\n", res);
+    mutex_unlock(&dict->mutex);
+    pos = 0;
+    //Without DICTIONARY_KERNEL the value is user memory: a kernel pointer is refused and no key is left behind
+    res = dictionary_write(dict, "Chiave 3", 8, "Valore 3", 8, 0);
+    increment_if_failed(res, -EFAULT, count, "dictionary_write of a kernel value as user memory returned %d\n", res);
+    res = (int)dictionary_read(dict, "Chiave 3", 8, readBuffer, sizeof(readBuffer) - 1, 0, DICTIONARY_NONBLOCK | DICTIONARY_KERNEL, &pos);
+    increment_if_failed(res, -EAGAIN, count, "A write that failed to copy its value created the key, read returned %d\n", res);
+    pos = 0;
+    //Keys the filter knows are missing are answered without the mutex
+    increment_if_failed(filter_may_contain(dict, filter_hash("Chiave 1", 8)), true, count, "The filter lost key \"Chiave 1\"\n");
+    misses = atomic64_read(&dict->filtered_misses);
+    mutex_lock(&dict->mutex);
+    res = dictionary_delete_key(dict, "Chiave 3", 8, DICTIONARY_NONBLOCK);
+    increment_if_failed(res, 1, count, "Delete of a missing key on a locked dictionary returned %d\n", res);
+    mutex_unlock(&dict->mutex);
+    increment_if_failed((int)(atomic64_read(&dict->filtered_misses) - misses), 1, count, 
+        "The filter answered %d misses instead of 1\n", (int)(atomic64_read(&dict->filtered_misses) - misses));
+
+    //Test namespaces
+    printk(KERN_INFO 
+        "-------------------------------------------------\n"
+        "Tests: executing test on namespaces.\n");
+    other = test_dictionary_create();
+    if (IS_ERR(other))
+    {
+        ++count;
+        printk(KERN_ALERT "Creating the dictionary of the tests failed with code %ld\n", PTR_ERR(other));
+    } else {
+        //Same key, different namespace: the two values must not interfere
+        test_write(other, "Chiave 1", "Valore di test", res, count, 0);
+        test_read(other, "Chiave 1", readBuffer, pos, "Valore di test", res, count, timeout);
+        test_read(dict, "Chiave 1", readBuffer, pos, "Valore 1", res, count, timeout);
+        test_count(other, 1, res, count);
+        test_count(dict, 4, res, count);
+        dictionary_free(other);
+
+        //Test snapshots: save the dictionary and load it, split in two writes, into the other namespace
+        printk(KERN_INFO 
+            "-------------------------------------------------\n"
+            "Tests: executing test on snapshots.\n");
+        size = snapshot_save(dict, &snapshot, 0);
+        if (size < 0)
+        {
+            ++count;
+            printk(KERN_ALERT "snapshot_save() failed with code %d\n", (int)size);
+        } else {
+            loader = snapshot_loader_create();
+            if (loader == NULL || 
+                snapshot_loader_write(loader, snapshot, size / 2, false) < 0 ||
+                snapshot_loader_write(loader, snapshot + size / 2, size - size / 2, false) < 0 ||
+                snapshot_loader_commit(loader, other) != 0)
+            {
+                ++count;
+                printk(KERN_ALERT "Loading a snapshot of %d bytes failed\n", (int)size);
+            }
+            snapshot_loader_free(loader);
+            kvfree(snapshot);
+            test_count(other, 4, res, count);
+            test_read(other, "Lorem", readBuffer, pos, "Ipsum dixit", res, count, timeout);
+            dictionary_free(other);
+        }
+        //A record header with impossible lengths is refused before anything is allocated
+        for (i = 0; i < 2; ++i)
+        {
+            put_unaligned_le32(DICTIONARY_SNAPSHOT_MAGIC, &((struct dictionary_snapshot_header*)wire)->magic);
+            put_unaligned_le32(DICTIONARY_SNAPSHOT_VERSION, &((struct dictionary_snapshot_header*)wire)->version);
+            put_unaligned_le64(1, &((struct dictionary_snapshot_header*)wire)->count);
+            put_unaligned_le32(i == 0 ? U32_MAX : 1, &((struct dictionary_snapshot_record*)&wire[sizeof(struct dictionary_snapshot_header)])->key_length);
+            put_unaligned_le32(i == 0 ? 1 : U32_MAX, &((struct dictionary_snapshot_record*)&wire[sizeof(struct dictionary_snapshot_header)])->value_length);
+            loader = snapshot_loader_create();
+            size = loader != NULL ? snapshot_loader_write(loader, wire, 
+                sizeof(struct dictionary_snapshot_header) + sizeof(struct dictionary_snapshot_record), false) : -ENOMEM;
+            increment_if_failed((int)size, -EINVAL, count, "A snapshot record with a %s of 4GB was loaded with code %d\n", 
+                i == 0 ? "key" : "value", (int)size);
+            snapshot_loader_free(loader);
+        }
+        //A key loaded twice keeps its last value, and a snapshot cut in the middle of a record is not committed
+        put_unaligned_le64(2, &((struct dictionary_snapshot_header*)wire)->count);
+        length = sizeof(struct dictionary_snapshot_header);
+        for (i = 0; i < 2; ++i)
+        {
+            put_unaligned_le32(3, &((struct dictionary_snapshot_record*)&wire[length])->key_length);
+            put_unaligned_le32(1, &((struct dictionary_snapshot_record*)&wire[length])->value_length);
+            length += sizeof(struct dictionary_snapshot_record);
+            memcpy(&wire[length], "Dup", 3);
+            wire[length + 3] = i == 0 ? 'a' : 'b';
+            length += 4;
+        }
+        loader = snapshot_loader_create();
+        res = loader == NULL ? -ENOMEM : 
+            (snapshot_loader_write(loader, wire, length - 1, false) < 0 ? -EIO : snapshot_loader_commit(loader, other));
+        increment_if_failed(res, -EINVAL, count, "A snapshot cut in the middle of a record was committed with code %d\n", res);
+        snapshot_loader_free(loader);
+        loader = snapshot_loader_create();
+        res = loader == NULL ? -ENOMEM : 
+            (snapshot_loader_write(loader, wire, length, false) < 0 ? -EIO : snapshot_loader_commit(loader, other));
+        increment_if_failed(res, 0, count, "A snapshot with a key loaded twice failed with code %d\n", res);
+        snapshot_loader_free(loader);
+        test_count(other, 1, res, count);
+        test_read(other, "Dup", readBuffer, pos, "b", res, count, timeout);
+        dictionary_free(other);
+
+        //Test views: a view keeps seeing the keys as they were when it was opened
+        test_write(other, "Vista 1", "Prima", res, count, 0);
+        test_write(other, "Vista 2", "Resta", res, count, 0);
+        res = dictionary_view_open(other, &view, 0);
+        increment_if_failed(res, 0, count, "dictionary_view_open() failed with code %d\n", res);
+        test_write(other, "Vista 1", "Dopo", res, count, 0);
+        test_append(other, "Vista 2", " ancora", res, count, 0);
+        test_write(other, "Vista 3", "Nuova", res, count, 0);
+        test_read(other, "Vista 1", readBuffer, pos, "Dopo", res, count, timeout);
+        test_count(other, 3, res, count);
+        for (i = 0, length = 0; !IS_ERR_OR_NULL(node = dictionary_view_next(other, &view, 0)); ++i)
+        {
+            length += node->value_length;
+        }
+        increment_if_failed(i, 2, count, "The view saw %d keys instead of 2\n", i);
+        increment_if_failed((int)length, 10, count, "The view saw %d bytes of values instead of 10\n", (int)length);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)stats.versions, 2, count, "%d old versions kept instead of 2\n", (int)stats.versions);
+        dictionary_view_close(other, &view);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)stats.versions, 0, count, "%d old versions left after the view\n", (int)stats.versions);
+        test_read(other, "Vista 2", readBuffer, pos, "Resta ancora", res, count, timeout);
+        dictionary_free(other);
+
+        //Test deltas: only the keys changed after a generation are listed, deletes included
+        test_write(other, "A", "1", res, count, 0);
+        test_write(other, "B", "1", res, count, 0);
+        //Since 0 every key is listed, from a view
+        size = dictionary_read_delta(other, 0, &snapshot, &since, 0);
+        if (size < 0)
+        {
+            ++count;
+            printk(KERN_ALERT "dictionary_read_delta() of all the keys failed with code %d\n", (int)size);
+        } else {
+            scnprintf(readBuffer, sizeof(readBuffer), "#%llu all\n", since);
+            if (size != strlen(readBuffer) + 2 * strlen("<A>: \"1\"\n") || memcmp(snapshot, readBuffer, strlen(readBuffer)) != 0)
+            {
+                ++count;
+                printk(KERN_ALERT "The delta of all the keys was \"%.*s\"\n", (int)size, snapshot);
+            }
+            kvfree(snapshot);
+        }
+        test_write(other, "B", "2", res, count, 0);
+        test_write(other, "A", "", res, count, 0);
+        test_write(other, "C", "3", res, count, 0);
+        size = dictionary_read_delta(other, since, &snapshot, &generation, 0);
+        if (size < 0)
+        {
+            ++count;
+            printk(KERN_ALERT "dictionary_read_delta() failed with code %d\n", (int)size);
+        } else {
+            scnprintf(readBuffer, sizeof(readBuffer), "#%llu\n<B>: \"2\"\n-<A>\n<C>: \"3\"\n", since + 3);
+            if (generation != since + 3 || size != strlen(readBuffer) || memcmp(snapshot, readBuffer, size) != 0)
+            {
+                ++count;
+                printk(KERN_ALERT "The delta since %llu was \"%.*s\" instead of \"%s\"\n", since, (int)size, snapshot, readBuffer);
+            }
+            kvfree(snapshot);
+        }
+        memset(readBuffer, 0, sizeof(readBuffer));
+        dictionary_free(other);
+
+        //Test compression: a repetitive value above the threshold is stored compressed and read back plain
+        printk(KERN_INFO 
+            "-------------------------------------------------\n"
+            "Tests: executing test on compressed values.\n");
+        old_threshold = compress_threshold;
+        compress_threshold = 32;
+        test_write(other, "Compressa", "abcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcd", res, count, 0);
+        test_append(other, "Compressa", "abcdabcdabcdabcd", res, count, 0);
+        test_read(other, "Compressa", readBuffer, pos, 
+            "abcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcdabcd", res, count, timeout);
+        res = dictionary_get_stats(other, &stats);
+        increment_if_failed(res, 0, count, "dictionary_get_stats() failed with code %d\n", res);
+        increment_if_failed((int)stats.compressed_values, 1, count, 
+            "%d values compressed instead of 1\n", (int)stats.compressed_values);
+        increment_if_failed((int)stats.compressed_original, 80, count, 
+            "Compressed values hold %d bytes instead of 80\n", (int)stats.compressed_original);
+        increment_if_failed((stats.compressed_stored < stats.compressed_original), true, count, 
+            "Compressed value uses %d bytes\n", (int)stats.compressed_stored);
+        test_write(other, "Compressa", "", res, count, 0);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)stats.compressed_values, 0, count, 
+            "%d values compressed after the delete\n", (int)stats.compressed_values);
+        compress_threshold = old_threshold;
+        dictionary_free(other);
+
+        //Test dedup: identical values and the prefixes of the keys are stored once
+        printk(KERN_INFO 
+            "-------------------------------------------------\n"
+            "Tests: executing test on dedup.\n");
+        old_dedup = dedup;
+        dedup = true;
+        test_write(other, "utenti:1234:nome", "attivo", res, count, 0);
+        test_write(other, "utenti:1234:stato", "attivo", res, count, 0);
+        test_read(other, "utenti:1234:nome", readBuffer, pos, "attivo", res, count, timeout);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)stats.shared_values, 1, count, "%d shared values instead of 1\n", (int)stats.shared_values);
+        increment_if_failed((int)stats.shared_original, 12, count, 
+            "Shared values stand for %d bytes instead of 12\n", (int)stats.shared_original);
+        increment_if_failed((int)stats.shared_prefixes, 1, count, "%d shared prefixes instead of 1\n", (int)stats.shared_prefixes);
+        increment_if_failed((int)stats.prefix_original, 24, count, 
+            "Shared prefixes stand for %d bytes instead of 24\n", (int)stats.prefix_original);
+        //Appends give the node a private copy, the other one keeps the shared value
+        test_append(other, "utenti:1234:stato", " da ieri", res, count, 0);
+        test_read(other, "utenti:1234:stato", readBuffer, pos, "attivo da ieri", res, count, timeout);
+        test_read(other, "utenti:1234:nome", readBuffer, pos, "attivo", res, count, timeout);
+        test_write(other, "utenti:1234:nome", "", res, count, 0);
+        test_write(other, "utenti:1234:stato", "", res, count, 0);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)(stats.shared_values + stats.shared_prefixes), 0, count, 
+            "%d shared values and prefixes left after the deletes\n", (int)(stats.shared_values + stats.shared_prefixes));
+        increment_if_failed((int)stats.memory_used, 0, count, "%d bytes used after the deletes\n", (int)stats.memory_used);
+        //Delete all hands the shared values to the workqueue with the nodes
+        test_write(other, "utenti:1234:nome", "attivo", res, count, 0);
+        test_write(other, "utenti:5678:nome", "attivo", res, count, 0);
+        dictionary_free(other);
+        test_count(other, 0, res, count);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)(stats.memory_used + stats.shared_values), 0, count, 
+            "Delete all left %d bytes and %d shared values\n", (int)stats.memory_used, (int)stats.shared_values);
+        dedup = old_dedup;
+
+        //Arena: the short values are placed one after the other, a delete all takes the segments away
+        old_arena = use_arena;
+        use_arena = true;
+        for (i = 0; i < 100; ++i)
+        {
+            snprintf(wire, sizeof(wire), "arena:%d", i);
+            test_write(other, wire, "valore", res, count, 0);
+        }
+        test_write(other, "arena:7", "valore piu' lungo", res, count, 0);
+        test_read(other, "arena:7", readBuffer, pos, "valore piu' lungo", res, count, timeout);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)stats.arena_segments, 1, count, "100 short values used %d arena segments\n", (int)stats.arena_segments);
+        dictionary_free(other);
+        dictionary_get_stats(other, &stats);
+        increment_if_failed((int)(stats.arena_segments + stats.arena_live), 0, count, 
+            "Delete all left %d arena segments\n", (int)stats.arena_segments);
+        use_arena = old_arena;
+
+        //Replicas: the second read is served by the copy on the NUMA node, a write drops the copies.
+        //A dictionary of their own, created with numa_replicas and the counters at zero
+        old_replicas = numa_replicas;
+        numa_replicas = true;
+        replicas = test_dictionary_create();
+        numa_replicas = old_replicas;
+        if (IS_ERR(replicas))
+        {
+            ++count;
+            printk(KERN_ALERT "Creating the dictionary of the replica tests failed with code %ld\n", PTR_ERR(replicas));
+        } else {
+            test_write(replicas, "Replica", "Prima", res, count, 0);
+            test_read(replicas, "Replica", readBuffer, pos, "Prima", res, count, timeout);
+            test_read(replicas, "Replica", readBuffer, pos, "Prima", res, count, timeout);
+            dictionary_get_stats(replicas, &stats);
+            for (i = 0, hits = 0; i < DICTIONARY_MAX_NUMA_NODES; ++i)
+            {
+                hits += stats.replica_hits[i];
+            }
+            increment_if_failed((int)hits, 1, count, "Two reads of a short value hit the replica %d times\n", (int)hits);
+            increment_if_failed((int)stats.reads, 2, count, "Two reads, one of them from the replica, were counted as %d\n", (int)stats.reads);
+            test_write(replicas, "Replica", "Dopo", res, count, 0);
+            test_read(replicas, "Replica", readBuffer, pos, "Dopo", res, count, timeout);
+            test_dictionary_destroy(replicas);
+        }
+
+        //Appends to the same key from 4 threads at the same time: every one of them is applied whole
+        old_combine = combine_appends;
+        combine_appends = true;
+        res = benchmark_append_round(other, 4, 400) != 0 ? 
+            dictionary_copy_value(other, "hot", 3, 0, 0, NULL, &value, &length) : -ENOMEM;
+        increment_if_failed(res, 0, count, "Reading the key of the concurrent appends failed with code %d\n", res);
+        if (res == 0)
+        {
+            increment_if_failed((int)length, 400 * (int)(sizeof(BENCHMARK_APPEND) - 1), count, 
+                "400 concurrent appends gave a value of %d bytes\n", (int)length);
+            kvfree(value);
+        }
+        dictionary_free(other);
+        //The value of an append from user memory is copied before it's queued for the combiner
+        test_write(other, "Utente", "Dal ", res, count, 0);
+        res = test_user_append(other, "Utente", "processo", 8);
+        if (res != -ENOTSUPP)
+        {
+            increment_if_failed(res, 0, count, "An append from user memory failed with code %d\n", res);
+            test_read(other, "Utente", readBuffer, pos, "Dal processo", res, count, timeout);
+        }
+        dictionary_free(other);
+        combine_appends = old_combine;
+
+        //Hot keys: with every access sampled the sketch counts at least the accesses made. The tracker is shared
+        //with the namespaces, so it's only checked when hot_keys_sample is 1 and never reset here
+        if (READ_ONCE(hot_keys_sample) == 1)
+        {
+            sampled = hotkeys_accesses(other, "Calda", 5, HOTKEYS_READ);
+            test_write(other, "Calda", "Letta spesso", res, count, 0);
+            for (i = 0; i < 5; ++i)
+            {
+                test_read(other, "Calda", readBuffer, pos, "Letta spesso", res, count, timeout);
+            }
+            hits = hotkeys_accesses(other, "Calda", 5, HOTKEYS_READ) - sampled;
+            increment_if_failed((int)(hits < 5), 0, count, "5 reads of a key were counted %d times\n", (int)hits);
+            hits = hotkeys_accesses(other, "Calda", 5, HOTKEYS_WRITE);
+            increment_if_failed((int)(hits < 1), 0, count, "A write of a key was counted %d times\n", (int)hits);
+            dictionary_free(other);
+        }
+
+        //Writes that wait for the write-ahead log: a dictionary that is not a namespace is never logged, so they return at once
+        res = dictionary_write(other, "Durevole", 8, "Scritto", 7, DICTIONARY_SYNC | DICTIONARY_KERNEL);
+        increment_if_failed(res, 0, count, "A write waiting for the log failed with code %d (log %s)\n", 
+            res, wal_enabled() ? "enabled" : "disabled");
+        res = dictionary_append(other, "Durevole", 8, " sul disco", 10, DICTIONARY_SYNC | DICTIONARY_KERNEL);
+        increment_if_failed(res, 0, count, "An append waiting for the log failed with code %d\n", res);
+        test_read(other, "Durevole", readBuffer, pos, "Scritto sul disco", res, count, timeout);
+        res = wal_sync();
+        increment_if_failed(res, 0, count, "Syncing the log failed with code %d\n", res);
+        dictionary_free(other);
+
+        //Replay of the write-ahead log: the records rebuild the keys, a record cut by a crash is dropped
+        snapshot = (char*)kvmalloc(WAL_TEST_KEYS * 32 + 512, GFP_KERNEL);
+        if (snapshot == NULL)
+        {
+            ++count;
+            printk(KERN_ALERT "Allocating the log of the replay test failed\n");
+        } else {
+            length = wal_wire_record(snapshot, WAL_SET, "Sparita", 7, "x", 1, 0);
+            length += wal_wire_record(&snapshot[length], WAL_CLEAR, "", 0, "", 0, 0);
+            length += wal_wire_record(&snapshot[length], WAL_SET, "Log", 3, "uno", 3, 0);
+            length += wal_wire_record(&snapshot[length], WAL_APPEND, "Log", 3, "due", 3, 0);
+            length += wal_wire_record(&snapshot[length], WAL_RANGE, "Log", 3, "DUE", 3, 3);
+            length += wal_wire_record(&snapshot[length], WAL_APPEND, "Nuova", 5, "n", 1, 0);
+            length += wal_wire_record(&snapshot[length], WAL_SET, "Tolta", 5, "t", 1, 0);
+            length += wal_wire_record(&snapshot[length], WAL_DELETE, "Tolta", 5, "", 0, 0);
+            for (i = 0; i < WAL_TEST_KEYS; ++i)
+            {
+                snprintf(wire, sizeof(wire), "k%04d", i);
+                length += wal_wire_record(&snapshot[length], WAL_SET, wire, 5, "v", 1, 0);
+            }
+            consumed = length;
+            length += wal_wire_record(&snapshot[length], WAL_SET, "Troncata", 8, "persa", 5, 0) - 2;
+            size = wal_replay_buffer(other, snapshot, length, &valid);
+            kvfree(snapshot);
+            increment_if_failed((int)size, 8 + WAL_TEST_KEYS, count, "The log replayed %d records instead of %d\n", (int)size, 8 + WAL_TEST_KEYS);
+            increment_if_failed((int)valid, (int)consumed, count, "The log would be cut at %d bytes instead of %d\n", (int)valid, (int)consumed);
+            test_count(other, 2 + WAL_TEST_KEYS, res, count);
+            test_read(other, "Log", readBuffer, pos, "unoDUE", res, count, timeout);
+            test_read(other, "Nuova", readBuffer, pos, "n", res, count, timeout);
+            test_read(other, "k2099", readBuffer, pos, "v", res, count, timeout);
+            dictionary_free(other);
+        }
+
+        //Test chunked values: four appends of 1500 bytes move the value into page sized chunks
+        printk(KERN_INFO 
+            "-------------------------------------------------\n"
+            "Tests: executing test on chunked values.\n");
+        piece = (char*)kzalloc(1501, GFP_KERNEL);
+        if (piece == NULL)
+        {
+            ++count;
+            printk(KERN_ALERT "Couldn't allocate the test buffer\n");
+        } else {
+            for (i = 0; i < 4; ++i)
+            {
+                memset(piece, 'a' + i, 1500);
+                test_append(other, "Lunga", piece, res, count, 0);
+                digest = value_digest(digest, piece, 1500);
+            }
+            kfree(piece);
+            //The digest kept by the appends, across the move into chunks, is the one of the whole value
+            memset(&condition, 0, sizeof(condition));
+            condition.match = DICTIONARY_IF_DIGEST;
+            condition.digest = digest;
+            res = dictionary_copy_value(other, "Lunga", 5, 0, 0, &condition, &value, &length);
+            if (res != 0 || value != NULL)
+            {
+                ++count;
+                printk(KERN_ALERT "Conditional copy of an unchanged value returned %d, digest %08x instead of %08x\n", 
+                    res, condition.digest, digest);
+                kvfree(value);
+            }
+            //The version of the last append matches as well, a stale one doesn't
+            condition.match = DICTIONARY_IF_VERSION;
+            pos = 0;
+            res = (int)dictionary_read_if_changed(other, "Lunga", 5, readBuffer, 100, 0, DICTIONARY_KERNEL, &pos, &condition);
+            increment_if_failed(res, 0, count, "Conditional read of an unchanged version returned %d\n", res);
+            condition.version--;
+            res = (int)dictionary_read_if_changed(other, "Lunga", 5, readBuffer, 100, 0, DICTIONARY_KERNEL, &pos, &condition);
+            increment_if_failed(res, 100, count, "Conditional read of a changed version returned %d\n", res);
+            //Read across the boundary between the first two appends
+            pos = 1450;
+            res = (int)dictionary_read(other, "Lunga", 5, readBuffer, 100, (u64)timeout * USEC_PER_MSEC, DICTIONARY_KERNEL, &pos);
+            if (res != 100 || readBuffer[0] != 'a' || readBuffer[49] != 'a' || readBuffer[50] != 'b' || readBuffer[99] != 'b')
+            {
+                failed_read(count, "Lunga", "50 'a' and 50 'b'", readBuffer, 100, res);
+            }
+            //Read across the boundary between the first two chunks
+            pos = 4000;
+            res = (int)dictionary_read(other, "Lunga", 5, readBuffer, 100, (u64)timeout * USEC_PER_MSEC, DICTIONARY_KERNEL, &pos);
+            if (res != 100 || readBuffer[0] != 'c' || readBuffer[99] != 'c' || pos != 4100)
+            {
+                failed_read(count, "Lunga", "100 'c'", readBuffer, 100, res);
+            }
+            //Read past the end
+            pos = 5950;
+            res = (int)dictionary_read(other, "Lunga", 5, readBuffer, 100, (u64)timeout * USEC_PER_MSEC, DICTIONARY_KERNEL, &pos);
+            increment_if_failed(res, 50, count, "Read of the last 50 bytes of a chunked value returned %d\n", res);
+            //Same read as above, through an iov_iter
+            pos = 4000;
+            kvec.iov_base = readBuffer;
+            kvec.iov_len = 100;
+            iov_iter_kvec(&iter, ITER_DEST, &kvec, 1, 100);
+            res = (int)dictionary_read_iter(other, "Lunga", 5, &iter, (u64)timeout * USEC_PER_MSEC, 0, &pos);
+            if (res != 100 || readBuffer[0] != 'c' || readBuffer[99] != 'c' || pos != 4100)
+            {
+                failed_read(count, "Lunga", "100 'c'", readBuffer, 100, res);
+            }
+            //Range write across the boundary between the first two chunks: the digest follows the new bytes
+            res = dictionary_write_range(other, "Lunga", 5, 4090, "zzzzzzzzzzzzzzzzzzzz", 20, DICTIONARY_KERNEL);
+            increment_if_failed(res, 0, count, "Range write of a chunked value returned %d\n", res);
+            res = dictionary_copy_value(other, "Lunga", 5, 0, 0, NULL, &value, &length);
+            if (res != 0 || length != 6000 || value[4089] != 'c' || value[4090] != 'z' || value[4109] != 'z' || value[4110] != 'c')
+            {
+                ++count;
+                printk(KERN_ALERT "Range write of a chunked value left the wrong bytes (%d)\n", res);
+            }
+            if (res == 0)
+            {
+                digest = value_digest(VALUE_DIGEST_SEED, value, length);
+                kvfree(value);
+                condition.match = DICTIONARY_IF_DIGEST;
+                condition.digest = digest;
+                res = dictionary_copy_value(other, "Lunga", 5, 0, 0, &condition, &value, &length);
+                increment_if_failed(condition.digest, digest, count, "Range write left digest %08x instead of %08x\n", 
+                    condition.digest, digest);
+                kvfree(value);
+            }
+            //Range write of a plain value, past its end
+            test_write(other, "Breve", "ciao", res, count, 0);
+            res = dictionary_write_range(other, "Breve", 5, 2, "ndo mondo", 9, DICTIONARY_KERNEL);
+            increment_if_failed(res, 0, count, "Range write past the end returned %d\n", res);
+            pos = 0;
+            test_read(other, "Breve", readBuffer, pos, "cindo mondo", res, count, timeout);
+            res = dictionary_write_range(other, "Breve", 5, 12, "!", 1, DICTIONARY_KERNEL);
+            increment_if_failed(res, -EINVAL, count, "Range write leaving a hole returned %d\n", res);
+            memset(readBuffer, 0, sizeof(readBuffer));
+            pos = 0;
+            dictionary_free(other);
+        }
+        test_dictionary_destroy(other);
+    }
+
     //Test dictionary_count
     printk(KERN_INFO 
         "-------------------------------------------------\n"
         "Tests: executing test on parse_command function.\n");
-    parse_command(dict, "-w <Hello1> World1|-w <Hello2> World2", 39, 0, true);
-    parse_command(dict, "-w <Hello3> World3|-w <Hello4> World4", 39, 0, false);
+    parse_command(dict, "-w <Hello1> World1|-w <Hello2> World2", 39, &options, true, NULL);
+    parse_command(dict, "-w <Hello3> World3|-w <Hello4> World4", 39, &options, false, NULL);
+
+    //Each command of a batch adds one result line, the batch stops at the first failure
+    other = test_dictionary_create();
+    if (IS_ERR(other))
+    {
+        ++count;
+        printk(KERN_ALERT "Creating the dictionary of the tests failed with code %ld\n", PTR_ERR(other));
+    } else {
+        command_results_init(&results);
+        options.results = &results;
+        res = parse_command(other, "-w <R> V|-r <R>|-c|-e|-x|-c", 27, &options, true, NULL);
+        increment_if_failed(res, 4, count, "parse_command() executed %d commands instead of 4\n", res);
+        if (results.length != 17 || strncmp(results.buffer, "OK\nV\n1\n0\nERR -22\n", 17) != 0)
+        {
+            ++count;
+            printk(KERN_ALERT "Commands reported \"%.*s\" instead of \"OK V 1 0 ERR -22\"\n", (int)results.length, results.buffer);
+        }
+        command_results_free(&results);
+        //Lists, sets and hashes: each operation reports its result, a typed key reads as a line per element
+        res = parse_command(other, "-q <L> a|-q <L> b|-Q <L> z|-n <L>|-y <L>|-Y <L>|-m <S> x|-m <S> x|-k <S> x|-H <H> <f> v|-G <H> <f>", 
+            98, &options, true, NULL);
+        increment_if_failed(res, 11, count, "parse_command() executed %d typed commands instead of 11\n", res);
+        if (results.length != 22 || strncmp(results.buffer, "1\n2\n3\n3\nz\nb\n1\n0\n1\n1\nv\n", 22) != 0)
+        {
+            ++count;
+            printk(KERN_ALERT "Typed commands reported \"%.*s\"\n", (int)results.length, results.buffer);
+        }
+        command_results_free(&results);
+        test_read(other, "L", readBuffer, pos, "a\n", res, count, timeout);
+        test_read(other, "H", readBuffer, pos, "<f> v\n", res, count, timeout);
+        res = dictionary_append(other, "S", 1, "y", 1, DICTIONARY_KERNEL);
+        increment_if_failed(res, -EMEDIUMTYPE, count, "Append to a set returned %d\n", res);
+        //Popping the last element deletes the key
+        parse_command(other, "-y <L>", 6, &options, true, NULL);
+        test_count(other, 2, res, count);
+        //A non blocking command that would wait stops the batch: it reports nothing and the bytes before it are consumed
+        options.flags = DICTIONARY_NONBLOCK | DICTIONARY_KERNEL;
+        res = parse_command(other, "-w <N> 1|-r <Missing>|-w <M> 2", 30, &options, true, &consumed);
+        increment_if_failed(res, 1, count, "parse_command() executed %d non blocking commands instead of 1\n", res);
+        increment_if_failed((int)consumed, 9, count, "A batch stopped by a missing key consumed %d bytes instead of 9\n", (int)consumed);
+        options.flags = DICTIONARY_KERNEL;
+        command_results_free(&results);
+        //Values are escaped, so each result stays on one line
+        res = parse_command(other, "-w <E> a\nb\\c|-r <E>", 19, &options, true, NULL);
+        if (res != 2 || results.length != 11 || strncmp(results.buffer, "OK\na\\nb\\\\c\n", 11) != 0)
+        {
+            ++count;
+            printk(KERN_ALERT "An escaped value reported \"%.*s\"\n", (int)results.length, results.buffer);
+        }
+        command_results_free(&results);
+        //The commands are not NUL terminated: a key without <> ends with them, and an empty key is refused
+        res = parse_command(other, "-w <K> v|-d Kxyz", 13, &options, true, NULL);
+        increment_if_failed(res, 2, count, "A delete at the end of the commands executed %d commands instead of 2\n", res);
+        res = parse_command(other, "-d <>", 5, &options, true, NULL);
+        increment_if_failed(res, 0, count, "A delete of an empty key executed %d commands\n", res);
+        command_results_free(&results);
+        //The results past COMMAND_RESULTS_MAX are not dropped silently
+        snapshot = (char*)kvmalloc(COMMAND_RESULTS_MAX / 2 + 1, GFP_KERNEL);
+        if (snapshot != NULL)
+        {
+            memset(snapshot, 'x', COMMAND_RESULTS_MAX / 2 + 1);
+            dictionary_write(other, "Big", 3, snapshot, COMMAND_RESULTS_MAX / 2 + 1, DICTIONARY_KERNEL);
+            kvfree(snapshot);
+            parse_command(other, "-r <Big>|-r <Big>", 17, &options, true, NULL);
+            increment_if_failed(results.overflow, true, count, "Results of %d bytes did not overflow\n", (int)COMMAND_RESULTS_MAX + 4);
+            dictionary_delete_key(other, "Big", 3, 0);
+        }
+        command_results_free(&results);
+        options.results = NULL;
+        test_dictionary_destroy(other);
+    }
+
+    //Binary records: keys can hold the separators and '\0'
+    printk(KERN_INFO 
+        "-------------------------------------------------\n"
+        "Tests: executing test on parse_binary_commands function.\n");
+    wire[0] = (char)DICTIONARY_WIRE_MAGIC;
+    length = 1;
+    length += wire_record(&wire[length], DICTIONARY_WIRE_SET, "a>b\0|", 5, "v1", 2);
+    length += wire_record(&wire[length], DICTIONARY_WIRE_APPEND, "a>b\0|", 5, "23", 2);
+    length += wire_record(&wire[length], DICTIONARY_WIRE_SET, "x|y", 3, "z", 1);
+    length += wire_record(&wire[length], DICTIONARY_WIRE_DELETE, "x|y", 3, "", 0);
+    res = parse_binary_commands(dict, wire, length, &options, &consumed);
+    increment_if_failed(res, 4, count, "parse_binary_commands() executed %d records instead of 4\n", res);
+    increment_if_failed(consumed, length, count, "parse_binary_commands() consumed %d bytes instead of %d\n", (int)consumed, (int)length);
+    res = (int)dictionary_read(dict, "a>b\0|", 5, readBuffer, sizeof(readBuffer) - 1, (u64)timeout * USEC_PER_MSEC, DICTIONARY_KERNEL, &pos);
+    if (res != 4 || strncmp(readBuffer, "v123", 4) != 0)
+    {
+        failed_read(count, "a>b", "v123", readBuffer, 4, res);
+    }
+    memset(readBuffer, 0, sizeof(readBuffer));
+    pos = 0;
+    //A record longer than what is left of the write stops the batch: only the records before it are executed and consumed
+    res = parse_binary_commands(dict, wire, length - 1, &options, &consumed);
+    increment_if_failed(res, 3, count, "parse_binary_commands() on a truncated batch returned %d instead of 3\n", res);
+    increment_if_failed(consumed, length - sizeof(struct dictionary_wire_record) - 3, count, 
+        "parse_binary_commands() on a truncated batch consumed %d bytes\n", (int)consumed);
+    res = parse_binary_commands(dict, &wire[1], sizeof(struct dictionary_wire_record) - 1, &options, NULL);
+    increment_if_failed(res, -EINVAL, count, "parse_binary_commands() on a truncated header returned %d\n", res);
+    //Deleting a key that is already missing is executed: a batch sent again doesn't stop on it
+    length = wire_record(wire, DICTIONARY_WIRE_DELETE, "x|y", 3, "", 0);
+    length += wire_record(&wire[length], DICTIONARY_WIRE_DELETE, "x|y", 3, "", 0);
+    res = parse_binary_commands(dict, wire, length, &options, &consumed);
+    increment_if_failed(res, 2, count, "parse_binary_commands() executed %d of 2 deletes of the same key\n", res);
+    increment_if_failed(consumed, length, count, "Two deletes of the same key consumed %d bytes instead of %d\n", (int)consumed, (int)length);
+    dictionary_delete_key(dict, "a>b\0|", 5, 0);
 
     return count;
+}
+
+//The scan of the separators as it was before command_scan, one byte per iteration
+static noinline size_t benchmark_bytewise_scan(const char *str, size_t index, size_t length, char delimiter)
+{
+    for ( ; index < length && str[index] != delimiter && str[index] != '\0'; ++index)
+    {
+        //Do nothing
+    }
+    return index;
+}
+
+#define benchmark_print(name, bytes, ns) \
+    printk(KERN_INFO "benchmark_parser: %s %llu MB/s (%llu ns)\n", name, \
+        div64_u64((u64)(bytes) * 1000, max_t(u64, ns, 1)), (u64)(ns))
+
+int benchmark_parser(uint commands)
+{
+    static const char value[] = "a value long enough to look like a real one, with spaces";
+    struct command_options options = { .timeout_us = 0, .flags = DICTIONARY_NONBLOCK | DICTIONARY_KERNEL };
+    pdictionary dict;
+    char *batch;
+    size_t size, length = 0, index, found_bytewise = 0, found_words = 0;
+    u64 start, bytewise_ns, words_ns, parse_ns;
+    uint i;
+    int res;
+
+    size = (size_t)commands * (sizeof(value) + 24);
+    batch = (char*)kvmalloc(size, GFP_KERNEL);
+    if (batch == NULL)
+        return -ENOMEM;
+    for (i = 0; i < commands; ++i)
+    {
+        length += scnprintf(&batch[length], size - length, "%s-w <Key%u> %s", i == 0 ? "" : "|", i, value);
+    }
+
+    //Scans only: the same separators searched byte by byte and word by word
+    start = ktime_get_ns();
+    for (index = 0; index < length; ++index, ++found_bytewise)
+    {
+        index = benchmark_bytewise_scan(batch, index, length, COMMAND_SEPARATOR);
+    }
+    bytewise_ns = ktime_get_ns() - start;
+    start = ktime_get_ns();
+    for (index = 0; index < length; ++index, ++found_words)
+    {
+        index = command_scan(batch, index, length, COMMAND_SEPARATOR);
+    }
+    words_ns = ktime_get_ns() - start;
+    if (found_bytewise != found_words)
+    {
+        printk(KERN_ALERT "benchmark_parser: the scans found %zu and %zu commands\n", found_bytewise, found_words);
+    }
+
+    //The whole parser, commands executed on a dictionary of their own
+    dict = test_dictionary_create();
+    if (!IS_ERR(dict))
+    {
+        start = ktime_get_ns();
+        res = parse_command(dict, batch, length, &options, true, NULL);
+        parse_ns = ktime_get_ns() - start;
+        printk(KERN_INFO "benchmark_parser: %d of %u commands executed, %zu bytes\n", res, commands, length);
+        benchmark_print("parse_command", length, parse_ns);
+        test_dictionary_destroy(dict);
+    }
+    benchmark_print("bytewise scan", length, bytewise_ns);
+    benchmark_print("word scan", length, words_ns);
+    kvfree(batch);
+    return 0;
+}
+
+int benchmark_appends(uint appends)
+{
+    pdictionary dict;
+    bool old_combine = combine_appends;
+    uint threads;
+    u64 ns;
+    int combine;
+
+    dict = test_dictionary_create();
+    if (IS_ERR(dict))
+        return PTR_ERR(dict);
+    for (combine = 0; combine <= 1; ++combine)
+    {
+        combine_appends = combine != 0;
+        for (threads = 1; threads <= num_online_cpus(); threads *= 2)
+        {
+            ns = benchmark_append_round(dict, threads, appends);
+            dictionary_free(dict);
+            if (ns == 0)
+                break;
+            printk(KERN_INFO "benchmark_appends: %u threads on one key, %s: %llu appends/s (%llu ns)\n", 
+                threads, combine ? "combined" : "one at a time", 
+                div64_u64((u64)(appends / threads) * threads * NSEC_PER_SEC, ns), ns);
+        }
+    }
+    combine_appends = old_combine;
+    test_dictionary_destroy(dict);
+    return 0;
 }
\ No newline at end of file
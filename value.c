@@ -0,0 +1,635 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include "module.h"
+#include "value.h"
+#include "compression.h"
+#include "collection.h"
+#include "arena.h"
+
+//Copies length bytes of src, a user string unless user is false
+static int value_copy_from(char *dest, const char __user *src, size_t length, bool user)
+{
+    if (!user)
+    {
+        memcpy(dest, (const char __force*)src, length);
+        return 0;
+    }
+    return copy_from_user(dest, src, length) != 0 ? -EFAULT : 0;
+}
+//Copies length bytes to dest, a user buffer unless user is false
+static int value_copy_to(char __user *dest, const char *src, size_t length, bool user)
+{
+    if (!user)
+    {
+        memcpy((char __force*)dest, src, length);
+        return 0;
+    }
+    return copy_to_user(dest, src, length) != 0 ? -EFAULT : 0;
+}
+static struct value_chunk* value_chunk_alloc(void)
+{
+    struct page *page;
+    struct value_chunk *chunk;
+
+    page = alloc_page(GFP_USER);
+    if (page == NULL)
+        return NULL;
+    chunk = (struct value_chunk*)page_address(page);
+    INIT_LIST_HEAD(&chunk->list);
+    chunk->page = page;
+    chunk->used = 0;
+    return chunk;
+}
+static void value_chunks_free(struct list_head *chunks)
+{
+    struct value_chunk *chunk, *tmp;
+
+    list_for_each_entry_safe(chunk, tmp, chunks, list)
+    {
+        list_del(&chunk->list);
+        //The page could still be referenced by someone else (a pipe, for example)
+        put_page(chunk->page);
+    }
+}
+//Adds str at the end of the chunks of the node: all the bytes or none of them
+static int value_chunks_append(pnode node, const char __user *str, size_t length, bool user)
+{
+    struct value_chunk *tail = NULL, *chunk;
+    LIST_HEAD(added);
+    size_t room = 0, needed, copied = 0, chunk_length, i;
+    u32 digest = node->digest;
+
+    if (!list_empty(&node->chunks))
+    {
+        tail = list_last_entry(&node->chunks, struct value_chunk, list);
+        room = VALUE_CHUNK_DATA - tail->used;
+    }
+    //The chunks are allocated first, so that a failure leaves the value as it was
+    needed = length > room ? DIV_ROUND_UP(length - room, VALUE_CHUNK_DATA) : 0;
+    for (i = 0; i < needed; ++i)
+    {
+        chunk = value_chunk_alloc();
+        if (chunk == NULL)
+        {
+            value_chunks_free(&added);
+            return -ENOMEM;
+        }
+        list_add_tail(&chunk->list, &added);
+    }
+    if (tail != NULL && room > 0)
+    {
+        //Fill what is left of the last chunk
+        copied = min(room, length);
+        if (value_copy_from(value_chunk_data(tail) + tail->used, str, copied, user) != 0)
+        {
+            value_chunks_free(&added);
+            return -EFAULT;
+        }
+        digest = value_digest(digest, value_chunk_data(tail) + tail->used, copied);
+    }
+    list_for_each_entry(chunk, &added, list)
+    {
+        chunk_length = min_t(size_t, length - copied, VALUE_CHUNK_DATA);
+        if (value_copy_from(value_chunk_data(chunk), &str[copied], chunk_length, user) != 0)
+        {
+            value_chunks_free(&added);
+            return -EFAULT;
+        }
+        chunk->used = chunk_length;
+        copied += chunk_length;
+        digest = value_digest(digest, value_chunk_data(chunk), chunk_length);
+    }
+    if (tail != NULL)
+    {
+        tail->used += min(room, length);
+    }
+    list_splice_tail(&added, &node->chunks);
+    node->digest = digest;
+    node->value_length += length;
+    node->stored_length += needed * PAGE_SIZE;
+    return 0;
+}
+//Allocates the buffer of a contiguous value: the short ones go to the arena, if there is one
+static char* value_buffer_alloc(struct arena *arena, pnode node, size_t size, bool *in_arena)
+{
+    *in_arena = arena != NULL && size <= ARENA_MAX_VALUE;
+    if (*in_arena)
+        return arena_alloc(arena, node, size);
+    //kvmalloc: a large value doesn't need physically contiguous pages
+    return (char*)kvmalloc(size, GFP_USER);
+}
+//Frees a buffer of value_buffer_alloc that was not given to the node
+static void value_buffer_put(char *value, bool in_arena)
+{
+    if (in_arena)
+    {
+        arena_free(value);
+    } else {
+        kvfree(value);
+    }
+}
+//Moves a contiguous value into chunks, call once the value has grown too much to be reallocated at every append
+static int value_to_chunks(pnode node)
+{
+    const char *plain;
+    size_t length = node->value_length, stored = node->stored_length;
+    u32 digest = node->digest;
+    int res;
+
+    plain = node_value_get(node);
+    if (plain == NULL)
+        return -ENOMEM;
+    //The same bytes are appended to an empty value: the digest comes out the same
+    node->value_length = 0;
+    node->stored_length = 0;
+    node->digest = VALUE_DIGEST_SEED;
+    res = value_chunks_append(node, plain, length, false);
+    node_value_put(node, plain);
+    if (res != 0)
+    {
+        node->value_length = length;
+        node->stored_length = stored;
+        node->digest = digest;
+        return res;
+    }
+    value_buffer_free(node);
+    node->flags = (node->flags & ~NODE_COMPRESSED) | NODE_CHUNKED;
+    return 0;
+}
+//Appends to a small contiguous value
+static int value_append_contiguous(void **workspace, struct arena *arena, pnode node, const char __user *str, size_t length, bool user)
+{
+    char *value;
+    bool in_arena;
+    int res;
+
+    //Appending to a compressed stream is not possible: go back to the plain value first
+    res = compression_decompress_node(node);
+    if (res != 0)
+        return res;
+    value = value_buffer_alloc(arena, node, node->value_length + length + 1, &in_arena);
+    if (value == NULL)
+        return -ENOMEM;
+    memcpy(value, node->value, node->value_length);
+    res = value_copy_from(&value[node->value_length], str, length, user);
+    if (res != 0)
+    {
+        value_buffer_put(value, in_arena);
+        return res;
+    }
+    value[node->value_length + length] = '\0';
+    value_buffer_free(node);
+    node->value = value;
+    if (in_arena)
+    {
+        node->flags |= NODE_ARENA;
+    }
+    //Only the new bytes are hashed
+    node->digest = value_digest(node->digest, &value[node->value_length], length);
+    node->value_length += length;
+    node->stored_length = node->value_length + 1;
+    compression_compress_node(workspace, node);
+    return 0;
+}
+
+//Finds the chunk holding the byte at *offset, which becomes the offset inside the chunk
+static struct value_chunk* value_chunk_at(pnode node, size_t *offset)
+{
+    struct value_chunk *chunk;
+
+    list_for_each_entry(chunk, &node->chunks, list)
+    {
+        if (*offset < chunk->used)
+            return chunk;
+        *offset -= chunk->used;
+    }
+    return NULL;
+}
+
+//Updates the digest for length bytes at offset whose CRC32 from 0 went from old_crc to new_crc.
+//CRC32 is linear: the digest changes by the CRC of the changed bits followed by the zeros of the rest of the value
+static void value_digest_replace(pnode node, size_t offset, size_t length, u32 old_crc, u32 new_crc)
+{
+    node->digest ^= crc32_le_shift(old_crc ^ new_crc, node->value_length - offset - length);
+}
+//Hashes the whole plain or chunked value again, after a range write failed halfway
+static void value_digest_again(pnode node)
+{
+    struct value_chunk *chunk;
+
+    if (!(node->flags & NODE_CHUNKED))
+    {
+        node->digest = value_digest(VALUE_DIGEST_SEED, node->value, node->value_length);
+        return;
+    }
+    node->digest = VALUE_DIGEST_SEED;
+    list_for_each_entry(chunk, &node->chunks, list)
+    {
+        node->digest = value_digest(node->digest, value_chunk_data(chunk), chunk->used);
+    }
+}
+//Copies length bytes of str over the value at offset, updating the digest. The bytes must be in the value already
+static int value_overwrite(pnode node, char *dest, size_t offset, const char __user *str, size_t length, bool user)
+{
+    u32 old_crc;
+    int res;
+
+    old_crc = crc32_le(0, dest, length);
+    res = value_copy_from(dest, str, length, user);
+    if (res != 0)
+    {
+        //Part of the bytes could have been copied
+        value_digest_again(node);
+        return res;
+    }
+    value_digest_replace(node, offset, length, old_crc, crc32_le(0, dest, length));
+    return 0;
+}
+//Gives a chunk a page of its own if its page is referenced by someone else too (a pipe, after a splice)
+static int value_chunk_own(struct value_chunk **chunk)
+{
+    struct value_chunk *copy;
+
+    if (page_count((*chunk)->page) == 1)
+        return 0;
+    copy = value_chunk_alloc();
+    if (copy == NULL)
+        return -ENOMEM;
+    memcpy(value_chunk_data(copy), value_chunk_data(*chunk), (*chunk)->used);
+    copy->used = (*chunk)->used;
+    list_replace(&(*chunk)->list, &copy->list);
+    put_page((*chunk)->page);
+    *chunk = copy;
+    return 0;
+}
+//Overwrites length bytes of a chunked value, from offset: only the chunks holding them are touched
+static int value_chunks_overwrite(pnode node, size_t offset, const char __user *str, size_t length, bool user)
+{
+    struct value_chunk *chunk;
+    size_t inside = offset, done = 0, piece;
+    int res;
+
+    chunk = value_chunk_at(node, &inside);
+    if (chunk == NULL)
+        return -EINVAL;
+    list_for_each_entry_from(chunk, &node->chunks, list)
+    {
+        if (done == length)
+            break;
+        res = value_chunk_own(&chunk);
+        if (res != 0)
+            return res;
+        piece = min(chunk->used - inside, length - done);
+        res = value_overwrite(node, value_chunk_data(chunk) + inside, offset + done, &str[done], piece, user);
+        if (res != 0)
+            return res;
+        done += piece;
+        inside = 0;
+    }
+    return 0;
+}
+
+// Set function
+int value_set(void **workspace, struct arena *arena, pnode node, const char __user *str, size_t length, bool user)
+{
+    char *value;
+    bool in_arena;
+    int res;
+
+    value = value_buffer_alloc(arena, node, length + 1, &in_arena);
+    if (value == NULL)
+        return -ENOMEM;
+    res = value_copy_from(value, str, length, user);
+    if (res != 0)
+    {
+        value_buffer_put(value, in_arena);
+        return res;
+    }
+    value[length] = '\0';
+    value_free(node);
+    node->value = value;
+    if (in_arena)
+    {
+        node->flags |= NODE_ARENA;
+    }
+    node->value_length = length;
+    node->digest = value_digest(VALUE_DIGEST_SEED, value, length);
+    node->stored_length = length + 1;
+    compression_compress_node(workspace, node);
+    return 0;
+}
+
+// Append function
+int value_append(void **workspace, struct arena *arena, pnode node, const char __user *str, size_t length, bool user)
+{
+    int res;
+
+    if (node->flags & NODE_TYPED)
+        return -EMEDIUMTYPE;
+    if (!(node->flags & NODE_CHUNKED))
+    {
+        if (node->value_length + length < VALUE_CHUNK_DATA)
+        {
+            return value_append_contiguous(workspace, arena, node, str, length, user);
+        }
+        //From now on the value grows by chunks: the bytes already there are copied this time only
+        res = value_to_chunks(node);
+        if (res != 0)
+            return res;
+    }
+    return value_chunks_append(node, str, length, user);
+}
+
+// Range write function
+int value_write_range(void **workspace, struct arena *arena, pnode node, size_t offset, const char __user *str, size_t length, bool user)
+{
+    size_t inside;
+    bool compressed = (node->flags & NODE_COMPRESSED) != 0;
+    int res;
+
+    if (node->flags & NODE_TYPED)
+        return -EMEDIUMTYPE;
+    if (offset > node->value_length)
+        return -EINVAL;
+    inside = min(length, node->value_length - offset);
+    if (inside < length)
+    {
+        //The bytes past the end are appended first: that's where an allocation can fail
+        res = value_append(workspace, arena, node, &str[inside], length - inside, user);
+        if (res != 0)
+            return res;
+        compressed = (node->flags & NODE_COMPRESSED) != 0;
+    }
+    if (inside == 0)
+        return 0;
+    if (node->flags & NODE_CHUNKED)
+        return value_chunks_overwrite(node, offset, str, inside, user);
+    //A compressed stream can't be changed in place: go back to the plain value first
+    res = compression_decompress_node(node);
+    if (res != 0)
+        return res;
+    res = value_overwrite(node, &node->value[offset], offset, str, inside, user);
+    if (compressed)
+    {
+        compression_compress_node(workspace, node);
+    }
+    return res;
+}
+
+// Free function
+void value_free(pnode node)
+{
+    if (node->flags & NODE_CHUNKED)
+    {
+        value_chunks_free(&node->chunks);
+    } else if (node->flags & NODE_TYPED)
+    {
+        collection_free(node);
+    } else {
+        value_buffer_free(node);
+    }
+    node->value = NULL;
+    node->value_length = 0;
+    node->stored_length = 0;
+    node->digest = VALUE_DIGEST_SEED;
+    node->flags &= ~(NODE_COMPRESSED | NODE_CHUNKED | NODE_TYPED);
+}
+
+void value_buffer_free(pnode node)
+{
+    if (node->flags & NODE_ARENA)
+    {
+        arena_free(node->value);
+    } else {
+        kvfree(node->value);
+    }
+    node->value = NULL;
+    node->flags &= ~NODE_ARENA;
+}
+
+// Read function
+ssize_t value_read(pnode node, char __user *buffer, size_t maxsize, loff_t *ppos, bool user)
+{
+    struct value_chunk *chunk;
+    const char *value;
+    ssize_t res;
+    size_t offset, copied = 0, length;
+
+    if (!(node->flags & NODE_CHUNKED))
+    {
+        //Compressed values are expanded in a kernel buffer: LZ4 can't write to user memory
+        value = node_value_get(node);
+        if (value == NULL)
+            return -ENOMEM;
+        res = user ? simple_read_from_buffer(buffer, maxsize, ppos, value, node->value_length) :
+            memory_read_from_buffer((char __force*)buffer, maxsize, ppos, value, node->value_length);
+        node_value_put(node, value);
+        return res;
+    }
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (*ppos >= node->value_length)
+        return 0;
+    //Skip the chunks before *ppos, then copy out one chunk at a time
+    offset = (size_t)*ppos;
+    chunk = value_chunk_at(node, &offset);
+    if (chunk == NULL)
+        return 0;
+    list_for_each_entry_from(chunk, &node->chunks, list)
+    {
+        length = min(chunk->used - offset, maxsize - copied);
+        if (value_copy_to(&buffer[copied], value_chunk_data(chunk) + offset, length, user) != 0)
+        {
+            if (copied == 0)
+                return -EFAULT;
+            break;
+        }
+        copied += length;
+        offset = 0;
+        if (copied == maxsize)
+            break;
+    }
+    *ppos += copied;
+    return (ssize_t)copied;
+}
+
+// Read to iov_iter function
+ssize_t value_read_iter(pnode node, struct iov_iter *to, loff_t *ppos)
+{
+    struct value_chunk *chunk;
+    const char *value;
+    size_t offset, copied = 0, length, res;
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (*ppos >= node->value_length || iov_iter_count(to) == 0)
+        return 0;
+    offset = (size_t)*ppos;
+    if (!(node->flags & NODE_CHUNKED))
+    {
+        value = node_value_get(node);
+        if (value == NULL)
+            return -ENOMEM;
+        copied = copy_to_iter(&value[offset], node->value_length - offset, to);
+        node_value_put(node, value);
+    } else {
+        chunk = value_chunk_at(node, &offset);
+        if (chunk == NULL)
+            return 0;
+        list_for_each_entry_from(chunk, &node->chunks, list)
+        {
+            if (iov_iter_count(to) == 0)
+                break;
+            length = chunk->used - offset;
+            res = copy_to_iter(value_chunk_data(chunk) + offset, length, to);
+            copied += res;
+            if (res < length)
+                break;
+            offset = 0;
+        }
+    }
+    if (copied == 0)
+        return -EFAULT;
+    *ppos += copied;
+    return (ssize_t)copied;
+}
+
+static void value_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    put_page(spd->pages[i]);
+}
+
+// Splice function
+ssize_t value_splice(pnode node, struct pipe_inode_info *pipe, size_t len, loff_t *ppos)
+{
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages = 0,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &nosteal_pipe_buf_ops,
+        .spd_release = value_spd_release,
+    };
+    struct value_chunk *chunk;
+    const char *value;
+    size_t offset, length;
+    ssize_t res;
+
+    if (*ppos < 0)
+        return -EINVAL;
+    if (*ppos >= node->value_length || len == 0)
+        return 0;
+    offset = (size_t)*ppos;
+    len = min_t(size_t, len, node->value_length - offset);
+    if (node->flags & NODE_CHUNKED)
+    {
+        //Zero copy: the pipe takes a reference to the pages of the chunks.
+        //Appends only write after the bytes given to the pipe, a new value never reuses the old pages
+        //and range writes copy the pages that are referenced by someone else
+        chunk = value_chunk_at(node, &offset);
+        if (chunk == NULL)
+            return 0;
+        list_for_each_entry_from(chunk, &node->chunks, list)
+        {
+            if (len == 0 || spd.nr_pages == PIPE_DEF_BUFFERS)
+                break;
+            length = min(chunk->used - offset, len);
+            get_page(chunk->page);
+            pages[spd.nr_pages] = chunk->page;
+            partial[spd.nr_pages].offset = offset_in_page(value_chunk_data(chunk) + offset);
+            partial[spd.nr_pages].len = (unsigned int)length;
+            spd.nr_pages++;
+            len -= length;
+            offset = 0;
+        }
+    } else {
+        //kmalloc/vmalloc memory can't be given to a pipe: copy the value to new pages
+        value = node_value_get(node);
+        if (value == NULL)
+            return -ENOMEM;
+        while (len > 0 && spd.nr_pages < PIPE_DEF_BUFFERS)
+        {
+            pages[spd.nr_pages] = alloc_page(GFP_KERNEL);
+            if (pages[spd.nr_pages] == NULL)
+                break;
+            length = min_t(size_t, len, PAGE_SIZE);
+            memcpy(page_address(pages[spd.nr_pages]), &value[offset], length);
+            partial[spd.nr_pages].offset = 0;
+            partial[spd.nr_pages].len = (unsigned int)length;
+            spd.nr_pages++;
+            offset += length;
+            len -= length;
+        }
+        node_value_put(node, value);
+    }
+    if (spd.nr_pages == 0)
+        return -ENOMEM;
+    //Pages the pipe has no room for are released through value_spd_release
+    res = splice_to_pipe(pipe, &spd);
+    if (res > 0)
+    {
+        *ppos += res;
+    }
+    return res;
+}
+
+// Copy function
+int value_copy(pnode node, char *dest)
+{
+    struct value_chunk *chunk;
+
+    if (node->flags & NODE_COMPRESSED)
+        return compression_expand(node, dest);
+    if (node->flags & NODE_TYPED)
+    {
+        //The text form is built only here
+        collection_render(node, dest);
+        return 0;
+    }
+    if (node->flags & NODE_CHUNKED)
+    {
+        list_for_each_entry(chunk, &node->chunks, list)
+        {
+            memcpy(dest, value_chunk_data(chunk), chunk->used);
+            dest += chunk->used;
+        }
+        return 0;
+    }
+    memcpy(dest, node->value, node->value_length);
+    return 0;
+}
+
+// Plain value function
+const char* node_value_get(pnode node)
+{
+    char *plain;
+
+    if (!(node->flags & (NODE_COMPRESSED | NODE_CHUNKED | NODE_TYPED)))
+        return node->value;
+    plain = (char*)kvmalloc(node->value_length + 1, GFP_KERNEL);
+    if (plain == NULL)
+        return NULL;
+    if (value_copy(node, plain) != 0)
+    {
+        kvfree(plain);
+        return NULL;
+    }
+    plain[node->value_length] = '\0';
+    return plain;
+}
+
+void node_value_put(pnode node, const char* value)
+{
+    if (value != NULL && value != node->value)
+    {
+        kvfree(value);
+    }
+}
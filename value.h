@@ -0,0 +1,110 @@
+#ifndef _MODULE_VALUE_H
+#define _MODULE_VALUE_H
+
+#include <linux/crc32.h>
+#include "dictionary.h"
+
+struct arena;
+
+/// @brief Page of a chunked value: the header is at the start of the page, the data follows it
+struct value_chunk {
+    struct list_head list;
+    struct page *page;
+    size_t used;    //Bytes of data in the chunk
+};
+
+//Digest of an empty value
+#define VALUE_DIGEST_SEED (~0u)
+
+/// @brief Extends the digest of a value (CRC32, see node->digest) with the bytes that follow it
+#define value_digest(digest, data, length) crc32_le(digest, (const unsigned char*)(data), length)
+
+//Bytes of data a chunk can hold
+#define VALUE_CHUNK_DATA (PAGE_SIZE - sizeof(struct value_chunk))
+
+//Data of a chunk
+#define value_chunk_data(chunk) ((char*)((chunk) + 1))
+
+/// @brief Replaces the value of the node. The new value is a single buffer, compressed if it's long enough
+/// @param workspace workspace of the compressor, see compression_compress_node
+/// @param arena where the short values are placed (see arena.h), NULL to kvmalloc all of them
+/// @param node the node to update
+/// @param str the new value
+/// @param length the length of the value
+/// @param user true if str is user memory, false if it is kernel memory
+/// @return zero for success (the old value has been freed), below zero otherwise (the old value is left as it was)
+int value_set(void **workspace, struct arena *arena, pnode node, const char __user *str, size_t length, bool user);
+
+/// @brief Appends str to the value of the node. Values that grow past a chunk are moved once into
+/// page sized chunks, from then on appends only copy the new bytes
+/// @param workspace workspace of the compressor, see compression_compress_node
+/// @param arena where the short values are placed (see arena.h), NULL to kvmalloc all of them
+/// @param node the node to update
+/// @param str the bytes to append
+/// @param length the number of bytes to append
+/// @param user true if str is user memory, false if it is kernel memory
+/// @return zero for success, -EMEDIUMTYPE for typed values, below zero otherwise (the value is left as it was)
+int value_append(void **workspace, struct arena *arena, pnode node, const char __user *str, size_t length, bool user);
+
+/// @brief Overwrites the bytes of the value from offset, the ones past the end are appended.
+/// Only the bytes written are copied: the rest of the value is neither copied nor reallocated (unless compressed)
+/// @param workspace workspace of the compressor, see compression_compress_node
+/// @param arena where the bytes past the end can be placed, see value_append
+/// @param node the node to update
+/// @param offset first byte to overwrite, at most node->value_length
+/// @param str the new bytes
+/// @param length the number of bytes to write
+/// @param user true if str is user memory, false if it is kernel memory
+/// @return zero for success, -EMEDIUMTYPE for typed values, below zero otherwise (with -EFAULT the range can be written in part)
+int value_write_range(void **workspace, struct arena *arena, pnode node, size_t offset, const char __user *str, size_t length, bool user);
+
+/// @brief Frees the value of the node, whatever its kind
+/// @param node the node
+void value_free(pnode node);
+
+/// @brief Frees the buffer of a contiguous (plain or compressed) value, from the arena or from kvmalloc
+/// @param node the node, its value is set to NULL
+void value_buffer_free(pnode node);
+
+/// @brief Copies the plain value, starting from *ppos, to a buffer: chunked values are copied one chunk at a time
+/// @param node the node to read
+/// @param buffer the output buffer, user memory unless user is false
+/// @param maxsize the length of the output buffer
+/// @param ppos offset inside the value, incremented by the bytes copied
+/// @param user false if buffer is kernel memory
+/// @return number of bytes copied, below zero for errors
+ssize_t value_read(pnode node, char __user *buffer, size_t maxsize, loff_t *ppos, bool user);
+
+/// @brief Copies the plain value, starting from *ppos, to an iov_iter
+/// @param node the node to read
+/// @param to where the value is copied
+/// @param ppos offset inside the value, incremented by the bytes copied
+/// @return number of bytes copied, below zero for errors
+ssize_t value_read_iter(pnode node, struct iov_iter *to, loff_t *ppos);
+
+/// @brief Moves the plain value, starting from *ppos, to a pipe. The pages of chunked values are
+/// given to the pipe by reference, the other values are copied to new pages
+/// @param node the node to read
+/// @param pipe the pipe to fill
+/// @param len max number of bytes to move
+/// @param ppos offset inside the value, incremented by the bytes moved
+/// @return number of bytes moved, below zero for errors
+ssize_t value_splice(pnode node, struct pipe_inode_info *pipe, size_t len, loff_t *ppos);
+
+/// @brief Copies the plain value to a kernel buffer
+/// @param node the node to read
+/// @param dest buffer of at least node->value_length bytes
+/// @return zero for success, non zero otherwise
+int value_copy(pnode node, char *dest);
+
+/// @brief Gives the plain value of the node: the value of the node itself or, when compressed, chunked or typed, a new contiguous copy
+/// @param node the node to read
+/// @return the value, '\0' terminated, NULL for errors. Release it with node_value_put
+const char* node_value_get(pnode node);
+
+/// @brief Releases the value returned by node_value_get
+/// @param node the node that was read
+/// @param value the value returned by node_value_get, can be NULL
+void node_value_put(pnode node, const char* value);
+
+#endif
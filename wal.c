@@ -0,0 +1,742 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/kthread.h>
+#include <linux/crc32.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
+#include "module.h"
+#include "namespace.h"
+#include "compression.h"
+#include "filter.h"
+#include "value.h"
+#include "wal.h"
+
+/*
+ * Write-ahead log. Writers build the record of their change before they take the mutex of the namespace
+ * and queue it while they hold it: they never touch the file. A kernel thread takes all the queued records every wal_flush_ms,
+ * or as soon as wal_batch bytes are queued or someone waits for one of them, writes them and makes the whole
+ * group durable with a single fsync. Only the writers that asked for it (DICTIONARY_SYNC) wait for the fsync.
+ * When the module is loaded the records are replayed into tables of nodes, one per namespace, that are
+ * moved into the namespaces with dictionary_bulk_insert: no search of the dictionary for each record.
+ */
+
+/// @brief State of the log
+static struct {
+    struct file *file;
+    loff_t position;                //Where the next record is written, used by the thread only
+    struct task_struct *thread;     //NULL while there is no log or it's being replayed: nothing is queued
+    spinlock_t lock;                //Protects the fields below
+    struct list_head queue;         //Records waiting for the thread
+    size_t queued;                  //Bytes of the records in queue
+    u64 lsn;                        //Sequence number of the last record queued
+    u64 durable;                    //Sequence number of the last record on disk
+    bool sync;                      //Someone waits for a record: the thread doesn't wait for the interval
+    u64 failures;                   //Groups of records that could not be written, they are tried again
+    wait_queue_head_t wake;         //The thread waits here
+    wait_queue_head_t durable_queue;//The writers waiting for their record wait here
+} wal;
+
+/// @brief Keys of a namespace rebuilt while the log is replayed
+struct wal_replay {
+    struct list_head list;
+    char name[DICTIONARY_NAME_MAX];
+    struct list_head *buckets;      //Nodes by key_hash, linked by their list
+    size_t bucket_count;            //Power of two
+    size_t count;
+};
+
+//Buckets of a new replay table
+#define WAL_REPLAY_BUCKETS 1024
+
+#define wal_should_flush() (READ_ONCE(wal.sync) || READ_ONCE(wal.queued) >= READ_ONCE(wal_batch) || kthread_should_stop())
+
+bool wal_enabled(void)
+{
+    return wal.thread != NULL;
+}
+
+struct wal_entry* wal_prepare(pdictionary dict, unsigned int opcode, const char *key, size_t key_length,
+    const char *value, size_t value_length, size_t offset, unsigned int flags)
+{
+    struct wal_entry *entry;
+    struct wal_record *record;
+    size_t name_length, size;
+    char *data;
+
+    //Dictionaries that are not namespaces (the ones of the tests) have no name to be replayed into
+    if (!wal_enabled() || dict->name[0] == '\0')
+        return NULL;
+    if (key_length == 0 && key != NULL)
+    {
+        key_length = strlen(key);
+    }
+    name_length = strnlen(dict->name, DICTIONARY_NAME_MAX);
+    size = sizeof(struct wal_record) + name_length + key_length + value_length;
+    entry = (struct wal_entry*)kvmalloc(sizeof(struct wal_entry) + size, 
+        (flags & DICTIONARY_NONBLOCK) ? GFP_NOWAIT : GFP_KERNEL);
+    if (entry == NULL)
+        return ERR_PTR((flags & DICTIONARY_NONBLOCK) ? -EAGAIN : -ENOMEM);
+
+    record = (struct wal_record*)entry->data;
+    memset(record, 0, sizeof(struct wal_record));
+    record->opcode = (u8)opcode;
+    record->name_length = (u8)name_length;
+    put_unaligned_le32((u32)key_length, &record->key_length);
+    put_unaligned_le32((u32)value_length, &record->value_length);
+    put_unaligned_le64((u64)offset, &record->offset);
+    data = &entry->data[sizeof(struct wal_record)];
+    memcpy(data, dict->name, name_length);
+    memcpy(&data[name_length], key, key_length);
+    if (value_length != 0)
+    {
+        if (flags & DICTIONARY_KERNEL)
+        {
+            memcpy(&data[name_length + key_length], value, value_length);
+        } else if (copy_from_user(&data[name_length + key_length], (const char __user*)value, value_length) != 0)
+        {
+            kvfree(entry);
+            return ERR_PTR(-EFAULT);
+        }
+    }
+    //The CRC is left to the thread, outside of the mutex
+    entry->size = size;
+    entry->lsn = 0;
+    INIT_LIST_HEAD(&entry->list);
+    return entry;
+}
+
+const char* wal_entry_value(const struct wal_entry *entry)
+{
+    const struct wal_record *record = (const struct wal_record*)entry->data;
+
+    return &entry->data[sizeof(struct wal_record) + record->name_length + get_unaligned_le32(&record->key_length)];
+}
+
+u64 wal_queue(struct wal_entry *entry)
+{
+    u64 lsn;
+    bool wake;
+
+    if (entry == NULL)
+        return 0;
+    spin_lock(&wal.lock);
+    entry->lsn = lsn = ++wal.lsn;
+    list_move_tail(&entry->list, &wal.queue);
+    wal.queued += entry->size;
+    wake = wal.queued >= wal_batch;
+    spin_unlock(&wal.lock);
+    if (wake)
+    {
+        wake_up(&wal.wake);
+    }
+    return lsn;
+}
+
+void wal_discard(struct wal_entry *entry)
+{
+    if (entry == NULL)
+        return;
+    list_del(&entry->list);
+    kvfree(entry);
+}
+
+//Writes all the queued records and syncs the file once. If it fails the records go back to the head of the queue
+//and the file back to where they started: the next attempt writes them over what is there
+static int wal_flush(void)
+{
+    LIST_HEAD(group);
+    struct wal_entry *entry, *tmp;
+    struct wal_record *record;
+    loff_t start = wal.position;
+    size_t size = 0;
+    u64 last = 0;
+    int res = 0;
+
+    spin_lock(&wal.lock);
+    list_splice_init(&wal.queue, &group);
+    wal.queued = 0;
+    wal.sync = false;
+    spin_unlock(&wal.lock);
+    if (list_empty(&group))
+        return 0;
+    list_for_each_entry(entry, &group, list)
+    {
+        record = (struct wal_record*)entry->data;
+        put_unaligned_le32(wal_record_crc(record, entry->size), &record->crc);
+        if (kernel_write(wal.file, entry->data, entry->size, &wal.position) != (ssize_t)entry->size)
+        {
+            res = -EIO;
+            break;
+        }
+        last = entry->lsn;
+    }
+    //One fsync for the whole group
+    if (res == 0 && vfs_fsync(wal.file, 1) != 0)
+    {
+        res = -EIO;
+    }
+    if (res != 0)
+    {
+        wal.position = start;
+        list_for_each_entry(entry, &group, list)
+        {
+            size += entry->size;
+        }
+        spin_lock(&wal.lock);
+        list_splice(&group, &wal.queue);
+        wal.queued += size;
+        wal.failures++;
+        spin_unlock(&wal.lock);
+        printk(KERN_ALERT "dictionary: the write-ahead log could not be written, trying again in %u ms.\n", 
+            max_t(uint, READ_ONCE(wal_flush_ms), 1));
+        wake_up_all(&wal.durable_queue);
+        return res;
+    }
+    list_for_each_entry_safe(entry, tmp, &group, list)
+    {
+        list_del(&entry->list);
+        kvfree(entry);
+    }
+    spin_lock(&wal.lock);
+    wal.durable = last;
+    spin_unlock(&wal.lock);
+    wake_up_all(&wal.durable_queue);
+    return 0;
+}
+
+static int wal_thread(void *data)
+{
+    bool failed = false;
+
+    while (!kthread_should_stop())
+    {
+        if (failed)
+        {
+            //A group that failed is tried again after the interval, not as soon as someone waits for it
+            wait_event_interruptible_timeout(wal.wake, kthread_should_stop(), msecs_to_jiffies(max_t(uint, READ_ONCE(wal_flush_ms), 1)));
+        } else {
+            wait_event_interruptible_timeout(wal.wake, wal_should_flush(), msecs_to_jiffies(max_t(uint, READ_ONCE(wal_flush_ms), 1)));
+        }
+        failed = wal_flush() != 0;
+    }
+    //The records queued before the stop
+    wal_flush();
+    return 0;
+}
+
+int wal_wait(u64 lsn)
+{
+    u64 failures;
+
+    if (lsn == 0)
+        return 0;
+    failures = READ_ONCE(wal.failures);
+    if (READ_ONCE(wal.durable) < lsn)
+    {
+        //Group commit: the record goes with all the ones queued meanwhile
+        WRITE_ONCE(wal.sync, true);
+        wake_up(&wal.wake);
+        //Only a write that fails while this task waits is reported: the ones before don't stop the next
+        if (wait_event_killable(wal.durable_queue, READ_ONCE(wal.durable) >= lsn || READ_ONCE(wal.failures) != failures) != 0)
+            return -EINTR;
+    }
+    return READ_ONCE(wal.durable) >= lsn ? 0 : -EIO;
+}
+
+int wal_sync(void)
+{
+    u64 lsn;
+
+    if (!wal_enabled())
+        return 0;
+    spin_lock(&wal.lock);
+    lsn = wal.lsn;
+    spin_unlock(&wal.lock);
+    return wal_wait(lsn);
+}
+
+//Frees the nodes of a replay table
+static void wal_replay_clear(struct wal_replay *replay)
+{
+    pnode node, tmp;
+    size_t i;
+
+    for (i = 0; i < replay->bucket_count; ++i)
+    {
+        list_for_each_entry_safe(node, tmp, &replay->buckets[i], list)
+        {
+            list_del(&node->list);
+            dictionary_free_node(node);
+        }
+    }
+    replay->count = 0;
+}
+
+//Searches the replay table of a namespace, creating it if it's missing
+static struct wal_replay* wal_replay_get(struct list_head *replays, const char *name, size_t name_length)
+{
+    struct wal_replay *replay;
+    size_t i;
+
+    if (name_length >= DICTIONARY_NAME_MAX)
+        return NULL;
+    list_for_each_entry(replay, replays, list)
+    {
+        if (strncmp(replay->name, name, name_length) == 0 && replay->name[name_length] == '\0')
+            return replay;
+    }
+    replay = (struct wal_replay*)kzalloc(sizeof(struct wal_replay), GFP_KERNEL);
+    if (replay == NULL)
+        return NULL;
+    replay->buckets = (struct list_head*)kvmalloc_array(WAL_REPLAY_BUCKETS, sizeof(struct list_head), GFP_KERNEL);
+    if (replay->buckets == NULL)
+    {
+        kfree(replay);
+        return NULL;
+    }
+    for (i = 0; i < WAL_REPLAY_BUCKETS; ++i)
+    {
+        INIT_LIST_HEAD(&replay->buckets[i]);
+    }
+    replay->bucket_count = WAL_REPLAY_BUCKETS;
+    memcpy(replay->name, name, name_length);
+    list_add_tail(&replay->list, replays);
+    return replay;
+}
+
+//Doubles the buckets of a table, if it can't it keeps the old ones
+static void wal_replay_grow(struct wal_replay *replay)
+{
+    struct list_head *buckets;
+    pnode node, tmp;
+    size_t i, count = replay->bucket_count * 2;
+
+    buckets = (struct list_head*)kvmalloc_array(count, sizeof(struct list_head), GFP_KERNEL);
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < count; ++i)
+    {
+        INIT_LIST_HEAD(&buckets[i]);
+    }
+    for (i = 0; i < replay->bucket_count; ++i)
+    {
+        list_for_each_entry_safe(node, tmp, &replay->buckets[i], list)
+        {
+            list_move(&node->list, &buckets[node->key_hash & (count - 1)]);
+        }
+    }
+    kvfree(replay->buckets);
+    replay->buckets = buckets;
+    replay->bucket_count = count;
+}
+
+//Searches a key in a replay table
+static pnode wal_replay_find(struct wal_replay *replay, const char *key, size_t key_length, u32 hash)
+{
+    pnode node;
+
+    list_for_each_entry(node, &replay->buckets[hash & (replay->bucket_count - 1)], list)
+    {
+        if (node->key_hash == hash && node->key_length == key_length && memcmp(node->key, key, key_length) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+//Writes value over the one of the node from offset. stored_length is the capacity of the buffer while the log is
+//replayed: appends double it, like a vector, instead of copying the value each time
+static int wal_replay_write(pnode node, size_t offset, const char *value, size_t length)
+{
+    size_t end = offset + length, capacity;
+    char *buffer;
+
+    if (end + 1 > node->stored_length)
+    {
+        capacity = max(end + 1, 2 * node->stored_length);
+        buffer = (char*)kvmalloc(capacity, GFP_KERNEL);
+        if (buffer == NULL)
+            return -ENOMEM;
+        if (node->value != NULL)
+        {
+            memcpy(buffer, node->value, min(offset, node->value_length));
+            kvfree(node->value);
+        }
+        node->value = buffer;
+        node->stored_length = capacity;
+    }
+    memcpy(&node->value[offset], value, length);
+    if (end > node->value_length)
+    {
+        node->value_length = end;
+    }
+    node->value[node->value_length] = '\0';
+    return 0;
+}
+
+//Applies a record to the replay tables
+static int wal_replay_record(struct list_head *replays, const struct wal_record *record, const char *data)
+{
+    struct wal_replay *replay;
+    size_t key_length = get_unaligned_le32(&record->key_length);
+    size_t value_length = get_unaligned_le32(&record->value_length);
+    size_t offset = (size_t)get_unaligned_le64(&record->offset);
+    const char *key = &data[record->name_length], *value = &key[key_length];
+    pnode node;
+    u32 hash;
+
+    replay = wal_replay_get(replays, data, record->name_length);
+    if (replay == NULL)
+        return -ENOMEM;
+    if (record->opcode == WAL_CLEAR)
+    {
+        wal_replay_clear(replay);
+        return 0;
+    }
+    if (key_length == 0)
+        return -EINVAL;
+    hash = filter_hash(key, key_length);
+    node = wal_replay_find(replay, key, key_length, hash);
+    switch (record->opcode)
+    {
+        case WAL_DELETE:
+            if (node != NULL)
+            {
+                list_del(&node->list);
+                dictionary_free_node(node);
+                replay->count--;
+            }
+            return 0;
+        case WAL_SET:
+            if (node != NULL)
+            {
+                //The old value is not kept: the write starts from an empty one
+                node->value_length = 0;
+            }
+            offset = 0;
+            break;
+        case WAL_APPEND:
+            offset = node != NULL ? node->value_length : 0;
+            break;
+        case WAL_RANGE:
+            //Only logged when it succeeded: the offset is inside the value
+            if ((node == NULL && offset != 0) || (node != NULL && offset > node->value_length))
+                return -EINVAL;
+            break;
+        default:
+            return -EINVAL;
+    }
+    if (value_length == 0)
+        return -EINVAL;
+    if (node == NULL)
+    {
+        if (dictionary_alloc_nodes(&node, 1) != 0)
+            return -ENOMEM;
+        node->key = (char*)kmalloc(key_length + 1, GFP_KERNEL);
+        if (node->key == NULL)
+        {
+            dictionary_free_node(node);
+            return -ENOMEM;
+        }
+        memcpy(node->key, key, key_length);
+        node->key[key_length] = '\0';
+        node->key_length = key_length;
+        node->key_hash = hash;
+        list_add(&node->list, &replay->buckets[hash & (replay->bucket_count - 1)]);
+        if (++replay->count > 2 * replay->bucket_count)
+        {
+            wal_replay_grow(replay);
+        }
+    }
+    return wal_replay_write(node, offset, value, value_length);
+}
+
+//Frees a replay table and the nodes left in it
+static void wal_replay_free(struct wal_replay *replay)
+{
+    wal_replay_clear(replay);
+    list_del(&replay->list);
+    kvfree(replay->buckets);
+    kfree(replay);
+}
+
+//Moves the nodes of a replay table into a dictionary, the table is emptied even if they could not be inserted
+static int wal_replay_load(struct wal_replay *replay, pdictionary dict, void **workspace)
+{
+    LIST_HEAD(nodes);
+    pnode node, next;
+    char *exact;
+    size_t i;
+    int res;
+
+    for (i = 0; i < replay->bucket_count; ++i)
+    {
+        list_for_each_entry_safe(node, next, &replay->buckets[i], list)
+        {
+                if (node->stored_length != node->value_length + 1)
+                {
+                //The spare capacity of the appends is given back
+                exact = (char*)kvmalloc(node->value_length + 1, GFP_KERNEL);
+                if (exact != NULL)
+                {
+                    memcpy(exact, node->value, node->value_length + 1);
+                    kvfree(node->value);
+                    node->value = exact;
+                    node->stored_length = node->value_length + 1;
+                }
+            }
+            node->digest = value_digest(VALUE_DIGEST_SEED, node->value, node->value_length);
+            compression_compress_node(workspace, node);
+            list_move_tail(&node->list, &nodes);
+        }
+    }
+    replay->count = 0;
+    res = dictionary_bulk_insert(dict, &nodes);
+    list_for_each_entry_safe(node, next, &nodes, list)
+    {
+        list_del(&node->list);
+        dictionary_free_node(node);
+    }
+    return res;
+}
+
+//Moves the nodes of the replay tables into their namespaces and frees the tables. A namespace whose keys can't be
+//loaded (over its memory limit, out of memory) doesn't stop the others: the module is loaded with what could be
+static void wal_replay_commit(struct list_head *replays)
+{
+    struct wal_replay *replay, *tmp;
+    pdictionary dict;
+    void *workspace = NULL;
+    int res;
+
+    list_for_each_entry_safe(replay, tmp, replays, list)
+    {
+        dict = namespace_get(replay->name, true);
+        res = IS_ERR(dict) ? (int)PTR_ERR(dict) : wal_replay_load(replay, dict, &workspace);
+        if (res != 0)
+        {
+            printk(KERN_WARNING "dictionary: the keys of namespace \"%s\" in the write-ahead log could not be loaded (code: %d)\n",
+                replay->name, res);
+        }
+        wal_replay_free(replay);
+    }
+    kvfree(workspace);
+}
+
+//Applies the complete records at the start of buffer and stops at the first incomplete or corrupted one.
+//*used gets the bytes of the records applied, *needed the size of the record that stopped it, 0 if it's corrupted
+static ssize_t wal_replay_records(struct list_head *replays, const char *buffer, size_t length, size_t *used, size_t *needed)
+{
+    const struct wal_record *record;
+    ssize_t records = 0;
+    int res;
+
+    *used = 0;
+    while (true)
+    {
+        *needed = sizeof(struct wal_record);
+        if (length - *used < *needed)
+            return records;
+        record = (const struct wal_record*)&buffer[*used];
+        *needed = wal_record_size(record);
+        if (length - *used < *needed)
+            return records;
+        if (get_unaligned_le32(&record->crc) != wal_record_crc(record, *needed))
+        {
+            *needed = 0;
+            return records;
+        }
+        res = wal_replay_record(replays, record, &buffer[*used + sizeof(struct wal_record)]);
+        if (res != 0)
+            return res;
+        *used += *needed;
+        ++records;
+    }
+}
+
+ssize_t wal_replay_buffer(pdictionary dict, const char *data, size_t length, size_t *valid)
+{
+    LIST_HEAD(replays);
+    struct wal_replay *replay, *tmp;
+    void *workspace = NULL;
+    size_t needed;
+    ssize_t records;
+    int res;
+
+    if (dict == NULL || (data == NULL && length != 0) || valid == NULL)
+        return -EINVAL;
+    records = wal_replay_records(&replays, data, length, valid, &needed);
+    list_for_each_entry_safe(replay, tmp, &replays, list)
+    {
+        res = records < 0 ? 0 : wal_replay_load(replay, dict, &workspace);
+        if (res != 0)
+            records = res;
+        wal_replay_free(replay);
+    }
+    kvfree(workspace);
+    return records;
+}
+
+//Reads the records of the log into the replay tables, stops at the first incomplete or corrupted one and
+//cuts the file there: it's the record a crash interrupted. Returns the number of records
+static ssize_t wal_replay(struct list_head *replays)
+{
+    struct wal_header header;
+    loff_t pos = 0, valid;
+    size_t capacity = WAL_READ_CHUNK, filled = 0, used, needed, records = 0;
+    char *buffer, *bigger;
+    ssize_t n;
+    int res = 0;
+
+    n = kernel_read(wal.file, &header, sizeof(struct wal_header), &pos);
+    if (n == 0)
+    {
+        //New log
+        put_unaligned_le32(WAL_MAGIC, &header.magic);
+        put_unaligned_le32(WAL_VERSION, &header.version);
+        wal.position = 0;
+        if (kernel_write(wal.file, &header, sizeof(struct wal_header), &wal.position) != sizeof(struct wal_header))
+            return -EIO;
+        return 0;
+    }
+    if (n != sizeof(struct wal_header) || get_unaligned_le32(&header.magic) != WAL_MAGIC ||
+        get_unaligned_le32(&header.version) != WAL_VERSION)
+    {
+        //Not a log: better to refuse it than to write over it
+        printk(KERN_ALERT "dictionary: %s is not a write-ahead log of this version.\n", wal_path);
+        return -EINVAL;
+    }
+    valid = pos;
+    buffer = (char*)kvmalloc(capacity, GFP_KERNEL);
+    if (buffer == NULL)
+        return -ENOMEM;
+    while (true)
+    {
+        n = wal_replay_records(replays, buffer, filled, &used, &needed);
+        if (n < 0)
+        {
+            res = (int)n;
+            break;
+        }
+        records += (size_t)n;
+        valid += used;
+        if (needed == 0)
+            break;//Corrupted record
+        //The rest of the record is in the file
+        memmove(buffer, &buffer[used], filled - used);
+        filled -= used;
+        if (needed > capacity)
+        {
+            if (needed > (size_t)i_size_read(file_inode(wal.file)))
+                break;//A length no record in this file can have: the header of the record is corrupted
+            bigger = (char*)kvmalloc(needed, GFP_KERNEL);
+            if (bigger == NULL)
+            {
+                res = -ENOMEM;
+                break;
+            }
+            memcpy(bigger, buffer, filled);
+            kvfree(buffer);
+            buffer = bigger;
+            capacity = needed;
+        }
+        n = kernel_read(wal.file, &buffer[filled], capacity - filled, &pos);
+        if (n <= 0)
+            break;
+        filled += (size_t)n;
+    }
+    kvfree(buffer);
+    if (res != 0)
+        return res;
+    if (valid < i_size_read(file_inode(wal.file)))
+    {
+        printk(KERN_WARNING "dictionary: %lld bytes of an interrupted record at the end of the write-ahead log dropped.\n",
+            i_size_read(file_inode(wal.file)) - valid);
+        res = vfs_truncate(&wal.file->f_path, valid);
+        if (res != 0)
+            return res;
+    }
+    wal.position = valid;
+    return (ssize_t)records;
+}
+
+int wal_init(void)
+{
+    LIST_HEAD(replays);
+    struct wal_replay *replay, *tmp;
+    u64 start;
+    ssize_t records;
+    int res = 0;
+
+    spin_lock_init(&wal.lock);
+    INIT_LIST_HEAD(&wal.queue);
+    init_waitqueue_head(&wal.wake);
+    init_waitqueue_head(&wal.durable_queue);
+    if (wal_path[0] == '\0')
+        return 0;
+    wal.file = filp_open(wal_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(wal.file))
+    {
+        res = (int)PTR_ERR(wal.file);
+        wal.file = NULL;
+        printk(KERN_ALERT "dictionary: the write-ahead log %s could not be opened (code: %d)\n", wal_path, res);
+        return res;
+    }
+    start = ktime_get_ns();
+    records = wal_replay(&replays);
+    if (records < 0)
+    {
+        res = (int)records;
+        list_for_each_entry_safe(replay, tmp, &replays, list)
+        {
+            wal_replay_free(replay);
+        }
+    } else {
+        wal_replay_commit(&replays);
+    }
+    if (res == 0)
+    {
+        printk(KERN_INFO "dictionary: %zd records of the write-ahead log replayed in %llu ms.\n",
+            records, div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+        wal.thread = kthread_run(wal_thread, NULL, "dictionary_wal");
+        if (IS_ERR(wal.thread))
+        {
+            res = (int)PTR_ERR(wal.thread);
+            wal.thread = NULL;
+        }
+    }
+    if (res != 0)
+    {
+        filp_close(wal.file, NULL);
+        wal.file = NULL;
+    }
+    return res;
+}
+
+void wal_exit(void)
+{
+    struct wal_entry *entry, *tmp;
+
+    if (wal.thread != NULL)
+    {
+        //The thread writes what is still queued before it stops
+        kthread_stop(wal.thread);
+        wal.thread = NULL;
+    }
+    if (!list_empty(&wal.queue))
+    {
+        printk(KERN_ALERT "dictionary: the last records of the write-ahead log could not be written.\n");
+        list_for_each_entry_safe(entry, tmp, &wal.queue, list)
+        {
+            list_del(&entry->list);
+            kvfree(entry);
+        }
+    }
+    if (wal.file != NULL)
+    {
+        filp_close(wal.file, NULL);
+        wal.file = NULL;
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef _MODULE_WAL_H
+#define _MODULE_WAL_H
+
+#include <linux/types.h>
+#include <linux/crc32.h>
+#include <asm/unaligned.h>
+#include "dictionary.h"
+
+/*
+ * Write-ahead log: the file starts with a struct wal_header, followed by a struct wal_record
+ * for each change, then name_length bytes of the name of the namespace, key_length bytes of key and
+ * value_length bytes of value. All the numbers are little endian.
+ */
+#define WAL_MAGIC   0x4C415744 //"DWAL"
+#define WAL_VERSION 1
+
+//Changes a record can hold
+#define WAL_SET     1 //Creates or replaces the key
+#define WAL_APPEND  2 //Appends the value, creating the key if it's missing
+#define WAL_RANGE   3 //Writes the value over the one of the key from offset
+#define WAL_DELETE  4 //value_length is 0
+#define WAL_CLEAR   5 //Deletes all the keys of the namespace, key_length and value_length are 0
+
+struct wal_header {
+    __le32 magic;
+    __le32 version;
+};
+
+struct wal_record {
+    __le32 crc;         //CRC32 of the rest of the record, name key and value included: a record cut by a crash doesn't match
+    __u8 opcode;        //One of WAL_*
+    __u8 name_length;   //Bytes of the name of the namespace
+    __u8 reserved[2];
+    __le32 key_length;
+    __le32 value_length;
+    __le64 offset;      //WAL_RANGE only
+};
+
+//Bytes of a record, name key and value included
+#define wal_record_size(record) (sizeof(struct wal_record) + (record)->name_length + \
+    (size_t)get_unaligned_le32(&(record)->key_length) + (size_t)get_unaligned_le32(&(record)->value_length))
+//Value of the crc field of a record of size bytes
+#define wal_record_crc(record, size) crc32_le(~0u, (const u8*)(record) + sizeof(__le32), (size) - sizeof(__le32))
+
+//Bytes read from the log at once while it's replayed, longer records get a buffer of their own
+#define WAL_READ_CHUNK (1 << 20)
+
+/// @brief Record of a change, built by wal_prepare and queued for the thread by wal_queue
+struct wal_entry {
+    struct list_head list;
+    u64 lsn;
+    size_t size;    //Bytes of data
+    char data[];    //struct wal_record, name, key and value
+};
+
+/// @brief Opens the file of the wal_path param, replays its records into the namespaces and starts the thread
+/// that appends the new ones. Call after namespace_init, before the device file is registered
+/// @return zero for success (also when wal_path is empty and there is no log), below zero otherwise
+int wal_init(void);
+
+/// @brief Replays the records of a log held in memory into a dictionary as wal_init does with the file, for the tests
+/// @param dict the dictionary that receives the keys, of all the namespaces of the records
+/// @param data the records, without the struct wal_header
+/// @param length bytes of data
+/// @param valid where the bytes of the records replayed are stored: the file would be cut there
+/// @return the number of records replayed, below zero for failure
+ssize_t wal_replay_buffer(pdictionary dict, const char *data, size_t length, size_t *valid);
+
+/// @brief Writes the records still queued, stops the thread and closes the file
+void wal_exit(void);
+
+/// @brief Checks if the changes are logged
+/// @return true if there is a log and it has been replayed
+bool wal_enabled(void);
+
+/// @brief Builds the record of a change before the mutex of the dictionary is taken: nothing is allocated
+/// or copied from user memory while it's held
+/// @param dict the namespace that will change
+/// @param opcode one of WAL_*
+/// @param key the key, kernel memory
+/// @param key_length the length of the key, zero if it's a string
+/// @param value the value, user memory unless flags has DICTIONARY_KERNEL, can be NULL if value_length is 0
+/// @param value_length the length of the value
+/// @param offset where the value will be written, WAL_RANGE only
+/// @param flags DICTIONARY_KERNEL if value is kernel memory, DICTIONARY_NONBLOCK not to wait for memory
+/// @return the record, NULL if the change is not logged (no log, or a dictionary that is not a namespace),
+/// ERR_PTR(-ENOMEM), ERR_PTR(-EAGAIN) with DICTIONARY_NONBLOCK or ERR_PTR(-EFAULT) if it couldn't be built
+struct wal_entry* wal_prepare(pdictionary dict, unsigned int opcode, const char *key, size_t key_length,
+    const char *value, size_t value_length, size_t offset, unsigned int flags);
+
+/// @brief The copy of the value inside a record, kernel memory: the change can be made from it
+/// @param entry a record of wal_prepare
+/// @return the value
+const char* wal_entry_value(const struct wal_entry *entry);
+
+/// @brief Queues a record of wal_prepare once its change succeeded. Call with the mutex of the dictionary
+/// locked so that the records are in the same order as the changes
+/// @param entry the record, NULL if the change is not logged
+/// @return the sequence number of the record to give to wal_wait, 0 if entry is NULL
+u64 wal_queue(struct wal_entry *entry);
+
+/// @brief Frees a record of wal_prepare whose change failed
+/// @param entry the record, can be NULL
+void wal_discard(struct wal_entry *entry);
+
+/// @brief Waits until a record is on disk. The thread is woken at once: the record is written
+/// with all the others queued meanwhile and a single fsync
+/// @param lsn the sequence number returned by wal_log, 0 returns at once
+/// @return zero for success, -EIO if writing the record failed while waiting (the thread tries again later),
+/// -EINTR if the task was killed
+int wal_wait(u64 lsn);
+
+/// @brief Waits until all the records queued so far are on disk, see wal_wait
+/// @return zero for success, -EIO if the log couldn't be written, -EINTR if the task was killed
+int wal_sync(void);
+
+//Waits for the record of a change that succeeded, if the caller asked for it with DICTIONARY_SYNC
+#define wal_wait_flags(res, lsn, flags) do { \
+        if ((res) == 0 && ((flags) & DICTIONARY_SYNC)) \
+            (res) = wal_wait(lsn); \
+    } while (0)
+
+#endif